@@ -24,9 +24,12 @@
 #include <linux/can/dev.h>
 #include <linux/can/error.h>
 #include <linux/can/led.h>
+#include <linux/can/rx-offload.h>
 #include <linux/can/platform/flexcan.h>
 #include <linux/clk.h>
+#include <linux/clocksource.h>
 #include <linux/delay.h>
+#include <linux/hrtimer.h>
 #include <linux/if_arp.h>
 #include <linux/if_ether.h>
 #include <linux/interrupt.h>
@@ -36,6 +39,7 @@
 #include <linux/mfd/syscon.h>
 #include <linux/mfd/syscon/imx6q-iomuxc-gpr.h>
 #include <linux/module.h>
+#include <linux/net_tstamp.h>
 #include <linux/of.h>
 #include <linux/of_device.h>
 #include <linux/platform_device.h>
@@ -44,8 +48,6 @@
 
 #define DRV_NAME			"flexcan"
 
-#define IRQ_CAN_RX           1
-
 /* 8 for RX fifo and 2 error handling */
 #define FLEXCAN_NAPI_WEIGHT		(8 + 2)
 
@@ -217,27 +219,12 @@ struct flexcan_stop_mode {
 	u8 ack_bit;
 };
 
-struct can_rx_offload{
-	struct net_device *dev;
-	unsigned int (*mailbox_read)(struct can_rx_offload * offload, bool drop, 
-				struct sk_buff **skb, u32 * timestamp, unsigned int mb);
-	struct sk_buff_head skb_queue;
-	u32 skb_queue_len_max;
-	unsigned int mb_first;
-	unsigned int mb_last;
-	struct napi_struct napi;
-
-	bool inc;
-};
-
 struct flexcan_priv {
 	struct can_priv can;
 	struct net_device *dev;
-	struct napi_struct napi;
 	struct can_rx_offload offload;
 
 	void __iomem *base;
-	u32 reg_esr;
 	u32 reg_ctrl_default;
 
 	struct clk *clk_ipg;
@@ -247,6 +234,16 @@ struct flexcan_priv {
 	struct regulator *reg_xceiver;
 	struct flexcan_stop_mode stm;
 	int id;
+
+	/*
+	 * hardware timestamps: the 16 bit timer counts bit times, it is
+	 * anchored to the system time four times per wrap around
+	 */
+	spinlock_t tc_lock;
+	struct cyclecounter cc;
+	struct timecounter tc;
+	struct hrtimer tc_timer;
+	ktime_t tc_period;
 };
 
 static struct flexcan_devtype_data fsl_p1010_devtype_data = {
@@ -450,67 +447,78 @@ static int flexcan_get_berr_counter(const struct net_device *dev,
 	return 0;
 }
 
-
-static int can_rx_offload_napi_poll(struct napi_struct *napi, int quota)
+static inline struct flexcan_priv *
+rx_offload_to_priv(struct can_rx_offload *offload)
 {
-	struct can_rx_offload *offload = container_of(napi, struct can_rx_offload, napi);
-	struct net_device *dev = offload->dev;
-	struct net_device_stats *stats = &dev->stats;
-	struct sk_buff *skb;
-	int work_done = 0;
-
-	while ((work_done < quota) &&
-	       (skb = skb_dequeue(&offload->skb_queue))) {
-		struct canfd_frame *cf = (struct canfd_frame *)skb->data;
-
-		work_done++;
-		stats->rx_packets++;
-		stats->rx_bytes += cf->len;
-		netif_receive_skb(skb);
-	}
-
-	if (work_done < quota) {
-		// napi_complete_done(napi, work_done);
-		napi_complete(napi);
+	return container_of(offload, struct flexcan_priv, offload);
+}
 
-		/* Check if there was another interrupt */
-		if (!skb_queue_empty(&offload->skb_queue))
-			napi_reschedule(&offload->napi);
-	}
+/* free running 16 bit timer, shifted up so the offload can sort on u32 */
+static inline u32 flexcan_get_timestamp(u32 reg_ctrl)
+{
+	return FLEXCAN_MB_CNT_TIMESTAMP(reg_ctrl) << 16;
+}
 
-	can_led_event(offload->dev, CAN_LED_EVENT_RX);
+static cycle_t flexcan_cc_read(const struct cyclecounter *cc)
+{
+	const struct flexcan_priv *priv =
+		container_of(cc, struct flexcan_priv, cc);
+	struct flexcan_regs __iomem *regs = priv->base;
 
-	return work_done;
+	return FLEXCAN_MB_CNT_TIMESTAMP(flexcan_read(&regs->timer));
 }
 
-static void can_rx_offload_reset(struct can_rx_offload *offload)
+/*
+ * Convert a timer value captured by the controller into system time.
+ * Called with tc_lock held: reading the timer register also unlocks
+ * the RX mailboxes, so it must not happen while flexcan_irq() runs.
+ */
+static ktime_t flexcan_ts_to_ktime(struct flexcan_priv *priv, u32 reg_ctrl)
 {
+	return ns_to_ktime(timecounter_cyc2time(&priv->tc,
+				FLEXCAN_MB_CNT_TIMESTAMP(reg_ctrl)));
 }
-static int can_rx_offload_init_queue(struct net_device *dev, struct can_rx_offload *offload, unsigned int weight)
+
+/*
+ * Re-anchor the timer to the system time instead of accumulating the
+ * wrap arounds: this also takes care of the drift between the CAN clock
+ * and the system clock.
+ */
+static void flexcan_tc_anchor(struct flexcan_priv *priv)
 {
-	offload->dev = dev;
+	unsigned long flags;
 
-	/* Limit queue len to 4x the weight (rounted to next power of two) */
-	offload->skb_queue_len_max = 2 << fls(weight);
-	offload->skb_queue_len_max *= 4;
-	skb_queue_head_init(&offload->skb_queue);
+	spin_lock_irqsave(&priv->tc_lock, flags);
+	timecounter_init(&priv->tc, &priv->cc,
+			 ktime_to_ns(ktime_get_real()));
+	spin_unlock_irqrestore(&priv->tc_lock, flags);
+}
 
-	can_rx_offload_reset(offload);
-	netif_napi_add(dev, &offload->napi, can_rx_offload_napi_poll, weight);
+static enum hrtimer_restart flexcan_tc_resync(struct hrtimer *timer)
+{
+	struct flexcan_priv *priv = container_of(timer, struct flexcan_priv,
+						 tc_timer);
 
-	dev_dbg(dev->dev.parent, "%s: skb_queue_len_max=%d\n",
-		__func__, offload->skb_queue_len_max);
+	flexcan_tc_anchor(priv);
+	hrtimer_forward_now(timer, priv->tc_period);
 
-	return 0;
+	return HRTIMER_RESTART;
 }
 
-
-int can_rx_offload_add_fifo(struct net_device *dev, struct can_rx_offload *offload, unsigned int weight)
+/* the timer runs with the bit clock, start it after the bit timing is set */
+static void flexcan_tc_start(struct flexcan_priv *priv)
 {
-	// if (!offload->mailbox_read)
-	// 	return -EINVAL;
+	u32 bitrate = priv->can.bittiming.bitrate;
+
+	priv->cc.read = flexcan_cc_read;
+	priv->cc.mask = CLOCKSOURCE_MASK(16);
+	clocks_calc_mult_shift(&priv->cc.mult, &priv->cc.shift, bitrate,
+			       NSEC_PER_SEC, DIV_ROUND_UP(1 << 16, bitrate));
+	priv->tc_period = ns_to_ktime(div_u64((u64)NSEC_PER_SEC << 14,
+					      bitrate));
 
-	return can_rx_offload_init_queue(dev, offload, weight);
+	flexcan_tc_anchor(priv);
+	hrtimer_start(&priv->tc_timer, priv->tc_period, HRTIMER_MODE_REL);
 }
 
 static int flexcan_start_xmit(struct sk_buff *skb, struct net_device *dev)
@@ -526,6 +534,10 @@ static int flexcan_start_xmit(struct sk_buff *skb, struct net_device *dev)
 
 	netif_stop_queue(dev);
 
+	skb_tx_timestamp(skb);
+	if (skb_shinfo(skb)->tx_flags & SKBTX_HW_TSTAMP)
+		skb_shinfo(skb)->tx_flags |= SKBTX_IN_PROGRESS;
+
 	if (cf->can_id & CAN_EFF_FLAG) {
 		can_id = cf->can_id & CAN_EFF_MASK;
 		ctrl |= FLEXCAN_MB_CNT_IDE | FLEXCAN_MB_CNT_SRR;
@@ -557,7 +569,6 @@ static int flexcan_start_xmit(struct sk_buff *skb, struct net_device *dev)
 
 	return NETDEV_TX_OK;
 }
-
 static void do_bus_err(struct net_device *dev,
 		       struct can_frame *cf, u32 reg_esr)
 {
@@ -611,23 +622,24 @@ static void do_bus_err(struct net_device *dev,
 	if (tx_errors)
 		dev->stats.tx_errors++;
 }
-
-static int flexcan_poll_bus_err(struct net_device *dev, u32 reg_esr)
+static void flexcan_irq_bus_err(struct net_device *dev, u32 reg_esr)
 {
+	struct flexcan_priv *priv = netdev_priv(dev);
+	struct flexcan_regs __iomem *regs = priv->base;
 	struct sk_buff *skb;
 	struct can_frame *cf;
+	u32 reg_timer;
+
+	reg_timer = flexcan_read(&regs->timer);
 
 	skb = alloc_can_err_skb(dev, &cf);
 	if (unlikely(!skb))
-		return 0;
+		return;
 
 	do_bus_err(dev, cf, reg_esr);
-	netif_receive_skb(skb);
-
-	dev->stats.rx_packets++;
-	dev->stats.rx_bytes += cf->can_dlc;
-
-	return 1;
+	skb_hwtstamps(skb)->hwtstamp = flexcan_ts_to_ktime(priv, reg_timer);
+	can_rx_offload_queue_timestamp(&priv->offload, skb,
+				       flexcan_get_timestamp(reg_timer));
 }
 
 static void do_state(struct net_device *dev,
@@ -695,15 +707,18 @@ static void do_state(struct net_device *dev,
 		break;
 	}
 }
-
-static int flexcan_poll_state(struct net_device *dev, u32 reg_esr)
+static void flexcan_irq_state(struct net_device *dev, u32 reg_esr)
 {
 	struct flexcan_priv *priv = netdev_priv(dev);
+	struct flexcan_regs __iomem *regs = priv->base;
 	struct sk_buff *skb;
 	struct can_frame *cf;
 	enum can_state new_state;
+	u32 reg_timer;
 	int flt;
 
+	reg_timer = flexcan_read(&regs->timer);
+
 	flt = reg_esr & FLEXCAN_ESR_FLT_CONF_MASK;
 	if (likely(flt == FLEXCAN_ESR_FLT_CONF_ACTIVE)) {
 		if (likely(!(reg_esr & (FLEXCAN_ESR_TX_WRN |
@@ -718,31 +733,50 @@ static int flexcan_poll_state(struct net_device *dev, u32 reg_esr)
 
 	/* state hasn't changed */
 	if (likely(new_state == priv->can.state))
-		return 0;
+		return;
 
 	skb = alloc_can_err_skb(dev, &cf);
 	if (unlikely(!skb))
-		return 0;
+		return;
 
 	do_state(dev, cf, new_state);
 	priv->can.state = new_state;
-	netif_receive_skb(skb);
-
-	dev->stats.rx_packets++;
-	dev->stats.rx_bytes += cf->can_dlc;
-
-	return 1;
+	skb_hwtstamps(skb)->hwtstamp = flexcan_ts_to_ktime(priv, reg_timer);
+	can_rx_offload_queue_timestamp(&priv->offload, skb,
+				       flexcan_get_timestamp(reg_timer));
 }
 
-static void flexcan_read_fifo(const struct net_device *dev,
-			      struct can_frame *cf)
+/*
+ * Read one frame out of the RX FIFO. With @drop set (offload queue full)
+ * the FIFO entry is released without allocating an skb.
+ */
+static unsigned int flexcan_mailbox_read(struct can_rx_offload *offload,
+					 bool drop, struct sk_buff **skb,
+					 u32 *timestamp, unsigned int n)
 {
-	const struct flexcan_priv *priv = netdev_priv(dev);
+	struct flexcan_priv *priv = rx_offload_to_priv(offload);
 	struct flexcan_regs __iomem *regs = priv->base;
-	struct flexcan_mb __iomem *mb = &regs->cantxfg[0];
+	struct flexcan_mb __iomem *mb = &regs->cantxfg[n];
+	struct can_frame *cf;
 	u32 reg_ctrl, reg_id;
 
+	if (!(flexcan_read(&regs->iflag1) & FLEXCAN_IFLAG_RX_FIFO_AVAILABLE))
+		return 0;
+
 	reg_ctrl = flexcan_read(&mb->can_ctrl);
+
+	if (drop) {
+		*skb = NULL;
+		goto mark_as_read;
+	}
+
+	*skb = alloc_can_skb(offload->dev, &cf);
+	if (!*skb)
+		goto mark_as_read;
+
+	*timestamp = flexcan_get_timestamp(reg_ctrl);
+	skb_hwtstamps(*skb)->hwtstamp = flexcan_ts_to_ktime(priv, reg_ctrl);
+
 	reg_id = flexcan_read(&mb->can_id);
 	if (reg_ctrl & FLEXCAN_MB_CNT_IDE)
 		cf->can_id = ((reg_id >> 0) & CAN_EFF_MASK) | CAN_EFF_FLAG;
@@ -756,279 +790,34 @@ static void flexcan_read_fifo(const struct net_device *dev,
 	*(__be32 *)(cf->data + 0) = cpu_to_be32(flexcan_read(&mb->data[0]));
 	*(__be32 *)(cf->data + 4) = cpu_to_be32(flexcan_read(&mb->data[1]));
 
+ mark_as_read:
 	/* mark as read */
 	flexcan_write(FLEXCAN_IFLAG_RX_FIFO_AVAILABLE, &regs->iflag1);
 	flexcan_read(&regs->timer);
-}
-
-static int flexcan_read_frame(struct net_device *dev)
-{
-	struct net_device_stats *stats = &dev->stats;
-	struct can_frame *cf;
-	struct sk_buff *skb;
-
-	skb = alloc_can_skb(dev, &cf);
-	if (unlikely(!skb)) {
-		stats->rx_dropped++;
-		return 0;
-	}
-
-	flexcan_read_fifo(dev, cf);
-	netif_receive_skb(skb);
-
-	stats->rx_packets++;
-	stats->rx_bytes += cf->can_dlc;
-
-	can_led_event(dev, CAN_LED_EVENT_RX);
 
 	return 1;
 }
-#ifndef IRQ_CAN_RX
-static int flexcan_poll(struct napi_struct *napi, int quota)
-{
-	struct net_device *dev = napi->dev;
-	const struct flexcan_priv *priv = netdev_priv(dev);
-	struct flexcan_regs __iomem *regs = priv->base;
-	u32 reg_iflag1, reg_esr;
-	int work_done = 0;
 
-	/*
-	 * The error bits are cleared on read,
-	 * use saved value from irq handler.
-	 */
-	reg_esr = flexcan_read(&regs->esr) | priv->reg_esr;
-
-	/* handle state changes */
-	work_done += flexcan_poll_state(dev, reg_esr);
-
-	/* handle RX-FIFO */
-	reg_iflag1 = flexcan_read(&regs->iflag1);
-	while (reg_iflag1 & FLEXCAN_IFLAG_RX_FIFO_AVAILABLE &&
-	       work_done < quota) {
-		work_done += flexcan_read_frame(dev);
-		reg_iflag1 = flexcan_read(&regs->iflag1);
-	}
-
-	/* report bus errors */
-	if (flexcan_has_and_handle_berr(priv, reg_esr) && work_done < quota)
-		work_done += flexcan_poll_bus_err(dev, reg_esr);
-
-	if (work_done < quota) {
-		napi_complete(napi);
-		/* enable IRQs */
-		flexcan_write(FLEXCAN_IFLAG_DEFAULT, &regs->imask1);
-		flexcan_write(priv->reg_ctrl_default, &regs->ctrl);
-	}
-
-	return work_done;
-}
-#endif 
-
-static inline struct flexcan_priv *rx_offload_to_priv(struct can_rx_offload *offload)
-{
-	return container_of(offload, struct flexcan_priv, offload);
-}
-static unsigned int flexcan_mailbox_read(struct can_rx_offload *offload, bool drop,
-					 struct sk_buff **skb, u32 *timestamp,
-					 unsigned int n)
-{
-	// struct flexcan_priv *priv = rx_offload_to_priv(offload);
-	// struct net_device *dev = offload->dev;
-
-	// u32 reg_ctrl, reg_id, reg_iflag1;
-
-	// reg_iflag1 = flexcan_read(&regs->iflag1); 
-	// if (!(reg_iflag1 & FLEXCAN_IFLAG_RX_FIFO_AVAILABLE))
-	// 		return 0;
-	// struct net_device_stats *stats = &dev->stats;
-	// struct can_frame *cf = NULL;
-
-	// *skb = alloc_can_skb(dev, &cf);
-	// if (unlikely(!skb)) {
-	// 	printk("hndz can alloc fail!\n");
-	// 	stats->rx_dropped++;
-	// 	return 0;
-	// }
-
-	// return new_flexcan_read_fifo(dev, cf);
-
-	const struct flexcan_priv *priv = rx_offload_to_priv(offload);
-	struct flexcan_regs __iomem *regs = priv->base;
-	struct flexcan_mb __iomem *mb = &regs->cantxfg[0];
-	u32 reg_ctrl, reg_id, reg_iflag1;
-	// struct canfd_frame *cf = NULL;
-	struct can_frame  *cf = NULL;
-	reg_iflag1 = flexcan_read(&regs->iflag1); 
-	if (!(reg_iflag1 & FLEXCAN_IFLAG_RX_FIFO_AVAILABLE))
-			return 0;
-
-	if (!drop) {
-			*skb = alloc_can_skb(offload->dev,
-					     &cf);
-	}
-	if(*skb && cf)
-	{
-		reg_ctrl = flexcan_read(&mb->can_ctrl);
-		reg_id = flexcan_read(&mb->can_id);
-		if (reg_ctrl & FLEXCAN_MB_CNT_IDE)
-			cf->can_id = ((reg_id >> 0) & CAN_EFF_MASK) | CAN_EFF_FLAG;
-		else
-			cf->can_id = (reg_id >> 18) & CAN_SFF_MASK;
-
-		if (reg_ctrl & FLEXCAN_MB_CNT_RTR)
-			cf->can_id |= CAN_RTR_FLAG;
-		cf->can_dlc = get_can_dlc((reg_ctrl >> 16) & 0xf);
-
-		*(__be32 *)(cf->data + 0) = cpu_to_be32(flexcan_read(&mb->data[0]));
-		*(__be32 *)(cf->data + 4) = cpu_to_be32(flexcan_read(&mb->data[1]));
-	}
-	/* mark as read */
-	flexcan_write(FLEXCAN_IFLAG_RX_FIFO_AVAILABLE, &regs->iflag1);
-	flexcan_read(&regs->timer);
-	return 1;
-
-	//return 1;
-}
-
-static struct sk_buff *can_rx_offload_offload_one(struct can_rx_offload *offload, unsigned int n)
-{
-	struct sk_buff *skb = NULL;
-	u32 timestamp;
-
-	/* If queue is full or skb not available, read to discard mailbox */
-	bool drop = unlikely(skb_queue_len(&offload->skb_queue) >
-					   offload->skb_queue_len_max);
-
-	// if (offload->mailbox_read(offload, drop, &skb, &timestamp, n) && !skb)
-	// 	offload->dev->stats.rx_dropped++;
-	if (flexcan_mailbox_read(offload, drop, &skb, &timestamp, n) && !skb)
-		offload->dev->stats.rx_dropped++;
-
-	// if (skb) {
-	// 	struct can_rx_offload_cb *cb = can_rx_offload_get_cb(skb);
-
-	// 	cb->timestamp = timestamp;
-	// }
-
-	return skb;
-}
-static inline void can_rx_offload_schedule(struct can_rx_offload *offload)
-{
-	napi_schedule(&offload->napi);
-}
-
-// static inline void can_rx_offload_disable(struct can_rx_offload *offload)
-// {
-// 	napi_disable(&offload->napi);
-// }
-int can_rx_offload_irq_offload_fifo(struct can_rx_offload *offload)
-{
-	struct sk_buff *skb;
-	int received = 0;
-	// printk("zty canrx offload!\n");
-	while ((skb = can_rx_offload_offload_one(offload, 0))) {
-		// printk("zty add!\n");
-		skb_queue_tail(&offload->skb_queue, skb);
-		received++;
-	}
-
-	if (received)
-		can_rx_offload_schedule(offload);
-
-	return received;
-}
-#ifndef IRQ_CAN_RX
 static irqreturn_t flexcan_irq(int irq, void *dev_id)
 {
 	struct net_device *dev = dev_id;
 	struct net_device_stats *stats = &dev->stats;
 	struct flexcan_priv *priv = netdev_priv(dev);
 	struct flexcan_regs __iomem *regs = priv->base;
-	u32 reg_iflag1, reg_esr;
-
-	reg_iflag1 = flexcan_read(&regs->iflag1);
-	reg_esr = flexcan_read(&regs->esr);
-	/* ACK all bus error and state change IRQ sources */
-	if (reg_esr & FLEXCAN_ESR_ALL_INT)
-		flexcan_write(reg_esr & FLEXCAN_ESR_ALL_INT, &regs->esr);
-
-	if (reg_esr & FLEXCAN_ESR_WAK_INT)
-		flexcan_exit_stop_mode(priv);
-
-	/*
-	 * schedule NAPI in case of:
-	 * - rx IRQ
-	 * - state change IRQ
-	 * - bus error IRQ and bus error reporting is activated
-	 */
-	if ((reg_iflag1 & FLEXCAN_IFLAG_RX_FIFO_AVAILABLE) ||
-	    (reg_esr & FLEXCAN_ESR_ERR_STATE) ||
-	    flexcan_has_and_handle_berr(priv, reg_esr)) {
-		/*
-		 * The error bits are cleared on read,
-		 * save them for later use.
-		 */
-		priv->reg_esr = reg_esr & FLEXCAN_ESR_ERR_BUS;
-		flexcan_write(FLEXCAN_IFLAG_DEFAULT &
-			~FLEXCAN_IFLAG_RX_FIFO_AVAILABLE, &regs->imask1);
-		flexcan_write(priv->reg_ctrl_default & ~FLEXCAN_CTRL_ERR_ALL,
-		       &regs->ctrl);
-		napi_schedule(&priv->napi);
-	}
-
-	/* FIFO overflow */
-	if (reg_iflag1 & FLEXCAN_IFLAG_RX_FIFO_OVERFLOW) {
-		flexcan_write(FLEXCAN_IFLAG_RX_FIFO_OVERFLOW, &regs->iflag1);
-		dev->stats.rx_over_errors++;
-		dev->stats.rx_errors++;
-	}
-
-	/* transmission complete interrupt */
-	if (reg_iflag1 & (1 << FLEXCAN_TX_BUF_ID)) {
-		stats->tx_bytes += can_get_echo_skb(dev, 0);
-		stats->tx_packets++;
-		can_led_event(dev, CAN_LED_EVENT_TX);
-		flexcan_write((1 << FLEXCAN_TX_BUF_ID), &regs->iflag1);
-		netif_wake_queue(dev);
-	}
-
-	return IRQ_HANDLED;
-}
-#endif
-// extern unsigned long hndz_read_current_timer(void);
-static irqreturn_t flexcan_napi_irq(int irq, void *dev_id)
-{
-	struct net_device *dev = dev_id;
-	struct net_device_stats *stats = &dev->stats;
-	struct flexcan_priv *priv = netdev_priv(dev);
-	struct flexcan_regs __iomem *regs = priv->base;
-	u32 reg_iflag1, reg_esr;
 	irqreturn_t handled = IRQ_NONE;
-	// unsigned long time1, time2;
-	u32 rvnum = 0;
-	// time1 = hndz_read_current_timer();
-	reg_iflag1 = flexcan_read(&regs->iflag1);
-	reg_esr = flexcan_read(&regs->esr);
-	/* ACK all bus error and state change IRQ sources */
-	// if (reg_esr & FLEXCAN_ESR_ALL_INT)
-	// 	flexcan_write(reg_esr & FLEXCAN_ESR_ALL_INT, &regs->esr);
+	u32 reg_iflag1, reg_esr, reg_ctrl;
 
-	// if (reg_esr & FLEXCAN_ESR_WAK_INT)
-	// 	flexcan_exit_stop_mode(priv);
+	spin_lock(&priv->tc_lock);
 
-	/*
-	 * schedule NAPI in case of:
-	 * - rx IRQ
-	 * - state change IRQ
-	 * - bus error IRQ and bus error reporting is activated
-	 */
+	reg_iflag1 = flexcan_read(&regs->iflag1);
 
-	if(reg_iflag1 & FLEXCAN_IFLAG_RX_FIFO_AVAILABLE){
+	/* reception interrupt */
+	if (reg_iflag1 & FLEXCAN_IFLAG_RX_FIFO_AVAILABLE) {
 		handled = IRQ_HANDLED;
-		rvnum = can_rx_offload_irq_offload_fifo(&priv->offload);
+		can_rx_offload_irq_offload_fifo(&priv->offload);
 	}
 
-		/* FIFO overflow */
+	/* FIFO overflow */
 	if (reg_iflag1 & FLEXCAN_IFLAG_RX_FIFO_OVERFLOW) {
 		handled = IRQ_HANDLED;
 		flexcan_write(FLEXCAN_IFLAG_RX_FIFO_OVERFLOW, &regs->iflag1);
@@ -1036,65 +825,44 @@ static irqreturn_t flexcan_napi_irq(int irq, void *dev_id)
 		dev->stats.rx_errors++;
 	}
 
-	// if ((reg_iflag1 & FLEXCAN_IFLAG_RX_FIFO_AVAILABLE) ||
-	//     (reg_esr & FLEXCAN_ESR_ERR_STATE) ||
-	//     flexcan_has_and_handle_berr(priv, reg_esr)) {
-	// 	/*
-	// 	 * The error bits are cleared on read,
-	// 	 * save them for later use.
-	// 	 */
-	// 	priv->reg_esr = reg_esr & FLEXCAN_ESR_ERR_BUS;
-	// 	flexcan_write(FLEXCAN_IFLAG_DEFAULT &
-	// 		~FLEXCAN_IFLAG_RX_FIFO_AVAILABLE, &regs->imask1);
-	// 	flexcan_write(priv->reg_ctrl_default & ~FLEXCAN_CTRL_ERR_ALL,
-	// 	       &regs->ctrl);
-	// 	napi_schedule(&priv->napi);
-	// }
-
-	// /* FIFO overflow */
-	// if (reg_iflag1 & FLEXCAN_IFLAG_RX_FIFO_OVERFLOW) {
-	// 	flexcan_write(FLEXCAN_IFLAG_RX_FIFO_OVERFLOW, &regs->iflag1);
-	// 	dev->stats.rx_over_errors++;
-	// 	dev->stats.rx_errors++;
-	// }
-
 	/* transmission complete interrupt */
 	if (reg_iflag1 & (1 << FLEXCAN_TX_BUF_ID)) {
 		handled = IRQ_HANDLED;
-		stats->tx_bytes += can_get_echo_skb(dev, 0);
+		/* the mailbox got the timestamp of the sent frame */
+		reg_ctrl = flexcan_read(&regs->cantxfg[FLEXCAN_TX_BUF_ID].can_ctrl);
+		stats->tx_bytes += can_get_echo_skb_hwts(dev, 0,
+				flexcan_ts_to_ktime(priv, reg_ctrl));
 		stats->tx_packets++;
 		can_led_event(dev, CAN_LED_EVENT_TX);
 		flexcan_write((1 << FLEXCAN_TX_BUF_ID), &regs->iflag1);
 		netif_wake_queue(dev);
 	}
 
+	reg_esr = flexcan_read(&regs->esr);
+
+	/* ACK all bus error and state change IRQ sources */
 	if (reg_esr & FLEXCAN_ESR_ALL_INT) {
 		handled = IRQ_HANDLED;
 		flexcan_write(reg_esr & FLEXCAN_ESR_ALL_INT, &regs->esr);
 	}
 
-	if(reg_esr & FLEXCAN_ESR_ERR_STATE)
-	{
-		printk("hndz flexcan FLEXCAN_ESR_ERR_STATE error 0x%x!\n", reg_esr);
-		//error process
-	}
+	if (reg_esr & FLEXCAN_ESR_WAK_INT)
+		flexcan_exit_stop_mode(priv);
 
-	if(reg_esr & FLEXCAN_ESR_ERR_BUS)
-	{
-		printk("hndz flexcan FLEXCAN_ESR_ERR_BUS error 0x%x!\n", reg_esr);
-		//error process
-	}
-	// time2 = hndz_read_current_timer();
-	// if(rvnum > 0)
-	// 	printk("hndz can time %lu num %d!\n", time2-time1, rvnum);
+	/* state change interrupt or broken error state quirk fix is enabled */
+	if ((reg_esr & FLEXCAN_ESR_ERR_STATE) ||
+	    (priv->devtype_data->features & FLEXCAN_HAS_BROKEN_ERR_STATE))
+		flexcan_irq_state(dev, reg_esr);
 
-	return IRQ_HANDLED;
-}
+	/* bus error IRQ - handle if bus error reporting is activated */
+	if (flexcan_has_and_handle_berr(priv, reg_esr))
+		flexcan_irq_bus_err(dev, reg_esr);
 
-void can_rx_offload_enable(struct can_rx_offload *offload)
-{
-//	can_rx_offload_reset(offload);
-	napi_enable(&offload->napi);
+	spin_unlock(&priv->tc_lock);
+
+	can_rx_offload_irq_finish(&priv->offload);
+
+	return handled;
 }
 
 static void flexcan_set_bittiming(struct net_device *dev)
@@ -1247,6 +1015,8 @@ static int flexcan_chip_start(struct net_device *dev)
 
 	priv->can.state = CAN_STATE_ERROR_ACTIVE;
 
+	flexcan_tc_start(priv);
+
 	/* enable FIFO interrupts */
 	flexcan_write(FLEXCAN_IFLAG_DEFAULT, &regs->imask1);
 
@@ -1274,6 +1044,8 @@ static void flexcan_chip_stop(struct net_device *dev)
 	struct flexcan_priv *priv = netdev_priv(dev);
 	struct flexcan_regs __iomem *regs = priv->base;
 
+	hrtimer_cancel(&priv->tc_timer);
+
 	/* freeze + disable module */
 	flexcan_chip_freeze(priv);
 	flexcan_chip_disable(priv);
@@ -1306,18 +1078,9 @@ static int flexcan_open(struct net_device *dev)
 	if (err)
 		goto out_disable_per;
 
-#ifndef IRQ_CAN_RX
 	err = request_irq(dev->irq, flexcan_irq, IRQF_SHARED, dev->name, dev);
 	if (err)
 		goto out_close;
-#else
-	err = request_irq(dev->irq, flexcan_napi_irq, IRQF_SHARED, dev->name, dev);
-	if (err)
-		goto out_close;
- 	err = can_rx_offload_add_fifo(dev, &priv->offload, FLEXCAN_NAPI_WEIGHT);
-	if(err)
-		goto out_free_irq;
-#endif
 
 	/* start chip and queuing */
 	err = flexcan_chip_start(dev);
@@ -1325,11 +1088,7 @@ static int flexcan_open(struct net_device *dev)
 		goto out_free_irq;
 
 	can_led_event(dev, CAN_LED_EVENT_OPEN);
-#ifndef IRQ_CAN_RX
-	napi_enable(&priv->napi);
-#else
 	can_rx_offload_enable(&priv->offload);
-#endif
 	netif_start_queue(dev);
 
 	return 0;
@@ -1351,7 +1110,7 @@ static int flexcan_close(struct net_device *dev)
 	struct flexcan_priv *priv = netdev_priv(dev);
 
 	netif_stop_queue(dev);
-	napi_disable(&priv->napi);
+	can_rx_offload_disable(&priv->offload);
 	flexcan_chip_stop(dev);
 
 	free_irq(dev->irq, dev);
@@ -1389,6 +1148,11 @@ static const struct net_device_ops flexcan_netdev_ops = {
 	.ndo_open	= flexcan_open,
 	.ndo_stop	= flexcan_close,
 	.ndo_start_xmit	= flexcan_start_xmit,
+	.ndo_do_ioctl	= can_hwtstamp_ioctl,
+};
+
+static const struct ethtool_ops flexcan_ethtool_ops = {
+	.get_ts_info	= can_ethtool_get_ts_info_hwts,
 };
 
 static int register_flexcandev(struct net_device *dev)
@@ -1573,6 +1337,7 @@ static int flexcan_probe(struct platform_device *pdev)
 		return -ENOMEM;
 
 	dev->netdev_ops = &flexcan_netdev_ops;
+	dev->ethtool_ops = &flexcan_ethtool_ops;
 	dev->irq = irq;
 	dev->flags |= IFF_ECHO;
 
@@ -1591,12 +1356,19 @@ static int flexcan_probe(struct platform_device *pdev)
 	priv->pdata = dev_get_platdata(&pdev->dev);
 	priv->devtype_data = devtype_data;
 
+	spin_lock_init(&priv->tc_lock);
+	hrtimer_init(&priv->tc_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	priv->tc_timer.function = flexcan_tc_resync;
+
 	priv->reg_xceiver = devm_regulator_get(&pdev->dev, "xceiver");
 	if (IS_ERR(priv->reg_xceiver))
 		priv->reg_xceiver = NULL;
-#ifndef IRQ_CAN_RX
-	netif_napi_add(dev, &priv->napi, flexcan_poll, FLEXCAN_NAPI_WEIGHT);
-#endif
+
+	priv->offload.mailbox_read = flexcan_mailbox_read;
+	err = can_rx_offload_add_fifo(dev, &priv->offload, FLEXCAN_NAPI_WEIGHT);
+	if (err)
+		goto failed_offload;
+
 	platform_set_drvdata(pdev, dev);
 	SET_NETDEV_DEV(dev, &pdev->dev);
 
@@ -1624,6 +1396,8 @@ static int flexcan_probe(struct platform_device *pdev)
 	return 0;
 
  failed_register:
+	can_rx_offload_del(&priv->offload);
+ failed_offload:
 	free_candev(dev);
 	return err;
 }
@@ -1634,7 +1408,7 @@ static int flexcan_remove(struct platform_device *pdev)
 	struct flexcan_priv *priv = netdev_priv(dev);
 
 	unregister_flexcandev(dev);
-	netif_napi_del(&priv->napi);
+	can_rx_offload_del(&priv->offload);
 	free_candev(dev);
 
 	return 0;
@@ -58,6 +58,7 @@
 #include <linux/can/dev.h>
 #include <linux/can/led.h>
 #include <linux/can/platform/mcp251x.h>
+#include <linux/can/rx-offload.h>
 #include <linux/clk.h>
 #include <linux/completion.h>
 #include <linux/delay.h>
@@ -77,7 +78,6 @@
 #include <linux/uaccess.h>
 #include <linux/regulator/consumer.h>
 #include <linux/of_gpio.h>
-#include "../../spi/spi-imx.h"
 
 /* SPI interface instruction set */
 #define INSTRUCTION_WRITE	0x02
@@ -150,6 +150,7 @@
 #  define TXBCTRL_MLOA	0x20
 #  define TXBCTRL_TXERR 0x10
 #  define TXBCTRL_TXREQ 0x08
+#  define TXBCTRL_TXP_MASK 0x03
 #define TXBSIDH(n)  (((n) * 0x10) + 0x30 + TXBSIDH_OFF)
 #  define SIDH_SHIFT    3
 #define TXBSIDL(n)  (((n) * 0x10) + 0x30 + TXBSIDL_OFF)
@@ -206,28 +207,40 @@
 #define SET_BYTE(val, byte)			\
 	(((val) & 0xff) << ((byte) * 8))
 
-static int  rst_gpio;
-
 /*
  * Buffer size required for the largest SPI transfer (i.e., reading a
  * frame)
  */
 #define CAN_FRAME_MAX_DATA_LEN	8
 #define SPI_TRANSFER_BUF_LEN	(6 + CAN_FRAME_MAX_DATA_LEN)
+/* WRITE instruction + address + TXBnCTRL..TXBnD7 */
+#define SPI_TX_LOAD_LEN		(2 + SPI_TRANSFER_BUF_LEN)
+/*
+ * The interrupt thread chains up to two RX buffer reads, two BIT MODIFY
+ * commands and the next CANINTF/EFLG read into a single SPI message.
+ */
+#define MCP251X_IST_MAX_XFERS	5
+#define SPI_BATCH_BUF_LEN	(2 * SPI_TRANSFER_BUF_LEN + 3 * 4)
 #define CAN_FRAME_MAX_BITS	128
 
-#define TX_ECHO_SKB_MAX	1
+/*
+ * All three TX buffers are used, each one owns the echo skb with the
+ * same index.
+ */
+#define MCP251X_TX_BUF_NUM	3
+#define MCP251X_TX_BUF_MASK	(BIT(MCP251X_TX_BUF_NUM) - 1)
+#define TX_ECHO_SKB_MAX	MCP251X_TX_BUF_NUM
+
+/* frames handed to the stack per NAPI poll */
+#define MCP251X_NAPI_WEIGHT	32
 
 #define MCP251X_OST_DELAY_MS	(50)
 
 #define DEVICE_NAME "mcp251x"
 
-static int mcp251x_enable_dma = 1; /* Enable SPI DMA. Default: 0 (Off) */
+static int mcp251x_enable_dma = 1; /* Enable SPI DMA. Default: 1 (On) */
 module_param(mcp251x_enable_dma, int, S_IRUGO);
-MODULE_PARM_DESC(mcp251x_enable_dma, "Enable SPI DMA. Default: 0 (Off)");
-
-struct spi_transfer gMcp25_tf;
-struct spi_message  gMcp25_msg;
+MODULE_PARM_DESC(mcp251x_enable_dma, "Enable SPI DMA. Default: 1 (On)");
 
 static const struct can_bittiming_const mcp251x_bittiming_const = {
 	.name = DEVICE_NAME,
@@ -252,15 +265,27 @@ struct mcp251x_priv {
 	struct spi_device *spi;
 	enum mcp251x_model model;
 
+	struct can_rx_offload offload;
+	/*
+	 * The chip has no timestamp counter: frames get the time the
+	 * interrupt was raised (or the status read of the round that saw
+	 * them) as their software timestamp.
+	 */
+	ktime_t irq_tstamp;
+
 	struct mutex mcp_lock; /* SPI device lock */
 	spinlock_t spin_mcp_lock;
 	u8 *spi_tx_buf;
 	u8 *spi_rx_buf;
 	dma_addr_t spi_tx_dma;
 	dma_addr_t spi_rx_dma;
+	bool use_dma;			/* SPI buffers are DMA coherent */
 
-	struct sk_buff *tx_skb;
-	int tx_len;
+	struct sk_buff_head tx_queue;	/* frames waiting for a TX buffer */
+	atomic_t tx_pending;		/* frames queued or in a TX buffer */
+	u8 tx_busy;			/* TX buffers owned by the chip */
+	int tx_prio;			/* TXP of the last loaded TX buffer */
+	int tx_len[MCP251X_TX_BUF_NUM];
 
 	struct workqueue_struct *wq;
 	struct work_struct tx_work;
@@ -278,6 +303,7 @@ struct mcp251x_priv {
 	struct regulator *power;
 	struct regulator *transceiver;
 	struct clk *clk;
+	int rst_gpio;
 };
 
 #define MCP251X_IS(_model) \
@@ -290,20 +316,35 @@ static inline int mcp251x_is_##_model(struct spi_device *spi) \
 MCP251X_IS(2510);
 MCP251X_IS(2515);
 
-extern int spi_imx_dma_wait(struct spi_device * spi, struct spi_transfer *transfer);
-
+/*
+ * Drop everything queued for transmission. The queue is stopped and the
+ * TX lock held so that mcp251x_hard_start_xmit() cannot bump tx_pending
+ * between the purge and the reset; whoever restarts the device wakes it.
+ */
 static void mcp251x_clean(struct net_device *net)
 {
 	struct mcp251x_priv *priv = netdev_priv(net);
+	struct sk_buff *skb;
+	int i;
 
-	if (priv->tx_skb || priv->tx_len)
+	netif_tx_lock_bh(net);
+	netif_stop_queue(net);
+
+	while ((skb = skb_dequeue(&priv->tx_queue))) {
 		net->stats.tx_errors++;
-	if (priv->tx_skb)
-		dev_kfree_skb(priv->tx_skb);
-	if (priv->tx_len)
-		can_free_echo_skb(priv->net, 0);
-	priv->tx_skb = NULL;
-	priv->tx_len = 0;
+		dev_kfree_skb(skb);
+	}
+
+	for (i = 0; i < MCP251X_TX_BUF_NUM; i++) {
+		if (!(priv->tx_busy & BIT(i)))
+			continue;
+		net->stats.tx_errors++;
+		can_free_echo_skb(net, i);
+	}
+	priv->tx_busy = 0;
+	atomic_set(&priv->tx_pending, 0);
+
+	netif_tx_unlock_bh(net);
 }
 
 /*
@@ -319,9 +360,6 @@ static void mcp251x_clean(struct net_device *net)
  * conversation with the chip and to avoid doing really nasty things
  * (like injecting bogus packets in the network stack).
  */
-extern int hndz_spi_async(struct spi_device *spi, struct spi_message *message);
-extern int hndz_spi_dma_irq_async(struct spi_device *spi, struct spi_message *message, 
-							dma_async_tx_callback rxcallback, dma_async_tx_callback txcallback);
 static int mcp251x_spi_trans(struct spi_device *spi, int len)
 {
 	struct mcp251x_priv *priv = spi_get_drvdata(spi);
@@ -333,57 +371,23 @@ static int mcp251x_spi_trans(struct spi_device *spi, int len)
 	};
 	struct spi_message m;
 	int ret;
-	// if(len == 1)
-	// {
-	// 	printk("hndz spi send len 1!\n");
-	// 	dump_stack();
-	// }
+
 	spi_message_init(&m);
 
-	if (mcp251x_enable_dma) {
+	if (priv->use_dma) {
 		t.tx_dma = priv->spi_tx_dma;
 		t.rx_dma = priv->spi_rx_dma;
 		m.is_dma_mapped = 1;
 	}
-	// m.spi = spi;
 	spi_message_add_tail(&t, &m);
 
-	ret = hndz_spi_async(spi, &m);
-	//  ret = spi_sync(spi, &m);
+	ret = spi_sync(spi, &m);
 	if (ret)
 		dev_err(&spi->dev, "spi transfer failed: ret = %d\n", ret);
 	return ret;
 }
 
 
-static int mcp251x_spi_async_trans(struct spi_device *spi, int len, dma_async_tx_callback rxcallback, dma_async_tx_callback txcallback)
-{
-	struct mcp251x_priv *priv = spi_get_drvdata(spi);
-	int ret;
-
-	memset(&gMcp25_tf, 0, sizeof(struct spi_transfer));
-	gMcp25_tf.tx_buf = priv->spi_tx_buf;
-	gMcp25_tf.rx_buf = priv->spi_rx_buf;
-	gMcp25_tf.len = len;
-	
-	spi_message_init(&gMcp25_msg);
-
-	if (mcp251x_enable_dma) {
-		gMcp25_tf.tx_dma = priv->spi_tx_dma;
-		gMcp25_tf.rx_dma = priv->spi_rx_dma;
-		gMcp25_msg.is_dma_mapped = 1;
-	}
-	// m.spi = spi;
-	spi_message_add_tail(&gMcp25_tf, &gMcp25_msg);
-
-	ret = hndz_spi_dma_irq_async(spi, &gMcp25_msg, rxcallback,  txcallback);
-	//  ret = spi_sync(spi, &m);
-	if (ret)
-		dev_err(&spi->dev, "spi transfer failed: ret = %d\n", ret);
-	ret = spi_imx_dma_wait(spi, &gMcp25_tf);
-	return ret;
-}
-
 static u8 mcp251x_read_reg(struct spi_device *spi, uint8_t reg)
 {
 	struct mcp251x_priv *priv = spi_get_drvdata(spi);
@@ -398,21 +402,6 @@ static u8 mcp251x_read_reg(struct spi_device *spi, uint8_t reg)
 	return val;
 }
 
-static void mcp251x_read_2regs(struct spi_device *spi, uint8_t reg,
-		uint8_t *v1, uint8_t *v2)
-{
-	struct mcp251x_priv *priv = spi_get_drvdata(spi);
-
-	priv->spi_tx_buf[0] = INSTRUCTION_READ;
-	priv->spi_tx_buf[1] = reg;
-
-	mcp251x_spi_trans(spi, 4);
-
-	*v1 = priv->spi_rx_buf[2];
-	*v2 = priv->spi_rx_buf[3];
-	// printk("hndz vi1 0x%x v2 0x%x!\n", *v1, *v2);
-}
-
 static void mcp251x_write_reg(struct spi_device *spi, u8 reg, uint8_t val)
 {
 	struct mcp251x_priv *priv = spi_get_drvdata(spi);
@@ -437,6 +426,10 @@ static void mcp251x_write_bits(struct spi_device *spi, u8 reg,
 	mcp251x_spi_trans(spi, 4);
 }
 
+/*
+ * Write TXBnCTRL (for the priority) and the frame with a single WRITE
+ * instruction, LOAD TX BUFFER would skip the control register.
+ */
 static void mcp251x_hw_tx_frame(struct spi_device *spi, u8 *buf,
 				int len, int tx_buf_idx)
 {
@@ -445,17 +438,19 @@ static void mcp251x_hw_tx_frame(struct spi_device *spi, u8 *buf,
 	if (mcp251x_is_2510(spi)) {
 		int i;
 
-		for (i = 1; i < TXBDAT_OFF + len; i++)
+		for (i = 0; i < TXBDAT_OFF + len; i++)
 			mcp251x_write_reg(spi, TXBCTRL(tx_buf_idx) + i,
 					  buf[i]);
 	} else {
-		memcpy(priv->spi_tx_buf, buf, TXBDAT_OFF + len);
-		mcp251x_spi_trans(spi, TXBDAT_OFF + len);
+		priv->spi_tx_buf[0] = INSTRUCTION_WRITE;
+		priv->spi_tx_buf[1] = TXBCTRL(tx_buf_idx);
+		memcpy(priv->spi_tx_buf + 2, buf, TXBDAT_OFF + len);
+		mcp251x_spi_trans(spi, 2 + TXBDAT_OFF + len);
 	}
 }
 
 static void mcp251x_hw_tx(struct spi_device *spi, struct can_frame *frame,
-			  int tx_buf_idx)
+			  int tx_buf_idx, int prio)
 {
 	struct mcp251x_priv *priv = spi_get_drvdata(spi);
 	u32 sid, eid, exide, rtr;
@@ -469,7 +464,7 @@ static void mcp251x_hw_tx(struct spi_device *spi, struct can_frame *frame,
 	eid = frame->can_id & CAN_EFF_MASK; /* Extended ID */
 	rtr = (frame->can_id & CAN_RTR_FLAG) ? 1 : 0; /* Remote transmission */
 
-	buf[TXBCTRL_OFF] = INSTRUCTION_LOAD_TXB(tx_buf_idx);
+	buf[TXBCTRL_OFF] = prio & TXBCTRL_TXP_MASK;
 	buf[TXBSIDH_OFF] = sid >> SIDH_SHIFT;
 	buf[TXBSIDL_OFF] = ((sid & SIDL_SID_MASK) << SIDL_SID_SHIFT) |
 		(exide << SIDL_EXIDE_SHIFT) |
@@ -506,21 +501,18 @@ static void mcp251x_hw_rx_frame(struct spi_device *spi, u8 *buf,
 	}
 }
 
-static void mcp251x_hw_rx(struct spi_device *spi, int buf_idx)
+/* Build an skb from the RXBnCTRL..RXBnD7 image in @buf and queue it */
+static void mcp251x_rx_skb(struct mcp251x_priv *priv, const u8 *buf)
 {
-	struct mcp251x_priv *priv = spi_get_drvdata(spi);
 	struct sk_buff *skb;
 	struct can_frame *frame;
-	u8 buf[SPI_TRANSFER_BUF_LEN];
 
 	skb = alloc_can_skb(priv->net, &frame);
 	if (!skb) {
-		dev_err(&spi->dev, "cannot allocate RX skb\n");
 		priv->net->stats.rx_dropped++;
 		return;
 	}
 
-	mcp251x_hw_rx_frame(spi, buf, buf_idx);
 	if (buf[RXBSIDL_OFF] & RXBSIDL_IDE) {
 		/* Extended ID format */
 		frame->can_id = CAN_EFF_FLAG;
@@ -547,74 +539,17 @@ static void mcp251x_hw_rx(struct spi_device *spi, int buf_idx)
 	frame->can_dlc = get_can_dlc(buf[RXBDLC_OFF] & RXBDLC_LEN_MASK);
 	memcpy(frame->data, buf + RXBDAT_OFF, frame->can_dlc);
 
-	priv->net->stats.rx_packets++;
-	priv->net->stats.rx_bytes += frame->can_dlc;
-
-	can_led_event(priv->net, CAN_LED_EVENT_RX);
-
-	netif_rx_ni(skb);
-}
-
-static void mcp251x_hw_irq_dma_read_frame(struct spi_device *spi, u8 *buf,
-				int buf_idx)
-{
-	struct mcp251x_priv *priv = spi_get_drvdata(spi);
-
-	priv->spi_tx_buf[RXBCTRL_OFF] = INSTRUCTION_READ_RXB(buf_idx);
-
-	mcp251x_spi_async_trans(spi, SPI_TRANSFER_BUF_LEN, NULL, NULL);
-	memcpy(buf, priv->spi_rx_buf, SPI_TRANSFER_BUF_LEN);
-	
-
+	skb->tstamp = priv->irq_tstamp;
+	can_rx_offload_irq_queue_tail(&priv->offload, skb);
 }
 
-static void mcp251x_irq_dma_hw_rx(struct spi_device *spi, int buf_idx)
+static void mcp251x_hw_rx(struct spi_device *spi, int buf_idx)
 {
 	struct mcp251x_priv *priv = spi_get_drvdata(spi);
-	struct sk_buff *skb;
-	struct can_frame *frame;
 	u8 buf[SPI_TRANSFER_BUF_LEN];
 
-	skb = alloc_can_skb(priv->net, &frame);
-	if (!skb) {
-		dev_err(&spi->dev, "cannot allocate RX skb\n");
-		priv->net->stats.rx_dropped++;
-		return;
-	}
-
-	mcp251x_hw_irq_dma_read_frame(spi, buf, buf_idx);
-	if (buf[RXBSIDL_OFF] & RXBSIDL_IDE) {
-		/* Extended ID format */
-		frame->can_id = CAN_EFF_FLAG;
-		frame->can_id |=
-			/* Extended ID part */
-			SET_BYTE(buf[RXBSIDL_OFF] & RXBSIDL_EID, 2) |
-			SET_BYTE(buf[RXBEID8_OFF], 1) |
-			SET_BYTE(buf[RXBEID0_OFF], 0) |
-			/* Standard ID part */
-			(((buf[RXBSIDH_OFF] << RXBSIDH_SHIFT) |
-			  (buf[RXBSIDL_OFF] >> RXBSIDL_SHIFT)) << 18);
-		/* Remote transmission request */
-		if (buf[RXBDLC_OFF] & RXBDLC_RTR)
-			frame->can_id |= CAN_RTR_FLAG;
-	} else {
-		/* Standard ID format */
-		frame->can_id =
-			(buf[RXBSIDH_OFF] << RXBSIDH_SHIFT) |
-			(buf[RXBSIDL_OFF] >> RXBSIDL_SHIFT);
-		if (buf[RXBSIDL_OFF] & RXBSIDL_SRR)
-			frame->can_id |= CAN_RTR_FLAG;
-	}
-	/* Data length */
-	frame->can_dlc = get_can_dlc(buf[RXBDLC_OFF] & RXBDLC_LEN_MASK);
-	memcpy(frame->data, buf + RXBDAT_OFF, frame->can_dlc);
-
-	priv->net->stats.rx_packets++;
-	priv->net->stats.rx_bytes += frame->can_dlc;
-
-	can_led_event(priv->net, CAN_LED_EVENT_RX);
-
-	netif_rx_ni(skb);
+	mcp251x_hw_rx_frame(spi, buf, buf_idx);
+	mcp251x_rx_skb(priv, buf);
 }
 
 static void mcp251x_hw_sleep(struct spi_device *spi)
@@ -626,18 +561,17 @@ static netdev_tx_t mcp251x_hard_start_xmit(struct sk_buff *skb,
 					   struct net_device *net)
 {
 	struct mcp251x_priv *priv = netdev_priv(net);
-	struct spi_device *spi = priv->spi;
-
-	if (priv->tx_skb || priv->tx_len) {
-		// dev_warn(&spi->dev, "hard_xmit called while tx busy\n");
-		return NETDEV_TX_BUSY;
-	}
 
 	if (can_dropped_invalid_skb(net, skb))
 		return NETDEV_TX_OK;
 
-	netif_stop_queue(net);
-	priv->tx_skb = skb;
+	skb_queue_tail(&priv->tx_queue, skb);
+	if (atomic_inc_return(&priv->tx_pending) >= MCP251X_TX_BUF_NUM) {
+		netif_stop_queue(net);
+		/* a TX buffer may have been freed in the meantime */
+		if (atomic_read(&priv->tx_pending) < MCP251X_TX_BUF_NUM)
+			netif_wake_queue(net);
+	}
 	queue_work(priv->wq, &priv->tx_work);
 
 	return NETDEV_TX_OK;
@@ -798,6 +732,7 @@ static void mcp251x_open_clean(struct net_device *net)
 	struct spi_device *spi = priv->spi;
 
 	free_irq(spi->irq, priv);
+	can_rx_offload_disable(&priv->offload);
 	mcp251x_hw_sleep(spi);
 	mcp251x_power_enable(priv->transceiver, 0);
 	close_candev(net);
@@ -807,6 +742,7 @@ static int mcp251x_stop(struct net_device *net)
 {
 	struct mcp251x_priv *priv = netdev_priv(net);
 	struct spi_device *spi = priv->spi;
+	int i;
 
 	close_candev(net);
 
@@ -814,6 +750,7 @@ static int mcp251x_stop(struct net_device *net)
 	free_irq(spi->irq, priv);
 	destroy_workqueue(priv->wq);
 	priv->wq = NULL;
+	can_rx_offload_disable(&priv->offload);
 
 	mutex_lock(&priv->mcp_lock);
 
@@ -821,7 +758,8 @@ static int mcp251x_stop(struct net_device *net)
 	mcp251x_write_reg(spi, CANINTE, 0x00);
 	mcp251x_write_reg(spi, CANINTF, 0x00);
 
-	mcp251x_write_reg(spi, TXBCTRL(0), 0);
+	for (i = 0; i < MCP251X_TX_BUF_NUM; i++)
+		mcp251x_write_reg(spi, TXBCTRL(i), 0);
 	mcp251x_clean(net);
 
 	mcp251x_hw_sleep(spi);
@@ -839,6 +777,7 @@ static int mcp251x_stop(struct net_device *net)
 
 static void mcp251x_error_skb(struct net_device *net, int can_id, int data1)
 {
+	struct mcp251x_priv *priv = netdev_priv(net);
 	struct sk_buff *skb;
 	struct can_frame *frame;
 
@@ -846,36 +785,65 @@ static void mcp251x_error_skb(struct net_device *net, int can_id, int data1)
 	if (skb) {
 		frame->can_id |= can_id;
 		frame->data[1] = data1;
-		netif_rx_ni(skb);
+		skb->tstamp = priv->irq_tstamp;
+		can_rx_offload_irq_queue_tail(&priv->offload, skb);
 	} else {
 		netdev_err(net, "cannot allocate error skb\n");
 	}
 }
 
-static void mcp251x_tx_work_handler(struct work_struct *ws)
+/*
+ * Move queued frames into free TX buffers, called with mcp_lock held.
+ *
+ * The chip sends the pending buffer with the highest TXP first (and the
+ * highest buffer number on a tie), so every frame gets a lower priority
+ * than the ones still pending to keep the frames in order. Once the
+ * lowest priority is used up, wait until all buffers are sent.
+ */
+static void mcp251x_tx_load(struct mcp251x_priv *priv)
 {
-	struct mcp251x_priv *priv = container_of(ws, struct mcp251x_priv,
-						 tx_work);
 	struct spi_device *spi = priv->spi;
 	struct net_device *net = priv->net;
 	struct can_frame *frame;
+	struct sk_buff *skb;
+	int idx, prio;
 
-	mutex_lock(&priv->mcp_lock);
-	if (priv->tx_skb) {
-		if (priv->can.state == CAN_STATE_BUS_OFF) {
-			mcp251x_clean(net);
-		} else {
-			priv->rxtx_state = 1;
-			frame = (struct can_frame *)priv->tx_skb->data;
-
-			if (frame->can_dlc > CAN_FRAME_MAX_DATA_LEN)
-				frame->can_dlc = CAN_FRAME_MAX_DATA_LEN;
-			mcp251x_hw_tx(spi, frame, 0);
-			priv->tx_len = 1 + frame->can_dlc;
-			can_put_echo_skb(priv->tx_skb, net, 0);
-			priv->tx_skb = NULL;
-		}
+	if (priv->can.state == CAN_STATE_BUS_OFF) {
+		mcp251x_clean(net);
+		return;
+	}
+
+	while (priv->tx_busy != MCP251X_TX_BUF_MASK) {
+		prio = priv->tx_busy ? priv->tx_prio - 1 : TXBCTRL_TXP_MASK;
+		if (prio < 0)
+			break;
+
+		skb = skb_dequeue(&priv->tx_queue);
+		if (!skb)
+			break;
+
+		priv->rxtx_state = 1;
+		frame = (struct can_frame *)skb->data;
+
+		if (frame->can_dlc > CAN_FRAME_MAX_DATA_LEN)
+			frame->can_dlc = CAN_FRAME_MAX_DATA_LEN;
+
+		idx = ffz(priv->tx_busy);
+		mcp251x_hw_tx(spi, frame, idx, prio);
+		priv->tx_len[idx] = frame->can_dlc;
+		priv->tx_busy |= BIT(idx);
+		priv->tx_prio = prio;
+		can_put_echo_skb(skb, net, idx);
 	}
+}
+
+static void mcp251x_tx_work_handler(struct work_struct *ws)
+{
+	struct mcp251x_priv *priv = container_of(ws, struct mcp251x_priv,
+						 tx_work);
+
+	mutex_lock(&priv->mcp_lock);
+	mcp251x_tx_load(priv);
 	mutex_unlock(&priv->mcp_lock);
 }
 
@@ -905,59 +873,145 @@ static void mcp251x_restart_work_handler(struct work_struct *ws)
 	}
 
 	if (priv->restart_tx) {
+		int i;
+
 		priv->restart_tx = 0;
-		mcp251x_write_reg(spi, TXBCTRL(0), 0);
+		for (i = 0; i < MCP251X_TX_BUF_NUM; i++)
+			mcp251x_write_reg(spi, TXBCTRL(i), 0);
 		mcp251x_clean(net);
 		netif_wake_queue(net);
+		priv->irq_tstamp = ktime_get_real();
 		mcp251x_error_skb(net, CAN_ERR_RESTARTED, 0);
+		can_rx_offload_threaded_irq_finish(&priv->offload);
 	}
 	mutex_unlock(&priv->mcp_lock);
 }
 
-static void mcp251x_spi_imx_dma_rx_callback(void *cookie)
+static void mcp251x_read_2regs(struct spi_device *spi, uint8_t reg,
+		uint8_t *v1, uint8_t *v2)
 {
-	u8 intf, eflag;
-	struct spi_device *spi = (struct spi_device *)cookie;
-	struct spi_imx_data *spi_imx = spi_master_get_devdata(spi->master);
 	struct mcp251x_priv *priv = spi_get_drvdata(spi);
-	complete(&spi_imx->dma_rx_completion);
-
-	// intf = priv->spi_rx_buf[2];
-	// eflag = priv->spi_rx_buf[3];
 
-	// intf &= CANINTF_RX | CANINTF_TX | CANINTF_ERR;
+	priv->spi_tx_buf[0] = INSTRUCTION_READ;
+	priv->spi_tx_buf[1] = reg;
 
-	// /* receive buffer 0 */
-	// if (intf & CANINTF_RX0IF) {
-	// 	mcp251x_hw_rx(spi, 0);
-	// }
+	mcp251x_spi_trans(spi, 4);
 
+	*v1 = priv->spi_rx_buf[2];
+	*v2 = priv->spi_rx_buf[3];
 }
 
-static void mcp251x_spi_imx_dma_tx_callback(void *cookie)
+static u8 *mcp251x_batch_add(struct mcp251x_priv *priv, struct spi_message *m,
+			     struct spi_transfer *t, unsigned int *off,
+			     unsigned int len)
 {
-	struct spi_device *spi = (struct spi_device *)cookie;
-	struct spi_imx_data *spi_imx = spi_master_get_devdata(spi->master);
+	memset(t, 0, sizeof(*t));
+	t->tx_buf = priv->spi_tx_buf + *off;
+	t->rx_buf = priv->spi_rx_buf + *off;
+	t->len = len;
+	/* every command needs its own chip select cycle */
+	t->cs_change = 1;
+	if (priv->use_dma) {
+		t->tx_dma = priv->spi_tx_dma + *off;
+		t->rx_dma = priv->spi_rx_dma + *off;
+	}
+	spi_message_add_tail(t, m);
+	*off += len;
 
-	complete(&spi_imx->dma_tx_completion);
+	return priv->spi_tx_buf + *off - len;
 }
 
-
-static void mcp251x_stage1_read_2regs(struct spi_device *spi, uint8_t *v1, uint8_t *v2)
+/*
+ * Run the SPI commands of one interrupt thread iteration as a single
+ * chained message:
+ *
+ *  - READ RX BUFFER for every full RX buffer; on the MCP2515 this also
+ *    clears RXnIF when the chip select is released
+ *  - BIT MODIFY CANINTF to ack the TX and error interrupts
+ *  - BIT MODIFY EFLG to clear the error flags
+ *  - READ CANINTF/EFLG for the next iteration, if @poll is set
+ *
+ * The received frames are queued to the rx-offload before returning.
+ */
+static int mcp251x_ist_batch(struct mcp251x_priv *priv, u8 intf,
+			     u8 clear_intf, u8 eflag, bool poll,
+			     u8 *next_intf, u8 *next_eflag)
 {
-	struct mcp251x_priv *priv = spi_get_drvdata(spi);
+	struct spi_device *spi = priv->spi;
+	struct spi_transfer t[MCP251X_IST_MAX_XFERS];
+	struct spi_message m;
+	unsigned int off = 0, rx_off[2] = { 0, 0 }, poll_off = 0;
+	int n = 0, i, ret;
+	u8 *cmd;
 
-	priv->spi_tx_buf[0] = INSTRUCTION_READ;
-	priv->spi_tx_buf[1] = CANINTF;
+	spi_message_init(&m);
+	m.is_dma_mapped = priv->use_dma;
 
-	// mcp251x_spi_trans(spi, 4);
-	mcp251x_spi_async_trans(spi, 4, mcp251x_spi_imx_dma_rx_callback, mcp251x_spi_imx_dma_tx_callback);
+	for (i = 0; i < 2; i++) {
+		if (!(intf & (CANINTF_RX0IF << i)))
+			continue;
 
-	//  spi_imx_dma_wait(spi, struct spi_transfer *transfer)
-	*v1 = priv->spi_rx_buf[2];
-	*v2 = priv->spi_rx_buf[3];
-	
-	// printk("hndz read v1 0x%x v2 0x%x!\n", *v1, *v2);
+		if (mcp251x_is_2510(spi)) {
+			/* no READ RX BUFFER instruction, read register wise */
+			mcp251x_hw_rx(spi, i);
+			clear_intf |= CANINTF_RX0IF << i;
+			continue;
+		}
+
+		rx_off[i] = off;
+		cmd = mcp251x_batch_add(priv, &m, &t[n++], &off,
+					SPI_TRANSFER_BUF_LEN);
+		cmd[RXBCTRL_OFF] = INSTRUCTION_READ_RXB(i);
+	}
+
+	if (clear_intf) {
+		cmd = mcp251x_batch_add(priv, &m, &t[n++], &off, 4);
+		cmd[0] = INSTRUCTION_BIT_MODIFY;
+		cmd[1] = CANINTF;
+		cmd[2] = clear_intf;
+		cmd[3] = 0x00;
+	}
+
+	if (eflag) {
+		cmd = mcp251x_batch_add(priv, &m, &t[n++], &off, 4);
+		cmd[0] = INSTRUCTION_BIT_MODIFY;
+		cmd[1] = EFLG;
+		cmd[2] = eflag;
+		cmd[3] = 0x00;
+	}
+
+	if (poll) {
+		poll_off = off;
+		cmd = mcp251x_batch_add(priv, &m, &t[n++], &off, 4);
+		cmd[0] = INSTRUCTION_READ;
+		cmd[1] = CANINTF;
+	}
+
+	*next_intf = 0;
+	*next_eflag = 0;
+
+	if (!n)
+		return 0;
+
+	/* release the chip select after the last command */
+	t[n - 1].cs_change = 0;
+
+	ret = spi_sync(spi, &m);
+	if (ret) {
+		dev_err(&spi->dev, "spi transfer failed: ret = %d\n", ret);
+		return ret;
+	}
+
+	for (i = 0; i < 2; i++)
+		if ((intf & (CANINTF_RX0IF << i)) && !mcp251x_is_2510(spi))
+			mcp251x_rx_skb(priv, priv->spi_rx_buf + rx_off[i]);
+
+	if (poll) {
+		*next_intf = priv->spi_rx_buf[poll_off + 2];
+		*next_eflag = priv->spi_rx_buf[poll_off + 3];
+	}
+
+	return 0;
 }
 
 static irqreturn_t mcp251x_can_ist(int irq, void *dev_id)
@@ -965,54 +1019,33 @@ static irqreturn_t mcp251x_can_ist(int irq, void *dev_id)
 	struct mcp251x_priv *priv = dev_id;
 	struct spi_device *spi = priv->spi;
 	struct net_device *net = priv->net;
+	u8 intf, eflag;
 
 	mutex_lock(&priv->mcp_lock);
+
+	mcp251x_read_2regs(spi, CANINTF, &intf, &eflag);
+
 	while (!priv->force_quit) {
 		enum can_state new_state;
-		u8 intf, eflag;
-		u8 clear_intf = 0;
+		ktime_t next_tstamp;
+		u8 next_intf, next_eflag;
 		int can_id = 0, data1 = 0;
 
-		// mcp251x_read_2regs(spi, CANINTF, &intf, &eflag);
-		mcp251x_stage1_read_2regs(spi, &intf, &eflag);
-
 		/* mask out flags we don't care about */
 		intf &= CANINTF_RX | CANINTF_TX | CANINTF_ERR;
 
-		/* receive buffer 0 */
-		if (intf & CANINTF_RX0IF) {
-			// mcp251x_hw_rx(spi, 0);
-			mcp251x_irq_dma_hw_rx(spi, 0);
-			/*
-			 * Free one buffer ASAP
-			 * (The MCP2515 does this automatically.)
-			 */
-			if (mcp251x_is_2510(spi))
-				mcp251x_write_bits(spi, CANINTF, CANINTF_RX0IF, 0x00);
-			if (!(intf & CANINTF_RX1IF))
-			{
-				mcp251x_read_2regs(spi, CANINTF, &intf, &eflag);
-				intf &= CANINTF_RX | CANINTF_TX | CANINTF_ERR;
-			}
-		}
-
-		/* receive buffer 1 */
-		if (intf & CANINTF_RX1IF) {
-			// mcp251x_hw_rx(spi, 1);
-			mcp251x_irq_dma_hw_rx(spi, 1);
-			/* the MCP2515 does this automatically */
-			if (mcp251x_is_2510(spi))
-				clear_intf |= CANINTF_RX1IF;
-		}
-
-		/* any error or tx interrupt we need to clear? */
-		if (intf & (CANINTF_ERR | CANINTF_TX))
-			clear_intf |= intf & (CANINTF_ERR | CANINTF_TX);
-		if (clear_intf)
-			mcp251x_write_bits(spi, CANINTF, clear_intf, 0x00);
-
-		if (eflag)
-			mcp251x_write_bits(spi, EFLG, eflag, 0x00);
+		/*
+		 * Read the frames, ack the interrupts and fetch the status
+		 * for the next round in one go. Only poll again if there
+		 * was something to do in this round.
+		 */
+		if (mcp251x_ist_batch(priv, intf,
+				      intf & (CANINTF_ERR | CANINTF_TX),
+				      eflag, intf != 0,
+				      &next_intf, &next_eflag))
+			break;
+		/* next_intf was sampled just now */
+		next_tstamp = ktime_get_real();
 
 		/* Update can state */
 		if (eflag & EFLG_TXBO) {
@@ -1085,22 +1118,49 @@ static irqreturn_t mcp251x_can_ist(int irq, void *dev_id)
 			break;
 
 		if (intf & CANINTF_TX) {
-			net->stats.tx_packets++;
-			net->stats.tx_bytes += priv->tx_len - 1;
-			can_led_event(net, CAN_LED_EVENT_TX);
-			if (priv->tx_len) {
-				can_get_echo_skb(net, 0);
-				priv->tx_len = 0;
+			int i;
+
+			for (i = 0; i < MCP251X_TX_BUF_NUM; i++) {
+				if (!(intf & (CANINTF_TX0IF << i)) ||
+				    !(priv->tx_busy & BIT(i)))
+					continue;
+
+				net->stats.tx_packets++;
+				net->stats.tx_bytes += priv->tx_len[i];
+				can_get_echo_skb_tstamp(net, i,
+							priv->irq_tstamp);
+				priv->tx_busy &= ~BIT(i);
+				atomic_dec(&priv->tx_pending);
 			}
-			netif_wake_queue(net);
+			can_led_event(net, CAN_LED_EVENT_TX);
+
+			/* refill the freed buffers without a work item hop */
+			mcp251x_tx_load(priv);
+			if (atomic_read(&priv->tx_pending) < MCP251X_TX_BUF_NUM)
+				netif_wake_queue(net);
 		}
 
+		intf = next_intf;
+		eflag = next_eflag;
+		priv->irq_tstamp = next_tstamp;
 	}
+	/* hand all frames read in this run to NAPI in one go */
+	can_rx_offload_threaded_irq_finish(&priv->offload);
 	mutex_unlock(&priv->mcp_lock);
 	return IRQ_HANDLED;
 }
 
 
+/* take the timestamp before the interrupt thread gets scheduled */
+static irqreturn_t mcp251x_can_hardirq(int irq, void *dev_id)
+{
+	struct mcp251x_priv *priv = dev_id;
+
+	priv->irq_tstamp = ktime_get_real();
+
+	return IRQ_WAKE_THREAD;
+}
+
 static irqreturn_t mcp251x_can_irq(int irq, void *dev_id)
 {
 	unsigned long flags;
@@ -1125,18 +1185,18 @@ static int mcp251x_open(struct net_device *net)
 	unsigned long flags = IRQF_ONESHOT | IRQF_TRIGGER_FALLING;
 	int ret;
 
-	if (!gpio_is_valid(rst_gpio)) {
+	if (!gpio_is_valid(priv->rst_gpio)) {
 		printk("zty mcp251x no rst gpio!\n");
 	}
 	else
 	{
 		printk("zty open mcp251x rst gpio ok!\n");
 
-		gpio_set_value(rst_gpio, 0);
+		gpio_set_value(priv->rst_gpio, 0);
 
 		msleep(100);
 
-		gpio_set_value(rst_gpio, 1);
+		gpio_set_value(priv->rst_gpio, 1);
 		msleep(100);
 	}
 
@@ -1150,13 +1210,17 @@ static int mcp251x_open(struct net_device *net)
 	mcp251x_power_enable(priv->transceiver, 1);
 
 	priv->force_quit = 0;
-	priv->tx_skb = NULL;
-	priv->tx_len = 0;
+	priv->tx_busy = 0;
+	atomic_set(&priv->tx_pending, 0);
+
+	can_rx_offload_enable(&priv->offload);
 
-	ret = request_threaded_irq(spi->irq, NULL, mcp251x_can_ist,
+	ret = request_threaded_irq(spi->irq, mcp251x_can_hardirq,
+				   mcp251x_can_ist,
 				   flags | IRQF_ONESHOT, DEVICE_NAME, priv);
 	if (ret) {
 		dev_err(&spi->dev, "failed to acquire irq %d\n", spi->irq);
+		can_rx_offload_disable(&priv->offload);
 		mcp251x_power_enable(priv->transceiver, 0);
 		close_candev(net);
 		goto open_unlock;
@@ -1238,7 +1302,7 @@ static int mcp251x_can_probe(struct spi_device *spi)
 	struct clk *clk;
 	int freq, ret;
 	struct device *dev = &spi->dev;
-//	int rst_gpio = 0;
+	int rst_gpio;
 	// if (ktc256sign!=0xFF) return 0;
 	//printk("zty mcp251x probe start!\n");
 
@@ -1297,6 +1361,13 @@ static int mcp251x_can_probe(struct spi_device *spi)
 		priv->model = spi_get_device_id(spi)->driver_data;
 	priv->net = net;
 	priv->clk = clk;
+	priv->rst_gpio = rst_gpio;
+	skb_queue_head_init(&priv->tx_queue);
+
+	ret = can_rx_offload_add_manual(net, &priv->offload,
+					MCP251X_NAPI_WEIGHT);
+	if (ret)
+		goto out_clk;
 
 	spi_set_drvdata(spi, priv);
 
@@ -1308,26 +1379,27 @@ static int mcp251x_can_probe(struct spi_device *spi)
 		spi->max_speed_hz = spi->max_speed_hz ? : 10 * 1000 * 1000;
 	ret = spi_setup(spi);
 	if (ret)
-		goto out_clk;
+		goto out_offload;
 
 	priv->power = devm_regulator_get(&spi->dev, "vdd");
 	priv->transceiver = devm_regulator_get(&spi->dev, "xceiver");
 	if ((PTR_ERR(priv->power) == -EPROBE_DEFER) ||
 	    (PTR_ERR(priv->transceiver) == -EPROBE_DEFER)) {
 		ret = -EPROBE_DEFER;
-		goto out_clk;
+		goto out_offload;
 	}
 
 	ret = mcp251x_power_enable(priv->power, 1);
 	if (ret)
-		goto out_clk;
+		goto out_offload;
 	printk("zty mcp251x_enable_dma %d!\n",mcp251x_enable_dma);
 	priv->spi = spi;
 	mutex_init(&priv->mcp_lock);
 	spin_lock_init(&priv->spin_mcp_lock);
 
 	/* If requested, allocate DMA buffers */
-	if (mcp251x_enable_dma) {
+	priv->use_dma = mcp251x_enable_dma;
+	if (priv->use_dma) {
 
 		printk("zty mcp251x enable dma!\n");
 		spi->dev.coherent_dma_mask = ~0;
@@ -1348,19 +1420,19 @@ static int mcp251x_can_probe(struct spi_device *spi)
 		} else {
 			/* Fall back to non-DMA */
 			printk("zty mcp251x no dma!\n");
-			mcp251x_enable_dma = 0;
+			priv->use_dma = false;
 		}
 	}
 	//printk("zty mcp251x %d!\n",__LINE__);
 	/* Allocate non-DMA buffers */
-	if (!mcp251x_enable_dma) {
-		priv->spi_tx_buf = devm_kzalloc(&spi->dev, SPI_TRANSFER_BUF_LEN,
+	if (!priv->use_dma) {
+		priv->spi_tx_buf = devm_kzalloc(&spi->dev, SPI_BATCH_BUF_LEN,
 						GFP_KERNEL);
 		if (!priv->spi_tx_buf) {
 			ret = -ENOMEM;
 			goto error_probe;
 		}
-		priv->spi_rx_buf = devm_kzalloc(&spi->dev, SPI_TRANSFER_BUF_LEN,
+		priv->spi_rx_buf = devm_kzalloc(&spi->dev, SPI_BATCH_BUF_LEN,
 						GFP_KERNEL);
 		if (!priv->spi_rx_buf) {
 			ret = -ENOMEM;
@@ -1394,6 +1466,9 @@ static int mcp251x_can_probe(struct spi_device *spi)
 error_probe:
 	mcp251x_power_enable(priv->power, 0);
 
+out_offload:
+	can_rx_offload_del(&priv->offload);
+
 out_clk:
 	if (!IS_ERR(clk))
 		clk_disable_unprepare(clk);
@@ -1410,6 +1485,7 @@ static int mcp251x_can_remove(struct spi_device *spi)
 	struct net_device *net = priv->net;
 
 	unregister_candev(net);
+	can_rx_offload_del(&priv->offload);
 
 	mcp251x_power_enable(priv->power, 0);
 
@@ -0,0 +1,1650 @@
+/*
+ * CAN bus driver for Microchip MCP2517FD/MCP2518FD CAN FD controllers
+ * with SPI interface
+ *
+ * Based on the mcp251x driver, see mcp251x.c for the authors.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the version 2 of the GNU General Public License
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ *
+ * The message RAM of the controller is split into three rings:
+ *
+ *  - the TX event FIFO (TEF), the chip stores the ID and the sequence
+ *    number of every transmitted frame there, this is where the TX
+ *    completion (and the local echo) comes from
+ *  - FIFO 1, the TX FIFO, frames are written to the object the FIFO head
+ *    points to and handed to the chip with UINC | TXREQ
+ *  - FIFO 2, the RX FIFO, filter 0 routes all frames there
+ *
+ * All rings are accessed in bulk: the interrupt thread reads every
+ * pending RX and TEF object with one READ per ring (two if the ring
+ * wraps) and acknowledges them in the same chained SPI message, which
+ * also carries the status read for the next round.
+ *
+ * Your platform definition file should specify something like:
+ *
+ * static struct mcp251x_platform_data mcp2517fd_info = {
+ *         .oscillator_frequency = 40000000,
+ * };
+ *
+ * static struct spi_board_info spi_board_info[] = {
+ *         {
+ *                 .modalias = "mcp2517fd",
+ *			// or "mcp2518fd" depending on your controller
+ *                 .platform_data = &mcp2517fd_info,
+ *                 .irq = IRQ_EINT13,
+ *                 .max_speed_hz = 17 * 1000 * 1000,
+ *                 .chip_select = 2,
+ *         },
+ * };
+ */
+
+#include <linux/can/core.h>
+#include <linux/can/dev.h>
+#include <linux/can/led.h>
+#include <linux/can/platform/mcp251x.h>
+#include <linux/can/rx-offload.h>
+#include <linux/clk.h>
+#include <linux/delay.h>
+#include <linux/device.h>
+#include <linux/dma-mapping.h>
+#include <linux/freezer.h>
+#include <linux/interrupt.h>
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/netdevice.h>
+#include <linux/of.h>
+#include <linux/of_device.h>
+#include <linux/slab.h>
+#include <linux/spi/spi.h>
+#include <linux/regulator/consumer.h>
+#include <asm/unaligned.h>
+
+/* SPI interface instruction set, followed by a 12 bit address */
+#define INSTRUCTION_RESET	0x0000
+#define INSTRUCTION_WRITE	0x2000
+#define INSTRUCTION_READ	0x3000
+#define INSTRUCTION_ADDR_MASK	0x0fff
+#define INSTRUCTION_LEN		2
+
+/* CAN FD controller module registers */
+#define CON		0x000
+#  define CON_REQOP_BYTE	3	/* TXBWS, ABAT and REQOP */
+#  define CON_OPMOD_BYTE	2
+#  define CON_OPMOD_SHIFT	5
+#  define CON_TXQEN		BIT(20)
+#  define CON_STEF		BIT(19)
+#  define CON_RTXAT		BIT(16)
+#  define CON_ISOCRCEN		BIT(5)
+#  define MODE_MIXED		0	/* normal CAN FD mode */
+#  define MODE_SLEEP		1
+#  define MODE_INT_LOOPBACK	2
+#  define MODE_LISTEN_ONLY	3
+#  define MODE_CONFIG		4
+#  define MODE_EXT_LOOPBACK	5
+#  define MODE_CAN2_0		6
+#define NBTCFG		0x004
+#define DBTCFG		0x008
+#  define BTCFG_BRP_SHIFT	24
+#  define BTCFG_TSEG1_SHIFT	16
+#  define BTCFG_TSEG2_SHIFT	8
+#define TDC		0x00c
+#  define TDC_TDCMOD_AUTO	(2 << 16)
+#  define TDC_TDCO_SHIFT		8
+#  define TDC_TDCO_MASK		0x7f
+#define INT		0x01c
+#  define INT_IVMIE		BIT(31)
+#  define INT_CERRIE		BIT(29)
+#  define INT_SERRIE		BIT(28)
+#  define INT_RXOVIE		BIT(27)
+#  define INT_TEFIE		BIT(20)
+#  define INT_RXIE		BIT(17)
+#  define INT_IE_SHIFT		16
+#  define INT_IVMIF		BIT(15)
+#  define INT_WAKIF		BIT(14)
+#  define INT_CERRIF		BIT(13)
+#  define INT_SERRIF		BIT(12)
+#  define INT_RXOVIF		BIT(11)
+#  define INT_MODIF		BIT(3)
+#  define INT_TBCIF		BIT(2)
+#  define INT_TEFIF		BIT(4)
+#  define INT_RXIF		BIT(1)
+/* flags that are cleared by writing 0, all others follow the FIFOs */
+#  define INT_IF_CLEARABLE	(INT_IVMIF | INT_WAKIF | INT_CERRIF | \
+				 INT_SERRIF | INT_MODIF | INT_TBCIF)
+#define TREC		0x034
+#  define TREC_TXBO		BIT(21)
+#  define TREC_TXBP		BIT(20)
+#  define TREC_RXBP		BIT(19)
+#  define TREC_TXWARN		BIT(18)
+#  define TREC_RXWARN		BIT(17)
+#  define TREC_TEC(x)		(((x) >> 8) & 0xff)
+#  define TREC_REC(x)		((x) & 0xff)
+#define TEFCON		0x040
+#  define TEFCON_FSIZE_SHIFT	24
+#  define TEFCON_UINC_BYTE	1	/* UINC is bit 0 of this byte */
+#  define TEFCON_TEFNEIE	BIT(0)
+#define TEFSTA		0x044
+#  define TEFSTA_TEFNEIF	BIT(0)
+#define FIFOCON(n)	(0x050 + 12 * (n))
+#  define FIFOCON_PLSIZE_SHIFT	29
+#  define FIFOCON_FSIZE_SHIFT	24
+#  define FIFOCON_TXAT_UNLIMITED (3 << 21)
+#  define FIFOCON_UINC_BYTE	1
+#  define FIFOCON_UINC		0x01	/* in FIFOCON_UINC_BYTE */
+#  define FIFOCON_TXREQ		0x02	/* in FIFOCON_UINC_BYTE */
+#  define FIFOCON_TXEN		BIT(7)
+#  define FIFOCON_RXOVIE	BIT(3)
+#  define FIFOCON_TFNRFNIE	BIT(0)
+#define FIFOSTA(n)	(0x054 + 12 * (n))
+#  define FIFOSTA_FIFOCI(x)	(((x) >> 8) & 0x1f)
+#  define FIFOSTA_RXOVIF	BIT(3)
+#  define FIFOSTA_TFERFFIF	BIT(2)
+#define FLTCON(n)	(0x1d0 + 4 * (n))
+#  define FLTCON_FLTEN		BIT(7)
+#define FLTOBJ(n)	(0x1f0 + 8 * (n))
+#define MASK(n)		(0x1f4 + 8 * (n))
+
+/* MCP251xFD specific registers */
+#define OSC		0xe00
+#  define OSC_OSCRDY		BIT(10)
+
+#define MCP251XFD_RAM_START	0x400
+#define MCP251XFD_RAM_SIZE	2048
+
+/*
+ * The interrupt thread snapshots INT..TREC, TEFSTA and FIFOSTA1..FIFOSTA2
+ * in three transfers of one message.
+ */
+#define STATUS_INT_LEN		(TREC + 4 - INT)
+#define STATUS_FIFO_START	FIFOSTA(MCP251XFD_TX_FIFO)
+#define STATUS_FIFO_LEN		(FIFOSTA(MCP251XFD_RX_FIFO) + 4 - \
+				 STATUS_FIFO_START)
+
+/* RX, TX and TEF objects: ID, flags, then the payload for RX and TX */
+#define OBJ_ID_SID_MASK		0x7ff
+#define OBJ_ID_EID_SHIFT	11
+#define OBJ_ID_EID_MASK		0x3ffff
+#define OBJ_FLAGS_SEQ_SHIFT	9
+#define OBJ_FLAGS_SEQ_MASK	0x7f	/* 7 bits on the MCP2517FD */
+#define OBJ_FLAGS_ESI		BIT(8)
+#define OBJ_FLAGS_FDF		BIT(7)
+#define OBJ_FLAGS_BRS		BIT(6)
+#define OBJ_FLAGS_RTR		BIT(5)
+#define OBJ_FLAGS_IDE		BIT(4)
+#define OBJ_FLAGS_DLC_MASK	0x0f
+#define OBJ_HDR_LEN		8
+#define TEF_OBJ_LEN		OBJ_HDR_LEN
+
+#define MCP251XFD_TX_FIFO	1
+#define MCP251XFD_RX_FIFO	2
+#define MCP251XFD_FIFO_DEPTH_MAX 32
+
+/*
+ * TX FIFO depth: CAN 2.0 frames are small enough to give the TX FIFO
+ * twice the objects, the RX FIFO gets the rest of the message RAM.
+ */
+#define MCP251XFD_TX_OBJ_NUM_CAN	16
+#define MCP251XFD_TX_OBJ_NUM_FD		8
+#define TX_ECHO_SKB_MAX			MCP251XFD_TX_OBJ_NUM_CAN
+
+/*
+ * One message carries at most: the status read (3), two RX ring reads
+ * and one UINC per RX object, the same for the TEF, one write to INT and
+ * one to FIFOSTA2.
+ */
+#define MCP251XFD_XFER_MAX	(3 + 2 * (2 + MCP251XFD_FIFO_DEPTH_MAX) + 2)
+#define SPI_BUF_LEN		PAGE_SIZE
+
+/* frames handed to the stack per NAPI poll */
+#define MCP251XFD_NAPI_WEIGHT	32
+
+#define MCP251XFD_OST_DELAY_MS	3
+#define MCP251XFD_MODE_TIMEOUT_MS 100
+
+#define DEVICE_NAME "mcp251xfd"
+
+static int mcp251xfd_enable_dma = 1; /* Enable SPI DMA. Default: 1 (On) */
+module_param(mcp251xfd_enable_dma, int, S_IRUGO);
+MODULE_PARM_DESC(mcp251xfd_enable_dma, "Enable SPI DMA. Default: 1 (On)");
+
+static const struct can_bittiming_const mcp251xfd_bittiming_const = {
+	.name = DEVICE_NAME,
+	.tseg1_min = 2,
+	.tseg1_max = 256,
+	.tseg2_min = 1,
+	.tseg2_max = 128,
+	.sjw_max = 128,
+	.brp_min = 1,
+	.brp_max = 256,
+	.brp_inc = 1,
+};
+
+static const struct can_bittiming_const mcp251xfd_data_bittiming_const = {
+	.name = DEVICE_NAME,
+	.tseg1_min = 1,
+	.tseg1_max = 32,
+	.tseg2_min = 1,
+	.tseg2_max = 16,
+	.sjw_max = 16,
+	.brp_min = 1,
+	.brp_max = 256,
+	.brp_inc = 1,
+};
+
+enum mcp251xfd_model {
+	CAN_MCP251XFD_MCP2517FD	= 0x2517,
+	CAN_MCP251XFD_MCP2518FD	= 0x2518,
+};
+
+struct mcp251xfd_priv {
+	struct can_priv	   can;
+	struct net_device *net;
+	struct spi_device *spi;
+	enum mcp251xfd_model model;
+
+	struct can_rx_offload offload;
+	/* time the interrupt was raised, the chip's TBC is not used */
+	ktime_t irq_tstamp;
+
+	struct mutex mcp_lock; /* SPI device lock */
+	u8 *spi_tx_buf;
+	u8 *spi_rx_buf;
+	dma_addr_t spi_tx_dma;
+	dma_addr_t spi_rx_dma;
+	bool use_dma;			/* SPI buffers are DMA coherent */
+	struct spi_transfer xfer[MCP251XFD_XFER_MAX];
+
+	/* message RAM layout, fixed while the interface is up */
+	unsigned int tx_obj_num;
+	unsigned int tx_obj_len;
+	unsigned int rx_obj_num;
+	unsigned int rx_obj_len;
+	u16 tx_ram;
+	u16 rx_ram;
+
+	/* free running ring positions, the hardware index is pos % num */
+	unsigned int tx_head;
+	unsigned int tx_tail;
+	unsigned int rx_tail;
+
+	struct sk_buff_head tx_queue;	/* frames waiting for a TX object */
+	atomic_t tx_pending;		/* frames queued or in the TX FIFO */
+
+	struct workqueue_struct *wq;
+	struct work_struct tx_work;
+	struct work_struct restart_work;
+
+	int force_quit;
+	struct regulator *power;
+	struct regulator *transceiver;
+	struct clk *clk;
+};
+
+/* status snapshot of one interrupt thread round */
+struct mcp251xfd_status {
+	u32 intf;
+	u32 trec;
+	u32 tefsta;
+	u32 tx_sta;
+	u32 rx_sta;
+};
+
+static void mcp251xfd_clean(struct net_device *net)
+{
+	struct mcp251xfd_priv *priv = netdev_priv(net);
+	struct sk_buff *skb;
+
+	while ((skb = skb_dequeue(&priv->tx_queue))) {
+		net->stats.tx_errors++;
+		dev_kfree_skb(skb);
+	}
+
+	for (; priv->tx_tail != priv->tx_head; priv->tx_tail++) {
+		net->stats.tx_errors++;
+		can_free_echo_skb(net, priv->tx_tail % priv->tx_obj_num);
+	}
+	priv->tx_head = 0;
+	priv->tx_tail = 0;
+	priv->rx_tail = 0;
+	atomic_set(&priv->tx_pending, 0);
+}
+
+static void mcp251xfd_cmd(u8 *buf, u16 instr, u16 addr)
+{
+	u16 cmd = instr | (addr & INSTRUCTION_ADDR_MASK);
+
+	buf[0] = cmd >> 8;
+	buf[1] = cmd & 0xff;
+}
+
+/*
+ * Register access outside of the interrupt thread's batches. As in the
+ * mcp251x driver the return value of the single transfers is only
+ * checked where a failure would make us talk nonsense to the chip.
+ */
+static int mcp251xfd_spi_trans(struct mcp251xfd_priv *priv, int len)
+{
+	struct spi_transfer t = {
+		.tx_buf = priv->spi_tx_buf,
+		.rx_buf = priv->spi_rx_buf,
+		.len = len,
+		.cs_change = 0,
+	};
+	struct spi_message m;
+	int ret;
+
+	spi_message_init(&m);
+
+	if (priv->use_dma) {
+		t.tx_dma = priv->spi_tx_dma;
+		t.rx_dma = priv->spi_rx_dma;
+		m.is_dma_mapped = 1;
+	}
+	spi_message_add_tail(&t, &m);
+
+	ret = spi_sync(priv->spi, &m);
+	if (ret)
+		dev_err(&priv->spi->dev, "spi transfer failed: ret = %d\n",
+			ret);
+	return ret;
+}
+
+static u32 mcp251xfd_read_reg(struct mcp251xfd_priv *priv, u16 reg)
+{
+	memset(priv->spi_tx_buf, 0, INSTRUCTION_LEN + 4);
+	mcp251xfd_cmd(priv->spi_tx_buf, INSTRUCTION_READ, reg);
+
+	if (mcp251xfd_spi_trans(priv, INSTRUCTION_LEN + 4))
+		return 0;
+
+	return get_unaligned_le32(priv->spi_rx_buf + INSTRUCTION_LEN);
+}
+
+static void mcp251xfd_write_reg(struct mcp251xfd_priv *priv, u16 reg,
+				u32 val)
+{
+	mcp251xfd_cmd(priv->spi_tx_buf, INSTRUCTION_WRITE, reg);
+	put_unaligned_le32(val, priv->spi_tx_buf + INSTRUCTION_LEN);
+
+	mcp251xfd_spi_trans(priv, INSTRUCTION_LEN + 4);
+}
+
+static void mcp251xfd_write_byte(struct mcp251xfd_priv *priv, u16 reg,
+				 u8 val)
+{
+	mcp251xfd_cmd(priv->spi_tx_buf, INSTRUCTION_WRITE, reg);
+	priv->spi_tx_buf[INSTRUCTION_LEN] = val;
+
+	mcp251xfd_spi_trans(priv, INSTRUCTION_LEN + 1);
+}
+
+static u8 *mcp251xfd_batch_add(struct mcp251xfd_priv *priv,
+			       struct spi_message *m, unsigned int *n,
+			       unsigned int *off, unsigned int len)
+{
+	struct spi_transfer *t = &priv->xfer[(*n)++];
+
+	memset(t, 0, sizeof(*t));
+	t->tx_buf = priv->spi_tx_buf + *off;
+	t->rx_buf = priv->spi_rx_buf + *off;
+	t->len = len;
+	/* every command needs its own chip select cycle */
+	t->cs_change = 1;
+	if (priv->use_dma) {
+		t->tx_dma = priv->spi_tx_dma + *off;
+		t->rx_dma = priv->spi_rx_dma + *off;
+	}
+	spi_message_add_tail(t, m);
+	*off += len;
+
+	memset(priv->spi_tx_buf + *off - len, 0, len);
+	return priv->spi_tx_buf + *off - len;
+}
+
+/* queue a READ of @len bytes at @addr, returns its offset in spi_rx_buf */
+static unsigned int mcp251xfd_batch_read(struct mcp251xfd_priv *priv,
+					 struct spi_message *m,
+					 unsigned int *n, unsigned int *off,
+					 u16 addr, unsigned int len)
+{
+	u8 *cmd;
+
+	cmd = mcp251xfd_batch_add(priv, m, n, off, INSTRUCTION_LEN + len);
+	mcp251xfd_cmd(cmd, INSTRUCTION_READ, addr);
+
+	return *off - len;
+}
+
+static void mcp251xfd_batch_write_byte(struct mcp251xfd_priv *priv,
+				       struct spi_message *m, unsigned int *n,
+				       unsigned int *off, u16 addr, u8 val)
+{
+	u8 *cmd;
+
+	cmd = mcp251xfd_batch_add(priv, m, n, off, INSTRUCTION_LEN + 1);
+	mcp251xfd_cmd(cmd, INSTRUCTION_WRITE, addr);
+	cmd[INSTRUCTION_LEN] = val;
+}
+
+/*
+ * Queue the reads of @num objects of a ring starting at index @first,
+ * split in two if the range wraps. Returns the offsets of both parts.
+ */
+static void mcp251xfd_batch_read_ring(struct mcp251xfd_priv *priv,
+				      struct spi_message *m, unsigned int *n,
+				      unsigned int *off, u16 ram,
+				      unsigned int obj_len,
+				      unsigned int ring_num,
+				      unsigned int first, unsigned int num,
+				      unsigned int part_off[2])
+{
+	unsigned int len = min(num, ring_num - first);
+
+	part_off[0] = mcp251xfd_batch_read(priv, m, n, off,
+					   ram + first * obj_len,
+					   len * obj_len);
+	part_off[1] = 0;
+	if (len < num)
+		part_off[1] = mcp251xfd_batch_read(priv, m, n, off, ram,
+						   (num - len) * obj_len);
+}
+
+static const u8 *mcp251xfd_ring_obj(struct mcp251xfd_priv *priv,
+				    const unsigned int part_off[2],
+				    unsigned int ring_num,
+				    unsigned int first, unsigned int i,
+				    unsigned int obj_len)
+{
+	unsigned int len = ring_num - first;
+
+	if (i < len)
+		return priv->spi_rx_buf + part_off[0] + i * obj_len;
+
+	return priv->spi_rx_buf + part_off[1] + (i - len) * obj_len;
+}
+
+/* queue the status read that drives the next interrupt thread round */
+static void mcp251xfd_batch_status(struct mcp251xfd_priv *priv,
+				   struct spi_message *m, unsigned int *n,
+				   unsigned int *off, unsigned int status_off[3])
+{
+	status_off[0] = mcp251xfd_batch_read(priv, m, n, off, INT,
+					     STATUS_INT_LEN);
+	status_off[1] = mcp251xfd_batch_read(priv, m, n, off, TEFSTA, 4);
+	status_off[2] = mcp251xfd_batch_read(priv, m, n, off,
+					     STATUS_FIFO_START,
+					     STATUS_FIFO_LEN);
+}
+
+static void mcp251xfd_parse_status(struct mcp251xfd_priv *priv,
+				   const unsigned int status_off[3],
+				   struct mcp251xfd_status *st)
+{
+	const u8 *buf = priv->spi_rx_buf;
+
+	st->intf = get_unaligned_le32(buf + status_off[0]);
+	st->trec = get_unaligned_le32(buf + status_off[0] + TREC - INT);
+	st->tefsta = get_unaligned_le32(buf + status_off[1]);
+	st->tx_sta = get_unaligned_le32(buf + status_off[2]);
+	st->rx_sta = get_unaligned_le32(buf + status_off[2] +
+					FIFOSTA(MCP251XFD_RX_FIFO) -
+					STATUS_FIFO_START);
+}
+
+static int mcp251xfd_read_status(struct mcp251xfd_priv *priv,
+				 struct mcp251xfd_status *st)
+{
+	unsigned int n = 0, off = 0, status_off[3];
+	struct spi_message m;
+	int ret;
+
+	spi_message_init(&m);
+	m.is_dma_mapped = priv->use_dma;
+
+	mcp251xfd_batch_status(priv, &m, &n, &off, status_off);
+	priv->xfer[n - 1].cs_change = 0;
+
+	ret = spi_sync(priv->spi, &m);
+	if (ret) {
+		dev_err(&priv->spi->dev, "spi transfer failed: ret = %d\n",
+			ret);
+		return ret;
+	}
+
+	mcp251xfd_parse_status(priv, status_off, st);
+	return 0;
+}
+
+static u8 mcp251xfd_get_mode(struct mcp251xfd_priv *priv)
+{
+	u32 con = mcp251xfd_read_reg(priv, CON);
+
+	return (con >> (CON_OPMOD_BYTE * 8 + CON_OPMOD_SHIFT)) & 0x7;
+}
+
+static int mcp251xfd_set_mode(struct mcp251xfd_priv *priv, u8 mode)
+{
+	unsigned long timeout;
+
+	mcp251xfd_write_byte(priv, CON + CON_REQOP_BYTE, mode);
+
+	/* sleep mode switches the oscillator off, OPMOD can't be read */
+	if (mode == MODE_SLEEP)
+		return 0;
+
+	timeout = jiffies + msecs_to_jiffies(MCP251XFD_MODE_TIMEOUT_MS);
+	while (mcp251xfd_get_mode(priv) != mode) {
+		if (time_after(jiffies, timeout)) {
+			dev_err(&priv->spi->dev,
+				"didn't enter mode %u, still in %u\n",
+				mode, mcp251xfd_get_mode(priv));
+			return -EBUSY;
+		}
+		usleep_range(100, 200);
+	}
+
+	return 0;
+}
+
+static void mcp251xfd_hw_sleep(struct mcp251xfd_priv *priv)
+{
+	mcp251xfd_set_mode(priv, MODE_SLEEP);
+}
+
+/* Take the chip off the bus and release the level triggered INT pin */
+static void mcp251xfd_hw_stop(struct mcp251xfd_priv *priv)
+{
+	mcp251xfd_set_mode(priv, MODE_CONFIG);
+	mcp251xfd_write_reg(priv, INT, 0);
+	mcp251xfd_hw_sleep(priv);
+}
+
+static int mcp251xfd_hw_reset(struct mcp251xfd_priv *priv)
+{
+	unsigned long timeout;
+	int ret;
+
+	/*
+	 * Writing OSC wakes the chip from sleep mode, the RESET instruction
+	 * is only accepted in configuration mode.
+	 */
+	mcp251xfd_write_reg(priv, OSC, 0);
+	mdelay(MCP251XFD_OST_DELAY_MS);
+	mcp251xfd_write_byte(priv, CON + CON_REQOP_BYTE, MODE_CONFIG);
+
+	memset(priv->spi_tx_buf, 0, INSTRUCTION_LEN);
+	mcp251xfd_cmd(priv->spi_tx_buf, INSTRUCTION_RESET, 0);
+	ret = mcp251xfd_spi_trans(priv, INSTRUCTION_LEN);
+	if (ret)
+		return ret;
+
+	/* Wait for the oscillator after reset */
+	timeout = jiffies + msecs_to_jiffies(MCP251XFD_MODE_TIMEOUT_MS);
+	while (!(mcp251xfd_read_reg(priv, OSC) & OSC_OSCRDY)) {
+		if (time_after(jiffies, timeout))
+			return -ETIMEDOUT;
+		mdelay(1);
+	}
+
+	if (mcp251xfd_get_mode(priv) != MODE_CONFIG)
+		return -ENODEV;
+
+	return 0;
+}
+
+static int mcp251xfd_hw_probe(struct mcp251xfd_priv *priv)
+{
+	u32 con;
+	int ret;
+
+	ret = mcp251xfd_hw_reset(priv);
+	if (ret)
+		return ret;
+
+	con = mcp251xfd_read_reg(priv, CON);
+
+	dev_dbg(&priv->spi->dev, "CON 0x%08x\n", con);
+
+	/* Check for power up default value of TXQEN and STEF */
+	if ((con & (CON_TXQEN | CON_STEF)) != (CON_TXQEN | CON_STEF))
+		return -ENODEV;
+
+	return 0;
+}
+
+static int mcp251xfd_power_enable(struct regulator *reg, int enable)
+{
+	if (IS_ERR_OR_NULL(reg))
+		return 0;
+
+	if (enable)
+		return regulator_enable(reg);
+	else
+		return regulator_disable(reg);
+}
+
+/* payload size of a FIFO object, encoded as PLSIZE */
+static u32 mcp251xfd_plsize(unsigned int len)
+{
+	return len == CANFD_MAX_DLEN ? 7 : 0;
+}
+
+/* Split the message RAM between TEF, TX FIFO and RX FIFO */
+static void mcp251xfd_ring_init(struct mcp251xfd_priv *priv)
+{
+	unsigned int payload, ram;
+	bool fd = priv->can.ctrlmode & CAN_CTRLMODE_FD;
+
+	payload = fd ? CANFD_MAX_DLEN : CAN_MAX_DLEN;
+	priv->tx_obj_num = fd ? MCP251XFD_TX_OBJ_NUM_FD :
+		MCP251XFD_TX_OBJ_NUM_CAN;
+	priv->tx_obj_len = OBJ_HDR_LEN + payload;
+	priv->rx_obj_len = OBJ_HDR_LEN + payload;
+
+	priv->tx_ram = MCP251XFD_RAM_START + priv->tx_obj_num * TEF_OBJ_LEN;
+	priv->rx_ram = priv->tx_ram + priv->tx_obj_num * priv->tx_obj_len;
+
+	ram = MCP251XFD_RAM_START + MCP251XFD_RAM_SIZE - priv->rx_ram;
+	priv->rx_obj_num = min_t(unsigned int, ram / priv->rx_obj_len,
+				 MCP251XFD_FIFO_DEPTH_MAX);
+
+	priv->tx_head = 0;
+	priv->tx_tail = 0;
+	priv->rx_tail = 0;
+}
+
+static void mcp251xfd_set_bittiming(struct mcp251xfd_priv *priv)
+{
+	struct can_bittiming *bt = &priv->can.bittiming;
+	struct can_bittiming *dbt = &priv->can.data_bittiming;
+	int tdco;
+
+	mcp251xfd_write_reg(priv, NBTCFG,
+			    ((bt->brp - 1) << BTCFG_BRP_SHIFT) |
+			    ((bt->prop_seg + bt->phase_seg1 - 1) <<
+			     BTCFG_TSEG1_SHIFT) |
+			    ((bt->phase_seg2 - 1) << BTCFG_TSEG2_SHIFT) |
+			    (bt->sjw - 1));
+
+	if (!(priv->can.ctrlmode & CAN_CTRLMODE_FD))
+		return;
+
+	mcp251xfd_write_reg(priv, DBTCFG,
+			    ((dbt->brp - 1) << BTCFG_BRP_SHIFT) |
+			    ((dbt->prop_seg + dbt->phase_seg1 - 1) <<
+			     BTCFG_TSEG1_SHIFT) |
+			    ((dbt->phase_seg2 - 1) << BTCFG_TSEG2_SHIFT) |
+			    (dbt->sjw - 1));
+
+	/* measure the transceiver delay, offset is the data sample point */
+	tdco = clamp_t(int, dbt->brp * (dbt->prop_seg + dbt->phase_seg1),
+		       -64, 63);
+	mcp251xfd_write_reg(priv, TDC, TDC_TDCMOD_AUTO |
+			    ((tdco & TDC_TDCO_MASK) << TDC_TDCO_SHIFT));
+}
+
+/* Reset the chip and configure it, leaves it in configuration mode */
+static int mcp251xfd_setup(struct mcp251xfd_priv *priv)
+{
+	u32 con, ie;
+	int ret;
+
+	ret = mcp251xfd_hw_reset(priv);
+	if (ret)
+		return ret;
+
+	mcp251xfd_set_bittiming(priv);
+	mcp251xfd_ring_init(priv);
+
+	/* no TX queue, store transmitted frames in the TEF */
+	con = mcp251xfd_read_reg(priv, CON);
+	con &= ~(CON_TXQEN | CON_RTXAT);
+	con |= CON_STEF | CON_ISOCRCEN;
+	mcp251xfd_write_reg(priv, CON, con);
+
+	mcp251xfd_write_reg(priv, TEFCON,
+			    ((priv->tx_obj_num - 1) << TEFCON_FSIZE_SHIFT) |
+			    TEFCON_TEFNEIE);
+	mcp251xfd_write_reg(priv, FIFOCON(MCP251XFD_TX_FIFO),
+			    (mcp251xfd_plsize(priv->tx_obj_len - OBJ_HDR_LEN) <<
+			     FIFOCON_PLSIZE_SHIFT) |
+			    ((priv->tx_obj_num - 1) << FIFOCON_FSIZE_SHIFT) |
+			    FIFOCON_TXAT_UNLIMITED | FIFOCON_TXEN);
+	mcp251xfd_write_reg(priv, FIFOCON(MCP251XFD_RX_FIFO),
+			    (mcp251xfd_plsize(priv->rx_obj_len - OBJ_HDR_LEN) <<
+			     FIFOCON_PLSIZE_SHIFT) |
+			    ((priv->rx_obj_num - 1) << FIFOCON_FSIZE_SHIFT) |
+			    FIFOCON_RXOVIE | FIFOCON_TFNRFNIE);
+
+	/* filter 0 accepts everything into the RX FIFO */
+	mcp251xfd_write_reg(priv, FLTOBJ(0), 0);
+	mcp251xfd_write_reg(priv, MASK(0), 0);
+	mcp251xfd_write_byte(priv, FLTCON(0), FLTCON_FLTEN | MCP251XFD_RX_FIFO);
+
+	ie = INT_CERRIE | INT_SERRIE | INT_RXOVIE | INT_TEFIE | INT_RXIE;
+	if (priv->can.ctrlmode & CAN_CTRLMODE_BERR_REPORTING)
+		ie |= INT_IVMIE;
+	mcp251xfd_write_reg(priv, INT, ie);
+
+	return 0;
+}
+
+static int mcp251xfd_set_normal_mode(struct mcp251xfd_priv *priv)
+{
+	u8 mode;
+	int ret;
+
+	if (priv->can.ctrlmode & CAN_CTRLMODE_LOOPBACK)
+		mode = MODE_EXT_LOOPBACK;
+	else if (priv->can.ctrlmode & CAN_CTRLMODE_LISTENONLY)
+		mode = MODE_LISTEN_ONLY;
+	else if (priv->can.ctrlmode & CAN_CTRLMODE_FD)
+		mode = MODE_MIXED;
+	else
+		mode = MODE_CAN2_0;
+
+	ret = mcp251xfd_set_mode(priv, mode);
+	if (ret)
+		return ret;
+
+	priv->can.state = CAN_STATE_ERROR_ACTIVE;
+	return 0;
+}
+
+static netdev_tx_t mcp251xfd_hard_start_xmit(struct sk_buff *skb,
+					     struct net_device *net)
+{
+	struct mcp251xfd_priv *priv = netdev_priv(net);
+
+	if (can_dropped_invalid_skb(net, skb))
+		return NETDEV_TX_OK;
+
+	skb_queue_tail(&priv->tx_queue, skb);
+	if (atomic_inc_return(&priv->tx_pending) >= priv->tx_obj_num) {
+		netif_stop_queue(net);
+		/* a TX object may have been freed in the meantime */
+		if (atomic_read(&priv->tx_pending) < priv->tx_obj_num)
+			netif_wake_queue(net);
+	}
+	queue_work(priv->wq, &priv->tx_work);
+
+	return NETDEV_TX_OK;
+}
+
+/* Build the TX object for @skb at @buf, returns its length in RAM */
+static unsigned int mcp251xfd_tx_obj(struct mcp251xfd_priv *priv,
+				     struct sk_buff *skb, u8 *buf)
+{
+	const struct canfd_frame *cfd = (struct canfd_frame *)skb->data;
+	unsigned int len, pad;
+	u32 id, flags;
+	u8 dlc;
+
+	if (cfd->can_id & CAN_EFF_FLAG)
+		id = ((cfd->can_id >> 18) & OBJ_ID_SID_MASK) |
+			((cfd->can_id & OBJ_ID_EID_MASK) << OBJ_ID_EID_SHIFT);
+	else
+		id = cfd->can_id & CAN_SFF_MASK;
+
+	dlc = can_len2dlc(cfd->len);
+	flags = (priv->tx_head & OBJ_FLAGS_SEQ_MASK) << OBJ_FLAGS_SEQ_SHIFT;
+	flags |= dlc;
+	if (cfd->can_id & CAN_EFF_FLAG)
+		flags |= OBJ_FLAGS_IDE;
+
+	if (skb->protocol == htons(ETH_P_CANFD)) {
+		flags |= OBJ_FLAGS_FDF;
+		if (cfd->flags & CANFD_BRS)
+			flags |= OBJ_FLAGS_BRS;
+		len = can_dlc2len(dlc);
+	} else {
+		if (cfd->can_id & CAN_RTR_FLAG)
+			flags |= OBJ_FLAGS_RTR;
+		len = dlc;
+	}
+
+	put_unaligned_le32(id, buf);
+	put_unaligned_le32(flags, buf + 4);
+	memcpy(buf + OBJ_HDR_LEN, cfd->data, cfd->len);
+
+	/* the DLC may round the length up and RAM is written in words */
+	pad = round_up(len, 4);
+	memset(buf + OBJ_HDR_LEN + cfd->len, 0, pad - cfd->len);
+
+	return OBJ_HDR_LEN + pad;
+}
+
+/*
+ * Move queued frames into the TX FIFO, called with mcp_lock held.
+ *
+ * Every frame is written into the object the FIFO head points to and
+ * followed by UINC | TXREQ, all frames go out in one SPI message.
+ */
+static void mcp251xfd_tx_load(struct mcp251xfd_priv *priv)
+{
+	struct net_device *net = priv->net;
+	struct sk_buff *skb;
+	unsigned int n = 0, off = 0, num = 0, len, idx, i;
+	struct spi_message m;
+	u8 *cmd;
+	int ret;
+
+	if (priv->can.state == CAN_STATE_BUS_OFF) {
+		mcp251xfd_clean(net);
+		return;
+	}
+
+	spi_message_init(&m);
+	m.is_dma_mapped = priv->use_dma;
+
+	while (priv->tx_head - priv->tx_tail < priv->tx_obj_num) {
+		skb = skb_dequeue(&priv->tx_queue);
+		if (!skb)
+			break;
+
+		idx = priv->tx_head % priv->tx_obj_num;
+		cmd = mcp251xfd_batch_add(priv, &m, &n, &off,
+					  INSTRUCTION_LEN + priv->tx_obj_len);
+		mcp251xfd_cmd(cmd, INSTRUCTION_WRITE,
+			      priv->tx_ram + idx * priv->tx_obj_len);
+		len = mcp251xfd_tx_obj(priv, skb, cmd + INSTRUCTION_LEN);
+		priv->xfer[n - 1].len = INSTRUCTION_LEN + len;
+
+		mcp251xfd_batch_write_byte(priv, &m, &n, &off,
+					   FIFOCON(MCP251XFD_TX_FIFO) +
+					   FIFOCON_UINC_BYTE,
+					   FIFOCON_UINC | FIFOCON_TXREQ);
+
+		can_put_echo_skb(skb, net, idx);
+		priv->tx_head++;
+		num++;
+	}
+
+	if (!num)
+		return;
+
+	priv->xfer[n - 1].cs_change = 0;
+	ret = spi_sync(priv->spi, &m);
+	if (ret) {
+		dev_err(&priv->spi->dev, "spi transfer failed: ret = %d\n",
+			ret);
+		/* the frames never reached the chip */
+		for (i = 0; i < num; i++) {
+			priv->tx_head--;
+			can_free_echo_skb(net,
+					  priv->tx_head % priv->tx_obj_num);
+			atomic_dec(&priv->tx_pending);
+			net->stats.tx_errors++;
+		}
+		netif_wake_queue(net);
+	}
+}
+
+static void mcp251xfd_tx_work_handler(struct work_struct *ws)
+{
+	struct mcp251xfd_priv *priv = container_of(ws, struct mcp251xfd_priv,
+						   tx_work);
+
+	mutex_lock(&priv->mcp_lock);
+	if (!priv->force_quit)
+		mcp251xfd_tx_load(priv);
+	mutex_unlock(&priv->mcp_lock);
+}
+
+static void mcp251xfd_error_skb(struct net_device *net, int can_id,
+				int data1, int data2, u32 trec)
+{
+	struct mcp251xfd_priv *priv = netdev_priv(net);
+	struct sk_buff *skb;
+	struct can_frame *frame;
+
+	skb = alloc_can_err_skb(net, &frame);
+	if (skb) {
+		frame->can_id |= can_id;
+		frame->data[1] = data1;
+		frame->data[2] = data2;
+		frame->data[6] = TREC_TEC(trec);
+		frame->data[7] = TREC_REC(trec);
+		skb->tstamp = priv->irq_tstamp;
+		can_rx_offload_irq_queue_tail(&priv->offload, skb);
+	} else {
+		netdev_err(net, "cannot allocate error skb\n");
+	}
+}
+
+/* Build an skb from the RX object at @obj and queue it */
+static void mcp251xfd_rx_skb(struct mcp251xfd_priv *priv, const u8 *obj)
+{
+	u32 id = get_unaligned_le32(obj);
+	u32 flags = get_unaligned_le32(obj + 4);
+	struct canfd_frame *cfd;
+	struct can_frame *cf;
+	struct sk_buff *skb;
+	canid_t can_id;
+	u8 dlc = flags & OBJ_FLAGS_DLC_MASK;
+
+	if (flags & OBJ_FLAGS_IDE)
+		can_id = CAN_EFF_FLAG |
+			((id & OBJ_ID_SID_MASK) << 18) |
+			((id >> OBJ_ID_EID_SHIFT) & OBJ_ID_EID_MASK);
+	else
+		can_id = id & OBJ_ID_SID_MASK;
+
+	if (flags & OBJ_FLAGS_FDF) {
+		skb = alloc_canfd_skb(priv->net, &cfd);
+		if (!skb)
+			goto drop;
+
+		cfd->can_id = can_id;
+		cfd->len = can_dlc2len(dlc);
+		if (flags & OBJ_FLAGS_BRS)
+			cfd->flags |= CANFD_BRS;
+		if (flags & OBJ_FLAGS_ESI)
+			cfd->flags |= CANFD_ESI;
+		memcpy(cfd->data, obj + OBJ_HDR_LEN, cfd->len);
+	} else {
+		skb = alloc_can_skb(priv->net, &cf);
+		if (!skb)
+			goto drop;
+
+		cf->can_id = can_id;
+		cf->can_dlc = get_can_dlc(dlc);
+		if (flags & OBJ_FLAGS_RTR)
+			cf->can_id |= CAN_RTR_FLAG;
+		else
+			memcpy(cf->data, obj + OBJ_HDR_LEN, cf->can_dlc);
+	}
+
+	skb->tstamp = priv->irq_tstamp;
+	can_rx_offload_irq_queue_tail(&priv->offload, skb);
+	return;
+
+drop:
+	priv->net->stats.rx_dropped++;
+}
+
+/* number of filled RX objects, the FIFO index is the chip's head */
+static unsigned int mcp251xfd_rx_pending(struct mcp251xfd_priv *priv,
+					 const struct mcp251xfd_status *st)
+{
+	unsigned int tail = priv->rx_tail % priv->rx_obj_num;
+	unsigned int head = FIFOSTA_FIFOCI(st->rx_sta);
+
+	if (!(st->intf & INT_RXIF))
+		return 0;
+
+	if (head == tail)
+		return (st->rx_sta & FIFOSTA_TFERFFIF) ? priv->rx_obj_num : 0;
+
+	return (head + priv->rx_obj_num - tail) % priv->rx_obj_num;
+}
+
+/*
+ * Number of TEF objects to read: the TX FIFO index points behind the
+ * last transmitted object. With every object in flight head and tail
+ * are equal, then the TEF tells whether all or none are done.
+ */
+static unsigned int mcp251xfd_tef_pending(struct mcp251xfd_priv *priv,
+					  const struct mcp251xfd_status *st)
+{
+	unsigned int in_flight = priv->tx_head - priv->tx_tail;
+	unsigned int tail = priv->tx_tail % priv->tx_obj_num;
+	unsigned int chip_tail = FIFOSTA_FIFOCI(st->tx_sta);
+
+	if (!in_flight || !(st->tefsta & TEFSTA_TEFNEIF))
+		return 0;
+
+	if (chip_tail == tail)
+		return in_flight == priv->tx_obj_num ? in_flight : 0;
+
+	return min((chip_tail + priv->tx_obj_num - tail) % priv->tx_obj_num,
+		   in_flight);
+}
+
+static void mcp251xfd_tef_obj(struct mcp251xfd_priv *priv, const u8 *obj)
+{
+	struct net_device *net = priv->net;
+	u32 flags = get_unaligned_le32(obj + 4);
+	u32 seq = (flags >> OBJ_FLAGS_SEQ_SHIFT) & OBJ_FLAGS_SEQ_MASK;
+
+	if (seq != (priv->tx_tail & OBJ_FLAGS_SEQ_MASK) && net_ratelimit())
+		netdev_warn(net, "TEF sequence %u, expected %u\n",
+			    seq, priv->tx_tail & OBJ_FLAGS_SEQ_MASK);
+
+	net->stats.tx_packets++;
+	net->stats.tx_bytes +=
+		can_get_echo_skb_tstamp(net, priv->tx_tail % priv->tx_obj_num,
+					priv->irq_tstamp);
+	priv->tx_tail++;
+	atomic_dec(&priv->tx_pending);
+}
+
+/*
+ * Run the SPI commands of one interrupt thread iteration as a single
+ * chained message:
+ *
+ *  - READ of all filled RX objects, UINC of the RX FIFO for each
+ *  - READ of all new TEF objects, UINC of the TEF for each
+ *  - clear the handled flags in INT and the RX overflow in FIFOSTA2
+ *  - READ of the status for the next iteration
+ *
+ * The received frames are queued to the rx-offload and the sent ones
+ * are echoed before returning.
+ */
+static int mcp251xfd_ist_batch(struct mcp251xfd_priv *priv,
+			       struct mcp251xfd_status *st, u16 clear_intf)
+{
+	unsigned int n = 0, off = 0, rx_off[2], tef_off[2], status_off[3];
+	unsigned int rx_num, tef_num, rx_first, tef_first, i;
+	struct spi_message m;
+	int ret;
+
+	rx_num = mcp251xfd_rx_pending(priv, st);
+	tef_num = mcp251xfd_tef_pending(priv, st);
+	rx_first = priv->rx_tail % priv->rx_obj_num;
+	tef_first = priv->tx_tail % priv->tx_obj_num;
+
+	spi_message_init(&m);
+	m.is_dma_mapped = priv->use_dma;
+
+	if (rx_num) {
+		mcp251xfd_batch_read_ring(priv, &m, &n, &off, priv->rx_ram,
+					  priv->rx_obj_len, priv->rx_obj_num,
+					  rx_first, rx_num, rx_off);
+		for (i = 0; i < rx_num; i++)
+			mcp251xfd_batch_write_byte(priv, &m, &n, &off,
+						   FIFOCON(MCP251XFD_RX_FIFO) +
+						   FIFOCON_UINC_BYTE,
+						   FIFOCON_UINC);
+	}
+
+	if (tef_num) {
+		mcp251xfd_batch_read_ring(priv, &m, &n, &off,
+					  MCP251XFD_RAM_START, TEF_OBJ_LEN,
+					  priv->tx_obj_num, tef_first, tef_num,
+					  tef_off);
+		for (i = 0; i < tef_num; i++)
+			mcp251xfd_batch_write_byte(priv, &m, &n, &off,
+						   TEFCON + TEFCON_UINC_BYTE,
+						   0x01);
+	}
+
+	/* writing 0 clears a flag, writing 1 leaves it alone */
+	if (clear_intf) {
+		u8 *cmd = mcp251xfd_batch_add(priv, &m, &n, &off,
+					      INSTRUCTION_LEN + 2);
+
+		mcp251xfd_cmd(cmd, INSTRUCTION_WRITE, INT);
+		put_unaligned_le16(~clear_intf, cmd + INSTRUCTION_LEN);
+	}
+
+	if (st->rx_sta & FIFOSTA_RXOVIF)
+		mcp251xfd_batch_write_byte(priv, &m, &n, &off,
+					   FIFOSTA(MCP251XFD_RX_FIFO),
+					   (u8)~FIFOSTA_RXOVIF);
+
+	mcp251xfd_batch_status(priv, &m, &n, &off, status_off);
+
+	/* release the chip select after the last command */
+	priv->xfer[n - 1].cs_change = 0;
+
+	ret = spi_sync(priv->spi, &m);
+	if (ret) {
+		dev_err(&priv->spi->dev, "spi transfer failed: ret = %d\n",
+			ret);
+		return ret;
+	}
+
+	for (i = 0; i < rx_num; i++)
+		mcp251xfd_rx_skb(priv, mcp251xfd_ring_obj(priv, rx_off,
+							  priv->rx_obj_num,
+							  rx_first, i,
+							  priv->rx_obj_len));
+	priv->rx_tail += rx_num;
+
+	for (i = 0; i < tef_num; i++)
+		mcp251xfd_tef_obj(priv, mcp251xfd_ring_obj(priv, tef_off,
+							   priv->tx_obj_num,
+							   tef_first, i,
+							   TEF_OBJ_LEN));
+
+	mcp251xfd_parse_status(priv, status_off, st);
+
+	return tef_num;
+}
+
+static void mcp251xfd_error(struct mcp251xfd_priv *priv,
+			    const struct mcp251xfd_status *st)
+{
+	struct net_device *net = priv->net;
+	enum can_state new_state;
+	u32 trec = st->trec;
+	int can_id = 0, data1 = 0, data2 = 0;
+
+	/* Update can state */
+	if (trec & TREC_TXBO) {
+		new_state = CAN_STATE_BUS_OFF;
+		can_id |= CAN_ERR_BUSOFF;
+	} else if (trec & TREC_TXBP) {
+		new_state = CAN_STATE_ERROR_PASSIVE;
+		can_id |= CAN_ERR_CRTL;
+		data1 |= CAN_ERR_CRTL_TX_PASSIVE;
+	} else if (trec & TREC_RXBP) {
+		new_state = CAN_STATE_ERROR_PASSIVE;
+		can_id |= CAN_ERR_CRTL;
+		data1 |= CAN_ERR_CRTL_RX_PASSIVE;
+	} else if (trec & TREC_TXWARN) {
+		new_state = CAN_STATE_ERROR_WARNING;
+		can_id |= CAN_ERR_CRTL;
+		data1 |= CAN_ERR_CRTL_TX_WARNING;
+	} else if (trec & TREC_RXWARN) {
+		new_state = CAN_STATE_ERROR_WARNING;
+		can_id |= CAN_ERR_CRTL;
+		data1 |= CAN_ERR_CRTL_RX_WARNING;
+	} else {
+		new_state = CAN_STATE_ERROR_ACTIVE;
+	}
+
+	/* Update can state statistics */
+	switch (priv->can.state) {
+	case CAN_STATE_ERROR_ACTIVE:
+		if (new_state >= CAN_STATE_ERROR_WARNING &&
+		    new_state <= CAN_STATE_BUS_OFF)
+			priv->can.can_stats.error_warning++;
+	case CAN_STATE_ERROR_WARNING:	/* fallthrough */
+		if (new_state >= CAN_STATE_ERROR_PASSIVE &&
+		    new_state <= CAN_STATE_BUS_OFF)
+			priv->can.can_stats.error_passive++;
+		break;
+	default:
+		break;
+	}
+	priv->can.state = new_state;
+
+	if (st->intf & INT_RXOVIF) {
+		net->stats.rx_over_errors++;
+		net->stats.rx_errors++;
+		can_id |= CAN_ERR_CRTL;
+		data1 |= CAN_ERR_CRTL_RX_OVERFLOW;
+	}
+
+	if (st->intf & INT_SERRIF) {
+		/* the message assembly buffer overflowed, a frame is lost */
+		net->stats.rx_errors++;
+		can_id |= CAN_ERR_CRTL;
+		data1 |= CAN_ERR_CRTL_RX_OVERFLOW;
+	}
+
+	if (st->intf & INT_IVMIF) {
+		priv->can.can_stats.bus_error++;
+		net->stats.rx_errors++;
+		can_id |= CAN_ERR_PROT | CAN_ERR_BUSERROR;
+		data2 |= CAN_ERR_PROT_UNSPEC;
+	}
+
+	if (can_id)
+		mcp251xfd_error_skb(net, can_id, data1, data2, trec);
+}
+
+static irqreturn_t mcp251xfd_can_ist(int irq, void *dev_id)
+{
+	struct mcp251xfd_priv *priv = dev_id;
+	struct net_device *net = priv->net;
+	struct mcp251xfd_status st;
+
+	mutex_lock(&priv->mcp_lock);
+
+	if (mcp251xfd_read_status(priv, &st))
+		goto out;
+
+	while (!priv->force_quit) {
+		u32 intf = st.intf & (st.intf >> INT_IE_SHIFT);
+		ktime_t next_tstamp;
+		int done;
+
+		if (!(intf & 0xffff))
+			break;
+
+		/*
+		 * Read the frames, ack the interrupts and fetch the status
+		 * for the next round in one go.
+		 */
+		done = mcp251xfd_ist_batch(priv, &st,
+					   intf & INT_IF_CLEARABLE);
+		if (done < 0)
+			break;
+		/* the status was sampled just now */
+		next_tstamp = ktime_get_real();
+
+		if (intf & (INT_CERRIF | INT_SERRIF | INT_RXOVIF | INT_IVMIF))
+			mcp251xfd_error(priv, &st);
+
+		/*
+		 * The chip would recover on its own, keep it off the bus
+		 * until the restart timer or the user restarts it.
+		 */
+		if (priv->can.state == CAN_STATE_BUS_OFF) {
+			priv->force_quit = 1;
+			can_bus_off(net);
+			mcp251xfd_hw_stop(priv);
+			break;
+		}
+
+		if (done) {
+			can_led_event(net, CAN_LED_EVENT_TX);
+
+			/* refill the freed objects without a work item hop */
+			mcp251xfd_tx_load(priv);
+			if (atomic_read(&priv->tx_pending) < priv->tx_obj_num)
+				netif_wake_queue(net);
+		}
+
+		priv->irq_tstamp = next_tstamp;
+	}
+
+out:
+	/* hand all frames read in this run to NAPI in one go */
+	can_rx_offload_threaded_irq_finish(&priv->offload);
+	mutex_unlock(&priv->mcp_lock);
+	return IRQ_HANDLED;
+}
+
+/* take the timestamp before the interrupt thread gets scheduled */
+static irqreturn_t mcp251xfd_can_hardirq(int irq, void *dev_id)
+{
+	struct mcp251xfd_priv *priv = dev_id;
+
+	priv->irq_tstamp = ktime_get_real();
+
+	return IRQ_WAKE_THREAD;
+}
+
+static int mcp251xfd_do_set_mode(struct net_device *net, enum can_mode mode)
+{
+	struct mcp251xfd_priv *priv = netdev_priv(net);
+
+	switch (mode) {
+	case CAN_MODE_START:
+		/* We have to delay work since SPI I/O may sleep */
+		queue_work(priv->wq, &priv->restart_work);
+		break;
+	default:
+		return -EOPNOTSUPP;
+	}
+
+	return 0;
+}
+
+static void mcp251xfd_restart_work_handler(struct work_struct *ws)
+{
+	struct mcp251xfd_priv *priv = container_of(ws, struct mcp251xfd_priv,
+						   restart_work);
+	struct net_device *net = priv->net;
+	int ret;
+
+	mutex_lock(&priv->mcp_lock);
+	mcp251xfd_clean(net);
+	ret = mcp251xfd_setup(priv);
+	if (!ret)
+		ret = mcp251xfd_set_normal_mode(priv);
+	if (ret) {
+		netdev_err(net, "restart failed: %d\n", ret);
+		goto out_unlock;
+	}
+	priv->force_quit = 0;
+	netif_wake_queue(net);
+
+out_unlock:
+	mutex_unlock(&priv->mcp_lock);
+}
+
+static int mcp251xfd_get_berr_counter(const struct net_device *net,
+				      struct can_berr_counter *bec)
+{
+	struct mcp251xfd_priv *priv = netdev_priv(net);
+	u32 trec;
+
+	mutex_lock(&priv->mcp_lock);
+	trec = mcp251xfd_read_reg(priv, TREC);
+	mutex_unlock(&priv->mcp_lock);
+
+	bec->txerr = TREC_TEC(trec);
+	bec->rxerr = TREC_REC(trec);
+
+	return 0;
+}
+
+static int mcp251xfd_stop(struct net_device *net)
+{
+	struct mcp251xfd_priv *priv = netdev_priv(net);
+	struct spi_device *spi = priv->spi;
+
+	close_candev(net);
+
+	priv->force_quit = 1;
+	free_irq(spi->irq, priv);
+	destroy_workqueue(priv->wq);
+	priv->wq = NULL;
+	can_rx_offload_disable(&priv->offload);
+
+	mutex_lock(&priv->mcp_lock);
+
+	/* Stop the controller and disable the interrupts */
+	mcp251xfd_hw_stop(priv);
+	mcp251xfd_clean(net);
+
+	mcp251xfd_power_enable(priv->transceiver, 0);
+
+	priv->can.state = CAN_STATE_STOPPED;
+
+	mutex_unlock(&priv->mcp_lock);
+
+	can_led_event(net, CAN_LED_EVENT_STOP);
+
+	return 0;
+}
+
+static int mcp251xfd_open(struct net_device *net)
+{
+	struct mcp251xfd_priv *priv = netdev_priv(net);
+	struct spi_device *spi = priv->spi;
+	int ret;
+
+	ret = open_candev(net);
+	if (ret) {
+		dev_err(&spi->dev, "unable to set initial baudrate!\n");
+		return ret;
+	}
+
+	mutex_lock(&priv->mcp_lock);
+	mcp251xfd_power_enable(priv->transceiver, 1);
+
+	priv->force_quit = 0;
+	atomic_set(&priv->tx_pending, 0);
+
+	ret = mcp251xfd_setup(priv);
+	if (ret)
+		goto out_power;
+
+	priv->wq = create_freezable_workqueue("mcp251xfd_wq");
+	if (!priv->wq) {
+		ret = -ENOMEM;
+		goto out_sleep;
+	}
+	INIT_WORK(&priv->tx_work, mcp251xfd_tx_work_handler);
+	INIT_WORK(&priv->restart_work, mcp251xfd_restart_work_handler);
+
+	can_rx_offload_enable(&priv->offload);
+
+	/* the INT pin stays low while an enabled flag is set */
+	ret = request_threaded_irq(spi->irq, mcp251xfd_can_hardirq,
+				   mcp251xfd_can_ist,
+				   IRQF_ONESHOT | IRQF_TRIGGER_LOW,
+				   DEVICE_NAME, priv);
+	if (ret) {
+		dev_err(&spi->dev, "failed to acquire irq %d\n", spi->irq);
+		goto out_offload;
+	}
+
+	ret = mcp251xfd_set_normal_mode(priv);
+	if (ret)
+		goto out_irq;
+
+	can_led_event(net, CAN_LED_EVENT_OPEN);
+
+	netif_wake_queue(net);
+	mutex_unlock(&priv->mcp_lock);
+
+	return 0;
+
+out_irq:
+	priv->force_quit = 1;
+	mutex_unlock(&priv->mcp_lock);
+	free_irq(spi->irq, priv);
+	mutex_lock(&priv->mcp_lock);
+out_offload:
+	can_rx_offload_disable(&priv->offload);
+	destroy_workqueue(priv->wq);
+	priv->wq = NULL;
+out_sleep:
+	mcp251xfd_hw_stop(priv);
+out_power:
+	mcp251xfd_power_enable(priv->transceiver, 0);
+	close_candev(net);
+	mutex_unlock(&priv->mcp_lock);
+	return ret;
+}
+
+static const struct net_device_ops mcp251xfd_netdev_ops = {
+	.ndo_open = mcp251xfd_open,
+	.ndo_stop = mcp251xfd_stop,
+	.ndo_start_xmit = mcp251xfd_hard_start_xmit,
+};
+
+static const struct of_device_id mcp251xfd_of_match[] = {
+	{
+		.compatible	= "microchip,mcp2517fd",
+		.data		= (void *)CAN_MCP251XFD_MCP2517FD,
+	},
+	{
+		.compatible	= "microchip,mcp2518fd",
+		.data		= (void *)CAN_MCP251XFD_MCP2518FD,
+	},
+	{ }
+};
+MODULE_DEVICE_TABLE(of, mcp251xfd_of_match);
+
+static const struct spi_device_id mcp251xfd_id_table[] = {
+	{
+		.name		= "mcp2517fd",
+		.driver_data	= (kernel_ulong_t)CAN_MCP251XFD_MCP2517FD,
+	},
+	{
+		.name		= "mcp2518fd",
+		.driver_data	= (kernel_ulong_t)CAN_MCP251XFD_MCP2518FD,
+	},
+	{ }
+};
+MODULE_DEVICE_TABLE(spi, mcp251xfd_id_table);
+
+static int mcp251xfd_can_probe(struct spi_device *spi)
+{
+	const struct of_device_id *of_id = of_match_device(mcp251xfd_of_match,
+							   &spi->dev);
+	struct mcp251x_platform_data *pdata = dev_get_platdata(&spi->dev);
+	struct net_device *net;
+	struct mcp251xfd_priv *priv;
+	struct clk *clk;
+	int freq, ret;
+
+	clk = devm_clk_get(&spi->dev, NULL);
+	if (IS_ERR(clk)) {
+		if (pdata)
+			freq = pdata->oscillator_frequency;
+		else
+			return PTR_ERR(clk);
+	} else {
+		freq = clk_get_rate(clk);
+	}
+
+	/* Sanity check, the PLL for 4 MHz crystals is not used */
+	if (freq < 1000000 || freq > 40000000)
+		return -ERANGE;
+
+	/* Allocate can/net device */
+	net = alloc_candev(sizeof(struct mcp251xfd_priv), TX_ECHO_SKB_MAX);
+	if (!net)
+		return -ENOMEM;
+
+	if (!IS_ERR(clk)) {
+		ret = clk_prepare_enable(clk);
+		if (ret)
+			goto out_free;
+	}
+	net->netdev_ops = &mcp251xfd_netdev_ops;
+	net->flags |= IFF_ECHO;
+
+	priv = netdev_priv(net);
+	priv->can.bittiming_const = &mcp251xfd_bittiming_const;
+	priv->can.data_bittiming_const = &mcp251xfd_data_bittiming_const;
+	priv->can.do_set_mode = mcp251xfd_do_set_mode;
+	priv->can.do_get_berr_counter = mcp251xfd_get_berr_counter;
+	priv->can.clock.freq = freq;
+	priv->can.ctrlmode_supported = CAN_CTRLMODE_LOOPBACK |
+		CAN_CTRLMODE_LISTENONLY | CAN_CTRLMODE_BERR_REPORTING |
+		CAN_CTRLMODE_FD;
+	if (of_id)
+		priv->model = (enum mcp251xfd_model)of_id->data;
+	else
+		priv->model = spi_get_device_id(spi)->driver_data;
+	priv->net = net;
+	priv->spi = spi;
+	priv->clk = clk;
+	/* until the first open decides between CAN 2.0 and CAN FD */
+	priv->tx_obj_num = MCP251XFD_TX_OBJ_NUM_CAN;
+	skb_queue_head_init(&priv->tx_queue);
+	mutex_init(&priv->mcp_lock);
+
+	ret = can_rx_offload_add_manual(net, &priv->offload,
+					MCP251XFD_NAPI_WEIGHT);
+	if (ret)
+		goto out_clk;
+
+	spi_set_drvdata(spi, priv);
+
+	/* Configure the SPI bus, SCK must stay below 0.85 * SYSCLK / 2 */
+	spi->bits_per_word = 8;
+	spi->max_speed_hz = min_t(u32, spi->max_speed_hz ? : UINT_MAX,
+				  freq / 200 * 85);
+	ret = spi_setup(spi);
+	if (ret)
+		goto out_offload;
+
+	priv->power = devm_regulator_get(&spi->dev, "vdd");
+	priv->transceiver = devm_regulator_get(&spi->dev, "xceiver");
+	if ((PTR_ERR(priv->power) == -EPROBE_DEFER) ||
+	    (PTR_ERR(priv->transceiver) == -EPROBE_DEFER)) {
+		ret = -EPROBE_DEFER;
+		goto out_offload;
+	}
+
+	ret = mcp251xfd_power_enable(priv->power, 1);
+	if (ret)
+		goto out_offload;
+
+	/* If requested, allocate DMA buffers */
+	priv->use_dma = mcp251xfd_enable_dma;
+	if (priv->use_dma) {
+		spi->dev.coherent_dma_mask = ~0;
+
+		priv->spi_tx_buf = dmam_alloc_coherent(&spi->dev,
+						       2 * SPI_BUF_LEN,
+						       &priv->spi_tx_dma,
+						       GFP_DMA);
+		if (priv->spi_tx_buf) {
+			priv->spi_rx_buf = priv->spi_tx_buf + SPI_BUF_LEN;
+			priv->spi_rx_dma = priv->spi_tx_dma + SPI_BUF_LEN;
+		} else {
+			/* Fall back to non-DMA */
+			priv->use_dma = false;
+		}
+	}
+
+	/* Allocate non-DMA buffers */
+	if (!priv->use_dma) {
+		priv->spi_tx_buf = devm_kzalloc(&spi->dev, SPI_BUF_LEN,
+						GFP_KERNEL);
+		if (!priv->spi_tx_buf) {
+			ret = -ENOMEM;
+			goto error_probe;
+		}
+		priv->spi_rx_buf = devm_kzalloc(&spi->dev, SPI_BUF_LEN,
+						GFP_KERNEL);
+		if (!priv->spi_rx_buf) {
+			ret = -ENOMEM;
+			goto error_probe;
+		}
+	}
+
+	SET_NETDEV_DEV(net, &spi->dev);
+
+	/* Here is OK to not lock the chip, no one knows about it yet */
+	ret = mcp251xfd_hw_probe(priv);
+	if (ret) {
+		dev_err(&spi->dev, "MCP%xFD didn't respond: %d\n",
+			priv->model, ret);
+		goto error_probe;
+	}
+
+	mcp251xfd_hw_sleep(priv);
+
+	ret = register_candev(net);
+	if (ret)
+		goto error_probe;
+
+	devm_can_led_init(net);
+
+	netdev_info(net, "MCP%xFD successfully initialized\n", priv->model);
+
+	return 0;
+
+error_probe:
+	mcp251xfd_power_enable(priv->power, 0);
+
+out_offload:
+	can_rx_offload_del(&priv->offload);
+
+out_clk:
+	if (!IS_ERR(clk))
+		clk_disable_unprepare(clk);
+
+out_free:
+	free_candev(net);
+
+	return ret;
+}
+
+static int mcp251xfd_can_remove(struct spi_device *spi)
+{
+	struct mcp251xfd_priv *priv = spi_get_drvdata(spi);
+	struct net_device *net = priv->net;
+
+	unregister_candev(net);
+	can_rx_offload_del(&priv->offload);
+
+	mcp251xfd_power_enable(priv->power, 0);
+
+	if (!IS_ERR(priv->clk))
+		clk_disable_unprepare(priv->clk);
+
+	free_candev(net);
+
+	return 0;
+}
+
+static struct spi_driver mcp251xfd_can_driver = {
+	.driver = {
+		.name = DEVICE_NAME,
+		.owner = THIS_MODULE,
+		.of_match_table = mcp251xfd_of_match,
+	},
+	.id_table = mcp251xfd_id_table,
+	.probe = mcp251xfd_can_probe,
+	.remove = mcp251xfd_can_remove,
+};
+module_spi_driver(mcp251xfd_can_driver);
+
+MODULE_DESCRIPTION("Microchip MCP2517FD/MCP2518FD CAN FD driver");
+MODULE_LICENSE("GPL v2");
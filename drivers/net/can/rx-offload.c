@@ -0,0 +1,436 @@
+/*
+ * CAN RX offload helpers
+ *
+ * Moves frames out of the CAN controller in interrupt context, keeps them
+ * on a per device bounded skb queue and feeds them into the networking
+ * stack from NAPI context, optionally sorted by hardware timestamp.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the version 2 of the GNU General Public License
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/netdevice.h>
+#include <linux/can.h>
+#include <linux/can/dev.h>
+#include <linux/can/led.h>
+#include <linux/can/rx-offload.h>
+
+static int can_rx_offload_napi_poll(struct napi_struct *napi, int quota)
+{
+	struct can_rx_offload *offload = container_of(napi,
+						      struct can_rx_offload,
+						      napi);
+	struct net_device *dev = offload->dev;
+	struct net_device_stats *stats = &dev->stats;
+	struct sk_buff *skb;
+	int work_done = 0;
+
+	while ((work_done < quota) &&
+	       (skb = skb_dequeue(&offload->skb_queue))) {
+		struct canfd_frame *cfd = (struct canfd_frame *)skb->data;
+
+		work_done++;
+		stats->rx_packets++;
+		stats->rx_bytes += cfd->len;
+		netif_receive_skb(skb);
+	}
+
+	if (work_done < quota) {
+		napi_complete(napi);
+
+		/* Check if there was another interrupt */
+		if (!skb_queue_empty(&offload->skb_queue))
+			napi_reschedule(&offload->napi);
+	}
+
+	if (work_done)
+		can_led_event(offload->dev, CAN_LED_EVENT_RX);
+
+	return work_done;
+}
+
+/*
+ * Insert @new into @head sorted by ascending timestamp. Frames usually
+ * arrive in order, so walk the list from its tail.
+ */
+static void __skb_queue_add_sort(struct sk_buff_head *head,
+				 struct sk_buff *new)
+{
+	const struct can_rx_offload_cb *cb_new = can_rx_offload_get_cb(new);
+	struct sk_buff *pos, *insert = NULL;
+
+	skb_queue_reverse_walk(head, pos) {
+		const struct can_rx_offload_cb *cb_pos =
+			can_rx_offload_get_cb(pos);
+
+		/* signed difference copes with the timer wrapping around */
+		if ((s32)(cb_new->timestamp - cb_pos->timestamp) < 0)
+			continue;
+
+		insert = pos;
+		break;
+	}
+
+	if (!insert)
+		__skb_queue_head(head, new);
+	else
+		__skb_queue_after(head, insert, new);
+}
+
+static inline bool can_rx_offload_le(struct can_rx_offload *offload,
+				     unsigned int a, unsigned int b)
+{
+	if (offload->inc)
+		return a <= b;
+	else
+		return a >= b;
+}
+
+static inline unsigned int can_rx_offload_inc(struct can_rx_offload *offload,
+					      unsigned int *val)
+{
+	if (offload->inc)
+		return (*val)++;
+	else
+		return (*val)--;
+}
+
+/*
+ * Read one frame out of mailbox @n. If the queue is already full the
+ * mailbox is still read (to free it in hardware), but the frame is
+ * discarded and accounted as FIFO error.
+ */
+static struct sk_buff *
+can_rx_offload_offload_one(struct can_rx_offload *offload, unsigned int n)
+{
+	struct net_device_stats *stats = &offload->dev->stats;
+	struct sk_buff *skb = NULL;
+	u32 timestamp = 0;
+	bool drop;
+
+	drop = unlikely(skb_queue_len(&offload->skb_queue) +
+			skb_queue_len(&offload->skb_irq_queue) >=
+			offload->skb_queue_len_max);
+
+	if (!offload->mailbox_read(offload, drop, &skb, &timestamp, n))
+		return NULL;
+
+	if (unlikely(!skb)) {
+		if (drop) {
+			stats->rx_fifo_errors++;
+			stats->rx_errors++;
+		} else {
+			stats->rx_dropped++;
+		}
+		return ERR_PTR(-ENOBUFS);
+	}
+
+	can_rx_offload_get_cb(skb)->timestamp = timestamp;
+
+	return skb;
+}
+
+/*
+ * can_rx_offload_irq_offload_timestamp - read all pending mailboxes
+ * @offload: offload context
+ * @pending: bit mask of mailboxes holding a frame
+ *
+ * The frames are sorted by their hardware timestamp, so the order the
+ * controller filled the mailboxes in is restored. Call with interrupts
+ * disabled and finish with can_rx_offload_irq_finish().
+ */
+int can_rx_offload_irq_offload_timestamp(struct can_rx_offload *offload,
+					 u64 pending)
+{
+	unsigned int i;
+	int received = 0;
+
+	for (i = offload->mb_first;
+	     can_rx_offload_le(offload, i, offload->mb_last);
+	     can_rx_offload_inc(offload, &i)) {
+		struct sk_buff *skb;
+
+		if (!(pending & BIT_ULL(i)))
+			continue;
+
+		skb = can_rx_offload_offload_one(offload, i);
+		if (IS_ERR_OR_NULL(skb))
+			continue;
+
+		__skb_queue_add_sort(&offload->skb_irq_queue, skb);
+		received++;
+	}
+
+	return received;
+}
+EXPORT_SYMBOL_GPL(can_rx_offload_irq_offload_timestamp);
+
+/*
+ * can_rx_offload_irq_offload_fifo - drain a hardware RX FIFO
+ * @offload: offload context
+ *
+ * Reads frames until the FIFO is empty. The FIFO already delivers the
+ * frames in order, no sorting is done. Call with interrupts disabled and
+ * finish with can_rx_offload_irq_finish().
+ */
+int can_rx_offload_irq_offload_fifo(struct can_rx_offload *offload)
+{
+	struct sk_buff *skb;
+	int received = 0;
+
+	while (1) {
+		skb = can_rx_offload_offload_one(offload, 0);
+		if (PTR_ERR(skb) == -ENOBUFS)
+			continue;
+		if (!skb)
+			break;
+
+		__skb_queue_tail(&offload->skb_irq_queue, skb);
+		received++;
+	}
+
+	return received;
+}
+EXPORT_SYMBOL_GPL(can_rx_offload_irq_offload_fifo);
+
+/*
+ * can_rx_offload_queue_timestamp - queue a driver generated skb sorted
+ * @offload: offload context
+ * @skb: frame to queue (e.g. an error frame)
+ * @timestamp: hardware timestamp of the event
+ *
+ * Must be called from the interrupt handler owning @offload.
+ */
+int can_rx_offload_queue_timestamp(struct can_rx_offload *offload,
+				   struct sk_buff *skb, u32 timestamp)
+{
+	if (skb_queue_len(&offload->skb_queue) +
+	    skb_queue_len(&offload->skb_irq_queue) >=
+	    offload->skb_queue_len_max) {
+		dev_kfree_skb_any(skb);
+		offload->dev->stats.rx_fifo_errors++;
+		return -ENOBUFS;
+	}
+
+	can_rx_offload_get_cb(skb)->timestamp = timestamp;
+	__skb_queue_add_sort(&offload->skb_irq_queue, skb);
+
+	return 0;
+}
+EXPORT_SYMBOL_GPL(can_rx_offload_queue_timestamp);
+
+/*
+ * can_rx_offload_irq_queue_tail - queue a driver read skb in arrival order
+ * @offload: offload context
+ * @skb: frame to queue
+ *
+ * For drivers without hardware mailboxes (e.g. SPI attached controllers
+ * reading frames in a threaded interrupt handler). Must be called from the
+ * context owning @offload, finish with can_rx_offload_irq_finish() or
+ * can_rx_offload_threaded_irq_finish().
+ */
+int can_rx_offload_irq_queue_tail(struct can_rx_offload *offload,
+				  struct sk_buff *skb)
+{
+	if (skb_queue_len(&offload->skb_queue) +
+	    skb_queue_len(&offload->skb_irq_queue) >=
+	    offload->skb_queue_len_max) {
+		dev_kfree_skb_any(skb);
+		offload->dev->stats.rx_fifo_errors++;
+		return -ENOBUFS;
+	}
+
+	__skb_queue_tail(&offload->skb_irq_queue, skb);
+
+	return 0;
+}
+EXPORT_SYMBOL_GPL(can_rx_offload_irq_queue_tail);
+
+/*
+ * can_rx_offload_queue_tail - queue an skb from any context
+ * @offload: offload context
+ * @skb: frame to queue
+ *
+ * Bypasses the interrupt batch and appends directly to the NAPI queue.
+ * The caller has to schedule NAPI, either with can_rx_offload_schedule()
+ * from softirq/hardirq context or with can_rx_offload_threaded_irq_finish()
+ * from process context.
+ */
+int can_rx_offload_queue_tail(struct can_rx_offload *offload,
+			      struct sk_buff *skb)
+{
+	if (skb_queue_len(&offload->skb_queue) >=
+	    offload->skb_queue_len_max) {
+		dev_kfree_skb_any(skb);
+		offload->dev->stats.rx_fifo_errors++;
+		return -ENOBUFS;
+	}
+
+	skb_queue_tail(&offload->skb_queue, skb);
+
+	return 0;
+}
+EXPORT_SYMBOL_GPL(can_rx_offload_queue_tail);
+
+static bool can_rx_offload_splice(struct can_rx_offload *offload)
+{
+	unsigned long flags;
+
+	if (!skb_queue_empty(&offload->skb_irq_queue)) {
+		spin_lock_irqsave(&offload->skb_queue.lock, flags);
+		skb_queue_splice_tail_init(&offload->skb_irq_queue,
+					   &offload->skb_queue);
+		spin_unlock_irqrestore(&offload->skb_queue.lock, flags);
+	}
+
+	return !skb_queue_empty(&offload->skb_queue);
+}
+
+/*
+ * can_rx_offload_irq_finish - hand the collected frames over to NAPI
+ * @offload: offload context
+ *
+ * Call once at the end of the hard interrupt handler: the whole batch is
+ * moved to the NAPI queue with a single lock round trip.
+ */
+void can_rx_offload_irq_finish(struct can_rx_offload *offload)
+{
+	if (can_rx_offload_splice(offload))
+		napi_schedule(&offload->napi);
+}
+EXPORT_SYMBOL_GPL(can_rx_offload_irq_finish);
+
+/*
+ * can_rx_offload_threaded_irq_finish - hand frames over from process context
+ * @offload: offload context
+ *
+ * Like can_rx_offload_irq_finish() but for threaded interrupt handlers and
+ * work items: the bottom half section makes the NAPI softirq run right
+ * away instead of on the next interrupt.
+ */
+void can_rx_offload_threaded_irq_finish(struct can_rx_offload *offload)
+{
+	if (can_rx_offload_splice(offload)) {
+		local_bh_disable();
+		napi_schedule(&offload->napi);
+		local_bh_enable();
+	}
+}
+EXPORT_SYMBOL_GPL(can_rx_offload_threaded_irq_finish);
+
+static int can_rx_offload_init_queue(struct net_device *dev,
+				     struct can_rx_offload *offload,
+				     unsigned int weight)
+{
+	offload->dev = dev;
+
+	/* Limit queue len to 4x the weight (rounded to next power of two) */
+	offload->skb_queue_len_max = 2 << fls(weight);
+	offload->skb_queue_len_max *= 4;
+	skb_queue_head_init(&offload->skb_queue);
+	__skb_queue_head_init(&offload->skb_irq_queue);
+
+	netif_napi_add(dev, &offload->napi, can_rx_offload_napi_poll, weight);
+
+	dev_dbg(dev->dev.parent, "%s: skb_queue_len_max=%d\n",
+		__func__, offload->skb_queue_len_max);
+
+	return 0;
+}
+
+/*
+ * can_rx_offload_add_timestamp - set up mailbox mode
+ *
+ * offload->mailbox_read, mb_first and mb_last have to be set by the
+ * driver. The NAPI weight is the number of mailboxes.
+ */
+int can_rx_offload_add_timestamp(struct net_device *dev,
+				 struct can_rx_offload *offload)
+{
+	unsigned int weight;
+
+	if (offload->mb_first >= BITS_PER_LONG_LONG ||
+	    offload->mb_last >= BITS_PER_LONG_LONG || !offload->mailbox_read)
+		return -EINVAL;
+
+	if (offload->mb_first < offload->mb_last) {
+		offload->inc = true;
+		weight = offload->mb_last - offload->mb_first;
+	} else {
+		offload->inc = false;
+		weight = offload->mb_first - offload->mb_last;
+	}
+
+	return can_rx_offload_init_queue(dev, offload, weight);
+}
+EXPORT_SYMBOL_GPL(can_rx_offload_add_timestamp);
+
+/*
+ * can_rx_offload_add_fifo - set up FIFO mode
+ *
+ * offload->mailbox_read has to be set by the driver.
+ */
+int can_rx_offload_add_fifo(struct net_device *dev,
+			    struct can_rx_offload *offload,
+			    unsigned int weight)
+{
+	if (!offload->mailbox_read)
+		return -EINVAL;
+
+	return can_rx_offload_init_queue(dev, offload, weight);
+}
+EXPORT_SYMBOL_GPL(can_rx_offload_add_fifo);
+
+/*
+ * can_rx_offload_add_manual - set up manual mode
+ *
+ * For drivers that read the frames themselves and only use the queueing
+ * and NAPI part of the offload helpers.
+ */
+int can_rx_offload_add_manual(struct net_device *dev,
+			      struct can_rx_offload *offload,
+			      unsigned int weight)
+{
+	if (offload->mailbox_read)
+		return -EINVAL;
+
+	return can_rx_offload_init_queue(dev, offload, weight);
+}
+EXPORT_SYMBOL_GPL(can_rx_offload_add_manual);
+
+void can_rx_offload_enable(struct can_rx_offload *offload)
+{
+	can_rx_offload_reset(offload);
+	napi_enable(&offload->napi);
+}
+EXPORT_SYMBOL_GPL(can_rx_offload_enable);
+
+void can_rx_offload_del(struct can_rx_offload *offload)
+{
+	netif_napi_del(&offload->napi);
+	skb_queue_purge(&offload->skb_queue);
+	__skb_queue_purge(&offload->skb_irq_queue);
+}
+EXPORT_SYMBOL_GPL(can_rx_offload_del);
+
+/*
+ * Drop frames left over from a previous run, call with the interrupt
+ * handler and NAPI disabled.
+ */
+void can_rx_offload_reset(struct can_rx_offload *offload)
+{
+	skb_queue_purge(&offload->skb_queue);
+	__skb_queue_purge(&offload->skb_irq_queue);
+}
+EXPORT_SYMBOL_GPL(can_rx_offload_reset);
@@ -55,6 +55,8 @@
 #include <linux/workqueue.h>
 #include <linux/can.h>
 #include <linux/can/skb.h>
+#include <linux/can/slcan.h>
+#include <asm/unaligned.h>
 
 static __initconst const char banner[] =
 	KERN_INFO "slcan: serial line CAN interface driver\n";
@@ -72,6 +74,10 @@ static int maxdev = 10;		/* MAX number of SLCAN channels;
 module_param(maxdev, int, 0);
 MODULE_PARM_DESC(maxdev, "Maximum number of slcan interfaces");
 
+static bool binary;		/* framing of new channels */
+module_param(binary, bool, 0644);
+MODULE_PARM_DESC(binary, "Use the binary framing on new channels");
+
 /* maximum rx buffer len: extended CAN frame with timestamp */
 #define SLC_MTU (sizeof("T1111222281122334455667788EA5F\r")+1)
 
@@ -79,6 +85,15 @@ MODULE_PARM_DESC(maxdev, "Maximum number of slcan interfaces");
 #define SLC_SFF_ID_LEN 3
 #define SLC_EFF_ID_LEN 8
 
+/* longest encoded frame: binary EFF with every byte escaped plus 2 END */
+#define SLC_ENC_MAX (2 * (1 + 4 + CAN_MAX_DLEN) + 2)
+
+/*
+ * Frames are appended to the transmit buffer while the tty is busy and
+ * go out together with the next write.
+ */
+#define SLC_XBUFF_LEN 1024
+
 struct slcan {
 	int			magic;
 
@@ -91,13 +106,15 @@ struct slcan {
 	/* These are pointers to the malloc()ed frame buffers. */
 	unsigned char		rbuff[SLC_MTU];	/* receiver buffer	     */
 	int			rcount;         /* received chars counter    */
-	unsigned char		xbuff[SLC_MTU];	/* transmitter buffer	     */
+	unsigned char		xbuff[SLC_XBUFF_LEN]; /* transmitter buffer */
 	unsigned char		*xhead;         /* pointer to next XMIT byte */
 	int			xleft;          /* bytes left in XMIT queue  */
+	int			mode;		/* SLCAN_MODE_*		     */
 
 	unsigned long		flags;		/* Flag values/ mode etc     */
 #define SLF_INUSE		0		/* Channel in use            */
 #define SLF_ERROR		1               /* Parity, etc. error        */
+#define SLF_ESCAPE		2		/* binary: ESC received	     */
 };
 
 static struct net_device **slcan_devs;
@@ -135,16 +152,49 @@ static struct net_device **slcan_devs;
  * T12ABCDEF2AA55 : extended can_id 0x12ABCDEF, can_dlc 2, data 0xAA 0x55
  * r1230 : can_id 0x123, can_dlc 0, no data, remote transmission request
  *
+ * The binary framing (SLCAN_MODE_BINARY) is described in linux/can/slcan.h,
+ * it needs 12 instead of 22 bytes for a standard frame with 8 data bytes.
  */
 
  /************************************************************************
   *			STANDARD SLCAN DECAPSULATION			 *
   ************************************************************************/
 
+/*
+ * Hand a received frame to the network layer. Called from
+ * slcan_receive_buf() with BHs disabled, the frames of one tty buffer are
+ * processed in a single softirq run.
+ */
+static void slc_rx_frame(struct slcan *sl, const struct can_frame *cf)
+{
+	struct sk_buff *skb;
+
+	skb = dev_alloc_skb(sizeof(struct can_frame) +
+			    sizeof(struct can_skb_priv));
+	if (!skb) {
+		sl->dev->stats.rx_dropped++;
+		return;
+	}
+
+	skb->dev = sl->dev;
+	skb->protocol = htons(ETH_P_CAN);
+	skb->pkt_type = PACKET_BROADCAST;
+	skb->ip_summed = CHECKSUM_UNNECESSARY;
+
+	can_skb_reserve(skb);
+	can_skb_prv(skb)->ifindex = sl->dev->ifindex;
+
+	memcpy(skb_put(skb, sizeof(struct can_frame)),
+	       cf, sizeof(struct can_frame));
+	netif_rx(skb);
+
+	sl->dev->stats.rx_packets++;
+	sl->dev->stats.rx_bytes += cf->can_dlc;
+}
+
 /* Send one completely decapsulated can_frame to the network layer */
 static void slc_bump(struct slcan *sl)
 {
-	struct sk_buff *skb;
 	struct can_frame cf;
 	int i, tmp;
 	u32 tmpid;
@@ -205,63 +255,153 @@ static void slc_bump(struct slcan *sl)
 		}
 	}
 
-	skb = dev_alloc_skb(sizeof(struct can_frame) +
-			    sizeof(struct can_skb_priv));
-	if (!skb)
+	slc_rx_frame(sl, &cf);
+}
+
+/* Send one unescaped binary frame to the network layer */
+static void slc_bump_bin(struct slcan *sl)
+{
+	const unsigned char *pos = sl->rbuff;
+	struct can_frame cf;
+	unsigned char hdr;
+	int id_len, len;
+
+	hdr = *pos++;
+	if (hdr & ~(SLCAN_BIN_HDR_EFF | SLCAN_BIN_HDR_RTR | SLCAN_BIN_HDR_DLC))
 		return;
 
-	skb->dev = sl->dev;
-	skb->protocol = htons(ETH_P_CAN);
-	skb->pkt_type = PACKET_BROADCAST;
-	skb->ip_summed = CHECKSUM_UNNECESSARY;
+	cf.can_dlc = hdr & SLCAN_BIN_HDR_DLC;
+	if (cf.can_dlc > CAN_MAX_DLEN)
+		return;
 
-	can_skb_reserve(skb);
-	can_skb_prv(skb)->ifindex = sl->dev->ifindex;
+	id_len = (hdr & SLCAN_BIN_HDR_EFF) ? 4 : 2;
+	len = (hdr & SLCAN_BIN_HDR_RTR) ? 0 : cf.can_dlc;
+	if (sl->rcount != 1 + id_len + len)
+		return;
 
-	memcpy(skb_put(skb, sizeof(struct can_frame)),
-	       &cf, sizeof(struct can_frame));
-	netif_rx_ni(skb);
+	if (hdr & SLCAN_BIN_HDR_EFF) {
+		cf.can_id = get_unaligned_be32(pos) & CAN_EFF_MASK;
+		cf.can_id |= CAN_EFF_FLAG;
+	} else {
+		cf.can_id = get_unaligned_be16(pos);
+		if (cf.can_id > CAN_SFF_MASK)
+			return;
+	}
+	pos += id_len;
 
-	sl->dev->stats.rx_packets++;
-	sl->dev->stats.rx_bytes += cf.can_dlc;
+	if (hdr & SLCAN_BIN_HDR_RTR)
+		cf.can_id |= CAN_RTR_FLAG;
+
+	*(u64 *) (&cf.data) = 0; /* clear payload */
+	memcpy(cf.data, pos, len);
+
+	slc_rx_frame(sl, &cf);
 }
 
-/* parse tty input stream */
-static void slcan_unesc(struct slcan *sl, unsigned char s)
+/* A CR or BEL (ASCII) or an END (binary) ends the pdu */
+static void slc_rx_end(struct slcan *sl)
 {
-	if ((s == '\r') || (s == '\a')) { /* CR or BEL ends the pdu */
-		if (!test_and_clear_bit(SLF_ERROR, &sl->flags) &&
-		    (sl->rcount > 4))  {
+	bool escape = test_and_clear_bit(SLF_ESCAPE, &sl->flags);
+
+	if (!test_and_clear_bit(SLF_ERROR, &sl->flags)) {
+		if (sl->mode == SLCAN_MODE_BINARY) {
+			/* ESC END is a broken frame, END END an empty one */
+			if (sl->rcount && !escape)
+				slc_bump_bin(sl);
+		} else if (sl->rcount > 4) {
 			slc_bump(sl);
 		}
-		sl->rcount = 0;
-	} else {
-		if (!test_bit(SLF_ERROR, &sl->flags))  {
-			if (sl->rcount < SLC_MTU)  {
-				sl->rbuff[sl->rcount++] = s;
-				return;
+	}
+	sl->rcount = 0;
+}
+
+static void slc_rx_overrun(struct slcan *sl)
+{
+	sl->dev->stats.rx_over_errors++;
+	set_bit(SLF_ERROR, &sl->flags);
+}
+
+/* Append a run of pdu bytes to the receive buffer */
+static void slc_rx_append(struct slcan *sl, const unsigned char *cp,
+			  int count)
+{
+	bool escape;
+
+	if (!count || test_bit(SLF_ERROR, &sl->flags))
+		return;
+
+	if (sl->mode != SLCAN_MODE_BINARY) {
+		if (count > SLC_MTU - sl->rcount) {
+			slc_rx_overrun(sl);
+			return;
+		}
+		memcpy(sl->rbuff + sl->rcount, cp, count);
+		sl->rcount += count;
+		return;
+	}
+
+	escape = test_bit(SLF_ESCAPE, &sl->flags);
+	while (count--) {
+		unsigned char c = *cp++;
+
+		if (escape) {
+			escape = false;
+			if (c == SLCAN_BIN_ESC_END) {
+				c = SLCAN_BIN_END;
+			} else if (c == SLCAN_BIN_ESC_ESC) {
+				c = SLCAN_BIN_ESC;
 			} else {
-				sl->dev->stats.rx_over_errors++;
 				set_bit(SLF_ERROR, &sl->flags);
+				break;
 			}
+		} else if (c == SLCAN_BIN_ESC) {
+			escape = true;
+			continue;
+		}
+
+		if (sl->rcount >= SLC_MTU) {
+			slc_rx_overrun(sl);
+			break;
 		}
+		sl->rbuff[sl->rcount++] = c;
 	}
+
+	if (escape)
+		set_bit(SLF_ESCAPE, &sl->flags);
+	else
+		clear_bit(SLF_ESCAPE, &sl->flags);
+}
+
+/* Returns the offset of the first pdu terminator in @cp or @count */
+static int slc_find_end(struct slcan *sl, const unsigned char *cp, int count)
+{
+	const unsigned char *end;
+	int i;
+
+	if (sl->mode == SLCAN_MODE_BINARY) {
+		end = memchr(cp, SLCAN_BIN_END, count);
+		return end ? end - cp : count;
+	}
+
+	for (i = 0; i < count; i++)
+		if (cp[i] == '\r' || cp[i] == '\a')
+			break;
+
+	return i;
 }
 
  /************************************************************************
   *			STANDARD SLCAN ENCAPSULATION			 *
   ************************************************************************/
 
-/* Encapsulate one can_frame and stuff into a TTY queue. */
-static void slc_encaps(struct slcan *sl, struct can_frame *cf)
+/* Encode one can_frame as ASCII at @pos, returns the end */
+static unsigned char *slc_encaps_ascii(unsigned char *pos,
+				       const struct can_frame *cf)
 {
-	int actual, i;
-	unsigned char *pos;
+	int i;
 	unsigned char *endpos;
 	canid_t id = cf->can_id;
 
-	pos = sl->xbuff;
-
 	if (cf->can_id & CAN_RTR_FLAG)
 		*pos = 'R'; /* becomes 'r' in standard frame format (SFF) */
 	else
@@ -296,6 +436,101 @@ static void slc_encaps(struct slcan *sl, struct can_frame *cf)
 
 	*pos++ = '\r';
 
+	return pos;
+}
+
+static unsigned char *slc_bin_put(unsigned char *pos, unsigned char c)
+{
+	if (c == SLCAN_BIN_END) {
+		*pos++ = SLCAN_BIN_ESC;
+		*pos++ = SLCAN_BIN_ESC_END;
+	} else if (c == SLCAN_BIN_ESC) {
+		*pos++ = SLCAN_BIN_ESC;
+		*pos++ = SLCAN_BIN_ESC_ESC;
+	} else {
+		*pos++ = c;
+	}
+
+	return pos;
+}
+
+/*
+ * Encode one can_frame in the binary framing at @pos, returns the end.
+ * @start adds a leading END to flush line noise at the receiver.
+ */
+static unsigned char *slc_encaps_bin(unsigned char *pos,
+				     const struct can_frame *cf, bool start)
+{
+	unsigned char hdr = cf->can_dlc & SLCAN_BIN_HDR_DLC;
+	canid_t id;
+	int i;
+
+	if (start)
+		*pos++ = SLCAN_BIN_END;
+
+	if (cf->can_id & CAN_RTR_FLAG)
+		hdr |= SLCAN_BIN_HDR_RTR;
+
+	if (cf->can_id & CAN_EFF_FLAG) {
+		id = cf->can_id & CAN_EFF_MASK;
+		pos = slc_bin_put(pos, SLCAN_BIN_HDR_EFF | hdr);
+		pos = slc_bin_put(pos, id >> 24);
+		pos = slc_bin_put(pos, id >> 16);
+	} else {
+		id = cf->can_id & CAN_SFF_MASK;
+		pos = slc_bin_put(pos, hdr);
+	}
+	pos = slc_bin_put(pos, id >> 8);
+	pos = slc_bin_put(pos, id);
+
+	/* RTR frames may have a dlc > 0 but they never have any data bytes */
+	if (!(cf->can_id & CAN_RTR_FLAG)) {
+		for (i = 0; i < cf->can_dlc; i++)
+			pos = slc_bin_put(pos, cf->data[i]);
+	}
+
+	*pos++ = SLCAN_BIN_END;
+
+	return pos;
+}
+
+/*
+ * Encapsulate one can_frame behind the bytes still waiting in the
+ * transmit buffer. If the tty is idle the write is started here,
+ * otherwise slcan_transmit() sends the frame together with the rest.
+ */
+static void slc_encaps(struct slcan *sl, struct can_frame *cf)
+{
+	unsigned char *pos;
+	bool idle = sl->xleft <= 0;
+	int actual;
+
+	if (cf->can_dlc > CAN_MAX_DLEN)
+		cf->can_dlc = CAN_MAX_DLEN;
+
+	if (idle) {
+		sl->xhead = sl->xbuff;
+		sl->xleft = 0;
+	} else if (sl->xhead + sl->xleft + SLC_ENC_MAX >
+		   sl->xbuff + SLC_XBUFF_LEN) {
+		/* move the unsent rest to the front to make room */
+		memmove(sl->xbuff, sl->xhead, sl->xleft);
+		sl->xhead = sl->xbuff;
+	}
+
+	pos = sl->xhead + sl->xleft;
+	if (sl->mode == SLCAN_MODE_BINARY)
+		pos = slc_encaps_bin(pos, cf, idle);
+	else
+		pos = slc_encaps_ascii(pos, cf);
+	sl->xleft = pos - sl->xhead;
+
+	sl->dev->stats.tx_packets++;
+	sl->dev->stats.tx_bytes += cf->can_dlc;
+
+	if (!idle)
+		return;
+
 	/* Order of next two lines is *very* important.
 	 * When we are sending a little amount of data,
 	 * the transfer may be completed inside the ops->write()
@@ -305,10 +540,15 @@ static void slc_encaps(struct slcan *sl, struct can_frame *cf)
 	 *       14 Oct 1994  Dmitry Gorodchanin.
 	 */
 	set_bit(TTY_DO_WRITE_WAKEUP, &sl->tty->flags);
-	actual = sl->tty->ops->write(sl->tty, sl->xbuff, pos - sl->xbuff);
-	sl->xleft = (pos - sl->xbuff) - actual;
-	sl->xhead = sl->xbuff + actual;
-	sl->dev->stats.tx_bytes += cf->can_dlc;
+	actual = sl->tty->ops->write(sl->tty, sl->xhead, sl->xleft);
+	sl->xleft -= actual;
+	sl->xhead += actual;
+}
+
+/* Room for another frame in the transmit buffer? */
+static bool slc_tx_room(struct slcan *sl)
+{
+	return SLC_XBUFF_LEN - sl->xleft >= SLC_ENC_MAX;
 }
 
 /* Write out any remaining transmit buffer. Scheduled when tty is writable */
@@ -327,16 +567,18 @@ static void slcan_transmit(struct work_struct *work)
 	if (sl->xleft <= 0)  {
 		/* Now serial buffer is almost free & we can start
 		 * transmission of another packet */
-		sl->dev->stats.tx_packets++;
 		clear_bit(TTY_DO_WRITE_WAKEUP, &sl->tty->flags);
 		spin_unlock_bh(&sl->lock);
 		netif_wake_queue(sl->dev);
 		return;
 	}
 
+	/* everything queued up since the last write goes out in one go */
 	actual = sl->tty->ops->write(sl->tty, sl->xhead, sl->xleft);
 	sl->xleft -= actual;
 	sl->xhead += actual;
+	if (slc_tx_room(sl))
+		netif_wake_queue(sl->dev);
 	spin_unlock_bh(&sl->lock);
 }
 
@@ -370,8 +612,9 @@ static netdev_tx_t slc_xmit(struct sk_buff *skb, struct net_device *dev)
 		goto out;
 	}
 
-	netif_stop_queue(sl->dev);
 	slc_encaps(sl, (struct can_frame *) skb->data); /* encaps & send */
+	if (!slc_tx_room(sl))
+		netif_stop_queue(sl->dev);
 	spin_unlock(&sl->lock);
 
 out:
@@ -467,16 +710,43 @@ static void slcan_receive_buf(struct tty_struct *tty,
 	if (!sl || sl->magic != SLCAN_MAGIC || !netif_running(sl->dev))
 		return;
 
-	/* Read the characters out of the buffer */
-	while (count--) {
-		if (fp && *fp++) {
-			if (!test_and_set_bit(SLF_ERROR, &sl->flags))
-				sl->dev->stats.rx_errors++;
-			cp++;
-			continue;
+	/* deliver all frames of this buffer in one softirq run */
+	local_bh_disable();
+
+	/*
+	 * Copy the buffer pdu wise, only runs with bytes the tty flagged
+	 * as broken are looked at byte by byte.
+	 */
+	while (count) {
+		int n = slc_find_end(sl, cp, count);
+		int span = n < count ? n + 1 : n;
+		int i;
+
+		if (fp && memchr_inv(fp, TTY_NORMAL, span)) {
+			for (i = 0; i < span; i++) {
+				if (fp[i]) {
+					if (!test_and_set_bit(SLF_ERROR,
+							      &sl->flags))
+						sl->dev->stats.rx_errors++;
+				} else if (i == n) {
+					slc_rx_end(sl);
+				} else {
+					slc_rx_append(sl, cp + i, 1);
+				}
+			}
+		} else {
+			slc_rx_append(sl, cp, n);
+			if (n < count)
+				slc_rx_end(sl);
 		}
-		slcan_unesc(sl, *cp++);
+
+		cp += span;
+		if (fp)
+			fp += span;
+		count -= span;
 	}
+
+	local_bh_enable();
 }
 
 /************************************
@@ -533,6 +803,7 @@ static struct slcan *slc_alloc(dev_t line)
 	/* Initialize channel control data */
 	sl->magic = SLCAN_MAGIC;
 	sl->dev	= dev;
+	sl->mode = binary ? SLCAN_MODE_BINARY : SLCAN_MODE_ASCII;
 	spin_lock_init(&sl->lock);
 	INIT_WORK(&sl->tx_work, slcan_transmit);
 	slcan_devs[i] = dev;
@@ -672,6 +943,29 @@ static int slcan_ioctl(struct tty_struct *tty, struct file *file,
 	case SIOCSIFHWADDR:
 		return -EINVAL;
 
+	case SIOCGIFENCAP:
+		if (put_user(sl->mode, (int __user *)arg))
+			return -EFAULT;
+		return 0;
+
+	case SIOCSIFENCAP:
+		if (get_user(tmp, (int __user *)arg))
+			return -EFAULT;
+		if (tmp != SLCAN_MODE_ASCII && tmp != SLCAN_MODE_BINARY)
+			return -EINVAL;
+		spin_lock_bh(&sl->lock);
+		sl->mode = tmp;
+		/*
+		 * Drop the rest of a partial pdu received in the old framing,
+		 * when there is none the next pdu is a complete one.
+		 */
+		if (sl->rcount)
+			set_bit(SLF_ERROR, &sl->flags);
+		sl->rcount = 0;
+		clear_bit(SLF_ESCAPE, &sl->flags);
+		spin_unlock_bh(&sl->lock);
+		return 0;
+
 	default:
 		return tty_mode_ioctl(tty, file, cmd, arg);
 	}
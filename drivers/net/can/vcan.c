@@ -41,11 +41,13 @@
 
 #include <linux/module.h>
 #include <linux/init.h>
+#include <linux/hrtimer.h>
 #include <linux/netdevice.h>
 #include <linux/if_arp.h>
 #include <linux/if_ether.h>
 #include <linux/can.h>
 #include <linux/can/dev.h>
+#include <linux/can/rx-offload.h>
 #include <linux/can/skb.h>
 #include <linux/slab.h>
 #include <net/rtnetlink.h>
@@ -68,37 +70,277 @@ static bool echo; /* echo testing. Default: 0 (Off) */
 module_param(echo, bool, S_IRUGO);
 MODULE_PARM_DESC(echo, "Echo sent frames (for testing). Default: 0 (Off)");
 
+/*
+ * Bit rate emulation:
+ * With a bitrate set, every vcan device behaves like a CAN bus of its own
+ * shared by all local senders. A frame occupies the bus for its length in
+ * bits (worst case bit stuffing, including the interframe space) and is
+ * delivered when its transmission is complete. Frames that wait for the
+ * bus are arbitrated by their identifier like on a real bus. The setting
+ * applies to devices created after loading the module.
+ */
 
-static void vcan_rx(struct sk_buff *skb, struct net_device *dev)
+static unsigned int bitrate; /* Default: 0 (instant delivery) */
+module_param(bitrate, uint, S_IRUGO);
+MODULE_PARM_DESC(bitrate, "Emulated bit rate in bit/s. Default: 0 (Off)");
+
+static unsigned int dbitrate; /* Default: 0 (same as bitrate) */
+module_param(dbitrate, uint, S_IRUGO);
+MODULE_PARM_DESC(dbitrate,
+		 "Emulated CAN FD data phase bit rate in bit/s. "
+		 "Default: 0 (same as bitrate)");
+
+#define VCAN_NAPI_WEIGHT	64
+
+/* frames waiting for the bus, like the TX mailboxes of a controller */
+#define VCAN_TX_SLOTS		8
+#define VCAN_TX_QUEUE_LEN	10
+
+struct vcan_priv {
+	/* must be first, the rx-offload helpers update the CAN LED triggers */
+	struct can_priv can;
+	struct can_rx_offload offload;
+
+	/* bit rate emulation */
+	struct net_device *dev;
+	u32 bitrate;
+	u32 dbitrate;
+	spinlock_t bus_lock;
+	struct sk_buff_head tx_pending;	/* sorted by arbitration priority */
+	struct sk_buff *tx_on_bus;
+	struct hrtimer bus_timer;
+};
+
+/* per skb state while waiting for and occupying the bus */
+struct vcan_bus_cb {
+	u32 arb;	/* arbitration field, the lower value wins */
+	bool loop;
+};
+
+static inline struct vcan_bus_cb *vcan_bus_cb(struct sk_buff *skb)
 {
-	struct canfd_frame *cfd = (struct canfd_frame *)skb->data;
-	struct net_device_stats *stats = &dev->stats;
+	BUILD_BUG_ON(sizeof(struct vcan_bus_cb) > sizeof(skb->cb));
 
-	stats->rx_packets++;
-	stats->rx_bytes += cfd->len;
+	return (struct vcan_bus_cb *)skb->cb;
+}
+
+/*
+ * Looped frames are fed into the stack from NAPI context, the packet
+ * counting is done by the rx-offload poll function.
+ */
+static void vcan_rx(struct sk_buff *skb, struct net_device *dev)
+{
+	struct vcan_priv *priv = netdev_priv(dev);
 
 	skb->pkt_type  = PACKET_BROADCAST;
 	skb->dev       = dev;
 	skb->ip_summed = CHECKSUM_UNNECESSARY;
 
-	netif_rx_ni(skb);
+	if (!can_rx_offload_queue_tail(&priv->offload, skb))
+		can_rx_offload_schedule(&priv->offload);
+}
+
+/*
+ * The bits of the arbitration field in the order they are sent: base ID,
+ * RTR (SFF) or SRR, IDE, extended ID and RTR (EFF). A dominant (0) bit
+ * wins, so SFF frames win over EFF frames with the same base ID.
+ */
+static u32 vcan_arb_field(canid_t can_id)
+{
+	u32 rtr = !!(can_id & CAN_RTR_FLAG);
+
+	if (!(can_id & CAN_EFF_FLAG))
+		return (can_id & CAN_SFF_MASK) << 21 | rtr << 20;
+
+	return ((can_id >> 18) & CAN_SFF_MASK) << 21 | 1 << 20 | 1 << 19 |
+		(can_id & 0x3ffff) << 1 | rtr;
+}
+
+/* worst case number of stuff bits in @bits bits with bit stuffing */
+static inline unsigned int vcan_stuff_bits(unsigned int bits)
+{
+	return (bits - 1) / 4;
+}
+
+/* time on the bus of @skb in ns, including the interframe space */
+static u64 vcan_frame_ns(const struct vcan_priv *priv,
+			 const struct sk_buff *skb)
+{
+	const struct canfd_frame *cfd = (struct canfd_frame *)skb->data;
+	bool eff = cfd->can_id & CAN_EFF_FLAG;
+	unsigned int arb_bits, data_bits, tail_bits;
+	unsigned int len = cfd->len;
+	u32 dbitrate = priv->dbitrate;
+
+	if (skb->len == CANFD_MTU) {
+		/* without BRS the data phase stays at the nominal rate */
+		if (!(cfd->flags & CANFD_BRS))
+			dbitrate = priv->bitrate;
+
+		/* SOF, ID, (SRR, IDE, ID ext,) RRS, IDE/FDF, res, BRS */
+		arb_bits = eff ? 36 : 17;
+		arb_bits += vcan_stuff_bits(arb_bits);
+
+		/* ESI, DLC, data, stuff count, CRC, fixed stuff bits */
+		data_bits = 1 + 4 + len * 8;
+		data_bits += vcan_stuff_bits(data_bits);
+		data_bits += 4 + (len > 16 ? 21 : 17);
+		data_bits += DIV_ROUND_UP(4 + (len > 16 ? 21 : 17), 4);
+
+		/* CRC delimiter, ACK, EOF, interframe space */
+		tail_bits = 1 + 2 + 7 + 3;
+	} else {
+		if (cfd->can_id & CAN_RTR_FLAG)
+			len = 0;
+
+		/* SOF ... CRC are subject to bit stuffing */
+		arb_bits = (eff ? 54 : 34) + len * 8;
+		arb_bits += vcan_stuff_bits(arb_bits);
+		data_bits = 0;
+
+		/* CRC delimiter, ACK, EOF, interframe space */
+		tail_bits = 1 + 2 + 7 + 3;
+	}
+
+	return div_u64((u64)(arb_bits + tail_bits) * NSEC_PER_SEC,
+		       priv->bitrate) +
+		div_u64((u64)data_bits * NSEC_PER_SEC, dbitrate);
+}
+
+/* queue @skb by arbitration priority, frames with the same ID stay in order */
+static void vcan_bus_enqueue(struct vcan_priv *priv, struct sk_buff *skb)
+{
+	u32 arb = vcan_bus_cb(skb)->arb;
+	struct sk_buff *pos;
+
+	skb_queue_reverse_walk(&priv->tx_pending, pos) {
+		if (vcan_bus_cb(pos)->arb <= arb) {
+			__skb_queue_after(&priv->tx_pending, pos, skb);
+			return;
+		}
+	}
+
+	__skb_queue_head(&priv->tx_pending, skb);
+}
+
+/*
+ * Put the winner of the arbitration onto the idle bus, called with
+ * bus_lock held. Returns its time on the bus in ns, 0 if nothing waits.
+ */
+static u64 vcan_bus_arbitrate(struct vcan_priv *priv)
+{
+	struct sk_buff *skb = __skb_dequeue(&priv->tx_pending);
+
+	priv->tx_on_bus = skb;
+	if (!skb)
+		return 0;
+
+	if (netif_queue_stopped(priv->dev))
+		netif_wake_queue(priv->dev);
+
+	return vcan_frame_ns(priv, skb);
+}
+
+/* the frame on the bus has been sent completely */
+static enum hrtimer_restart vcan_bus_timer(struct hrtimer *timer)
+{
+	struct vcan_priv *priv = container_of(timer, struct vcan_priv,
+					      bus_timer);
+	struct net_device *dev = priv->dev;
+	struct net_device_stats *stats = &dev->stats;
+	struct canfd_frame *cfd;
+	struct sk_buff *skb;
+	unsigned long flags;
+	u64 ns;
+
+	spin_lock_irqsave(&priv->bus_lock, flags);
+
+	skb = priv->tx_on_bus;
+	if (skb) {
+		cfd = (struct canfd_frame *)skb->data;
+		stats->tx_packets++;
+		stats->tx_bytes += cfd->len;
+
+		if (vcan_bus_cb(skb)->loop) {
+			skb = can_create_echo_skb(skb);
+			if (skb)
+				vcan_rx(skb, dev);
+		} else {
+			dev_kfree_skb_any(skb);
+		}
+	}
+
+	/* the next frame follows right after the interframe space */
+	ns = vcan_bus_arbitrate(priv);
+	if (ns)
+		hrtimer_add_expires_ns(timer, ns);
+
+	spin_unlock_irqrestore(&priv->bus_lock, flags);
+
+	return ns ? HRTIMER_RESTART : HRTIMER_NORESTART;
+}
+
+static netdev_tx_t vcan_bus_tx(struct sk_buff *skb, struct net_device *dev,
+			       bool loop)
+{
+	struct vcan_priv *priv = netdev_priv(dev);
+	unsigned long flags;
+	u64 ns;
+
+	vcan_bus_cb(skb)->arb =
+		vcan_arb_field(((struct canfd_frame *)skb->data)->can_id);
+	vcan_bus_cb(skb)->loop = loop;
+
+	spin_lock_irqsave(&priv->bus_lock, flags);
+
+	vcan_bus_enqueue(priv, skb);
+	if (skb_queue_len(&priv->tx_pending) >= VCAN_TX_SLOTS)
+		netif_stop_queue(dev);
+
+	/* idle bus: no arbitration needed */
+	if (!priv->tx_on_bus) {
+		ns = vcan_bus_arbitrate(priv);
+		hrtimer_start(&priv->bus_timer, ns_to_ktime(ns),
+			      HRTIMER_MODE_REL);
+	}
+
+	spin_unlock_irqrestore(&priv->bus_lock, flags);
+
+	return NETDEV_TX_OK;
+}
+
+static void vcan_bus_flush(struct vcan_priv *priv)
+{
+	hrtimer_cancel(&priv->bus_timer);
+
+	spin_lock_irq(&priv->bus_lock);
+	if (priv->tx_on_bus) {
+		dev_kfree_skb_any(priv->tx_on_bus);
+		priv->tx_on_bus = NULL;
+	}
+	__skb_queue_purge(&priv->tx_pending);
+	spin_unlock_irq(&priv->bus_lock);
 }
 
 static netdev_tx_t vcan_tx(struct sk_buff *skb, struct net_device *dev)
 {
 	struct canfd_frame *cfd = (struct canfd_frame *)skb->data;
 	struct net_device_stats *stats = &dev->stats;
+	struct vcan_priv *priv = netdev_priv(dev);
 	int loop;
 
 	if (can_dropped_invalid_skb(dev, skb))
 		return NETDEV_TX_OK;
 
-	stats->tx_packets++;
-	stats->tx_bytes += cfd->len;
-
 	/* set flag whether this packet has to be looped back */
 	loop = skb->pkt_type == PACKET_LOOPBACK;
 
+	if (priv->bitrate)
+		return vcan_bus_tx(skb, dev, loop);
+
+	stats->tx_packets++;
+	stats->tx_bytes += cfd->len;
+
 	if (!echo) {
 		/* no echo handling available inside this driver */
 
@@ -144,13 +386,40 @@ static int vcan_change_mtu(struct net_device *dev, int new_mtu)
 	return 0;
 }
 
+static int vcan_open(struct net_device *dev)
+{
+	struct vcan_priv *priv = netdev_priv(dev);
+
+	can_rx_offload_enable(&priv->offload);
+	netif_start_queue(dev);
+
+	return 0;
+}
+
+static int vcan_stop(struct net_device *dev)
+{
+	struct vcan_priv *priv = netdev_priv(dev);
+
+	netif_stop_queue(dev);
+	if (priv->bitrate)
+		vcan_bus_flush(priv);
+	can_rx_offload_disable(&priv->offload);
+	can_rx_offload_reset(&priv->offload);
+
+	return 0;
+}
+
 static const struct net_device_ops vcan_netdev_ops = {
+	.ndo_open	= vcan_open,
+	.ndo_stop	= vcan_stop,
 	.ndo_start_xmit = vcan_tx,
 	.ndo_change_mtu = vcan_change_mtu,
 };
 
 static void vcan_setup(struct net_device *dev)
 {
+	struct vcan_priv *priv = netdev_priv(dev);
+
 	dev->type		= ARPHRD_CAN;
 	dev->mtu		= CAN_MTU;
 	dev->hard_header_len	= 0;
@@ -164,11 +433,30 @@ static void vcan_setup(struct net_device *dev)
 
 	dev->netdev_ops		= &vcan_netdev_ops;
 	dev->destructor		= free_netdev;
+
+	/* Cannot fail: priv is zeroed, so there is no mailbox_read */
+	can_rx_offload_add_manual(dev, &priv->offload, VCAN_NAPI_WEIGHT);
+
+	priv->dev = dev;
+	priv->bitrate = bitrate;
+	priv->dbitrate = dbitrate ? dbitrate : bitrate;
+	spin_lock_init(&priv->bus_lock);
+	__skb_queue_head_init(&priv->tx_pending);
+	hrtimer_init(&priv->bus_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	priv->bus_timer.function = vcan_bus_timer;
+
+	if (priv->bitrate) {
+		/* frames are delivered when they left the emulated bus */
+		dev->flags |= IFF_ECHO;
+		/* senders queue up in front of the bus */
+		dev->tx_queue_len = VCAN_TX_QUEUE_LEN;
+	}
 }
 
 static struct rtnl_link_ops vcan_link_ops __read_mostly = {
-	.kind	= "vcan",
-	.setup	= vcan_setup,
+	.kind		= "vcan",
+	.priv_size	= sizeof(struct vcan_priv),
+	.setup		= vcan_setup,
 };
 
 static __init int vcan_init_module(void)
@@ -178,6 +466,10 @@ static __init int vcan_init_module(void)
 	if (echo)
 		printk(KERN_INFO "vcan: enabled echo on driver level.\n");
 
+	if (bitrate)
+		printk(KERN_INFO "vcan: emulating %u bit/s (data %u bit/s).\n",
+		       bitrate, dbitrate ? dbitrate : bitrate);
+
 	return rtnl_link_register(&vcan_link_ops);
 }
 
@@ -17,6 +17,8 @@
 #include <linux/net_tstamp.h>
 #include <linux/ptp_clock_kernel.h>
 
+struct sk_filter;
+
 #if defined(CONFIG_M523x) || defined(CONFIG_M527x) || defined(CONFIG_M528x) || \
     defined(CONFIG_M520x) || defined(CONFIG_M532x) || \
     defined(CONFIG_ARCH_MXC) || defined(CONFIG_SOC_IMX28)
@@ -299,6 +301,11 @@ struct bufdesc_ex {
 				((X == 2) ? \
 				   FEC_X_DES_ACTIVE_2 : FEC_X_DES_ACTIVE_0))
 
+#define FEC_TXIC(X)		((X == 1) ? FEC_TXIC1 : \
+				((X == 2) ? FEC_TXIC2 : FEC_TXIC0))
+#define FEC_RXIC(X)		((X == 1) ? FEC_RXIC1 : \
+				((X == 2) ? FEC_RXIC2 : FEC_RXIC0))
+
 #define FEC_DMA_CFG(X)		((X == 2) ? FEC_DMA_CFG_2 : FEC_DMA_CFG_1)
 
 #define DMA_CLASS_EN		(1 << 16)
@@ -315,6 +322,7 @@ struct bufdesc_ex {
 #define RCMR_CMP_2		(RCMR_CMP_CFG(4, 0) | RCMR_CMP_CFG(5, 1) | \
 				RCMR_CMP_CFG(6, 2) | RCMR_CMP_CFG(7, 3))
 #define RCMR_CMP(X)		((X == 1) ? RCMR_CMP_1 : RCMR_CMP_2)
+#define RCMR_CMP_NUM		4	/* VLAN priorities matched per ring */
 #define FEC_TX_BD_FTYPE(X)	((X & 0xF) << 20)
 
 /* The number of Tx and Rx buffers.  These are allocated from the page
@@ -328,6 +336,12 @@ struct bufdesc_ex {
 #define FEC_ENET_RX_FRSIZE	2048
 #define FEC_ENET_RX_FRPPG	(PAGE_SIZE / FEC_ENET_RX_FRSIZE)
 #define RX_RING_SIZE		(FEC_ENET_RX_FRPPG * FEC_ENET_RX_PAGES)
+/* Each receive buffer is one half of a page: the headroom, the frame
+ * written by the controller and the skb_shared_info build_skb() puts
+ * at the end. The headroom also keeps the buffer aligned for every
+ * rx_align in use.
+ */
+#define FEC_ENET_RX_HEADROOM	ALIGN(NET_SKB_PAD, 64)
 #define FEC_ENET_TX_FRSIZE	2048
 #define FEC_ENET_TX_FRPPG	(PAGE_SIZE / FEC_ENET_TX_FRSIZE)
 #define TX_RING_SIZE		512	/* Must be power of two */
@@ -360,6 +374,10 @@ struct bufdesc_ex {
 #define FEC_ENET_WAKEUP	((uint)0x00020000)	/* Wakeup request */
 #define FEC_ENET_TXF	(FEC_ENET_TXF_0 | FEC_ENET_TXF_1 | FEC_ENET_TXF_2)
 #define FEC_ENET_RXF	(FEC_ENET_RXF_0 | FEC_ENET_RXF_1 | FEC_ENET_RXF_2)
+#define FEC_ENET_TXF_Q(X)	((X == 1) ? FEC_ENET_TXF_1 : \
+				((X == 2) ? FEC_ENET_TXF_2 : FEC_ENET_TXF_0))
+#define FEC_ENET_RXF_Q(X)	((X == 1) ? FEC_ENET_RXF_1 : \
+				((X == 2) ? FEC_ENET_RXF_2 : FEC_ENET_RXF_0))
 #define FEC_ENET_TS_AVAIL       ((uint)0x00010000)
 #define FEC_ENET_TS_TIMER       ((uint)0x00008000)
 
@@ -376,9 +394,29 @@ struct bufdesc_ex {
 #define FEC_ITR_ICFT_DEFAULT	200  /* Set 200 frame count threshold */
 #define FEC_ITR_ICTT_DEFAULT	1000 /* Set 1000us timer threshold */
 
+/* Adaptive interrupt moderation levels, see fec_enet_itr_update() */
+enum fec_itr_level {
+	FEC_ITR_LOWEST_LATENCY,
+	FEC_ITR_LOW_LATENCY,
+	FEC_ITR_BULK,
+};
+
+/* Traffic seen by one ring since its moderation was last updated */
+struct fec_enet_itr {
+	unsigned int pkts;
+	unsigned int bytes;
+	u8 level;
+};
+
 #define FEC_VLAN_TAG_LEN       0x04
 #define FEC_ETHTYPE_LEN                0x02
 
+/* Private ioctl attaching an early RX filter. ifr_data points to a
+ * struct sock_fprog in the SO_ATTACH_FILTER format, a zero length
+ * detaches it. Frames the program returns 0 for are dropped.
+ */
+#define SIOCSFECRXFILTER	SIOCDEVPRIVATE
+
 /* Controller is ENET-MAC */
 #define FEC_QUIRK_ENET_MAC		(1 << 0)
 /* Controller needs driver to swap frame */
@@ -449,17 +487,46 @@ struct fec_enet_priv_tx_q {
 	struct bufdesc	*dirty_tx;
 	char *tso_hdrs;
 	dma_addr_t tso_hdrs_dma;
+
+	struct fec_enet_itr itr;
+
+	/* Only written by the NAPI context reaping this ring */
+	struct net_device_stats stats;
+	/* Only written under the xmit lock of this queue */
+	unsigned long tx_dropped;
+};
+
+/* The page behind one receive descriptor. It stays DMA-mapped while it
+ * is on the ring, page_offset selects the half the controller owns.
+ */
+struct fec_enet_rx_buffer {
+	struct page *page;
+	dma_addr_t dma;
+	unsigned int page_offset;
 };
 
 struct fec_enet_priv_rx_q {
 	int index;
-	struct  sk_buff *rx_skbuff[RX_RING_SIZE];
+	struct fec_enet_rx_buffer rx_buf[RX_RING_SIZE];
 
 	dma_addr_t	bd_dma;
 	struct bufdesc	*rx_bd_base;
 	uint rx_ring_size;
 
 	struct bufdesc	*cur_rx;
+
+	struct fec_enet_itr itr;
+
+	/* Only written by the NAPI context of this ring */
+	struct net_device_stats stats;
+
+	/* Polls this RX ring and the TX rings it is paired with */
+	struct napi_struct napi;
+	u32 napi_events;
+
+	/* Verdicts of the early RX filter */
+	unsigned long filter_pass;
+	unsigned long filter_drop;
 };
 
 /* The FEC buffer descriptors track the ring buffers.  The rx_bd_base and
@@ -494,8 +561,6 @@ struct fec_enet_private {
 	unsigned int total_tx_ring_size;
 	unsigned int total_rx_ring_size;
 
-	unsigned long work_tx;
-	unsigned long work_rx;
 	unsigned long work_ts;
 	unsigned long work_mdio;
 
@@ -518,15 +583,26 @@ struct fec_enet_private {
 	int	speed;
 	struct	completion mdio_done;
 	int	irq[FEC_IRQ_NUM];
+	/* Events each interrupt line services */
+	u32	irq_events[FEC_IRQ_NUM];
+	spinlock_t imask_lock;
 	bool	bufdesc_ex;
 	int	pause_flag;
 	int	wol_flag;
 	u32	quirks;
 
-	struct	napi_struct napi;
 	int	csum_flags;
 
+	/* RX ring of each VLAN priority, 0 for unclassified */
+	u8	pcp_rx_queue[8];
+
+	/* Classic BPF program run on received frames before an skb
+	 * is allocated for them, see SIOCSFECRXFILTER.
+	 */
+	struct sk_filter __rcu *rx_filter;
+
 	struct work_struct tx_timeout_work;
+	unsigned long tx_timeouts;
 
 	struct ptp_clock *ptp_clock;
 	struct ptp_clock_info ptp_caps;
@@ -551,6 +627,8 @@ struct fec_enet_private {
 	unsigned int tx_pkts_itr;
 	unsigned int tx_time_itr;
 	unsigned int itr_clk_rate;
+	bool rx_itr_adaptive;
+	bool tx_itr_adaptive;
 
 	u32 rx_copybreak;
 
@@ -33,6 +33,7 @@
 #include <linux/netdevice.h>
 #include <linux/etherdevice.h>
 #include <linux/skbuff.h>
+#include <linux/filter.h>
 #include <linux/in.h>
 #include <linux/ip.h>
 #include <net/ip.h>
@@ -66,11 +67,11 @@
 #include "fec.h"
 
 static void set_multicast_list(struct net_device *ndev);
-static void fec_enet_itr_coal_init(struct net_device *ndev);
+static void fec_enet_itr_coal_set(struct net_device *ndev);
+static void fec_enet_itr_update(struct net_device *ndev, int queue);
 
 #define DRIVER_NAME	"fec"
 
-#define FEC_ENET_GET_QUQUE(_x) ((_x == 0) ? 1 : ((_x == 1) ? 2 : 0))
 static const u16 fec_enet_vlan_pri_to_queue[8] = {1, 1, 1, 1, 2, 2, 2, 2};
 
 /* Pause frame feild and FIFO threshold */
@@ -300,6 +301,53 @@ static int fec_enet_get_free_txdesc_num(struct fec_enet_private *fep,
 	return entries > 0 ? entries : entries + txq->tx_ring_size;
 }
 
+/* Ring the TX doorbell for a queue. ERR007885 parts may lose a TDAR
+ * write that hits an active uDMA, there TDAR is only written once it
+ * has read clear; a descriptor the uDMA raced past is then restarted
+ * from the completion path (ERR006538).
+ */
+static void fec_enet_txq_kick(struct fec_enet_private *fep,
+			      unsigned short queue)
+{
+	void __iomem *tdar = fep->hwp + FEC_X_DES_ACTIVE(queue);
+
+	if (!(fep->quirks & FEC_QUIRK_ERR007885) ||
+	    !readl(tdar) || !readl(tdar) ||
+	    !readl(tdar) || !readl(tdar))
+		writel(0, tdar);
+}
+
+static void fec_enet_napi_enable(struct fec_enet_private *fep)
+{
+	int i;
+
+	for (i = 0; i < fep->num_rx_queues; i++)
+		napi_enable(&fep->rx_queue[i]->napi);
+}
+
+static void fec_enet_napi_disable(struct fec_enet_private *fep)
+{
+	int i;
+
+	for (i = 0; i < fep->num_rx_queues; i++)
+		napi_disable(&fep->rx_queue[i]->napi);
+}
+
+/* Mask or unmask ring events. Each NAPI context owns the bits of its
+ * rings, the lock serialises the read-modify-write between them.
+ */
+static void fec_enet_imask_update(struct fec_enet_private *fep, u32 clear,
+				  u32 set)
+{
+	unsigned long flags;
+	u32 val;
+
+	spin_lock_irqsave(&fep->imask_lock, flags);
+	val = readl(fep->hwp + FEC_IMASK);
+	writel((val & ~clear) | set, fep->hwp + FEC_IMASK);
+	spin_unlock_irqrestore(&fep->imask_lock, flags);
+}
+
 static void swap_buffer(void *bufaddr, int len)
 {
 	int i;
@@ -452,7 +500,7 @@ dma_mapping_error:
 		dma_unmap_single(&fep->pdev->dev, bdp->cbd_bufaddr,
 				bdp->cbd_datlen, DMA_TO_DEVICE);
 	}
-	return NETDEV_TX_OK;
+	return -ENOMEM;
 }
 
 static int fec_enet_txq_submit_skb(struct fec_enet_priv_tx_q *txq,
@@ -516,8 +564,12 @@ static int fec_enet_txq_submit_skb(struct fec_enet_priv_tx_q *txq,
 
 	if (nr_frags) {
 		ret = fec_enet_txq_submit_frag_skb(txq, skb, ndev);
-		if (ret)
-			return ret;
+		if (ret) {
+			/* The skb has been freed, it was never queued */
+			dma_unmap_single(&fep->pdev->dev, addr, buflen,
+					 DMA_TO_DEVICE);
+			return NETDEV_TX_OK;
+		}
 	} else {
 		status |= (BD_ENET_TX_INTR | BD_ENET_TX_LAST);
 		if (fep->bufdesc_ex) {
@@ -554,6 +606,12 @@ static int fec_enet_txq_submit_skb(struct fec_enet_priv_tx_q *txq,
 	bdp->cbd_datlen = buflen;
 	bdp->cbd_bufaddr = addr;
 
+	/* The skb may be completed and freed as soon as the first BD
+	 * is ready, account for it before.
+	 */
+	skb_tx_timestamp(skb);
+	netdev_tx_sent_queue(netdev_get_tx_queue(ndev, queue), skb->len);
+
 	/* Send it on its way.  Tell FEC it's ready, interrupt when done,
 	 * it's the last BD of the frame, and to put the CRC on the end.
 	 */
@@ -563,12 +621,10 @@ static int fec_enet_txq_submit_skb(struct fec_enet_priv_tx_q *txq,
 	/* If this was the last BD in the ring, start at the beginning again. */
 	bdp = fec_enet_get_nextdesc(last_bdp, fep, queue);
 
-	skb_tx_timestamp(skb);
-
 	txq->cur_tx = bdp;
 
 	/* Trigger transmission start */
-	writel(0, fep->hwp + FEC_X_DES_ACTIVE(queue));
+	fec_enet_txq_kick(fep, queue);
 
 	return 0;
 }
@@ -602,10 +658,9 @@ fec_enet_txq_put_data_tso(struct fec_enet_priv_tx_q *txq, struct sk_buff *skb,
 
 	addr = dma_map_single(&fep->pdev->dev, data, size, DMA_TO_DEVICE);
 	if (dma_mapping_error(&fep->pdev->dev, addr)) {
-		dev_kfree_skb_any(skb);
 		if (net_ratelimit())
 			netdev_err(ndev, "Tx DMA memory map failed\n");
-		return NETDEV_TX_BUSY;
+		return -ENOMEM;
 	}
 
 	bdp->cbd_datlen = size;
@@ -650,7 +705,10 @@ fec_enet_txq_put_hdr_tso(struct fec_enet_priv_tx_q *txq,
 
 	status = bdp->cbd_sc;
 	status &= ~BD_ENET_TX_STATS;
-	status |= (BD_ENET_TX_TC | BD_ENET_TX_READY);
+	status |= BD_ENET_TX_TC;
+	/* The first BD of the frame is made ready last */
+	if (bdp != txq->cur_tx)
+		status |= BD_ENET_TX_READY;
 
 	bufaddr = txq->tso_hdrs + index * TSO_HEADER_SIZE;
 	dmabuf = txq->tso_hdrs_dma + index * TSO_HEADER_SIZE;
@@ -665,10 +723,9 @@ fec_enet_txq_put_hdr_tso(struct fec_enet_priv_tx_q *txq,
 		dmabuf = dma_map_single(&fep->pdev->dev, bufaddr,
 					hdr_len, DMA_TO_DEVICE);
 		if (dma_mapping_error(&fep->pdev->dev, dmabuf)) {
-			dev_kfree_skb_any(skb);
 			if (net_ratelimit())
 				netdev_err(ndev, "Tx DMA memory map failed\n");
-			return NETDEV_TX_BUSY;
+			return -ENOMEM;
 		}
 	}
 
@@ -697,6 +754,7 @@ static int fec_enet_txq_submit_tso(struct fec_enet_priv_tx_q *txq,
 	int hdr_len = skb_transport_offset(skb) + tcp_hdrlen(skb);
 	int total_len, data_left;
 	struct bufdesc *bdp = txq->cur_tx;
+	struct bufdesc *last_bdp;
 	unsigned short queue = skb_get_queue_mapping(skb);
 	struct tso_t tso;
 	unsigned int index = 0;
@@ -758,22 +816,37 @@ static int fec_enet_txq_submit_tso(struct fec_enet_priv_tx_q *txq,
 	/* Save skb pointer */
 	txq->tx_skbuff[index] = skb;
 
+	/* The skb may be completed and freed as soon as the first BD
+	 * is ready, account for it before.
+	 */
 	skb_tx_timestamp(skb);
+	netdev_tx_sent_queue(netdev_get_tx_queue(ndev, queue), skb->len);
+
+	/* The rest of the frame must be visible before its first BD */
+	wmb();
+	txq->cur_tx->cbd_sc |= BD_ENET_TX_READY;
+
 	txq->cur_tx = bdp;
 
 	/* Trigger transmission start */
-	if (!(fep->quirks & FEC_QUIRK_ERR007885) ||
-	    !readl(fep->hwp + FEC_X_DES_ACTIVE(queue)) ||
-	    !readl(fep->hwp + FEC_X_DES_ACTIVE(queue)) ||
-	    !readl(fep->hwp + FEC_X_DES_ACTIVE(queue)) ||
-	    !readl(fep->hwp + FEC_X_DES_ACTIVE(queue)))
-		writel(0, fep->hwp + FEC_X_DES_ACTIVE(queue));
+	fec_enet_txq_kick(fep, queue);
 
 	return 0;
 
 err_release:
-	/* TODO: Release all used data descriptors for TSO */
-	return ret;
+	/* The first BD never became ready, take back the ones behind it */
+	for (last_bdp = txq->cur_tx; last_bdp != bdp;
+	     last_bdp = fec_enet_get_nextdesc(last_bdp, fep, queue)) {
+		last_bdp->cbd_sc &= ~BD_ENET_TX_READY;
+		if (!IS_TSO_HEADER(txq, last_bdp->cbd_bufaddr))
+			dma_unmap_single(&fep->pdev->dev,
+					 last_bdp->cbd_bufaddr,
+					 last_bdp->cbd_datlen, DMA_TO_DEVICE);
+		last_bdp->cbd_bufaddr = 0;
+	}
+	dev_kfree_skb_any(skb);
+	txq->tx_dropped++;
+	return NETDEV_TX_OK;
 }
 
 static netdev_tx_t
@@ -862,6 +935,31 @@ static void fec_enet_bd_init(struct net_device *dev)
 	}
 }
 
+/* Program the VLAN priorities that steer frames into RX ring 1 or 2.
+ * Each ring compares against up to RCMR_CMP_NUM priorities, unused
+ * slots repeat the first one.
+ */
+static void fec_enet_rx_class_set(struct fec_enet_private *fep, int queue)
+{
+	u32 val = 0;
+	int pcp, n = 0;
+
+	for (pcp = 0; pcp < ARRAY_SIZE(fep->pcp_rx_queue); pcp++) {
+		if (fep->pcp_rx_queue[pcp] != queue)
+			continue;
+		if (n == RCMR_CMP_NUM)
+			break;
+		if (!n)
+			val = RCMR_MATCHEN | RCMR_CMP_CFG(pcp, 1) |
+			      RCMR_CMP_CFG(pcp, 2) | RCMR_CMP_CFG(pcp, 3);
+		val &= ~RCMR_CMP_CFG(7, n);
+		val |= RCMR_CMP_CFG(pcp, n);
+		n++;
+	}
+
+	writel(val, fep->hwp + FEC_RCMR(queue));
+}
+
 static void fec_enet_active_rxring(struct net_device *ndev)
 {
 	struct fec_enet_private *fep = netdev_priv(ndev);
@@ -885,8 +983,7 @@ static void fec_enet_enable_ring(struct net_device *ndev)
 
 		/* enable DMA1/2 */
 		if (i)
-			writel(RCMR_MATCHEN | RCMR_CMP(i),
-			       fep->hwp + FEC_RCMR(i));
+			fec_enet_rx_class_set(fep, i);
 	}
 
 	for (i = 0; i < fep->num_tx_queues; i++) {
@@ -915,6 +1012,7 @@ static void fec_enet_reset_skb(struct net_device *ndev)
 				txq->tx_skbuff[j] = NULL;
 			}
 		}
+		netdev_tx_reset_queue(netdev_get_tx_queue(ndev, i));
 	}
 }
 
@@ -1102,7 +1200,7 @@ fec_restart(struct net_device *ndev)
 		writel(FEC_ENET_MII, fep->hwp + FEC_IMASK);
 
 	/* Init the interrupt coalescing */
-	fec_enet_itr_coal_init(ndev);
+	fec_enet_itr_coal_set(ndev);
 
 }
 
@@ -1161,7 +1259,7 @@ fec_timeout(struct net_device *ndev)
 
 	fec_dump(ndev);
 
-	ndev->stats.tx_errors++;
+	fep->tx_timeouts++;
 
 	schedule_work(&fep->tx_timeout_work);
 }
@@ -1174,12 +1272,12 @@ static void fec_enet_timeout_work(struct work_struct *work)
 
 	rtnl_lock();
 	if (netif_device_present(ndev) || netif_running(ndev)) {
-		napi_disable(&fep->napi);
+		fec_enet_napi_disable(fep);
 		netif_tx_lock_bh(ndev);
 		fec_restart(ndev);
 		netif_wake_queue(ndev);
 		netif_tx_unlock_bh(ndev);
-		napi_enable(&fep->napi);
+		fec_enet_napi_enable(fep);
 	}
 	rtnl_unlock();
 }
@@ -1211,11 +1309,11 @@ fec_enet_tx_queue(struct net_device *ndev, u16 queue_id)
 	int	index = 0;
 	int	i, bdnum;
 	int	entries_free;
+	unsigned int pkts_compl = 0, bytes_compl = 0;
+	unsigned int pkts = 0, bytes = 0;
 
 	fep = netdev_priv(ndev);
 
-	queue_id = FEC_ENET_GET_QUQUE(queue_id);
-
 	txq = fep->tx_queue[queue_id];
 	/* get next bdp of dirty_tx */
 	nq = netdev_get_tx_queue(ndev, queue_id);
@@ -1258,21 +1356,23 @@ fec_enet_tx_queue(struct net_device *ndev, u16 queue_id)
 		if (status & (BD_ENET_TX_HB | BD_ENET_TX_LC |
 				   BD_ENET_TX_RL | BD_ENET_TX_UN |
 				   BD_ENET_TX_CSL)) {
-			ndev->stats.tx_errors++;
+			txq->stats.tx_errors++;
 			if (status & BD_ENET_TX_HB)  /* No heartbeat */
-				ndev->stats.tx_heartbeat_errors++;
+				txq->stats.tx_heartbeat_errors++;
 			if (status & BD_ENET_TX_LC)  /* Late collision */
-				ndev->stats.tx_window_errors++;
+				txq->stats.tx_window_errors++;
 			if (status & BD_ENET_TX_RL)  /* Retrans limit */
-				ndev->stats.tx_aborted_errors++;
+				txq->stats.tx_aborted_errors++;
 			if (status & BD_ENET_TX_UN)  /* Underrun */
-				ndev->stats.tx_fifo_errors++;
+				txq->stats.tx_fifo_errors++;
 			if (status & BD_ENET_TX_CSL) /* Carrier lost */
-				ndev->stats.tx_carrier_errors++;
+				txq->stats.tx_carrier_errors++;
 		} else {
-			ndev->stats.tx_packets++;
-			ndev->stats.tx_bytes += skb->len;
+			pkts++;
+			bytes += skb->len;
 		}
+		pkts_compl++;
+		bytes_compl += skb->len;
 
 		if (unlikely(skb_shinfo(skb)->tx_flags & SKBTX_IN_PROGRESS) &&
 			fep->bufdesc_ex) {
@@ -1287,7 +1387,7 @@ fec_enet_tx_queue(struct net_device *ndev, u16 queue_id)
 		 * but we eventually sent the packet OK.
 		 */
 		if (status & BD_ENET_TX_DEF)
-			ndev->stats.collisions++;
+			txq->stats.collisions++;
 
 		/* Free the sk buffer associated with this last transmit */
 		dev_kfree_skb_any(skb);
@@ -1296,10 +1396,20 @@ fec_enet_tx_queue(struct net_device *ndev, u16 queue_id)
 
 		/* Update pointer to next buffer descriptor to be transmitted */
 		bdp = fec_enet_get_nextdesc(bdp, fep, queue_id);
+	}
 
-		/* Since we have freed up a buffer, the ring is no longer full
+	if (pkts_compl) {
+		txq->stats.tx_packets += pkts;
+		txq->stats.tx_bytes += bytes;
+		netdev_tx_completed_queue(nq, pkts_compl, bytes_compl);
+		txq->itr.pkts += pkts_compl;
+		txq->itr.bytes += bytes_compl;
+
+		/* Make the freed descriptors visible before checking
+		 * whether the ring is no longer full.
 		 */
-		if (netif_queue_stopped(ndev)) {
+		smp_mb();
+		if (netif_tx_queue_stopped(nq)) {
 			entries_free = fec_enet_get_free_txdesc_num(fep, txq);
 			if (entries_free >= txq->tx_wake_threshold)
 				netif_tx_wake_queue(nq);
@@ -1312,64 +1422,186 @@ fec_enet_tx_queue(struct net_device *ndev, u16 queue_id)
 		writel(0, fep->hwp + FEC_X_DES_ACTIVE(queue_id));
 }
 
-static void
-fec_enet_tx(struct net_device *ndev)
+static inline dma_addr_t fec_enet_rx_dma(struct fec_enet_rx_buffer *rxb)
 {
-	struct fec_enet_private *fep = netdev_priv(ndev);
-	u16 queue_id;
-	/* First process class A queue, then Class B and Best Effort queue */
-	for_each_set_bit(queue_id, &fep->work_tx, FEC_ENET_MAX_TX_QS) {
-		clear_bit(queue_id, &fep->work_tx);
-		fec_enet_tx_queue(ndev, queue_id);
+	return rxb->dma + rxb->page_offset + FEC_ENET_RX_HEADROOM;
+}
+
+static bool fec_enet_alloc_rx_page(struct fec_enet_private *fep,
+				   struct fec_enet_rx_buffer *rxb, gfp_t gfp)
+{
+	struct page *page;
+	dma_addr_t dma;
+
+	page = alloc_page(gfp | __GFP_COLD);
+	if (unlikely(!page))
+		return false;
+
+	/* The whole page is mapped once, recycling only syncs what the
+	 * controller wrote.
+	 */
+	dma = dma_map_single(&fep->pdev->dev, page_address(page), PAGE_SIZE,
+			     DMA_FROM_DEVICE);
+	if (dma_mapping_error(&fep->pdev->dev, dma)) {
+		__free_page(page);
+		return false;
 	}
-	return;
+
+	rxb->page = page;
+	rxb->dma = dma;
+	rxb->page_offset = 0;
+	return true;
+}
+
+static void fec_enet_unmap_rx_page(struct fec_enet_private *fep,
+				   struct fec_enet_rx_buffer *rxb)
+{
+	DEFINE_DMA_ATTRS(attrs);
+
+	/* The other half of the page may still be in the stack with
+	 * dirty cache lines, which an invalidate would throw away.
+	 * The half we received into has already been synced.
+	 */
+	dma_set_attr(DMA_ATTR_SKIP_CPU_SYNC, &attrs);
+	dma_unmap_single_attrs(&fep->pdev->dev, rxb->dma, PAGE_SIZE,
+			       DMA_FROM_DEVICE, &attrs);
+}
+
+static void fec_enet_free_rx_page(struct fec_enet_private *fep,
+				  struct fec_enet_rx_buffer *rxb)
+{
+	fec_enet_unmap_rx_page(fep, rxb);
+	put_page(rxb->page);
+	rxb->page = NULL;
+}
+
+/* Give a buffer back to the controller after the CPU has only read
+ * len bytes of it.
+ */
+static void fec_enet_reuse_rxbdp(struct fec_enet_private *fep,
+				 struct fec_enet_rx_buffer *rxb,
+				 unsigned int len)
+{
+	dma_sync_single_range_for_device(&fep->pdev->dev, rxb->dma,
+					 rxb->page_offset + FEC_ENET_RX_HEADROOM,
+					 len, DMA_FROM_DEVICE);
 }
 
 static int
-fec_enet_new_rxbdp(struct net_device *ndev, struct bufdesc *bdp, struct sk_buff *skb)
+fec_enet_new_rxbdp(struct net_device *ndev, struct bufdesc *bdp,
+		   struct fec_enet_rx_buffer *rxb)
 {
 	struct  fec_enet_private *fep = netdev_priv(ndev);
-	int off;
-
-	off = ((unsigned long)skb->data) & fep->rx_align;
-	if (off)
-		skb_reserve(skb, fep->rx_align + 1 - off);
 
-	bdp->cbd_bufaddr = dma_map_single(&fep->pdev->dev, skb->data,
-					  FEC_ENET_RX_FRSIZE - fep->rx_align,
-					  DMA_FROM_DEVICE);
-	if (dma_mapping_error(&fep->pdev->dev, bdp->cbd_bufaddr)) {
+	if (!fec_enet_alloc_rx_page(fep, rxb, GFP_KERNEL)) {
 		if (net_ratelimit())
 			netdev_err(ndev, "Rx DMA memory map failed\n");
 		return -ENOMEM;
 	}
 
+	bdp->cbd_bufaddr = fec_enet_rx_dma(rxb);
 	return 0;
 }
 
-static bool fec_enet_copybreak(struct net_device *ndev, struct sk_buff **skb,
-			       struct bufdesc *bdp, u32 length, bool swap)
+/* Build an skb around the half page the frame was received into and
+ * point the descriptor at a fresh buffer. If the stack has released
+ * the other half of the page, that half is used, so the page never
+ * leaves the ring or its DMA mapping. Returns NULL, with the buffer
+ * left in place, if no skb or replacement page could be had.
+ */
+static struct sk_buff *
+fec_enet_rx_build_skb(struct fec_enet_private *fep,
+		      struct fec_enet_rx_buffer *rxb, struct bufdesc *bdp)
+{
+	struct fec_enet_rx_buffer new_rxb;
+	struct page *page = rxb->page;
+	struct sk_buff *skb;
+	bool reuse;
+
+	reuse = page_count(page) == 1 && !page->pfmemalloc &&
+		page_to_nid(page) == numa_node_id();
+	if (!reuse && !fec_enet_alloc_rx_page(fep, &new_rxb, GFP_ATOMIC))
+		return NULL;
+
+	skb = build_skb(page_address(page) + rxb->page_offset,
+			FEC_ENET_RX_FRSIZE);
+	if (unlikely(!skb)) {
+		if (!reuse)
+			fec_enet_free_rx_page(fep, &new_rxb);
+		return NULL;
+	}
+	skb_reserve(skb, FEC_ENET_RX_HEADROOM);
+
+	if (reuse) {
+		/* The skb inherits the ring's reference, take another
+		 * one for the half going back to the controller.
+		 */
+		get_page(page);
+		rxb->page_offset ^= FEC_ENET_RX_FRSIZE;
+		fec_enet_reuse_rxbdp(fep, rxb, PKT_MAXBLR_SIZE);
+	} else {
+		fec_enet_unmap_rx_page(fep, rxb);
+		*rxb = new_rxb;
+	}
+	bdp->cbd_bufaddr = fec_enet_rx_dma(rxb);
+
+	return skb;
+}
+
+static struct sk_buff *fec_enet_copybreak(struct net_device *ndev, void *data,
+					  u32 length, bool swap)
 {
 	struct  fec_enet_private *fep = netdev_priv(ndev);
 	struct sk_buff *new_skb;
 
 	if (length > fep->rx_copybreak)
-		return false;
+		return NULL;
 
 	new_skb = netdev_alloc_skb(ndev, length);
 	if (!new_skb)
-		return false;
+		return NULL;
 
-	dma_sync_single_for_cpu(&fep->pdev->dev, bdp->cbd_bufaddr,
-				FEC_ENET_RX_FRSIZE - fep->rx_align,
-				DMA_FROM_DEVICE);
 	if (!swap)
-		memcpy(new_skb->data, (*skb)->data, length);
+		memcpy(new_skb->data, data, length);
 	else
-		swap_buffer2(new_skb->data, (*skb)->data, length);
-	*skb = new_skb;
+		swap_buffer2(new_skb->data, data, length);
 
-	return true;
+	return new_skb;
+}
+
+/* Run the early RX filter on a frame that is still in its DMA buffer.
+ * The BPF interpreter and JIT want an skb, they get one on the stack
+ * that only describes the buffer. Returns false if the frame is to be
+ * dropped.
+ */
+static bool fec_enet_rx_filter(struct net_device *ndev,
+			       struct fec_enet_priv_rx_q *rxq,
+			       const struct sk_filter *filter,
+			       void *data, unsigned int len)
+{
+	struct sk_buff skb;
+
+	memset(&skb, 0, offsetof(struct sk_buff, tail));
+	skb.dev = ndev;
+	skb.queue_mapping = rxq->index;
+	skb.head = data;
+	skb.data = data;
+	skb.len = len;
+	skb_reset_tail_pointer(&skb);
+	skb_set_tail_pointer(&skb, len);
+	skb.end = skb.tail;
+	skb_reset_mac_header(&skb);
+	skb_set_network_header(&skb, ETH_HLEN);
+	if (len >= ETH_HLEN)
+		skb.protocol = ((struct ethhdr *)data)->h_proto;
+
+	if (SK_RUN_FILTER(filter, &skb)) {
+		rxq->filter_pass++;
+		return true;
+	}
+
+	rxq->filter_drop++;
+	return false;
 }
 
 /* During a receive, the cur_rx points to the current incoming buffer.
@@ -1388,11 +1620,13 @@ fec_enet_rx_queue(struct net_device *ndev, int budget, u16 queue_id)
 	struct fec_enet_priv_rx_q *rxq;
 	struct bufdesc *bdp;
 	unsigned short status;
-	struct  sk_buff *skb_new = NULL;
+	struct fec_enet_rx_buffer *rxb;
+	struct sk_filter *filter;
 	struct  sk_buff *skb;
 	ushort	pkt_len;
 	__u8 *data;
 	int	pkt_received = 0;
+	unsigned int rx_bytes = 0;
 	struct	bufdesc_ex *ebdp = NULL;
 	bool	vlan_packet_rcvd = false;
 	u16	vlan_tag;
@@ -1403,9 +1637,11 @@ fec_enet_rx_queue(struct net_device *ndev, int budget, u16 queue_id)
 #ifdef CONFIG_M532x
 	flush_cache_all();
 #endif
-	queue_id = FEC_ENET_GET_QUQUE(queue_id);
 	rxq = fep->rx_queue[queue_id];
 
+	rcu_read_lock();
+	filter = rcu_dereference(fep->rx_filter);
+
 	/* First, grab all of the stats for the incoming packet.
 	 * These get messed up if we get called due to a busy condition.
 	 */
@@ -1429,19 +1665,19 @@ fec_enet_rx_queue(struct net_device *ndev, int budget, u16 queue_id)
 			   BD_ENET_RX_CR | BD_ENET_RX_OV)) {
 		// if (status & (BD_ENET_RX_LG | BD_ENET_RX_SH  |
 		// 	   BD_ENET_RX_CR | BD_ENET_RX_OV)) {
-			ndev->stats.rx_errors++;
+			rxq->stats.rx_errors++;
 			if (status & (BD_ENET_RX_LG | BD_ENET_RX_SH)) {
 				/* Frame too long or too short. */
-				ndev->stats.rx_length_errors++;
+				rxq->stats.rx_length_errors++;
 			}
 			if (status & BD_ENET_RX_NO)	/* Frame alignment */
 			{
-				ndev->stats.rx_frame_errors++;
+				rxq->stats.rx_frame_errors++;
 			}
 			if (status & BD_ENET_RX_CR)	/* CRC Error */
-				ndev->stats.rx_crc_errors++;
+				rxq->stats.rx_crc_errors++;
 			if (status & BD_ENET_RX_OV)	/* FIFO overrun */
-				ndev->stats.rx_fifo_errors++;
+				rxq->stats.rx_fifo_errors++;
 		}
 
 		/* Report late collisions as a frame error.
@@ -1449,40 +1685,53 @@ fec_enet_rx_queue(struct net_device *ndev, int budget, u16 queue_id)
 		 * have in the buffer.  So, just drop this frame on the floor.
 		 */
 		if (status & BD_ENET_RX_CL) {
-			ndev->stats.rx_errors++;
-			ndev->stats.rx_frame_errors++;
+			rxq->stats.rx_errors++;
+			rxq->stats.rx_frame_errors++;
 
 			goto rx_processing_done;
 		}
 
 		/* Process the incoming frame. */
-
-		ndev->stats.rx_packets++;
 		pkt_len = bdp->cbd_datlen;
-		ndev->stats.rx_bytes += pkt_len;
+		rx_bytes += pkt_len;
 
 		index = fec_enet_get_bd_index(rxq->rx_bd_base, bdp, fep);
-		skb = rxq->rx_skbuff[index];
+		rxb = &rxq->rx_buf[index];
+		data = page_address(rxb->page) + rxb->page_offset +
+		       FEC_ENET_RX_HEADROOM;
+
+		/* Only the bytes the controller wrote go back to the CPU */
+		dma_sync_single_range_for_cpu(&fep->pdev->dev, rxb->dma,
+					      rxb->page_offset +
+					      FEC_ENET_RX_HEADROOM,
+					      pkt_len, DMA_FROM_DEVICE);
+		prefetch(data);
+
+		/* Junk is dropped before it costs an skb */
+		if (filter && !fec_enet_rx_filter(ndev, rxq, filter, data,
+						  pkt_len - 4)) {
+			fec_enet_reuse_rxbdp(fep, rxb, pkt_len);
+			goto rx_processing_done;
+		}
 
+		rxq->stats.rx_packets++;
+		rxq->stats.rx_bytes += pkt_len;
 
 		/* The packet length includes FCS, but we don't want to
 		 * include that when passing upstream as it messes up
 		 * bridging applications.
 		 */
-		is_copybreak = fec_enet_copybreak(ndev, &skb, bdp, pkt_len - 4,
-						  need_swap);
+		skb = fec_enet_copybreak(ndev, data, pkt_len - 4, need_swap);
+		is_copybreak = skb != NULL;
 		if (!is_copybreak) {
-			skb_new = netdev_alloc_skb(ndev, FEC_ENET_RX_FRSIZE);
-			if (unlikely(!skb_new)) {
-				ndev->stats.rx_dropped++;
+			skb = fec_enet_rx_build_skb(fep, rxb, bdp);
+			if (unlikely(!skb)) {
+				rxq->stats.rx_dropped++;
+				fec_enet_reuse_rxbdp(fep, rxb, pkt_len);
 				goto rx_processing_done;
 			}
-			dma_unmap_single(&fep->pdev->dev, bdp->cbd_bufaddr,
-					 FEC_ENET_RX_FRSIZE - fep->rx_align,
-					 DMA_FROM_DEVICE);
 		}
 
-		prefetch(skb->data - NET_IP_ALIGN);
 		skb_put(skb, pkt_len - 4);
 		data = skb->data;
 		if (!is_copybreak && need_swap)
@@ -1532,16 +1781,11 @@ fec_enet_rx_queue(struct net_device *ndev, int budget, u16 queue_id)
 					       htons(ETH_P_8021Q),
 					       vlan_tag);
 
-		napi_gro_receive(&fep->napi, skb);
+		skb_record_rx_queue(skb, queue_id);
+		napi_gro_receive(&rxq->napi, skb);
 
-		if (is_copybreak) {
-			dma_sync_single_for_device(&fep->pdev->dev, bdp->cbd_bufaddr,
-						   FEC_ENET_RX_FRSIZE - fep->rx_align,
-						   DMA_FROM_DEVICE);
-		} else {
-			rxq->rx_skbuff[index] = skb_new;
-			fec_enet_new_rxbdp(ndev, bdp, skb_new);
-		}
+		if (is_copybreak)
+			fec_enet_reuse_rxbdp(fep, rxb, pkt_len);
 
 rx_processing_done:
 		/* Clear the status flags for this buffer */
@@ -1568,67 +1812,42 @@ rx_processing_done:
 		 */
 		writel(0, fep->hwp + FEC_R_DES_ACTIVE(queue_id));
 	}
-	rxq->cur_rx = bdp;
-	return pkt_received;
-}
-
-static int
-fec_enet_rx(struct net_device *ndev, int budget)
-{
-	int     pkt_received = 0;
-	u16	queue_id;
-	struct fec_enet_private *fep = netdev_priv(ndev);
+	rcu_read_unlock();
 
-	for_each_set_bit(queue_id, &fep->work_rx, FEC_ENET_MAX_RX_QS) {
-		clear_bit(queue_id, &fep->work_rx);
-		pkt_received += fec_enet_rx_queue(ndev,
-					budget - pkt_received, queue_id);
-	}
+	rxq->cur_rx = bdp;
+	rxq->itr.pkts += pkt_received;
+	rxq->itr.bytes += rx_bytes;
 	return pkt_received;
 }
 
-static bool
-fec_enet_collect_events(struct fec_enet_private *fep, uint int_events)
-{
-	if (int_events == 0)
-		return false;
-
-	if (int_events & FEC_ENET_RXF)
-		fep->work_rx |= (1 << 2);
-	if (int_events & FEC_ENET_RXF_1)
-		fep->work_rx |= (1 << 0);
-	if (int_events & FEC_ENET_RXF_2)
-		fep->work_rx |= (1 << 1);
-
-	if (int_events & FEC_ENET_TXF)
-		fep->work_tx |= (1 << 2);
-	if (int_events & FEC_ENET_TXF_1)
-		fep->work_tx |= (1 << 0);
-	if (int_events & FEC_ENET_TXF_2)
-		fep->work_tx |= (1 << 1);
-
-	return true;
-}
-
 static irqreturn_t
 fec_enet_interrupt(int irq, void *dev_id)
 {
 	struct net_device *ndev = dev_id;
 	struct fec_enet_private *fep = netdev_priv(ndev);
+	struct fec_enet_priv_rx_q *rxq;
 	uint int_events;
 	irqreturn_t ret = IRQ_NONE;
+	int i;
 
 	int_events = readl(fep->hwp + FEC_IEVENT);
+	for (i = 0; i < FEC_IRQ_NUM; i++)
+		if (fep->irq[i] == irq) {
+			int_events &= fep->irq_events[i];
+			break;
+		}
 	writel(int_events, fep->hwp + FEC_IEVENT);
-	fec_enet_collect_events(fep, int_events);
 
-	if ((fep->work_tx || fep->work_rx) && fep->link) {
-		ret = IRQ_HANDLED;
+	for (i = 0; i < fep->num_rx_queues; i++) {
+		rxq = fep->rx_queue[i];
+		if (!(int_events & rxq->napi_events))
+			continue;
 
-		if (napi_schedule_prep(&fep->napi)) {
-			/* Disable the NAPI interrupts */
-			writel(FEC_ENET_MII, fep->hwp + FEC_IMASK);
-			__napi_schedule(&fep->napi);
+		ret = IRQ_HANDLED;
+		if (fep->link && napi_schedule_prep(&rxq->napi)) {
+			/* Disable the NAPI interrupts of these rings */
+			fec_enet_imask_update(fep, rxq->napi_events, 0);
+			__napi_schedule(&rxq->napi);
 		}
 	}
 
@@ -1647,15 +1866,19 @@ static int fec_enet_rx_napi(struct napi_struct *napi, int budget)
 {
 	struct net_device *ndev = napi->dev;
 	struct fec_enet_private *fep = netdev_priv(ndev);
-	int pkts;
+	struct fec_enet_priv_rx_q *rxq;
+	int pkts, i;
 
-	pkts = fec_enet_rx(ndev, budget);
+	rxq = container_of(napi, struct fec_enet_priv_rx_q, napi);
+	pkts = fec_enet_rx_queue(ndev, budget, rxq->index);
 
-	fec_enet_tx(ndev);
+	for (i = rxq->index; i < fep->num_tx_queues; i += fep->num_rx_queues)
+		fec_enet_tx_queue(ndev, i);
 
 	if (pkts < budget) {
 		napi_complete(napi);
-		writel(FEC_DEFAULT_IMASK, fep->hwp + FEC_IMASK);
+		fec_enet_itr_update(ndev, rxq->index);
+		fec_enet_imask_update(fep, 0, rxq->napi_events);
 	}
 	return pkts;
 }
@@ -1777,20 +2000,20 @@ static void fec_enet_adjust_link(struct net_device *ndev)
 
 		/* if any of the above changed restart the FEC */
 		if (status_change) {
-			napi_disable(&fep->napi);
+			fec_enet_napi_disable(fep);
 			netif_tx_lock_bh(ndev);
 			fec_restart(ndev);
 			netif_wake_queue(ndev);
 			netif_tx_unlock_bh(ndev);
-			napi_enable(&fep->napi);
+			fec_enet_napi_enable(fep);
 		}
 	} else {
 		if (fep->link) {
-			napi_disable(&fep->napi);
+			fec_enet_napi_disable(fep);
 			netif_tx_lock_bh(ndev);
 			fec_stop(ndev);
 			netif_tx_unlock_bh(ndev);
-			napi_enable(&fep->napi);
+			fec_enet_napi_enable(fep);
 			fep->link = phy_dev->link;
 			status_change = 1;
 		}
@@ -2304,12 +2527,12 @@ static int fec_enet_set_pauseparam(struct net_device *ndev,
 		phy_start_aneg(fep->phy_dev);
 	}
 	if (netif_running(ndev)) {
-		napi_disable(&fep->napi);
+		fec_enet_napi_disable(fep);
 		netif_tx_lock_bh(ndev);
 		fec_restart(ndev);
 		netif_wake_queue(ndev);
 		netif_tx_unlock_bh(ndev);
-		napi_enable(&fep->napi);
+		fec_enet_napi_enable(fep);
 	}
 
 	return 0;
@@ -2381,14 +2604,28 @@ static const struct fec_stat {
 	{ "IEEE_rx_octets_ok", IEEE_R_OCTETS_OK },
 };
 
+/* Software counters reported after the hardware ones */
+static const char fec_sw_stats[][ETH_GSTRING_LEN] = {
+	"rx_filter_pass",
+	"rx_filter_drop",
+};
+
 static void fec_enet_get_ethtool_stats(struct net_device *dev,
 	struct ethtool_stats *stats, u64 *data)
 {
 	struct fec_enet_private *fep = netdev_priv(dev);
+	u64 pass = 0, drop = 0;
 	int i;
 
 	for (i = 0; i < ARRAY_SIZE(fec_stats); i++)
 		data[i] = readl(fep->hwp + fec_stats[i].offset);
+
+	for (i = 0; i < fep->num_rx_queues; i++) {
+		pass += fep->rx_queue[i]->filter_pass;
+		drop += fep->rx_queue[i]->filter_drop;
+	}
+	data[ARRAY_SIZE(fec_stats)] = pass;
+	data[ARRAY_SIZE(fec_stats) + 1] = drop;
 }
 
 static void fec_enet_get_strings(struct net_device *netdev,
@@ -2400,6 +2637,8 @@ static void fec_enet_get_strings(struct net_device *netdev,
 		for (i = 0; i < ARRAY_SIZE(fec_stats); i++)
 			memcpy(data + i * ETH_GSTRING_LEN,
 				fec_stats[i].name, ETH_GSTRING_LEN);
+		memcpy(data + i * ETH_GSTRING_LEN, fec_sw_stats,
+		       sizeof(fec_sw_stats));
 		break;
 	}
 }
@@ -2408,7 +2647,7 @@ static int fec_enet_get_sset_count(struct net_device *dev, int sset)
 {
 	switch (sset) {
 	case ETH_SS_STATS:
-		return ARRAY_SIZE(fec_stats);
+		return ARRAY_SIZE(fec_stats) + ARRAY_SIZE(fec_sw_stats);
 	default:
 		return -EOPNOTSUPP;
 	}
@@ -2437,41 +2676,134 @@ static int fec_enet_us_to_itr_clock(struct net_device *ndev, int us)
 	return us * (fep->itr_clk_rate / 64000) / 1000;
 }
 
+static u32 fec_enet_itr_val(struct net_device *ndev, unsigned int pkts,
+			    unsigned int usecs)
+{
+	/* Must be greater than zero to avoid unpredictable behavior */
+	if (!pkts || !usecs)
+		return 0;
+
+	/* Select enet system clock as Interrupt Coalescing
+	 * timer Clock Source, and set ICFT and ICTT
+	 */
+	return FEC_ITR_EN | FEC_ITR_CLK_SEL | FEC_ITR_ICFT(pkts) |
+	       FEC_ITR_ICTT(fec_enet_us_to_itr_clock(ndev, usecs));
+}
+
+/* Coalescing used at each adaptive moderation level. The lowest level
+ * leaves coalescing off, sparse traffic gets one interrupt per frame.
+ */
+static const struct {
+	unsigned int pkts;
+	unsigned int usecs;
+} fec_itr_profile[] = {
+	[FEC_ITR_LOWEST_LATENCY]	= { 0, 0 },
+	[FEC_ITR_LOW_LATENCY]		= { 8, 50 },
+	[FEC_ITR_BULK]			= { 64, 250 },
+};
+
+/* Per NAPI cycle traffic that selects a level */
+#define FEC_ITR_LATENCY_PKTS	2
+#define FEC_ITR_LATENCY_BYTES	1024
+#define FEC_ITR_BULK_PKTS	32
+#define FEC_ITR_BULK_BYTES	(16 * ETH_FRAME_LEN)
+
+static u32 fec_enet_itr_level_val(struct net_device *ndev, u8 level)
+{
+	return fec_enet_itr_val(ndev, fec_itr_profile[level].pkts,
+				fec_itr_profile[level].usecs);
+}
+
 /* Set threshold for interrupt coalescing */
 static void fec_enet_itr_coal_set(struct net_device *ndev)
 {
 	struct fec_enet_private *fep = netdev_priv(ndev);
-	int rx_itr, tx_itr;
+	u32 rx_itr, tx_itr;
+	int i;
 
 	if (!(fep->quirks & FEC_QUIRK_HAS_AVB))
 		return;
 
-	/* Must be greater than zero to avoid unpredictable behavior */
-	if (!fep->rx_time_itr || !fep->rx_pkts_itr ||
-	    !fep->tx_time_itr || !fep->tx_pkts_itr)
-		return;
+	rx_itr = fec_enet_itr_val(ndev, fep->rx_pkts_itr, fep->rx_time_itr);
+	tx_itr = fec_enet_itr_val(ndev, fep->tx_pkts_itr, fep->tx_time_itr);
 
-	/* Select enet system clock as Interrupt Coalescing
-	 * timer Clock Source
-	 */
-	rx_itr = FEC_ITR_CLK_SEL;
-	tx_itr = FEC_ITR_CLK_SEL;
+	for (i = 0; i < fep->num_tx_queues; i++) {
+		if (fep->tx_itr_adaptive)
+			tx_itr = fec_enet_itr_level_val(ndev,
+					fep->tx_queue[i]->itr.level);
+		writel(tx_itr, fep->hwp + FEC_TXIC(i));
+	}
+
+	for (i = 0; i < fep->num_rx_queues; i++) {
+		if (fep->rx_itr_adaptive)
+			rx_itr = fec_enet_itr_level_val(ndev,
+					fep->rx_queue[i]->itr.level);
+		writel(rx_itr, fep->hwp + FEC_RXIC(i));
+	}
+}
+
+/* Pick the moderation level for the traffic a ring saw during the last
+ * NAPI cycle. Falling back to a lower latency level happens at once so
+ * the first frames after a burst are not held back, moving towards bulk
+ * only goes one level per cycle.
+ */
+static u8 fec_enet_itr_next_level(struct fec_enet_itr *itr)
+{
+	u8 target;
+
+	if (itr->pkts <= FEC_ITR_LATENCY_PKTS &&
+	    itr->bytes < FEC_ITR_LATENCY_BYTES)
+		target = FEC_ITR_LOWEST_LATENCY;
+	else if (itr->pkts >= FEC_ITR_BULK_PKTS ||
+		 itr->bytes >= FEC_ITR_BULK_BYTES)
+		target = FEC_ITR_BULK;
+	else
+		target = FEC_ITR_LOW_LATENCY;
+
+	itr->pkts = 0;
+	itr->bytes = 0;
 
-	/* set ICFT and ICTT */
-	rx_itr |= FEC_ITR_ICFT(fep->rx_pkts_itr);
-	rx_itr |= FEC_ITR_ICTT(fec_enet_us_to_itr_clock(ndev, fep->rx_time_itr));
-	tx_itr |= FEC_ITR_ICFT(fep->tx_pkts_itr);
-	tx_itr |= FEC_ITR_ICTT(fec_enet_us_to_itr_clock(ndev, fep->tx_time_itr));
+	if (target > itr->level)
+		return itr->level + 1;
+	return target;
+}
+
+/* Retune the coalescing of the adaptive rings polled by one NAPI
+ * context. Called at the end of its cycle, before the interrupts are
+ * unmasked again.
+ */
+static void fec_enet_itr_update(struct net_device *ndev, int queue)
+{
+	struct fec_enet_private *fep = netdev_priv(ndev);
+	struct fec_enet_itr *itr;
+	u8 level;
+	int i;
 
-	rx_itr |= FEC_ITR_EN;
-	tx_itr |= FEC_ITR_EN;
+	if (!(fep->quirks & FEC_QUIRK_HAS_AVB))
+		return;
+
+	if (fep->rx_itr_adaptive) {
+		itr = &fep->rx_queue[queue]->itr;
+		level = fec_enet_itr_next_level(itr);
+		if (level != itr->level) {
+			itr->level = level;
+			writel(fec_enet_itr_level_val(ndev, level),
+			       fep->hwp + FEC_RXIC(queue));
+		}
+	}
 
-	writel(tx_itr, fep->hwp + FEC_TXIC0);
-	writel(rx_itr, fep->hwp + FEC_RXIC0);
-	writel(tx_itr, fep->hwp + FEC_TXIC1);
-	writel(rx_itr, fep->hwp + FEC_RXIC1);
-	writel(tx_itr, fep->hwp + FEC_TXIC2);
-	writel(rx_itr, fep->hwp + FEC_RXIC2);
+	if (fep->tx_itr_adaptive) {
+		for (i = queue; i < fep->num_tx_queues;
+		     i += fep->num_rx_queues) {
+			itr = &fep->tx_queue[i]->itr;
+			level = fec_enet_itr_next_level(itr);
+			if (level == itr->level)
+				continue;
+			itr->level = level;
+			writel(fec_enet_itr_level_val(ndev, level),
+			       fep->hwp + FEC_TXIC(i));
+		}
+	}
 }
 
 static int
@@ -2488,6 +2820,9 @@ fec_enet_get_coalesce(struct net_device *ndev, struct ethtool_coalesce *ec)
 	ec->tx_coalesce_usecs = fep->tx_time_itr;
 	ec->tx_max_coalesced_frames = fep->tx_pkts_itr;
 
+	ec->use_adaptive_rx_coalesce = fep->rx_itr_adaptive;
+	ec->use_adaptive_tx_coalesce = fep->tx_itr_adaptive;
+
 	return 0;
 }
 
@@ -2510,15 +2845,15 @@ fec_enet_set_coalesce(struct net_device *ndev, struct ethtool_coalesce *ec)
 		return -EINVAL;
 	}
 
-	cycle = fec_enet_us_to_itr_clock(ndev, fep->rx_time_itr);
+	cycle = fec_enet_us_to_itr_clock(ndev, ec->rx_coalesce_usecs);
 	if (cycle > 0xFFFF) {
 		pr_err("Rx coalesed usec exceeed hardware limiation");
 		return -EINVAL;
 	}
 
-	cycle = fec_enet_us_to_itr_clock(ndev, fep->tx_time_itr);
+	cycle = fec_enet_us_to_itr_clock(ndev, ec->tx_coalesce_usecs);
 	if (cycle > 0xFFFF) {
-		pr_err("Rx coalesed usec exceeed hardware limiation");
+		pr_err("Tx coalesed usec exceeed hardware limiation");
 		return -EINVAL;
 	}
 
@@ -2528,22 +2863,24 @@ fec_enet_set_coalesce(struct net_device *ndev, struct ethtool_coalesce *ec)
 	fep->tx_time_itr = ec->tx_coalesce_usecs;
 	fep->tx_pkts_itr = ec->tx_max_coalesced_frames;
 
-	fec_enet_itr_coal_set(ndev);
+	fep->rx_itr_adaptive = !!ec->use_adaptive_rx_coalesce;
+	fep->tx_itr_adaptive = !!ec->use_adaptive_tx_coalesce;
+
+	if (netif_running(ndev))
+		fec_enet_itr_coal_set(ndev);
 
 	return 0;
 }
 
 static void fec_enet_itr_coal_init(struct net_device *ndev)
 {
-	struct ethtool_coalesce ec;
-
-	ec.rx_coalesce_usecs = FEC_ITR_ICTT_DEFAULT;
-	ec.rx_max_coalesced_frames = FEC_ITR_ICFT_DEFAULT;
+	struct fec_enet_private *fep = netdev_priv(ndev);
 
-	ec.tx_coalesce_usecs = FEC_ITR_ICTT_DEFAULT;
-	ec.tx_max_coalesced_frames = FEC_ITR_ICFT_DEFAULT;
+	fep->rx_time_itr = FEC_ITR_ICTT_DEFAULT;
+	fep->rx_pkts_itr = FEC_ITR_ICFT_DEFAULT;
 
-	fec_enet_set_coalesce(ndev, &ec);
+	fep->tx_time_itr = FEC_ITR_ICTT_DEFAULT;
+	fep->tx_pkts_itr = FEC_ITR_ICFT_DEFAULT;
 }
 
 static int fec_enet_get_tunable(struct net_device *netdev,
@@ -2622,6 +2959,138 @@ fec_enet_set_wol(struct net_device *ndev, struct ethtool_wolinfo *wol)
 	return 0;
 }
 
+/* RX classification is exposed as one ethtool rule per VLAN priority:
+ * the rule location is the priority, it matches the PCP bits of the
+ * tag and steers to ring 1 or 2. Frames of priorities without a rule
+ * go to ring 0.
+ */
+static bool fec_enet_rx_class_supported(struct fec_enet_private *fep)
+{
+	return (fep->quirks & FEC_QUIRK_HAS_AVB) && fep->num_rx_queues > 1;
+}
+
+static int fec_enet_get_rxnfc(struct net_device *ndev,
+			      struct ethtool_rxnfc *cmd, u32 *rule_locs)
+{
+	struct fec_enet_private *fep = netdev_priv(ndev);
+	struct ethtool_rx_flow_spec *fs = &cmd->fs;
+	u32 loc = fs->location;
+	int pcp, n = 0;
+
+	if (!fec_enet_rx_class_supported(fep))
+		return -EOPNOTSUPP;
+
+	switch (cmd->cmd) {
+	case ETHTOOL_GRXRINGS:
+		cmd->data = fep->num_rx_queues;
+		return 0;
+	case ETHTOOL_GRXCLSRLCNT:
+	case ETHTOOL_GRXCLSRLALL:
+		for (pcp = 0; pcp < ARRAY_SIZE(fep->pcp_rx_queue); pcp++) {
+			if (!fep->pcp_rx_queue[pcp])
+				continue;
+			if (cmd->cmd == ETHTOOL_GRXCLSRLALL) {
+				if (n == cmd->rule_cnt)
+					return -EMSGSIZE;
+				rule_locs[n] = pcp;
+			}
+			n++;
+		}
+		cmd->rule_cnt = n;
+		cmd->data = ARRAY_SIZE(fep->pcp_rx_queue);
+		if (cmd->cmd == ETHTOOL_GRXCLSRLCNT)
+			cmd->data |= RX_CLS_LOC_SPECIAL;
+		return 0;
+	case ETHTOOL_GRXCLSRULE:
+		if (loc >= ARRAY_SIZE(fep->pcp_rx_queue) ||
+		    !fep->pcp_rx_queue[loc])
+			return -ENOENT;
+
+		memset(fs, 0, sizeof(*fs));
+		fs->flow_type = ETHER_FLOW | FLOW_EXT;
+		fs->h_ext.vlan_tci = htons(loc << VLAN_PRIO_SHIFT);
+		fs->m_ext.vlan_tci = htons(VLAN_PRIO_MASK);
+		fs->ring_cookie = fep->pcp_rx_queue[loc];
+		fs->location = loc;
+		return 0;
+	default:
+		return -EOPNOTSUPP;
+	}
+}
+
+static int fec_enet_add_rx_class(struct fec_enet_private *fep,
+				 struct ethtool_rx_flow_spec *fs)
+{
+	struct ethtool_flow_ext ext_mask;
+	unsigned int pcp, i, n = 0;
+
+	memset(&ext_mask, 0, sizeof(ext_mask));
+	ext_mask.vlan_tci = htons(VLAN_PRIO_MASK);
+
+	/* The controller only compares the priority of the VLAN tag */
+	if (fs->flow_type != (ETHER_FLOW | FLOW_EXT) ||
+	    memchr_inv(&fs->m_u, 0, sizeof(fs->m_u)) ||
+	    memcmp(&fs->m_ext, &ext_mask, sizeof(ext_mask)))
+		return -EINVAL;
+
+	if (fs->ring_cookie >= fep->num_rx_queues)
+		return -EINVAL;
+
+	pcp = ntohs(fs->h_ext.vlan_tci) >> VLAN_PRIO_SHIFT;
+	if (fs->location & RX_CLS_LOC_SPECIAL) {
+		if (fs->location != RX_CLS_LOC_ANY &&
+		    fs->location != RX_CLS_LOC_FIRST &&
+		    fs->location != RX_CLS_LOC_LAST)
+			return -EINVAL;
+		fs->location = pcp;
+	} else if (fs->location != pcp) {
+		return -EINVAL;
+	}
+
+	if (fs->ring_cookie) {
+		for (i = 0; i < ARRAY_SIZE(fep->pcp_rx_queue); i++)
+			if (i != pcp &&
+			    fep->pcp_rx_queue[i] == fs->ring_cookie)
+				n++;
+		if (n >= RCMR_CMP_NUM)
+			return -ENOSPC;
+	}
+
+	fep->pcp_rx_queue[pcp] = fs->ring_cookie;
+	return 0;
+}
+
+static int fec_enet_set_rxnfc(struct net_device *ndev,
+			      struct ethtool_rxnfc *cmd)
+{
+	struct fec_enet_private *fep = netdev_priv(ndev);
+	int ret, i;
+
+	if (!fec_enet_rx_class_supported(fep))
+		return -EOPNOTSUPP;
+
+	switch (cmd->cmd) {
+	case ETHTOOL_SRXCLSRLINS:
+		ret = fec_enet_add_rx_class(fep, &cmd->fs);
+		break;
+	case ETHTOOL_SRXCLSRLDEL:
+		if (cmd->fs.location >= ARRAY_SIZE(fep->pcp_rx_queue) ||
+		    !fep->pcp_rx_queue[cmd->fs.location])
+			return -ENOENT;
+		fep->pcp_rx_queue[cmd->fs.location] = 0;
+		ret = 0;
+		break;
+	default:
+		return -EOPNOTSUPP;
+	}
+
+	if (!ret && netif_running(ndev))
+		for (i = 1; i < fep->num_rx_queues; i++)
+			fec_enet_rx_class_set(fep, i);
+
+	return ret;
+}
+
 static const struct ethtool_ops fec_enet_ethtool_ops = {
 	.get_settings		= fec_enet_get_settings,
 	.set_settings		= fec_enet_set_settings,
@@ -2642,13 +3111,61 @@ static const struct ethtool_ops fec_enet_ethtool_ops = {
 	.set_tunable		= fec_enet_set_tunable,
 	.get_wol		= fec_enet_get_wol,
 	.set_wol		= fec_enet_set_wol,
+	.get_rxnfc		= fec_enet_get_rxnfc,
+	.set_rxnfc		= fec_enet_set_rxnfc,
 };
 
+static int fec_enet_set_rx_filter(struct net_device *ndev, struct ifreq *rq)
+{
+	struct fec_enet_private *fep = netdev_priv(ndev);
+	struct sk_filter *filter = NULL, *old;
+	struct sock_filter *insns;
+	struct sock_fprog fprog;
+	int ret;
+
+	/* Private ioctls reach the driver without any permission check */
+	if (!ns_capable(dev_net(ndev)->user_ns, CAP_NET_ADMIN))
+		return -EPERM;
+
+	/* The program would see the frame before it is swapped */
+	if (fep->quirks & FEC_QUIRK_SWAP_FRAME)
+		return -EOPNOTSUPP;
+
+	if (copy_from_user(&fprog, rq->ifr_data, sizeof(fprog)))
+		return -EFAULT;
+
+	if (fprog.len) {
+		if (fprog.len > BPF_MAXINSNS)
+			return -EINVAL;
+
+		insns = memdup_user(fprog.filter,
+				    fprog.len * sizeof(*insns));
+		if (IS_ERR(insns))
+			return PTR_ERR(insns);
+
+		fprog.filter = insns;
+		ret = sk_unattached_filter_create(&filter, &fprog);
+		kfree(insns);
+		if (ret)
+			return ret;
+	}
+
+	old = rtnl_dereference(fep->rx_filter);
+	rcu_assign_pointer(fep->rx_filter, filter);
+	if (old)
+		sk_unattached_filter_destroy(old);
+
+	return 0;
+}
+
 static int fec_enet_ioctl(struct net_device *ndev, struct ifreq *rq, int cmd)
 {
 	struct fec_enet_private *fep = netdev_priv(ndev);
 	struct phy_device *phydev = fep->phy_dev;
 
+	if (cmd == SIOCSFECRXFILTER)
+		return fec_enet_set_rx_filter(ndev, rq);
+
 	if (!netif_running(ndev))
 		return -EINVAL;
 
@@ -2679,15 +3196,9 @@ static void fec_enet_free_buffers(struct net_device *ndev)
 		rxq = fep->rx_queue[q];
 		bdp = rxq->rx_bd_base;
 		for (i = 0; i < rxq->rx_ring_size; i++) {
-			skb = rxq->rx_skbuff[i];
-			rxq->rx_skbuff[i] = NULL;
-			if (skb) {
-				dma_unmap_single(&fep->pdev->dev,
-						 bdp->cbd_bufaddr,
-						 FEC_ENET_RX_FRSIZE - fep->rx_align,
-						 DMA_FROM_DEVICE);
-				dev_kfree_skb(skb);
-			}
+			if (rxq->rx_buf[i].page)
+				fec_enet_free_rx_page(fep, &rxq->rx_buf[i]);
+			bdp->cbd_bufaddr = 0;
 			bdp = fec_enet_get_nextdesc(bdp, fep, q);
 		}
 	}
@@ -2784,23 +3295,20 @@ fec_enet_alloc_rxq_buffers(struct net_device *ndev, unsigned int queue)
 {
 	struct fec_enet_private *fep = netdev_priv(ndev);
 	unsigned int i;
-	struct sk_buff *skb;
 	struct bufdesc	*bdp;
 	struct fec_enet_priv_rx_q *rxq;
 
+	/* Frame and skb_shared_info must both fit in half a page */
+	BUILD_BUG_ON(FEC_ENET_RX_HEADROOM + PKT_MAXBLR_SIZE +
+		     SKB_DATA_ALIGN(sizeof(struct skb_shared_info)) >
+		     FEC_ENET_RX_FRSIZE);
+
 	rxq = fep->rx_queue[queue];
 	bdp = rxq->rx_bd_base;
 	for (i = 0; i < rxq->rx_ring_size; i++) {
-		skb = netdev_alloc_skb(ndev, FEC_ENET_RX_FRSIZE);
-		if (!skb)
+		if (fec_enet_new_rxbdp(ndev, bdp, &rxq->rx_buf[i]))
 			goto err_alloc;
 
-		if (fec_enet_new_rxbdp(ndev, bdp, skb)) {
-			dev_kfree_skb(skb);
-			goto err_alloc;
-		}
-
-		rxq->rx_skbuff[i] = skb;
 		bdp->cbd_sc = BD_ENET_RX_EMPTY;
 
 		if (fep->bufdesc_ex) {
@@ -2918,7 +3426,7 @@ fec_enet_open(struct net_device *ndev)
 		goto err_enet_mii_probe;
 
 	fec_restart(ndev);
-	napi_enable(&fep->napi);
+	fec_enet_napi_enable(fep);
 	phy_start(fep->phy_dev);
 	netif_tx_start_all_queues(ndev);
 
@@ -2954,7 +3462,7 @@ fec_enet_close(struct net_device *ndev)
 	phy_stop(fep->phy_dev);
 
 	if (netif_device_present(ndev)) {
-		napi_disable(&fep->napi);
+		fec_enet_napi_disable(fep);
 		netif_tx_disable(ndev);
 		fec_stop(ndev);
 	}
@@ -3115,14 +3623,14 @@ static int fec_set_features(struct net_device *netdev,
 	netdev_features_t changed = features ^ netdev->features;
 
 	if (netif_running(netdev) && changed & FEATURES_NEED_QUIESCE) {
-		napi_disable(&fep->napi);
+		fec_enet_napi_disable(fep);
 		netif_tx_lock_bh(netdev);
 		fec_stop(netdev);
 		fec_enet_set_netdev_features(netdev, features);
 		fec_restart(netdev);
 		netif_tx_wake_all_queues(netdev);
 		netif_tx_unlock_bh(netdev);
-		napi_enable(&fep->napi);
+		fec_enet_napi_enable(fep);
 	} else {
 		fec_enet_set_netdev_features(netdev, features);
 	}
@@ -3152,7 +3660,7 @@ u16 fec_enet_select_queue(struct net_device *ndev, struct sk_buff *skb,
 	u16 vlan_tag;
 
 	if (!(id_entry->driver_data & FEC_QUIRK_HAS_AVB))
-		return skb_tx_hash(ndev, skb);
+		return fallback(ndev, skb);
 
 	vlan_tag = fec_enet_get_raw_vlan_tci(skb);
 	if (!vlan_tag)
@@ -3161,11 +3669,50 @@ u16 fec_enet_select_queue(struct net_device *ndev, struct sk_buff *skb,
 	return  fec_enet_vlan_pri_to_queue[vlan_tag >> 13];
 }
 
+/* Each ring counts on its own, fold them into the caller's copy */
+static struct rtnl_link_stats64 *
+fec_enet_get_stats64(struct net_device *ndev, struct rtnl_link_stats64 *stats)
+{
+	struct fec_enet_private *fep = netdev_priv(ndev);
+	struct net_device_stats *qs;
+	int i;
+
+	for (i = 0; i < fep->num_rx_queues; i++) {
+		qs = &fep->rx_queue[i]->stats;
+		stats->rx_packets += qs->rx_packets;
+		stats->rx_bytes += qs->rx_bytes;
+		stats->rx_errors += qs->rx_errors;
+		stats->rx_dropped += qs->rx_dropped;
+		stats->rx_length_errors += qs->rx_length_errors;
+		stats->rx_frame_errors += qs->rx_frame_errors;
+		stats->rx_crc_errors += qs->rx_crc_errors;
+		stats->rx_fifo_errors += qs->rx_fifo_errors;
+	}
+
+	for (i = 0; i < fep->num_tx_queues; i++) {
+		qs = &fep->tx_queue[i]->stats;
+		stats->tx_packets += qs->tx_packets;
+		stats->tx_bytes += qs->tx_bytes;
+		stats->tx_errors += qs->tx_errors;
+		stats->tx_dropped += fep->tx_queue[i]->tx_dropped;
+		stats->tx_heartbeat_errors += qs->tx_heartbeat_errors;
+		stats->tx_window_errors += qs->tx_window_errors;
+		stats->tx_aborted_errors += qs->tx_aborted_errors;
+		stats->tx_fifo_errors += qs->tx_fifo_errors;
+		stats->tx_carrier_errors += qs->tx_carrier_errors;
+		stats->collisions += qs->collisions;
+	}
+	stats->tx_errors += fep->tx_timeouts;
+
+	return stats;
+}
+
 static const struct net_device_ops fec_netdev_ops = {
 	.ndo_open		= fec_enet_open,
 	.ndo_stop		= fec_enet_close,
 	.ndo_start_xmit		= fec_enet_start_xmit,
 	.ndo_select_queue       = fec_enet_select_queue,
+	.ndo_get_stats64	= fec_enet_get_stats64,
 	.ndo_set_rx_mode	= set_multicast_list,
 	.ndo_change_mtu		= eth_change_mtu,
 	.ndo_validate_addr	= eth_validate_addr,
@@ -3190,7 +3737,7 @@ static int fec_enet_init(struct net_device *ndev)
 	struct bufdesc *cbd_base;
 	dma_addr_t bd_dma;
 	int bd_size;
-	unsigned int i;
+	unsigned int i, j;
 
 #if defined(CONFIG_ARM)
 	fep->rx_align = 0xf;
@@ -3262,7 +3809,22 @@ static int fec_enet_init(struct net_device *ndev)
 	ndev->ethtool_ops = &fec_enet_ethtool_ops;
 
 	writel(FEC_RX_DISABLED_IMASK, fep->hwp + FEC_IMASK);
-	netif_napi_add(ndev, &fep->napi, fec_enet_rx_napi, NAPI_POLL_WEIGHT);
+	spin_lock_init(&fep->imask_lock);
+	for (i = 0; i < FEC_IRQ_NUM; i++)
+		fep->irq_events[i] = ~0U;
+	for (i = 0; i < fep->num_rx_queues; i++) {
+		rxq = fep->rx_queue[i];
+		rxq->napi_events = FEC_ENET_RXF_Q(i);
+		for (j = i; j < fep->num_tx_queues; j += fep->num_rx_queues)
+			rxq->napi_events |= FEC_ENET_TXF_Q(j);
+		netif_napi_add(ndev, &rxq->napi, fec_enet_rx_napi,
+			       NAPI_POLL_WEIGHT);
+	}
+
+	/* Default RX classification matches the TX queue selection */
+	for (i = 0; i < ARRAY_SIZE(fep->pcp_rx_queue); i++)
+		if (fec_enet_vlan_pri_to_queue[i] < fep->num_rx_queues)
+			fep->pcp_rx_queue[i] = fec_enet_vlan_pri_to_queue[i];
 
 	if (fep->quirks & FEC_QUIRK_HAS_VLAN)
 		/* enable hw VLAN support */
@@ -3366,6 +3928,59 @@ fec_enet_get_queue_num(struct platform_device *pdev, int *num_tx, int *num_rx)
 
 }
 
+/* ENETs that signal each ring on an interrupt line of its own name the
+ * lines "int0".."int2": a ring's line then only services that ring and
+ * is steered to its own CPU. Elsewhere every line services all events.
+ */
+static void fec_enet_init_irq_events(struct platform_device *pdev)
+{
+	struct net_device *ndev = platform_get_drvdata(pdev);
+	struct fec_enet_private *fep = netdev_priv(ndev);
+	int line[FEC_ENET_MAX_RX_QS];
+	u32 ring_events = 0;
+	char name[8];
+	int i, q, irq;
+
+	if (fep->num_rx_queues < 2)
+		return;
+
+	for (q = 0; q < fep->num_rx_queues; q++) {
+		snprintf(name, sizeof(name), "int%d", q);
+		irq = platform_get_irq_byname(pdev, name);
+		if (irq < 0)
+			return;
+
+		for (i = 0; i < FEC_IRQ_NUM; i++)
+			if (fep->irq[i] == irq)
+				break;
+		if (i == FEC_IRQ_NUM)
+			return;
+		line[q] = i;
+	}
+
+	for (q = 1; q < fep->num_rx_queues; q++) {
+		fep->irq_events[line[q]] = fep->rx_queue[q]->napi_events;
+		ring_events |= fep->rx_queue[q]->napi_events;
+	}
+
+	for (i = 0; i < FEC_IRQ_NUM; i++)
+		if (fep->irq_events[i] == ~0U)
+			fep->irq_events[i] = ~ring_events;
+
+	for (q = 0; q < fep->num_rx_queues; q++)
+		irq_set_affinity_hint(fep->irq[line[q]],
+				      cpumask_of(q % num_online_cpus()));
+}
+
+static void fec_enet_clear_irq_hints(struct fec_enet_private *fep)
+{
+	int i;
+
+	for (i = 0; i < FEC_IRQ_NUM; i++)
+		if (fep->irq[i] > 0)
+			irq_set_affinity_hint(fep->irq[i], NULL);
+}
+
 static int
 fec_probe(struct platform_device *pdev)
 {
@@ -3463,6 +4078,7 @@ fec_probe(struct platform_device *pdev)
 	}
 
 	fep->itr_clk_rate = clk_get_rate(fep->clk_ahb);
+	fec_enet_itr_coal_init(ndev);
 
 	/* enet_out is optional, depends on board */
 	fep->clk_enet_out = devm_clk_get(&pdev->dev, "enet_out");
@@ -3525,6 +4141,7 @@ fec_probe(struct platform_device *pdev)
 
 		fep->irq[i] = irq;
 	}
+	fec_enet_init_irq_events(pdev);
 
 	init_completion(&fep->mdio_done);
 	ret = fec_enet_mii_init(pdev);
@@ -3553,6 +4170,7 @@ fec_probe(struct platform_device *pdev)
 failed_register:
 	fec_enet_mii_remove(fep);
 failed_mii_init:
+	fec_enet_clear_irq_hints(fep);
 failed_irq:
 failed_init:
 	if (fep->reg_phy)
@@ -3573,11 +4191,16 @@ fec_drv_remove(struct platform_device *pdev)
 {
 	struct net_device *ndev = platform_get_drvdata(pdev);
 	struct fec_enet_private *fep = netdev_priv(ndev);
+	struct sk_filter *filter;
 
 	cancel_delayed_work_sync(&fep->time_keep);
 	cancel_work_sync(&fep->tx_timeout_work);
 	unregister_netdev(ndev);
+	filter = rcu_dereference_protected(fep->rx_filter, 1);
+	if (filter)
+		sk_unattached_filter_destroy(filter);
 	fec_enet_mii_remove(fep);
+	fec_enet_clear_irq_hints(fep);
 	if (fep->reg_phy)
 		regulator_disable(fep->reg_phy);
 	if (fep->ptp_clock)
@@ -3599,7 +4222,7 @@ static int __maybe_unused fec_suspend(struct device *dev)
 		if (fep->wol_flag & FEC_WOL_FLAG_ENABLE)
 			fep->wol_flag |= FEC_WOL_FLAG_SLEEP_ON;
 		phy_stop(fep->phy_dev);
-		napi_disable(&fep->napi);
+		fec_enet_napi_disable(fep);
 		netif_tx_lock_bh(ndev);
 		netif_device_detach(ndev);
 		netif_tx_unlock_bh(ndev);
@@ -3660,7 +4283,7 @@ static int __maybe_unused fec_resume(struct device *dev)
 		netif_tx_lock_bh(ndev);
 		netif_device_attach(ndev);
 		netif_tx_unlock_bh(ndev);
-		napi_enable(&fep->napi);
+		fec_enet_napi_enable(fep);
 		phy_start(fep->phy_dev);
 	} else if (fep->mii_bus_share && !fep->phy_dev) {
 		pinctrl_pm_select_default_state(&fep->pdev->dev);
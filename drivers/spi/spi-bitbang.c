@@ -269,6 +269,39 @@ static int spi_bitbang_prepare_hardware(struct spi_master *spi)
 	return 0;
 }
 
+/*
+ * Count the transfers following @t which can be chained to it: the chip
+ * select stays asserted, there is no delay in between and they run with
+ * the same clock rate and word size as @t, which is what the whole chain
+ * is set up for. A zero field means the device default, just like in
+ * setup_transfer(). The total length is returned in @len.
+ */
+static unsigned spi_bitbang_chain(struct spi_message *m,
+				  struct spi_transfer *t, unsigned *len)
+{
+	struct spi_device *spi = m->spi;
+	u32 speed_hz = t->speed_hz ? : spi->max_speed_hz;
+	u8 bits_per_word = t->bits_per_word ? : spi->bits_per_word;
+	struct spi_transfer *next;
+	unsigned n = 1;
+
+	*len = t->len;
+	while (!t->cs_change && !t->delay_usecs &&
+	       !list_is_last(&t->transfer_list, &m->transfers)) {
+		next = list_next_entry(t, transfer_list);
+		if (!next->len ||
+		    (next->speed_hz ? : spi->max_speed_hz) != speed_hz ||
+		    (next->bits_per_word ? : spi->bits_per_word) !=
+							bits_per_word)
+			break;
+		t = next;
+		*len += t->len;
+		n++;
+	}
+
+	return n;
+}
+
 static int spi_bitbang_transfer_one(struct spi_master *master,
 				    struct spi_message *m)
 {
@@ -276,9 +309,9 @@ static int spi_bitbang_transfer_one(struct spi_master *master,
 	unsigned		nsecs;
 	struct spi_transfer	*t = NULL;
 	unsigned		cs_change;
+	unsigned		chain, chain_len, no_chain = 0;
 	int			status;
 	int			do_setup = -1;
-	int         sendnum = 0;
 	struct spi_device	*spi = m->spi;
 
 	bitbang = spi_master_get_devdata(master);
@@ -313,14 +346,11 @@ static int spi_bitbang_transfer_one(struct spi_master *master,
 		 * (and also deselects any other chip that might be
 		 * selected ...)
 		 */
-		sendnum++;
 		if (cs_change) {
 			bitbang->chipselect(spi, BITBANG_CS_ACTIVE);
 			ndelay(nsecs);
 		}
 		cs_change = t->cs_change;
-		if(t->cs_change != 0)
-			printk("hndz spi cs_change %d!\n", t->cs_change);
 		if (!t->tx_buf && !t->rx_buf && t->len) {
 			status = -EINVAL;
 			break;
@@ -330,17 +360,34 @@ static int spi_bitbang_transfer_one(struct spi_master *master,
 		 * new dma mappings it needs. our caller always gave
 		 * us dma-safe buffers.
 		 */
+		chain = 1;
+		chain_len = t->len;
 		if (t->len) {
 			/* REVISIT dma API still needs a designated
 			 * DMA_ADDR_INVALID; ~0 might be better.
 			 */
 			if (!m->is_dma_mapped)
 				t->rx_dma = t->tx_dma = 0;
-			status = bitbang->txrx_bufs(spi, t);
+
+			status = -EAGAIN;
+			if (bitbang->txrx_chain && !no_chain) {
+				chain = spi_bitbang_chain(m, t, &chain_len);
+				if (chain > 1)
+					status = bitbang->txrx_chain(spi, t,
+								     chain);
+				/* don't retry for the rest of this chain */
+				if (status == -EAGAIN)
+					no_chain = chain;
+			}
+			if (status == -EAGAIN) {
+				chain = 1;
+				chain_len = t->len;
+				status = bitbang->txrx_bufs(spi, t);
+			}
 		}
 		if (status > 0)
 			m->actual_length += status;
-		if (status != t->len) {
+		if (status != chain_len) {
 			/* always report some kind of error */
 			if (status >= 0)
 				status = -EREMOTEIO;
@@ -348,6 +395,14 @@ static int spi_bitbang_transfer_one(struct spi_master *master,
 		}
 		status = 0;
 
+		if (no_chain)
+			no_chain--;
+
+		/* continue behind the last transfer of the chain */
+		while (--chain)
+			t = list_next_entry(t, transfer_list);
+		cs_change = t->cs_change;
+
 		/* protocol tweaks before next transfer */
 		if (t->delay_usecs)
 			udelay(t->delay_usecs);
@@ -357,7 +412,6 @@ static int spi_bitbang_transfer_one(struct spi_master *master,
 			/* sometimes a short mid-message deselect of the chip
 			 * may be needed to terminate a mode or command
 			 */
-			printk("hndz chip select 33BITBANG_CS_INACTIVE!\n");
 			ndelay(nsecs);
 			bitbang->chipselect(spi, BITBANG_CS_INACTIVE);
 			ndelay(nsecs);
@@ -370,10 +424,6 @@ static int spi_bitbang_transfer_one(struct spi_master *master,
 	 * cs_change has hinted that the next message will probably
 	 * be for this chip too.
 	 */
-	if(sendnum > 1)
-	{
-		printk("hndz spi send one is num %d!\n", sendnum);
-	}
 	if (!(status == 0 && cs_change)) {
 		// printk("hndz chip select status %d!\n",status);
 		ndelay(nsecs);
@@ -381,7 +431,7 @@ static int spi_bitbang_transfer_one(struct spi_master *master,
 		ndelay(nsecs);
 	}
 
-	// spi_finalize_current_message(master);
+	spi_finalize_current_message(master);
 
 	return status;
 }
@@ -131,9 +131,18 @@ static inline int is_imx35_cspi(struct spi_imx_data *d)
 
 static inline unsigned spi_imx_get_fifosize(struct spi_imx_data *d)
 {
-	return (d->devtype_data->devtype == IMX51_ECSPI) ? 4 : 8;
+	return (d->devtype_data->devtype == IMX51_ECSPI) ? 64 : 8;
 }
 
+/*
+ * Transfers up to this size are done by PIO: they fit into the FIFO and
+ * complete before SDMA would even have been set up.
+ */
+static unsigned int dma_threshold;
+module_param(dma_threshold, uint, 0444);
+MODULE_PARM_DESC(dma_threshold,
+		 "Use DMA for transfers longer than this many bytes (default: FIFO size)");
+
 #define MXC_SPI_BUF_RX(type)						\
 static void spi_imx_buf_rx_##type(struct spi_imx_data *spi_imx)		\
 {									\
@@ -204,16 +213,12 @@ static unsigned int spi_imx_clkdiv_2(unsigned int fin,
 static bool spi_imx_can_dma(struct spi_master *master, struct spi_device *spi,
 			 struct spi_transfer *transfer)
 {
-	// dump_stack();
-	// printk("zty spi imx can dma %d !\n", transfer->len);
 	struct spi_imx_data *spi_imx = spi_master_get_devdata(master);
 
-	// if (spi_imx->dma_is_inited &&
-	// 	(transfer->len > spi_imx_get_fifosize(spi_imx)) &&
-	// 	(transfer->len > spi_imx_get_fifosize(spi_imx)))
-	if(spi_imx->dma_is_inited)
-		return true;
-	return false;
+	if (!spi_imx->dma_is_inited)
+		return false;
+
+	return transfer->len > spi_imx->dma_threshold;
 }
 
 #define MX51_ECSPI_CTRL		0x08
@@ -316,11 +321,31 @@ static void __maybe_unused mx51_ecspi_trigger(struct spi_imx_data *spi_imx)
 	writel(reg, spi_imx->base + MX51_ECSPI_CTRL);
 }
 
+/*
+ * Program the watermarks of the current transfer and enable the DMA
+ * requests. The RX request is raised when the RX FIFO holds more than
+ * RX_WML words, so it is set one below the burst size.
+ */
+static void mx51_ecspi_dma_config(struct spi_imx_data *spi_imx)
+{
+	u32 dma = readl(spi_imx->base + MX51_ECSPI_DMA);
+
+	dma &= ~(MX51_ECSPI_DMA_TX_WML_MASK | MX51_ECSPI_DMA_RX_WML_MASK |
+		 MX51_ECSPI_DMA_RXT_WML_MASK);
+	dma |= (spi_imx->rx_wml - 1) << MX51_ECSPI_DMA_RX_WML_OFFSET;
+	dma |= spi_imx->tx_wml << MX51_ECSPI_DMA_TX_WML_OFFSET;
+	dma |= spi_imx->rxt_wml << MX51_ECSPI_DMA_RXT_WML_OFFSET;
+	dma |= (1 << MX51_ECSPI_DMA_TEDEN_OFFSET) |
+	       (1 << MX51_ECSPI_DMA_RXDEN_OFFSET) |
+	       (1 << MX51_ECSPI_DMA_RXTDEN_OFFSET);
+
+	writel(dma, spi_imx->base + MX51_ECSPI_DMA);
+}
+
 static int __maybe_unused mx51_ecspi_config(struct spi_imx_data *spi_imx,
 		struct spi_imx_config *config)
 {
-	u32 ctrl = MX51_ECSPI_CTRL_ENABLE, cfg = 0, dma = 0;
-	u32 tx_wml_cfg, rx_wml_cfg, rxt_wml_cfg;
+	u32 ctrl = MX51_ECSPI_CTRL_ENABLE, cfg = 0;
 	u32 clk = config->speed_hz, delay;
 
 	/*
@@ -378,28 +403,8 @@ static int __maybe_unused mx51_ecspi_config(struct spi_imx_data *spi_imx,
 	 * Configure the DMA register: setup the watermark
 	 * and enable DMA request.
 	 */
-	if (spi_imx->dma_is_inited) {
-		dma = readl(spi_imx->base + MX51_ECSPI_DMA);
-
-		// spi_imx->tx_wml = spi_imx_get_fifosize(spi_imx) / 4;
-		// spi_imx->rx_wml = spi_imx_get_fifosize(spi_imx) / 2;
-		// spi_imx->rxt_wml = spi_imx_get_fifosize(spi_imx) / 2;
-		spi_imx->tx_wml = 1;
-		spi_imx->rx_wml = 1;
-		spi_imx->rxt_wml = 1;
-		rx_wml_cfg = spi_imx->rx_wml << MX51_ECSPI_DMA_RX_WML_OFFSET;
-		tx_wml_cfg = spi_imx->tx_wml << MX51_ECSPI_DMA_TX_WML_OFFSET;
-		rxt_wml_cfg = spi_imx->rxt_wml << MX51_ECSPI_DMA_RXT_WML_OFFSET;
-		dma = (dma & ~MX51_ECSPI_DMA_TX_WML_MASK
-			   & ~MX51_ECSPI_DMA_RX_WML_MASK
-			   & ~MX51_ECSPI_DMA_RXT_WML_MASK)
-			   | rx_wml_cfg | tx_wml_cfg | rxt_wml_cfg
-			   |(1 << MX51_ECSPI_DMA_TEDEN_OFFSET)
-			   |(1 << MX51_ECSPI_DMA_RXDEN_OFFSET)
-			   |(1 << MX51_ECSPI_DMA_RXTDEN_OFFSET);
-
-		writel(dma, spi_imx->base + MX51_ECSPI_DMA);
-	}
+	if (spi_imx->dma_is_inited)
+		mx51_ecspi_dma_config(spi_imx);
 
 	return 0;
 }
@@ -847,6 +852,12 @@ static void spi_imx_sdma_exit(struct spi_imx_data *spi_imx)
 		master->dma_tx = NULL;
 	}
 
+	kfree(spi_imx->chain_tx);
+	kfree(spi_imx->chain_rx);
+	spi_imx->chain_tx = NULL;
+	spi_imx->chain_rx = NULL;
+	spi_imx->chain_nents = 0;
+
 	spi_imx->dma_is_inited = 0;
 }
 
@@ -856,7 +867,12 @@ static int spi_imx_sdma_init(struct device *dev, struct spi_imx_data *spi_imx,
 {
 	struct dma_slave_config slave_config = {};
 	int ret;
-	printk("hndz spi sdma init!\n");
+
+	/* start with single word bursts, adapted per transfer */
+	spi_imx->tx_wml = 1;
+	spi_imx->rx_wml = 1;
+	spi_imx->rxt_wml = 1;
+	spi_imx->dma_base = res->start;
 	/* Prepare for TX DMA: */
 	master->dma_tx = dma_request_slave_channel(dev, "tx");
 	if (!master->dma_tx) {
@@ -868,8 +884,7 @@ static int spi_imx_sdma_init(struct device *dev, struct spi_imx_data *spi_imx,
 	slave_config.direction = DMA_MEM_TO_DEV;
 	slave_config.dst_addr = res->start + MXC_CSPITXDATA;
 	slave_config.dst_addr_width = DMA_SLAVE_BUSWIDTH_1_BYTE;
-	// slave_config.dst_maxburst = spi_imx_get_fifosize(spi_imx) / 4;
-	slave_config.dst_maxburst = 1;
+	slave_config.dst_maxburst = spi_imx->tx_wml;
 	ret = dmaengine_slave_config(master->dma_tx, &slave_config);
 	if (ret) {
 		dev_err(dev, "error in TX dma configuration.\n");
@@ -887,8 +902,7 @@ static int spi_imx_sdma_init(struct device *dev, struct spi_imx_data *spi_imx,
 	slave_config.direction = DMA_DEV_TO_MEM;
 	slave_config.src_addr = res->start + MXC_CSPIRXDATA;
 	slave_config.src_addr_width = DMA_SLAVE_BUSWIDTH_1_BYTE;
-	// slave_config.src_maxburst = spi_imx_get_fifosize(spi_imx) / 2;
-	slave_config.src_maxburst = 1;
+	slave_config.src_maxburst = spi_imx->rx_wml;
 	ret = dmaengine_slave_config(master->dma_rx, &slave_config);
 	if (ret) {
 		dev_err(dev, "error in RX dma configuration.\n");
@@ -901,8 +915,9 @@ static int spi_imx_sdma_init(struct device *dev, struct spi_imx_data *spi_imx,
 	master->max_dma_len = MAX_SDMA_BD_BYTES;
 	spi_imx->bitbang.master->flags = SPI_MASTER_MUST_RX |
 					 SPI_MASTER_MUST_TX;
+	spi_imx->dma_threshold = max(dma_threshold,
+				     spi_imx_get_fifosize(spi_imx));
 	spi_imx->dma_is_inited = 1;
-	//printk("zty spi sdma end!\n");
 
 	return 0;
 err:
@@ -922,152 +937,86 @@ static void spi_imx_dma_tx_callback(void *cookie)
 	complete(&spi_imx->dma_tx_completion);
 }
 
-static int spi_imx_dma_transfer(struct spi_imx_data *spi_imx,
-				struct spi_transfer *transfer)
+/*
+ * Pick the largest burst of at most half the FIFO that divides @len, so
+ * SDMA moves every segment completely and no tail is left in the RX
+ * FIFO. The channels are only reconfigured when the burst size changes.
+ */
+static int spi_imx_dma_configure(struct spi_imx_data *spi_imx,
+				 unsigned int len)
 {
-	struct dma_async_tx_descriptor *desc_tx = NULL, *desc_rx = NULL;
-	int ret;
-	int left = 0;
 	struct spi_master *master = spi_imx->bitbang.master;
-	struct sg_table *tx = &transfer->tx_sg, *rx = &transfer->rx_sg;
-
-	if (tx) {
-		desc_tx = dmaengine_prep_slave_sg(master->dma_tx,
-					tx->sgl, tx->nents, DMA_TO_DEVICE,
-					DMA_PREP_INTERRUPT | DMA_CTRL_ACK);
-		if (!desc_tx)
-			goto no_dma;
-
-		desc_tx->callback = spi_imx_dma_tx_callback;
-		desc_tx->callback_param = (void *)spi_imx;
-		dmaengine_submit(desc_tx);
-	}
-
-	if (rx) {
-		struct scatterlist *sgl_last = &rx->sgl[rx->nents - 1];
-		unsigned int	orig_length = sgl_last->length;
-		int	wml_mask = ~(spi_imx->rx_wml - 1);
-		/*
-		 * Adjust the transfer lenth of the last scattlist if there are
-		 * some tail data, use PIO read to get the tail data since DMA
-		 * sometimes miss the last tail interrupt.
-		 */
-		left = transfer->len % spi_imx->rx_wml;
-		if (left)
-			sgl_last->length = orig_length & wml_mask;
-
-		desc_rx = dmaengine_prep_slave_sg(master->dma_rx,
-					rx->sgl, rx->nents, DMA_FROM_DEVICE,
-					DMA_PREP_INTERRUPT | DMA_CTRL_ACK);
-		if (!desc_rx)
-			goto no_dma;
-
-		desc_rx->callback = spi_imx_dma_rx_callback;
-		desc_rx->callback_param = (void *)spi_imx;
-		dmaengine_submit(desc_rx);
-	}
-
-	reinit_completion(&spi_imx->dma_rx_completion);
-	reinit_completion(&spi_imx->dma_tx_completion);
+	struct dma_slave_config tx = {}, rx = {};
+	unsigned int wml;
+	int ret;
 
-	/* Trigger the cspi module. */
-	spi_imx->dma_finished = 0;
+	/* long transfers are split into MAX_SDMA_BD_BYTES chunks */
+	if (len > MAX_SDMA_BD_BYTES)
+		len = gcd(len, MAX_SDMA_BD_BYTES);
 
-	spi_imx->devtype_data->trigger(spi_imx);
+	for (wml = spi_imx_get_fifosize(spi_imx) / 2; wml > 1; wml--)
+		if (!(len % wml))
+			break;
 
-	dma_async_issue_pending(master->dma_tx);
-	dma_async_issue_pending(master->dma_rx);
-	/* Wait SDMA to finish the data transfer.*/
-	ret = wait_for_completion_timeout(&spi_imx->dma_tx_completion,
-					  IMX_DMA_TIMEOUT(transfer->len));
-	if (!ret) {
-		pr_warn("%s %s: I/O Error in DMA TX:%x\n",
-			dev_driver_string(&master->dev),
-			dev_name(&master->dev), transfer->len);
-		dmaengine_terminate_all(master->dma_tx);
-	} else {
-		ret = wait_for_completion_timeout(&spi_imx->dma_rx_completion,
-				IMX_DMA_TIMEOUT(transfer->len));
-		if (!ret) {
-			pr_warn("%s %s: I/O Error in DMA RX:%x\n",
-				dev_driver_string(&master->dev),
-				dev_name(&master->dev), transfer->len);
-			spi_imx->devtype_data->reset(spi_imx);
-			dmaengine_terminate_all(master->dma_rx);
-		} else if (left) {
-			/* read the tail data by PIO */
-			void *tmpbuf = transfer->rx_buf + transfer->len - left;
-
-			while (readl(spi_imx->base + MX51_ECSPI_STAT) & 0x8) {
-				*(char *)tmpbuf =
-					readl(spi_imx->base + MXC_CSPIRXDATA);
-				tmpbuf++;
-			}
-		}
-	}
+	if (wml == spi_imx->rx_wml)
+		return 0;
 
-	spi_imx->dma_finished = 1;
-	spi_imx->devtype_data->trigger(spi_imx);
+	tx.direction = DMA_MEM_TO_DEV;
+	tx.dst_addr = spi_imx->dma_base + MXC_CSPITXDATA;
+	tx.dst_addr_width = DMA_SLAVE_BUSWIDTH_1_BYTE;
+	tx.dst_maxburst = wml;
+	ret = dmaengine_slave_config(master->dma_tx, &tx);
+	if (ret)
+		return ret;
 
-	if (!ret)
-		ret = -ETIMEDOUT;
-	else if (ret > 0)
-		ret = transfer->len;
+	rx.direction = DMA_DEV_TO_MEM;
+	rx.src_addr = spi_imx->dma_base + MXC_CSPIRXDATA;
+	rx.src_addr_width = DMA_SLAVE_BUSWIDTH_1_BYTE;
+	rx.src_maxburst = wml;
+	ret = dmaengine_slave_config(master->dma_rx, &rx);
+	if (ret)
+		return ret;
 
-	return ret;
+	spi_imx->tx_wml = wml;
+	spi_imx->rx_wml = wml;
+	spi_imx->rxt_wml = wml;
+	mx51_ecspi_dma_config(spi_imx);
 
-no_dma:
-	pr_warn_once("%s %s: DMA not available, falling back to PIO\n",
-		     dev_driver_string(&master->dev),
-		     dev_name(&master->dev));
-	return -EAGAIN;
+	return 0;
 }
 
-
-int spi_imx_dma_async_transfer(struct spi_imx_data *spi_imx,
-				struct spi_transfer *transfer)
+/*
+ * Run one SDMA transfer of @len bytes. The TX and RX scatterlists may
+ * span several spi_transfers, each with its own buffer descriptors.
+ */
+static int spi_imx_dma_run(struct spi_imx_data *spi_imx,
+			   struct scatterlist *tx_sgl, unsigned int tx_nents,
+			   struct scatterlist *rx_sgl, unsigned int rx_nents,
+			   unsigned int len)
 {
-	struct dma_async_tx_descriptor *desc_tx = NULL, *desc_rx = NULL;
-	int ret;
-	int left = 0;
+	struct dma_async_tx_descriptor *desc_tx, *desc_rx;
 	struct spi_master *master = spi_imx->bitbang.master;
-	struct sg_table *tx = &transfer->tx_sg, *rx = &transfer->rx_sg;
+	int ret;
 
-	// printk("hndz first spi tx len %d rx len %d!\n", tx->nents, rx->nents);
-	if (tx) {
-		desc_tx = dmaengine_prep_slave_sg(master->dma_tx,
-					tx->sgl, tx->nents, DMA_TO_DEVICE,
-					DMA_PREP_INTERRUPT | DMA_CTRL_ACK);
-		if (!desc_tx)
-			goto no_dma;
-
-		desc_tx->callback = spi_imx_dma_tx_callback;
-		desc_tx->callback_param = (void *)spi_imx;
-		dmaengine_submit(desc_tx);
-	}
-	if (rx) {
-		struct scatterlist *sgl_last = &rx->sgl[rx->nents - 1];
-		unsigned int	orig_length = sgl_last->length;
-		int	wml_mask = ~(spi_imx->rx_wml - 1);
-		/*
-		 * Adjust the transfer lenth of the last scattlist if there are
-		 * some tail data, use PIO read to get the tail data since DMA
-		 * sometimes miss the last tail interrupt.
-		 */
-		left = transfer->len % spi_imx->rx_wml;
-		if (left)
-			sgl_last->length = orig_length & wml_mask;
-
-		desc_rx = dmaengine_prep_slave_sg(master->dma_rx,
-					rx->sgl, rx->nents, DMA_FROM_DEVICE,
-					DMA_PREP_INTERRUPT | DMA_CTRL_ACK);
-		if (!desc_rx)
-			goto no_dma;
-
-		desc_rx->callback = spi_imx_dma_rx_callback;
-		desc_rx->callback_param = (void *)spi_imx;
-		dmaengine_submit(desc_rx);
-	}
+	desc_tx = dmaengine_prep_slave_sg(master->dma_tx,
+				tx_sgl, tx_nents, DMA_TO_DEVICE,
+				DMA_PREP_INTERRUPT | DMA_CTRL_ACK);
+	if (!desc_tx)
+		goto no_dma;
+
+	desc_rx = dmaengine_prep_slave_sg(master->dma_rx,
+				rx_sgl, rx_nents, DMA_FROM_DEVICE,
+				DMA_PREP_INTERRUPT | DMA_CTRL_ACK);
+	if (!desc_rx)
+		goto no_dma;
+
+	desc_tx->callback = spi_imx_dma_tx_callback;
+	desc_tx->callback_param = (void *)spi_imx;
+	dmaengine_submit(desc_tx);
+
+	desc_rx->callback = spi_imx_dma_rx_callback;
+	desc_rx->callback_param = (void *)spi_imx;
+	dmaengine_submit(desc_rx);
 
 	reinit_completion(&spi_imx->dma_rx_completion);
 	reinit_completion(&spi_imx->dma_tx_completion);
@@ -1079,32 +1028,24 @@ int spi_imx_dma_async_transfer(struct spi_imx_data *spi_imx,
 
 	dma_async_issue_pending(master->dma_tx);
 	dma_async_issue_pending(master->dma_rx);
-
-		ret = wait_for_completion_timeout(&spi_imx->dma_tx_completion,
-					  IMX_DMA_TIMEOUT(transfer->len));
+	/* Wait SDMA to finish the data transfer.*/
+	ret = wait_for_completion_timeout(&spi_imx->dma_tx_completion,
+					  IMX_DMA_TIMEOUT(len));
 	if (!ret) {
 		pr_warn("%s %s: I/O Error in DMA TX:%x\n",
 			dev_driver_string(&master->dev),
-			dev_name(&master->dev), transfer->len);
+			dev_name(&master->dev), len);
 		dmaengine_terminate_all(master->dma_tx);
+		dmaengine_terminate_all(master->dma_rx);
 	} else {
 		ret = wait_for_completion_timeout(&spi_imx->dma_rx_completion,
-				IMX_DMA_TIMEOUT(transfer->len));
+				IMX_DMA_TIMEOUT(len));
 		if (!ret) {
 			pr_warn("%s %s: I/O Error in DMA RX:%x\n",
 				dev_driver_string(&master->dev),
-				dev_name(&master->dev), transfer->len);
+				dev_name(&master->dev), len);
 			spi_imx->devtype_data->reset(spi_imx);
 			dmaengine_terminate_all(master->dma_rx);
-		} else if (left) {
-			/* read the tail data by PIO */
-			void *tmpbuf = transfer->rx_buf + transfer->len - left;
-
-			while (readl(spi_imx->base + MX51_ECSPI_STAT) & 0x8) {
-				*(char *)tmpbuf =
-					readl(spi_imx->base + MXC_CSPIRXDATA);
-				tmpbuf++;
-			}
 		}
 	}
 
@@ -1114,7 +1055,7 @@ int spi_imx_dma_async_transfer(struct spi_imx_data *spi_imx,
 	if (!ret)
 		ret = -ETIMEDOUT;
 	else if (ret > 0)
-		ret = transfer->len;
+		ret = len;
 
 	return ret;
 
@@ -1123,141 +1064,111 @@ no_dma:
 		     dev_driver_string(&master->dev),
 		     dev_name(&master->dev));
 	return -EAGAIN;
-
 }
 
-
-int spi_imx_irq_dma_transfer(struct spi_device * spi,
-				struct spi_transfer *transfer, dma_async_tx_callback rxcallback, dma_async_tx_callback txcallback)
+static int spi_imx_dma_transfer(struct spi_imx_data *spi_imx,
+				struct spi_transfer *transfer)
 {
-	struct spi_imx_data *spi_imx = spi_master_get_devdata(spi->master);
-	struct dma_async_tx_descriptor *desc_tx = NULL, *desc_rx = NULL;
-	int ret = 0;
-	// int left = 0;
-	struct spi_master *master = spi_imx->bitbang.master;
 	struct sg_table *tx = &transfer->tx_sg, *rx = &transfer->rx_sg;
 
-	spi_imx_setupxfer(spi, transfer);
-	spi_imx_chipselect(spi, 1);
-	ndelay(100);
-
-	// pr_info_once("hndz irq first spi tx len %d rx len %d!\n", tx->nents, rx->nents);
-	if (tx) {
-		desc_tx = dmaengine_prep_slave_sg(master->dma_tx,
-					tx->sgl, tx->nents, DMA_TO_DEVICE,
-					DMA_PREP_INTERRUPT | DMA_CTRL_ACK);
-		if (!desc_tx)
-			goto no_dma;
-		if(txcallback != NULL)
-		{
-			desc_tx->callback = txcallback;
-			desc_tx->callback_param = (void *)spi;
+	if (spi_imx_dma_configure(spi_imx, transfer->len))
+		return -EAGAIN;
 
-		}
-		else
-		{
-			desc_tx->callback = spi_imx_dma_tx_callback;
-			desc_tx->callback_param = (void *)spi_imx;
-		}
-		dmaengine_submit(desc_tx);
-	}
-	if (rx) {
-		struct scatterlist *sgl_last = &rx->sgl[rx->nents - 1];
-		unsigned int	orig_length = sgl_last->length;
-		int	wml_mask = ~(spi_imx->rx_wml - 1);
-		/*
-		 * Adjust the transfer lenth of the last scattlist if there are
-		 * some tail data, use PIO read to get the tail data since DMA
-		 * sometimes miss the last tail interrupt.
-		 */
-		// left = transfer->len % spi_imx->rx_wml;
-		// if (left)
-		// 	sgl_last->length = orig_length & wml_mask;
-
-		desc_rx = dmaengine_prep_slave_sg(master->dma_rx,
-					rx->sgl, rx->nents, DMA_FROM_DEVICE,
-					DMA_PREP_INTERRUPT | DMA_CTRL_ACK);
-		if (!desc_rx)
-			goto no_dma;
-
-		if(rxcallback != NULL)
-		{
-			desc_rx->callback = rxcallback;
-			desc_rx->callback_param = (void *)spi;
-
-		}
-		else
-		{
-			desc_rx->callback = spi_imx_dma_rx_callback;
-			desc_rx->callback_param = (void *)spi_imx;
-		}
+	return spi_imx_dma_run(spi_imx, tx->sgl, tx->nents,
+			       rx->sgl, rx->nents, transfer->len);
+}
 
+/*
+ * Append the DMA mapped entries of @src to @dst, starting at entry
+ * @pos. Only the bus addresses are used by the SDMA driver.
+ */
+static void spi_imx_chain_sg(struct scatterlist *dst, unsigned int pos,
+			     struct sg_table *src)
+{
+	struct scatterlist *sg;
+	int i;
 
-		dmaengine_submit(desc_rx);
+	for_each_sg(src->sgl, sg, src->nents, i) {
+		sg_dma_address(&dst[pos + i]) = sg_dma_address(sg);
+		sg_dma_len(&dst[pos + i]) = sg_dma_len(sg);
 	}
+}
 
-	reinit_completion(&spi_imx->dma_rx_completion);
-	reinit_completion(&spi_imx->dma_tx_completion);
-
-	/* Trigger the cspi module. */
-	spi_imx->dma_finished = 0;
-
-	spi_imx->devtype_data->trigger(spi_imx);
+static int spi_imx_chain_grow(struct spi_imx_data *spi_imx,
+			      unsigned int nents)
+{
+	struct scatterlist *tx, *rx;
 
-	dma_async_issue_pending(master->dma_tx);
-	dma_async_issue_pending(master->dma_rx);
-	
+	if (nents <= spi_imx->chain_nents)
+		return 0;
 
-	return ret;
+	tx = kmalloc_array(nents, sizeof(*tx), GFP_KERNEL);
+	rx = kmalloc_array(nents, sizeof(*rx), GFP_KERNEL);
+	if (!tx || !rx) {
+		kfree(tx);
+		kfree(rx);
+		return -ENOMEM;
+	}
 
-no_dma:
-	pr_warn_once("%s %s: DMA not available, falling back to PIO\n",
-		     dev_driver_string(&master->dev),
-		     dev_name(&master->dev));
-	return -EAGAIN;
+	kfree(spi_imx->chain_tx);
+	kfree(spi_imx->chain_rx);
+	spi_imx->chain_tx = tx;
+	spi_imx->chain_rx = rx;
+	spi_imx->chain_nents = nents;
 
+	return 0;
 }
 
-int spi_imx_dma_wait(struct spi_device * spi, struct spi_transfer *transfer)
+/*
+ * Move a chain of transfers which keep the chip select asserted with a
+ * single pair of SDMA descriptor lists, so only one setup and one wait
+ * is paid for the whole chain. Chip select handling before and after
+ * the chain is done by the bitbang core.
+ */
+static int spi_imx_dma_chain(struct spi_device *spi, struct spi_transfer *t,
+			     unsigned n)
 {
 	struct spi_imx_data *spi_imx = spi_master_get_devdata(spi->master);
-	int ret;
-	struct spi_master *master = spi_imx->bitbang.master;
-
-
-	ret = wait_for_completion_timeout(&spi_imx->dma_tx_completion,
-					  IMX_DMA_TIMEOUT(transfer->len));
-	if (!ret) {
-		pr_warn("%s %s: I/O Error in DMA TX:%x\n",
-			dev_driver_string(&master->dev),
-			dev_name(&master->dev), transfer->len);
-		dmaengine_terminate_all(master->dma_tx);
-	} else {
-		ret = wait_for_completion_timeout(&spi_imx->dma_rx_completion,
-				IMX_DMA_TIMEOUT(transfer->len));
-		if (!ret) {
-			pr_warn("%s %s: I/O Error in DMA RX:%x\n",
-				dev_driver_string(&master->dev),
-				dev_name(&master->dev), transfer->len);
-			spi_imx->devtype_data->reset(spi_imx);
-			dmaengine_terminate_all(master->dma_rx);
-		}
-		
+	struct spi_master *master = spi->master;
+	struct spi_transfer *xfer = t;
+	unsigned int tx_nents = 0, rx_nents = 0, len = 0, gran = 0;
+	unsigned i;
+
+	if (!master->can_dma)
+		return -EAGAIN;
+
+	for (i = 0; i < n; i++) {
+		if (!spi_imx_can_dma(master, spi, xfer) ||
+		    !xfer->tx_sg.nents || !xfer->rx_sg.nents)
+			return -EAGAIN;
+		tx_nents += xfer->tx_sg.nents;
+		rx_nents += xfer->rx_sg.nents;
+		len += xfer->len;
+		gran = gran ? gcd(gran, xfer->len) : xfer->len;
+		xfer = list_next_entry(xfer, transfer_list);
 	}
 
-	spi_imx->dma_finished = 1;
-	spi_imx->devtype_data->trigger(spi_imx);
-
-	if (!ret)
-		ret = -ETIMEDOUT;
-	else if (ret > 0)
-		ret = transfer->len;
+	if (spi_imx_chain_grow(spi_imx, max(tx_nents, rx_nents)))
+		return -EAGAIN;
+
+	sg_init_table(spi_imx->chain_tx, tx_nents);
+	sg_init_table(spi_imx->chain_rx, rx_nents);
+	tx_nents = 0;
+	rx_nents = 0;
+	for (xfer = t, i = 0; i < n; i++) {
+		spi_imx_chain_sg(spi_imx->chain_tx, tx_nents, &xfer->tx_sg);
+		spi_imx_chain_sg(spi_imx->chain_rx, rx_nents, &xfer->rx_sg);
+		tx_nents += xfer->tx_sg.nents;
+		rx_nents += xfer->rx_sg.nents;
+		xfer = list_next_entry(xfer, transfer_list);
+	}
 
-	ndelay(100);
-	spi_imx_chipselect(spi, 0);
-	ndelay(100);
+	if (spi_imx_dma_configure(spi_imx, gran))
+		return -EAGAIN;
 
-	return ret;
+	spi_imx->usedma = true;
+	return spi_imx_dma_run(spi_imx, spi_imx->chain_tx, tx_nents,
+			       spi_imx->chain_rx, rx_nents, len);
 }
 
 static int spi_imx_pio_transfer(struct spi_device *spi,
@@ -1287,57 +1198,18 @@ static int spi_imx_transfer(struct spi_device *spi,
 {
 	int ret;
 	struct spi_imx_data *spi_imx = spi_master_get_devdata(spi->master);
-	// printk("hndz spi spi_imx_transfer!\n");
-	// dump_stack();
 
-	
-	// printk("hndz master candma is %pF spi len %d!\n", spi_imx->bitbang.master->can_dma,
-	//  transfer->len);
-	
 	if (spi_imx->bitbang.master->can_dma &&
 	    spi_imx_can_dma(spi_imx->bitbang.master, spi, transfer)) {
-			// printk("zty spi dma transfer!\n");
 		spi_imx->usedma = true;
 		ret = spi_imx_dma_transfer(spi_imx, transfer);
 		if (ret != -EAGAIN)
 			return ret;
-		printk("hndz spi dma transfer fail!\n");
 	}
 	spi_imx->usedma = false;
-//	printk("zty spi pio transfer!\n");
 	return spi_imx_pio_transfer(spi, transfer);
 }
 
-static int spi_imx_hndz_transfer(struct spi_device *spi,
-				struct spi_transfer *transfer)
-{
-	int ret;
-	struct spi_imx_data *spi_imx = spi_master_get_devdata(spi->master);
-	spi_imx->usedma = true;
-	ret = spi_imx_dma_async_transfer(spi_imx, transfer);
-	if (ret != -EAGAIN)
-		return ret;
-	spi_imx->usedma = false;
-	printk("hndz spi dma transfer fail!\n");
-}
-
-int spi_imx_rt1(struct spi_device *spi,
-				struct spi_transfer *transfer)
-{
-	int ret;
-	struct spi_imx_data *spi_imx = spi_master_get_devdata(spi->master);
-
-	spi_imx_setupxfer(spi, transfer);
-	spi_imx_chipselect(spi, 1);
-	ndelay(100);
-	
-	ret = spi_imx_dma_async_transfer(spi_imx, transfer);
-	if (ret != -EAGAIN)
-		return ret;
-	
-
-}
-
 static int spi_imx_setup(struct spi_device *spi)
 {
 	struct spi_imx_data *spi_imx = spi_master_get_devdata(spi->master);
@@ -1446,7 +1318,8 @@ static int spi_imx_probe(struct platform_device *pdev)
 
 	spi_imx->bitbang.chipselect = spi_imx_chipselect;
 	spi_imx->bitbang.setup_transfer = spi_imx_setupxfer;
-	spi_imx->bitbang.txrx_bufs = spi_imx_hndz_transfer;
+	spi_imx->bitbang.txrx_bufs = spi_imx_transfer;
+	spi_imx->bitbang.txrx_chain = spi_imx_dma_chain;
 	spi_imx->bitbang.master->setup = spi_imx_setup;
 	spi_imx->bitbang.master->cleanup = spi_imx_cleanup;
 	spi_imx->bitbang.master->prepare_message = spi_imx_prepare_message;
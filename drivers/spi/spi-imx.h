@@ -26,6 +26,7 @@
 #include <linux/dmaengine.h>
 #include <linux/dma-mapping.h>
 #include <linux/err.h>
+#include <linux/gcd.h>
 #include <linux/gpio.h>
 #include <linux/interrupt.h>
 #include <linux/io.h>
@@ -113,8 +114,13 @@ struct spi_imx_data {
 	u32 rx_wml;
 	u32 tx_wml;
 	u32 rxt_wml;
+	unsigned int dma_threshold;	/* shorter transfers use PIO */
+	resource_size_t dma_base;	/* physical base for the SDMA scripts */
 	struct completion dma_rx_completion;
 	struct completion dma_tx_completion;
+	struct scatterlist *chain_tx;	/* descriptor lists of a chain */
+	struct scatterlist *chain_rx;
+	unsigned int chain_nents;
 
 	const struct spi_imx_devtype_data *devtype_data;
 	int chipselect[0];
@@ -71,11 +71,223 @@ modalias_show(struct device *dev, struct device_attribute *a, char *buf)
 }
 static DEVICE_ATTR_RO(modalias);
 
+#define SPI_STATISTICS_ATTRS(field, file)				\
+static ssize_t spi_master_##field##_show(struct device *dev,		\
+					 struct device_attribute *attr,	\
+					 char *buf)			\
+{									\
+	struct spi_master *master = container_of(dev,			\
+						 struct spi_master, dev); \
+	return spi_statistics_##field##_show(&master->statistics, buf); \
+}									\
+static struct device_attribute dev_attr_spi_master_##field = {		\
+	.attr = { .name = file, .mode = S_IRUGO },			\
+	.show = spi_master_##field##_show,				\
+};									\
+static ssize_t spi_device_##field##_show(struct device *dev,		\
+					 struct device_attribute *attr,	\
+					 char *buf)			\
+{									\
+	struct spi_device *spi = to_spi_device(dev);			\
+	return spi_statistics_##field##_show(&spi->statistics, buf);	\
+}									\
+static struct device_attribute dev_attr_spi_device_##field = {		\
+	.attr = { .name = file, .mode = S_IRUGO },			\
+	.show = spi_device_##field##_show,				\
+}
+
+#define SPI_STATISTICS_SHOW_NAME(name, file, field, format_string)	\
+static ssize_t spi_statistics_##name##_show(struct spi_statistics *stat, \
+					    char *buf)			\
+{									\
+	unsigned long flags;						\
+	ssize_t len;							\
+	spin_lock_irqsave(&stat->lock, flags);				\
+	len = sprintf(buf, format_string, stat->field);			\
+	spin_unlock_irqrestore(&stat->lock, flags);			\
+	return len;							\
+}									\
+SPI_STATISTICS_ATTRS(name, file)
+
+#define SPI_STATISTICS_SHOW(field, format_string)			\
+	SPI_STATISTICS_SHOW_NAME(field, __stringify(field),		\
+				 field, format_string)
+
+SPI_STATISTICS_SHOW(messages, "%lu");
+SPI_STATISTICS_SHOW(transfers, "%lu");
+SPI_STATISTICS_SHOW(errors, "%lu");
+SPI_STATISTICS_SHOW(timedout, "%lu");
+
+SPI_STATISTICS_SHOW(spi_sync, "%lu");
+SPI_STATISTICS_SHOW(spi_sync_immediate, "%lu");
+SPI_STATISTICS_SHOW(spi_async, "%lu");
+
+SPI_STATISTICS_SHOW(transfers_dma, "%lu");
+SPI_STATISTICS_SHOW(transfers_pio, "%lu");
+
+SPI_STATISTICS_SHOW(bytes, "%llu");
+SPI_STATISTICS_SHOW(bytes_rx, "%llu");
+SPI_STATISTICS_SHOW(bytes_tx, "%llu");
+
+/*
+ * The histograms use log2 buckets: bucket 0 counts 0 and 1, bucket n
+ * counts [2^n, 2^(n+1)) and the last bucket everything above.
+ */
+#define SPI_STATISTICS_HISTO(histo, index, number)			\
+	SPI_STATISTICS_SHOW_NAME(histo##_##index,				\
+				 #histo "_" number,			\
+				 histo[index], "%lu")
+
+#define SPI_STATISTICS_HISTOS(histo)					\
+	SPI_STATISTICS_HISTO(histo, 0,  "0-1");				\
+	SPI_STATISTICS_HISTO(histo, 1,  "2-3");				\
+	SPI_STATISTICS_HISTO(histo, 2,  "4-7");				\
+	SPI_STATISTICS_HISTO(histo, 3,  "8-15");			\
+	SPI_STATISTICS_HISTO(histo, 4,  "16-31");			\
+	SPI_STATISTICS_HISTO(histo, 5,  "32-63");			\
+	SPI_STATISTICS_HISTO(histo, 6,  "64-127");			\
+	SPI_STATISTICS_HISTO(histo, 7,  "128-255");			\
+	SPI_STATISTICS_HISTO(histo, 8,  "256-511");			\
+	SPI_STATISTICS_HISTO(histo, 9,  "512-1023");			\
+	SPI_STATISTICS_HISTO(histo, 10, "1024-2047");			\
+	SPI_STATISTICS_HISTO(histo, 11, "2048-4095");			\
+	SPI_STATISTICS_HISTO(histo, 12, "4096-8191");			\
+	SPI_STATISTICS_HISTO(histo, 13, "8192-16383");			\
+	SPI_STATISTICS_HISTO(histo, 14, "16384-32767");			\
+	SPI_STATISTICS_HISTO(histo, 15, "32768-65535");			\
+	SPI_STATISTICS_HISTO(histo, 16, "65536+")
+
+SPI_STATISTICS_HISTOS(transfer_bytes_histo);
+SPI_STATISTICS_HISTOS(queue_wait_histo);
+SPI_STATISTICS_HISTOS(transfer_time_histo);
+
+#define SPI_STATISTICS_HISTO_ATTRS(type, histo)				\
+	&dev_attr_spi_##type##_##histo##_0.attr,				\
+	&dev_attr_spi_##type##_##histo##_1.attr,				\
+	&dev_attr_spi_##type##_##histo##_2.attr,				\
+	&dev_attr_spi_##type##_##histo##_3.attr,				\
+	&dev_attr_spi_##type##_##histo##_4.attr,				\
+	&dev_attr_spi_##type##_##histo##_5.attr,				\
+	&dev_attr_spi_##type##_##histo##_6.attr,				\
+	&dev_attr_spi_##type##_##histo##_7.attr,				\
+	&dev_attr_spi_##type##_##histo##_8.attr,				\
+	&dev_attr_spi_##type##_##histo##_9.attr,				\
+	&dev_attr_spi_##type##_##histo##_10.attr,			\
+	&dev_attr_spi_##type##_##histo##_11.attr,			\
+	&dev_attr_spi_##type##_##histo##_12.attr,			\
+	&dev_attr_spi_##type##_##histo##_13.attr,			\
+	&dev_attr_spi_##type##_##histo##_14.attr,			\
+	&dev_attr_spi_##type##_##histo##_15.attr,			\
+	&dev_attr_spi_##type##_##histo##_16.attr
+
+#define SPI_STATISTICS_ALL_ATTRS(type)					\
+	&dev_attr_spi_##type##_messages.attr,				\
+	&dev_attr_spi_##type##_transfers.attr,				\
+	&dev_attr_spi_##type##_errors.attr,				\
+	&dev_attr_spi_##type##_timedout.attr,				\
+	&dev_attr_spi_##type##_spi_sync.attr,				\
+	&dev_attr_spi_##type##_spi_sync_immediate.attr,			\
+	&dev_attr_spi_##type##_spi_async.attr,				\
+	&dev_attr_spi_##type##_transfers_dma.attr,			\
+	&dev_attr_spi_##type##_transfers_pio.attr,			\
+	&dev_attr_spi_##type##_bytes.attr,				\
+	&dev_attr_spi_##type##_bytes_rx.attr,				\
+	&dev_attr_spi_##type##_bytes_tx.attr,				\
+	SPI_STATISTICS_HISTO_ATTRS(type, transfer_bytes_histo),		\
+	SPI_STATISTICS_HISTO_ATTRS(type, queue_wait_histo),		\
+	SPI_STATISTICS_HISTO_ATTRS(type, transfer_time_histo)
+
 static struct attribute *spi_dev_attrs[] = {
 	&dev_attr_modalias.attr,
 	NULL,
 };
-ATTRIBUTE_GROUPS(spi_dev);
+
+static const struct attribute_group spi_dev_group = {
+	.attrs  = spi_dev_attrs,
+};
+
+static struct attribute *spi_device_statistics_attrs[] = {
+	SPI_STATISTICS_ALL_ATTRS(device),
+	NULL,
+};
+
+static const struct attribute_group spi_device_statistics_group = {
+	.name  = "statistics",
+	.attrs  = spi_device_statistics_attrs,
+};
+
+static const struct attribute_group *spi_dev_groups[] = {
+	&spi_dev_group,
+	&spi_device_statistics_group,
+	NULL,
+};
+
+static struct attribute *spi_master_statistics_attrs[] = {
+	SPI_STATISTICS_ALL_ATTRS(master),
+	NULL,
+};
+
+static const struct attribute_group spi_master_statistics_group = {
+	.name  = "statistics",
+	.attrs  = spi_master_statistics_attrs,
+};
+
+static const struct attribute_group *spi_master_groups[] = {
+	&spi_master_statistics_group,
+	NULL,
+};
+
+static inline int spi_statistics_bucket(u64 val)
+{
+	int l2 = min(fls64(val), SPI_STATISTICS_HISTO_SIZE) - 1;
+
+	return max(l2, 0);
+}
+
+static void spi_statistics_add_transfer_stats(struct spi_statistics *stats,
+					      struct spi_transfer *xfer,
+					      bool dma)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&stats->lock, flags);
+
+	stats->transfers++;
+	stats->transfer_bytes_histo[spi_statistics_bucket(xfer->len)]++;
+
+	stats->bytes += xfer->len;
+	if (xfer->tx_buf)
+		stats->bytes_tx += xfer->len;
+	if (xfer->rx_buf)
+		stats->bytes_rx += xfer->len;
+
+	if (dma)
+		stats->transfers_dma++;
+	else
+		stats->transfers_pio++;
+
+	spin_unlock_irqrestore(&stats->lock, flags);
+}
+
+static void spi_statistics_add_msg_stats(struct spi_statistics *stats,
+					 struct spi_message *msg,
+					 s64 wait_us, s64 xfer_us)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&stats->lock, flags);
+
+	stats->messages++;
+	if (msg->status) {
+		stats->errors++;
+		if (msg->status == -ETIMEDOUT)
+			stats->timedout++;
+	}
+	stats->queue_wait_histo[spi_statistics_bucket(wait_us)]++;
+	stats->transfer_time_histo[spi_statistics_bucket(xfer_us)]++;
+
+	spin_unlock_irqrestore(&stats->lock, flags);
+}
 
 /* modalias support makes "modprobe $MODALIAS" new-style hotplug work,
  * and the sysfs version makes coldplug work too.
@@ -365,6 +577,9 @@ struct spi_device *spi_alloc_device(struct spi_master *master)
 	spi->dev.bus = &spi_bus_type;
 	spi->dev.release = spidev_release;
 	spi->cs_gpio = -ENOENT;
+
+	spin_lock_init(&spi->statistics.lock);
+
 	device_initialize(&spi->dev);
 	return spi;
 }
@@ -865,31 +1080,59 @@ void spi_finalize_current_transfer(struct spi_master *master)
 EXPORT_SYMBOL_GPL(spi_finalize_current_transfer);
 
 /**
- * spi_pump_messages - kthread work function which processes spi message queue
- * @work: pointer to kthread work struct contained in the master struct
+ * __spi_pump_messages - function which processes spi message queue
+ * @master: master to process queue for
+ * @in_kthread: true if we are in the context of the message pump thread
  *
  * This function checks if there is any spi message in the queue that
  * needs processing and if so call out to the driver to initialize hardware
  * and transfer each message.
  *
+ * Note that it is called both from the kthread itself and also from
+ * inside spi_sync(); the queue extraction handling at the top of the
+ * function should deal with this safely.
  */
-static void spi_pump_messages(struct kthread_work *work)
+static void __spi_pump_messages(struct spi_master *master, bool in_kthread)
 {
-	struct spi_master *master =
-		container_of(work, struct spi_master, pump_messages);
 	unsigned long flags;
 	bool was_busy = false;
 	int ret;
 
-	/* Lock queue and check for queue work */
+	/* Lock queue */
 	spin_lock_irqsave(&master->queue_lock, flags);
+
+	/* Make sure we are not already running a message */
+	if (master->cur_msg) {
+		spin_unlock_irqrestore(&master->queue_lock, flags);
+		return;
+	}
+
+	/* If another context is idling the device then defer */
+	if (master->idling) {
+		queue_kthread_work(&master->kworker, &master->pump_messages);
+		spin_unlock_irqrestore(&master->queue_lock, flags);
+		return;
+	}
+
+	/* Check if the queue is idle */
 	if (list_empty(&master->queue) || !master->running) {
 		if (!master->busy) {
 			spin_unlock_irqrestore(&master->queue_lock, flags);
 			return;
 		}
+
+		/* Only do teardown in the thread */
+		if (!in_kthread) {
+			queue_kthread_work(&master->kworker,
+					   &master->pump_messages);
+			spin_unlock_irqrestore(&master->queue_lock, flags);
+			return;
+		}
+
 		master->busy = false;
+		master->idling = true;
 		spin_unlock_irqrestore(&master->queue_lock, flags);
+
 		kfree(master->dummy_rx);
 		master->dummy_rx = NULL;
 		kfree(master->dummy_tx);
@@ -903,14 +1146,13 @@ static void spi_pump_messages(struct kthread_work *work)
 			pm_runtime_put_autosuspend(master->dev.parent);
 		}
 		trace_spi_master_idle(master);
-		return;
-	}
 
-	/* Make sure we are not already running a message */
-	if (master->cur_msg) {
+		spin_lock_irqsave(&master->queue_lock, flags);
+		master->idling = false;
 		spin_unlock_irqrestore(&master->queue_lock, flags);
 		return;
 	}
+
 	/* Extract head of queue */
 	master->cur_msg =
 		list_first_entry(&master->queue, struct spi_message, queue);
@@ -922,6 +1164,14 @@ static void spi_pump_messages(struct kthread_work *work)
 		master->busy = true;
 	spin_unlock_irqrestore(&master->queue_lock, flags);
 
+	master->cur_msg_start = ktime_get();
+	if (!in_kthread) {
+		SPI_STATISTICS_INCREMENT_FIELD(&master->statistics,
+					       spi_sync_immediate);
+		SPI_STATISTICS_INCREMENT_FIELD(&master->cur_msg->spi->statistics,
+					       spi_sync_immediate);
+	}
+
 	if (!was_busy && master->auto_runtime_pm) {
 		ret = pm_runtime_get_sync(master->dev.parent);
 		if (ret < 0) {
@@ -935,7 +1185,6 @@ static void spi_pump_messages(struct kthread_work *work)
 		trace_spi_master_busy(master);
 
 	if (!was_busy && master->prepare_transfer_hardware) {
-		// printk("hndz prepare_transfer_hardware is %pF!\n", master->prepare_transfer_hardware);
 		ret = master->prepare_transfer_hardware(master);
 		if (ret) {
 			dev_err(&master->dev,
@@ -951,7 +1200,6 @@ static void spi_pump_messages(struct kthread_work *work)
 
 	if (master->prepare_message) {
 		ret = master->prepare_message(master, master->cur_msg);
-		// printk("hndz prepare_message is %pF!\n", master->prepare_message);
 		if (ret) {
 			dev_err(&master->dev,
 				"failed to prepare message: %d\n", ret);
@@ -977,6 +1225,18 @@ static void spi_pump_messages(struct kthread_work *work)
 	}
 }
 
+/**
+ * spi_pump_messages - kthread work function which processes spi message queue
+ * @work: pointer to kthread work struct contained in the master struct
+ */
+static void spi_pump_messages(struct kthread_work *work)
+{
+	struct spi_master *master =
+		container_of(work, struct spi_master, pump_messages);
+
+	__spi_pump_messages(master, true);
+}
+
 static int spi_init_queue(struct spi_master *master)
 {
 	struct sched_param param = { .sched_priority = MAX_RT_PRIO - 1 };
@@ -986,6 +1246,7 @@ static int spi_init_queue(struct spi_master *master)
 
 	master->running = false;
 	master->busy = false;
+	master->idling = false;
 
 	init_kthread_worker(&master->kworker);
 	master->kworker_task = kthread_run(kthread_worker_fn,
@@ -1036,6 +1297,30 @@ struct spi_message *spi_get_next_queued_message(struct spi_master *master)
 }
 EXPORT_SYMBOL_GPL(spi_get_next_queued_message);
 
+static void spi_finalize_statistics(struct spi_master *master,
+				    struct spi_message *mesg)
+{
+	struct spi_statistics *stats = &mesg->spi->statistics;
+	struct spi_transfer *xfer;
+	ktime_t now = ktime_get();
+	s64 wait_us, xfer_us;
+	bool dma;
+
+	list_for_each_entry(xfer, &mesg->transfers, transfer_list) {
+		dma = master->cur_msg_mapped && master->can_dma &&
+		      master->can_dma(master, mesg->spi, xfer);
+		spi_statistics_add_transfer_stats(&master->statistics,
+						  xfer, dma);
+		spi_statistics_add_transfer_stats(stats, xfer, dma);
+	}
+
+	wait_us = ktime_us_delta(master->cur_msg_start, mesg->queued);
+	xfer_us = ktime_us_delta(now, master->cur_msg_start);
+	spi_statistics_add_msg_stats(&master->statistics, mesg,
+				     wait_us, xfer_us);
+	spi_statistics_add_msg_stats(stats, mesg, wait_us, xfer_us);
+}
+
 /**
  * spi_finalize_current_message() - the current message is complete
  * @master: the master to return the message to
@@ -1047,16 +1332,17 @@ void spi_finalize_current_message(struct spi_master *master)
 {
 	struct spi_message *mesg;
 	unsigned long flags;
+	bool idle;
 	int ret;
 
 	spin_lock_irqsave(&master->queue_lock, flags);
 	mesg = master->cur_msg;
-	master->cur_msg = NULL;
-
-	queue_kthread_work(&master->kworker, &master->pump_messages);
 	spin_unlock_irqrestore(&master->queue_lock, flags);
 
+	spi_finalize_statistics(master, mesg);
+
 	spi_unmap_msg(master, mesg);
+	master->cur_msg_mapped = false;
 
 	if (master->cur_msg_prepared && master->unprepare_message) {
 		ret = master->unprepare_message(master, mesg);
@@ -1067,11 +1353,27 @@ void spi_finalize_current_message(struct spi_master *master)
 	}
 	master->cur_msg_prepared = false;
 
+	/*
+	 * If more messages are queued behind this one kick the pump right
+	 * away. Otherwise complete the message first and only then let the
+	 * pump thread idle the hardware, so that a realtime pump thread
+	 * cannot delay the wakeup of a spi_sync() caller with the teardown.
+	 */
+	spin_lock_irqsave(&master->queue_lock, flags);
+	master->cur_msg = NULL;
+	idle = list_empty(&master->queue);
+	if (!idle)
+		queue_kthread_work(&master->kworker, &master->pump_messages);
+	spin_unlock_irqrestore(&master->queue_lock, flags);
+
+	trace_spi_message_done(mesg);
+
 	mesg->state = NULL;
 	if (mesg->complete)
 		mesg->complete(mesg->context);
 
-	trace_spi_message_done(mesg);
+	if (idle)
+		queue_kthread_work(&master->kworker, &master->pump_messages);
 }
 EXPORT_SYMBOL_GPL(spi_finalize_current_message);
 
@@ -1158,7 +1460,9 @@ static int spi_destroy_queue(struct spi_master *master)
  * @spi: spi device which is requesting transfer
  * @msg: spi message which is to handled is queued to driver queue
  */
-static int spi_queued_transfer(struct spi_device *spi, struct spi_message *msg)
+static int __spi_queued_transfer(struct spi_device *spi,
+				 struct spi_message *msg,
+				 bool need_pump)
 {
 	struct spi_master *master = spi->master;
 	unsigned long flags;
@@ -1171,15 +1475,26 @@ static int spi_queued_transfer(struct spi_device *spi, struct spi_message *msg)
 	}
 	msg->actual_length = 0;
 	msg->status = -EINPROGRESS;
+	msg->queued = ktime_get();
 
 	list_add_tail(&msg->queue, &master->queue);
-	if (!master->busy)
+	if (!master->busy && need_pump)
 		queue_kthread_work(&master->kworker, &master->pump_messages);
 
 	spin_unlock_irqrestore(&master->queue_lock, flags);
 	return 0;
 }
 
+/**
+ * spi_queued_transfer - transfer function for queued transfers
+ * @spi: spi device which is requesting transfer
+ * @msg: spi message which is to handled is queued to driver queue
+ */
+static int spi_queued_transfer(struct spi_device *spi, struct spi_message *msg)
+{
+	return __spi_queued_transfer(spi, msg, true);
+}
+
 static int spi_master_initialize_queue(struct spi_master *master)
 {
 	int ret;
@@ -1447,6 +1762,7 @@ static struct class spi_master_class = {
 	.name		= "spi_master",
 	.owner		= THIS_MODULE,
 	.dev_release	= spi_master_release,
+	.dev_groups	= spi_master_groups,
 };
 
 
@@ -1487,6 +1803,7 @@ struct spi_master *spi_alloc_master(struct device *dev, unsigned size)
 	master->num_chipselect = 1;
 	master->dev.class = &spi_master_class;
 	master->dev.parent = get_device(dev);
+	spin_lock_init(&master->statistics.lock);
 	spi_master_set_devdata(master, &master[1]);
 
 	return master;
@@ -1966,6 +2283,9 @@ static int __spi_async(struct spi_device *spi, struct spi_message *message)
 
 	message->spi = spi;
 
+	SPI_STATISTICS_INCREMENT_FIELD(&master->statistics, spi_async);
+	SPI_STATISTICS_INCREMENT_FIELD(&spi->statistics, spi_async);
+
 	trace_spi_message_submit(message);
 	// printk("hndz spi device name %s func %pF!\n", dev_name(&spi->dev), master->transfer);
 	return master->transfer(spi, message);
@@ -2096,15 +2416,39 @@ static int __spi_sync(struct spi_device *spi, struct spi_message *message,
 	message->complete = spi_complete;
 	message->context = &done;
 
+	SPI_STATISTICS_INCREMENT_FIELD(&master->statistics, spi_sync);
+	SPI_STATISTICS_INCREMENT_FIELD(&spi->statistics, spi_sync);
+
 	if (!bus_locked)
 		mutex_lock(&master->bus_lock_mutex);
 
-	status = spi_async_locked(spi, message);
+	/*
+	 * If we're not using the legacy transfer method then we will
+	 * try to transfer in the calling context so special case.
+	 * This code would be less tricky if we could remove the
+	 * support for driver implemented message queues.
+	 */
+	if (master->transfer == spi_queued_transfer) {
+		status = __spi_validate(spi, message);
+		if (status == 0) {
+			message->spi = spi;
+			trace_spi_message_submit(message);
+			status = __spi_queued_transfer(spi, message, false);
+		}
+	} else {
+		status = spi_async_locked(spi, message);
+	}
 
 	if (!bus_locked)
 		mutex_unlock(&master->bus_lock_mutex);
 
 	if (status == 0) {
+		/* Push out the messages in the calling context if we
+		 * can.
+		 */
+		if (master->transfer == spi_queued_transfer)
+			__spi_pump_messages(master, false);
+
 		wait_for_completion(&done);
 		status = message->status;
 	}
@@ -2140,66 +2484,6 @@ int spi_sync(struct spi_device *spi, struct spi_message *message)
 EXPORT_SYMBOL_GPL(spi_sync);
 
 
-int hndz_spi_async(struct spi_device *spi, struct spi_message *message)
-{
-	struct spi_master *master = spi->master;
-	int ret;
-	message->spi = spi;
-
-	if (master->prepare_message) {
-		ret = master->prepare_message(master,  message);
-		// printk("hndz prepare_message is %pF!\n", master->prepare_message);
-		if (ret) {
-			dev_err(&master->dev,
-				"failed to prepare message: %d\n", ret);
-			return ret;
-		}
-		master->cur_msg_prepared = true;
-	}
-
-	ret = spi_map_msg(master, message);
-	if (ret) {
-		message->status = ret;
-		return ret;
-	}
-	return master->transfer_one_message(master, message);
-}
-EXPORT_SYMBOL_GPL(hndz_spi_async);
-
-extern int spi_imx_irq_dma_transfer(struct spi_device * spi,
-				struct spi_transfer *transfer, dma_async_tx_callback rxcallback, dma_async_tx_callback txcallback);
-
-int hndz_spi_dma_irq_async(struct spi_device *spi, struct spi_message *message, 
-							dma_async_tx_callback rxcallback, dma_async_tx_callback txcallback)
-{
-	struct spi_master *master = spi->master;
-	int ret;
-	message->spi = spi;
-	struct spi_transfer	*t = NULL;
-
-	if (master->prepare_message) {
-		ret = master->prepare_message(master,  message);
-		// printk("hndz prepare_message is %pF!\n", master->prepare_message);
-		if (ret) {
-			dev_err(&master->dev,
-				"failed to prepare message: %d\n", ret);
-			return ret;
-		}
-		master->cur_msg_prepared = true;
-	}
-
-	ret = spi_map_msg(master, message);
-	if (ret) {
-		message->status = ret;
-		return ret;
-	}
-	list_for_each_entry(t, &message->transfers, transfer_list) {
-		 ret = spi_imx_irq_dma_transfer(spi, t,  rxcallback,  txcallback);
-	}
-	return ret;
-}
-EXPORT_SYMBOL_GPL(hndz_spi_dma_irq_async);
-
 /**
  * spi_sync_locked - version of spi_sync with exclusive bus usage
  * @spi: device with which data will be exchanged
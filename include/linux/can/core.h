@@ -26,6 +26,15 @@
 
 #define DNAME(dev) ((dev) ? (dev)->name : "any")
 
+/*
+ * Minimum length of a struct sockaddr_can handed in by user space that
+ * covers the given member. The sockaddr_can union grew with CAN_J1939,
+ * so the older protocols accept the shorter historical layout.
+ */
+#define CAN_REQUIRED_SIZE(struct_type, member) \
+	(offsetof(typeof(struct_type), member) + \
+	 sizeof(((typeof(struct_type) *)(NULL))->member))
+
 /**
  * struct can_proto - CAN protocol structure
  * @type:       type argument in socket() syscall, e.g. SOCK_DGRAM.
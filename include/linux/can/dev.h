@@ -13,6 +13,8 @@
 #ifndef CAN_DEV_H
 #define CAN_DEV_H
 
+#include <linux/ethtool.h>
+#include <linux/ktime.h>
 #include <linux/can.h>
 #include <linux/can/netlink.h>
 #include <linux/can/error.h>
@@ -33,8 +35,9 @@ enum can_mode {
 struct can_priv {
 	struct can_device_stats can_stats;
 
-	struct can_bittiming bittiming;
-	const struct can_bittiming_const *bittiming_const;
+	struct can_bittiming bittiming, data_bittiming;
+	const struct can_bittiming_const *bittiming_const,
+		*data_bittiming_const;
 	struct can_clock clock;
 
 	enum can_state state;
@@ -45,6 +48,7 @@ struct can_priv {
 	struct timer_list restart_timer;
 
 	int (*do_set_bittiming)(struct net_device *dev);
+	int (*do_set_data_bittiming)(struct net_device *dev);
 	int (*do_set_mode)(struct net_device *dev, enum can_mode mode);
 	int (*do_get_state)(const struct net_device *dev,
 			    enum can_state *state);
@@ -121,9 +125,19 @@ void can_bus_off(struct net_device *dev);
 void can_put_echo_skb(struct sk_buff *skb, struct net_device *dev,
 		      unsigned int idx);
 unsigned int can_get_echo_skb(struct net_device *dev, unsigned int idx);
+unsigned int can_get_echo_skb_hwts(struct net_device *dev, unsigned int idx,
+				   ktime_t hwtstamp);
+unsigned int can_get_echo_skb_tstamp(struct net_device *dev, unsigned int idx,
+				     ktime_t tstamp);
 void can_free_echo_skb(struct net_device *dev, unsigned int idx);
 
+int can_hwtstamp_ioctl(struct net_device *dev, struct ifreq *ifr, int cmd);
+int can_ethtool_get_ts_info_hwts(struct net_device *dev,
+				 struct ethtool_ts_info *info);
+
 struct sk_buff *alloc_can_skb(struct net_device *dev, struct can_frame **cf);
+struct sk_buff *alloc_canfd_skb(struct net_device *dev,
+				struct canfd_frame **cfd);
 struct sk_buff *alloc_can_err_skb(struct net_device *dev,
 				  struct can_frame **cf);
 
@@ -0,0 +1,101 @@
+/*
+ * linux/can/rx-offload.h
+ *
+ * Definitions for the CAN driver RX offload helpers
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the version 2 of the GNU General Public License
+ * as published by the Free Software Foundation
+ */
+
+#ifndef CAN_RX_OFFLOAD_H
+#define CAN_RX_OFFLOAD_H
+
+#include <linux/netdevice.h>
+#include <linux/can.h>
+
+/*
+ * struct can_rx_offload - RX offload context of a CAN network device
+ *
+ * The driver reads frames out of the hardware in its interrupt handler,
+ * collects them on @skb_irq_queue (owned by the interrupt handler, no
+ * locking) and hands the whole batch over to @skb_queue with a single
+ * can_rx_offload_irq_finish() call. The NAPI poll function then feeds
+ * @skb_queue into the networking stack.
+ *
+ * @mailbox_read: read (or with @drop set: discard) one frame from the
+ *	hardware. Returns 0 if the mailbox/FIFO was empty, otherwise the
+ *	frame is returned in @skb (NULL if dropped or out of memory) and
+ *	the hardware timestamp in @timestamp.
+ * @mb_first, @mb_last: mailbox range scanned in timestamp mode, may be
+ *	given in descending order.
+ */
+struct can_rx_offload {
+	struct net_device *dev;
+
+	unsigned int (*mailbox_read)(struct can_rx_offload *offload, bool drop,
+				     struct sk_buff **skb, u32 *timestamp,
+				     unsigned int mb);
+
+	struct sk_buff_head skb_queue;
+	struct sk_buff_head skb_irq_queue;
+	u32 skb_queue_len_max;
+
+	unsigned int mb_first;
+	unsigned int mb_last;
+
+	struct napi_struct napi;
+
+	bool inc;
+};
+
+/*
+ * Per skb private data, lives in skb->cb while the frame is queued in the
+ * offload context.
+ */
+struct can_rx_offload_cb {
+	u32 timestamp;
+};
+
+static inline struct can_rx_offload_cb *
+can_rx_offload_get_cb(struct sk_buff *skb)
+{
+	BUILD_BUG_ON(sizeof(struct can_rx_offload_cb) > sizeof(skb->cb));
+
+	return (struct can_rx_offload_cb *)skb->cb;
+}
+
+int can_rx_offload_add_timestamp(struct net_device *dev,
+				 struct can_rx_offload *offload);
+int can_rx_offload_add_fifo(struct net_device *dev,
+			    struct can_rx_offload *offload,
+			    unsigned int weight);
+int can_rx_offload_add_manual(struct net_device *dev,
+			      struct can_rx_offload *offload,
+			      unsigned int weight);
+int can_rx_offload_irq_offload_timestamp(struct can_rx_offload *offload,
+					 u64 reg);
+int can_rx_offload_irq_offload_fifo(struct can_rx_offload *offload);
+int can_rx_offload_queue_timestamp(struct can_rx_offload *offload,
+				   struct sk_buff *skb, u32 timestamp);
+int can_rx_offload_irq_queue_tail(struct can_rx_offload *offload,
+				  struct sk_buff *skb);
+int can_rx_offload_queue_tail(struct can_rx_offload *offload,
+			      struct sk_buff *skb);
+void can_rx_offload_irq_finish(struct can_rx_offload *offload);
+void can_rx_offload_threaded_irq_finish(struct can_rx_offload *offload);
+void can_rx_offload_reset(struct can_rx_offload *offload);
+void can_rx_offload_del(struct can_rx_offload *offload);
+void can_rx_offload_enable(struct can_rx_offload *offload);
+
+static inline void can_rx_offload_schedule(struct can_rx_offload *offload)
+{
+	napi_schedule(&offload->napi);
+}
+
+static inline void can_rx_offload_disable(struct can_rx_offload *offload)
+{
+	napi_disable(&offload->napi);
+}
+
+#endif /* CAN_RX_OFFLOAD_H */
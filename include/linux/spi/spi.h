@@ -25,6 +25,7 @@
 #include <linux/kthread.h>
 #include <linux/completion.h>
 #include <linux/scatterlist.h>
+#include <linux/ktime.h>
 
 struct dma_chan;
 
@@ -34,6 +35,66 @@ struct dma_chan;
  */
 extern struct bus_type spi_bus_type;
 
+/**
+ * struct spi_statistics - statistics for spi transfers
+ * @lock: lock protecting this structure
+ *
+ * @messages: number of spi-messages handled
+ * @transfers: number of spi_transfers handled
+ * @errors: number of messages which failed
+ * @timedout: number of messages which failed with a timeout
+ *
+ * @spi_sync: number of times spi_sync is used
+ * @spi_sync_immediate: number of times a message was pumped in the
+ *	calling context of spi_sync instead of the message pump thread
+ * @spi_async: number of times spi_async is used
+ *
+ * @transfers_dma: number of spi_transfers moved by DMA
+ * @transfers_pio: number of spi_transfers moved by the CPU
+ *
+ * @bytes: number of bytes transferred to/from device
+ * @bytes_tx: number of bytes sent to device
+ * @bytes_rx: number of bytes received from device
+ *
+ * @transfer_bytes_histo: log2 histogram of the spi_transfer lengths
+ * @queue_wait_histo: log2 histogram of the time in usecs a message
+ *	waited in the queue before the message pump picked it up
+ * @transfer_time_histo: log2 histogram of the time in usecs from the
+ *	message pump picking a message up until its completion
+ */
+#define SPI_STATISTICS_HISTO_SIZE 17
+struct spi_statistics {
+	spinlock_t		lock; /* lock for the whole structure */
+
+	unsigned long		messages;
+	unsigned long		transfers;
+	unsigned long		errors;
+	unsigned long		timedout;
+
+	unsigned long		spi_sync;
+	unsigned long		spi_sync_immediate;
+	unsigned long		spi_async;
+
+	unsigned long		transfers_dma;
+	unsigned long		transfers_pio;
+
+	unsigned long long	bytes;
+	unsigned long long	bytes_rx;
+	unsigned long long	bytes_tx;
+
+	unsigned long transfer_bytes_histo[SPI_STATISTICS_HISTO_SIZE];
+	unsigned long queue_wait_histo[SPI_STATISTICS_HISTO_SIZE];
+	unsigned long transfer_time_histo[SPI_STATISTICS_HISTO_SIZE];
+};
+
+#define SPI_STATISTICS_INCREMENT_FIELD(stats, field)	\
+	do {						\
+		unsigned long flags;			\
+		spin_lock_irqsave(&(stats)->lock, flags);	\
+		(stats)->field++;			\
+		spin_unlock_irqrestore(&(stats)->lock, flags);	\
+	} while (0)
+
 /**
  * struct spi_device - Master side proxy for an SPI slave device
  * @dev: Driver model representation of the device.
@@ -63,6 +124,7 @@ extern struct bus_type spi_bus_type;
  *	for driver coldplugging, and in uevents used for hotplugging
  * @cs_gpio: gpio number of the chipselect line (optional, -ENOENT when
  *	when not using a GPIO line)
+ * @statistics: statistics for the spi_device
  *
  * A @spi_device is used to interchange data between an SPI slave
  * (usually a discrete chip) and CPU memory.
@@ -102,6 +164,9 @@ struct spi_device {
 	char			modalias[SPI_NAME_SIZE];
 	int			cs_gpio;	/* chip select gpio */
 
+	/* the statistics */
+	struct spi_statistics	statistics;
+
 	/*
 	 * likely need more hooks for more protocol options affecting how
 	 * the controller talks to each chip, like:
@@ -263,6 +328,8 @@ static inline void spi_unregister_driver(struct spi_driver *sdrv)
  * @cur_msg_prepared: spi_prepare_message was called for the currently
  *                    in-flight message
  * @xfer_completion: used by core tranfer_one_message()
+ * @idling: the device is entering idle state
+ * @cur_msg_start: when the message pump picked up the current message
  * @busy: message pump is busy
  * @running: message pump is running
  * @rt: whether this queue is set to run as a realtime task
@@ -299,6 +366,7 @@ static inline void spi_unregister_driver(struct spi_driver *sdrv)
  * @cs_gpios: Array of GPIOs to use as chip select lines; one per CS
  *	number. Any individual value may be -ENOENT for CS lines that
  *	are not GPIOs (driven by the SPI controller itself).
+ * @statistics: statistics for the spi_master
  *
  * Each SPI master controller can communicate with one or more @spi_device
  * children.  These make a small bus, sharing MOSI, MISO and SCK signals
@@ -419,6 +487,8 @@ struct spi_master {
 	spinlock_t			queue_lock;
 	struct list_head		queue;
 	struct spi_message		*cur_msg;
+	bool				idling;
+	ktime_t				cur_msg_start;
 	bool				busy;
 	bool				running;
 	bool				rt;
@@ -455,6 +525,9 @@ struct spi_master {
 	/* dummy data for full duplex devices */
 	void			*dummy_rx;
 	void			*dummy_tx;
+
+	/* statistics */
+	struct spi_statistics	statistics;
 };
 
 static inline void *spi_master_get_devdata(struct spi_master *master)
@@ -677,6 +750,9 @@ struct spi_message {
 	unsigned		actual_length;
 	int			status;
 
+	/* when the message was queued, for the latency statistics */
+	ktime_t			queued;
+
 	/* for optional use by whatever driver currently owns the
 	 * spi_message ...  between calls to spi_async and then later
 	 * complete(), that's the spi_master controller driver.
@@ -26,6 +26,14 @@ struct spi_bitbang {
 	 */
 	int	(*txrx_bufs)(struct spi_device *spi, struct spi_transfer *t);
 
+	/* txrx_chain() optionally moves @n consecutive transfers, starting
+	 * at @t, in one go.  They keep the chip select asserted and share
+	 * the settings of the first one.  Returns the number of bytes moved,
+	 * or -EAGAIN without touching the bus to fall back to txrx_bufs().
+	 */
+	int	(*txrx_chain)(struct spi_device *spi, struct spi_transfer *t,
+			unsigned n);
+
 	/* txrx_word[SPI_MODE_*]() just looks like a shift register */
 	u32	(*txrx_word[4])(struct spi_device *spi,
 			unsigned nsecs,
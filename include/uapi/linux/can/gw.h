@@ -78,6 +78,7 @@ enum {
 	CGW_FILTER,	/* specify struct can_filter on source CAN device */
 	CGW_DELETED,	/* number of deleted CAN frames (see max_hops param) */
 	CGW_LIM_HOPS,	/* limit the number of hops of this specific rule */
+	CGW_LATENCY,	/* struct cgw_latency statistics of routed frames */
 	__CGW_MAX
 };
 
@@ -86,6 +87,7 @@ enum {
 #define CGW_FLAGS_CAN_ECHO 0x01
 #define CGW_FLAGS_CAN_SRC_TSTAMP 0x02
 #define CGW_FLAGS_CAN_IIF_TX_OK 0x04
+#define CGW_FLAGS_CAN_BATCH 0x08	/* send after the current RX softirq */
 
 #define CGW_MOD_FUNCS 4 /* AND OR XOR SET */
 
@@ -127,6 +129,20 @@ struct cgw_csum_crc8 {
 #define CGW_CS_XOR_LEN  sizeof(struct cgw_csum_xor)
 #define CGW_CS_CRC8_LEN  sizeof(struct cgw_csum_crc8)
 
+/*
+ * struct cgw_latency - latency statistics of a gateway job
+ *
+ * The latency of a routed frame is measured from the reception in the
+ * gateway until the frame has been handed to the destination interface.
+ * The average latency is sum_ns / frames.
+ */
+struct cgw_latency {
+	__u64 frames;
+	__u64 min_ns;
+	__u64 max_ns;
+	__u64 sum_ns;
+};
+
 /* CRC8 profiles (compute CRC for additional data elements - see below) */
 enum {
 	CGW_CRC8PRF_UNSPEC,
@@ -156,6 +172,10 @@ enum {
  * <struct can_frame> data used as operator
  * <u8> affected CAN frame elements
  *
+ * CGW_LATENCY (length 32 bytes):
+ * Latency statistics of the routed frames (struct cgw_latency). Only
+ * reported in the job dump, ignored when creating or removing a job.
+ *
  * CGW_LIM_HOPS (length 1 byte):
  * Limit the number of hops of this specific rule. Usually the received CAN
  * frame can be processed as much as 'max_hops' times (which is given at module
@@ -57,6 +57,66 @@ enum {
 	CAN_RAW_LOOPBACK,	/* local loopback (default:on)       */
 	CAN_RAW_RECV_OWN_MSGS,	/* receive my own msgs (default:off) */
 	CAN_RAW_FD_FRAMES,	/* allow CAN FD frames (default:off) */
+	CAN_RAW_RX_RING,	/* set up mmap()ed receive ring      */
+	CAN_RAW_TX_RING,	/* set up mmap()ed transmit ring     */
 };
 
+/* control message type of SOF_TIMESTAMPING TX timestamps (MSG_ERRQUEUE) */
+enum {
+	SCM_CAN_RAW_ERRQUEUE = 1,
+};
+
+/*
+ * Memory mapped frame rings (CAN_RAW_RX_RING / CAN_RAW_TX_RING)
+ *
+ * A ring consists of block_nr blocks of block_size bytes (a multiple of the
+ * page size), each block holding block_size / frame_size slots. frame_nr has
+ * to match the resulting number of slots. Both rings are mapped with a single
+ * mmap() of the socket, the RX ring first, followed by the TX ring. A ring
+ * can not be changed while it is mapped, a block_nr of zero removes it.
+ * The size of a ring is limited by SO_RCVBUF (RX) or SO_SNDBUF (TX).
+ *
+ * Every slot starts with a struct can_raw_slot, the CAN frame follows at
+ * offset CAN_RAW_SLOT_HDRLEN.
+ *
+ * RX: the kernel fills the slots in ring order and passes them to user space
+ * by setting CAN_RAW_SLOT_USER, poll() reports POLLIN while a frame is
+ * pending. User space returns a slot by writing CAN_RAW_SLOT_KERNEL. Frames
+ * which do not find a free slot are dropped and the next delivered slot is
+ * flagged with CAN_RAW_SLOT_LOSING.
+ *
+ * TX: user space fills the slots in ring order and marks them with
+ * CAN_RAW_SLOT_SEND_REQUEST. A send() with a length of zero transmits the
+ * pending slots and hands them back as CAN_RAW_SLOT_KERNEL. Malformed slots
+ * are skipped and flagged CAN_RAW_SLOT_WRONG_FORMAT. A slot ifindex of zero
+ * sends to the bound interface (or the msg_name of the send() call).
+ */
+struct can_raw_ring_req {
+	__u32 block_size;	/* size of a contiguous block        */
+	__u32 block_nr;		/* number of blocks                  */
+	__u32 frame_size;	/* size of a slot                    */
+	__u32 frame_nr;		/* total number of slots             */
+};
+
+struct can_raw_slot {
+	__u32 status;		/* CAN_RAW_SLOT_* ownership/flags    */
+	__u32 len;		/* CAN_MTU or CANFD_MTU              */
+	__s32 ifindex;		/* receiving or sending interface    */
+	__u32 flags;		/* MSG_DONTROUTE, MSG_CONFIRM (RX)   */
+	__u32 sec;		/* receive timestamp (RX)            */
+	__u32 nsec;
+};
+
+#define CAN_RAW_SLOT_KERNEL		0x00 /* RX: free, TX: available   */
+#define CAN_RAW_SLOT_USER		0x01 /* RX: frame for user space  */
+#define CAN_RAW_SLOT_LOSING		0x02 /* RX: frames were dropped   */
+#define CAN_RAW_SLOT_SEND_REQUEST	0x04 /* TX: frame to be sent      */
+#define CAN_RAW_SLOT_WRONG_FORMAT	0x08 /* TX: frame was rejected    */
+#define CAN_RAW_SLOT_TS_HW		0x10 /* RX: controller timestamp  */
+
+#define CAN_RAW_SLOT_ALIGNMENT	16
+#define CAN_RAW_SLOT_ALIGN(x)	(((x) + CAN_RAW_SLOT_ALIGNMENT - 1) & \
+				 ~(CAN_RAW_SLOT_ALIGNMENT - 1))
+#define CAN_RAW_SLOT_HDRLEN	CAN_RAW_SLOT_ALIGN(sizeof(struct can_raw_slot))
+
 #endif
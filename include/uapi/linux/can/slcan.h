@@ -0,0 +1,45 @@
+/*
+ * linux/can/slcan.h
+ *
+ * Definitions for the serial line CAN interface (slcan)
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ */
+
+#ifndef _UAPI_CAN_SLCAN_H
+#define _UAPI_CAN_SLCAN_H
+
+/*
+ * Framing modes, selected with the SIOCSIFENCAP ioctl on the tty and
+ * read back with SIOCGIFENCAP.
+ *
+ * SLCAN_MODE_ASCII is the classic Lawicel ASCII protocol.
+ *
+ * SLCAN_MODE_BINARY sends every frame as
+ *
+ *   <hdr> <id> <data>* <END>
+ *
+ * hdr:  bit 7 extended frame, bit 6 RTR, bits 3..0 dlc, the rest is 0
+ * id:   2 (standard) or 4 (extended) bytes, big endian
+ * data: dlc bytes, none for RTR frames
+ *
+ * END and ESC bytes inside a frame are escaped as in SLIP. Empty frames
+ * (two END in a row) are ignored, so a sender may start with an END to
+ * flush line noise.
+ */
+#define SLCAN_MODE_ASCII	0
+#define SLCAN_MODE_BINARY	1
+
+#define SLCAN_BIN_END		0xc0	/* ends a frame */
+#define SLCAN_BIN_ESC		0xdb	/* escapes the next byte */
+#define SLCAN_BIN_ESC_END	0xdc	/* ESC ESC_END means END data byte */
+#define SLCAN_BIN_ESC_ESC	0xdd	/* ESC ESC_ESC means ESC data byte */
+
+#define SLCAN_BIN_HDR_EFF	0x80
+#define SLCAN_BIN_HDR_RTR	0x40
+#define SLCAN_BIN_HDR_DLC	0x0f
+
+#endif /* !_UAPI_CAN_SLCAN_H */
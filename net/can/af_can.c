@@ -46,6 +46,7 @@
 #include <linux/kmod.h>
 #include <linux/slab.h>
 #include <linux/list.h>
+#include <linux/hash.h>
 #include <linux/spinlock.h>
 #include <linux/rcupdate.h>
 #include <linux/uaccess.h>
@@ -90,6 +91,7 @@ static DEFINE_MUTEX(proto_tab_lock);
 
 struct timer_list can_stattimer;   /* timer for statistics update */
 struct s_stats    can_stats;       /* packet statistics */
+DEFINE_PER_CPU(struct can_pcpu_stats, can_pcpu_stats);
 struct s_pstats   can_pstats;      /* receive list statistics */
 
 /*
@@ -314,8 +316,7 @@ int can_send(struct sk_buff *skb, int loop)
 		netif_rx_ni(newskb);
 
 	/* update statistics */
-	can_stats.tx_frames++;
-	can_stats.tx_frames_delta++;
+	this_cpu_inc(can_pcpu_stats.tx_frames);
 
 	return 0;
 
@@ -337,11 +338,52 @@ static struct dev_rcv_lists *find_dev_rcv_lists(struct net_device *dev)
 		return (struct dev_rcv_lists *)dev->ml_priv;
 }
 
+static unsigned int effhash(canid_t can_id)
+{
+	return hash_32(can_id & CAN_EFF_MASK, CAN_EFF_RCV_HASH_BITS);
+}
+
+static unsigned int filhash(canid_t can_id)
+{
+	return hash_32(can_id, CAN_FIL_RCV_HASH_BITS);
+}
+
+/*
+ * find_mask_group - find (or create) the receiver group for a mask
+ *
+ * Called with can_rcvlists_lock held. Returns NULL when there is no
+ * group for @mask and @create is not set or the allocation failed.
+ */
+static struct rcv_mask_group *find_mask_group(struct dev_rcv_lists *d,
+					      canid_t mask, bool create)
+{
+	struct rcv_mask_group *g;
+
+	hlist_for_each_entry(g, &d->rx_fil, list) {
+		if (g->mask == mask)
+			return g;
+	}
+
+	if (!create)
+		return NULL;
+
+	g = kzalloc(sizeof(*g), GFP_ATOMIC);
+	if (!g)
+		return NULL;
+
+	g->mask = mask;
+	hlist_add_head_rcu(&g->list, &d->rx_fil);
+
+	return g;
+}
+
 /**
  * find_rcv_list - determine optimal filterlist inside device filter struct
  * @can_id: pointer to CAN identifier of a given can_filter
  * @mask: pointer to CAN mask of a given can_filter
  * @d: pointer to the device filter struct
+ * @group: returns the mask group of a can_id/mask filter, NULL otherwise
+ * @create: create a missing mask group (registration)
  *
  * Description:
  *  Returns the optimal filterlist to reduce the filter handling in the
@@ -360,14 +402,20 @@ static struct dev_rcv_lists *find_dev_rcv_lists(struct net_device *dev)
  *  frames there is a special filterlist and a special rx path filter handling.
  *
  * Return:
- *  Pointer to optimal filterlist for the given can_id/mask pair.
+ *  Pointer to optimal filterlist for the given can_id/mask pair, NULL if
+ *  the mask group does not exist and could not be created.
  *  Constistency checked mask.
  *  Reduced can_id to have a preprocessed filter compare value.
  */
 static struct hlist_head *find_rcv_list(canid_t *can_id, canid_t *mask,
-					struct dev_rcv_lists *d)
+					struct dev_rcv_lists *d,
+					struct rcv_mask_group **group,
+					bool create)
 {
 	canid_t inv = *can_id & CAN_INV_FILTER; /* save flag before masking */
+	struct rcv_mask_group *g;
+
+	*group = NULL;
 
 	/* filter for error message frames in extra filterlist */
 	if (*mask & CAN_ERR_FLAG) {
@@ -400,18 +448,21 @@ static struct hlist_head *find_rcv_list(canid_t *can_id, canid_t *mask,
 	    !(*can_id & CAN_RTR_FLAG)) {
 
 		if (*can_id & CAN_EFF_FLAG) {
-			if (*mask == (CAN_EFF_MASK | CAN_EFF_RTR_FLAGS)) {
-				/* RFC: a future use-case for hash-tables? */
-				return &d->rx[RX_EFF];
-			}
+			if (*mask == (CAN_EFF_MASK | CAN_EFF_RTR_FLAGS))
+				return &d->rx_eff[effhash(*can_id)];
 		} else {
 			if (*mask == (CAN_SFF_MASK | CAN_EFF_RTR_FLAGS))
 				return &d->rx_sff[*can_id];
 		}
 	}
 
-	/* default: filter via can_id/can_mask */
-	return &d->rx[RX_FIL];
+	/* default: filter via can_id/can_mask, grouped by mask */
+	g = find_mask_group(d, *mask, create);
+	if (!g)
+		return NULL;
+
+	*group = g;
+	return &g->rx[filhash(*can_id)];
 }
 
 /**
@@ -450,6 +501,7 @@ int can_rx_register(struct net_device *dev, canid_t can_id, canid_t mask,
 	struct receiver *r;
 	struct hlist_head *rl;
 	struct dev_rcv_lists *d;
+	struct rcv_mask_group *g;
 	int err = 0;
 
 	/* insert new receiver  (dev,canid,mask) -> (func,data) */
@@ -465,7 +517,12 @@ int can_rx_register(struct net_device *dev, canid_t can_id, canid_t mask,
 
 	d = find_dev_rcv_lists(dev);
 	if (d) {
-		rl = find_rcv_list(&can_id, &mask, d);
+		rl = find_rcv_list(&can_id, &mask, d, &g, true);
+		if (!rl) {
+			kmem_cache_free(rcv_cache, r);
+			err = -ENOMEM;
+			goto out;
+		}
 
 		r->can_id  = can_id;
 		r->mask    = mask;
@@ -476,6 +533,8 @@ int can_rx_register(struct net_device *dev, canid_t can_id, canid_t mask,
 
 		hlist_add_head_rcu(&r->list, rl);
 		d->entries++;
+		if (g)
+			g->entries++;
 
 		can_pstats.rcv_entries++;
 		if (can_pstats.rcv_entries_max < can_pstats.rcv_entries)
@@ -485,6 +544,7 @@ int can_rx_register(struct net_device *dev, canid_t can_id, canid_t mask,
 		err = -ENODEV;
 	}
 
+ out:
 	spin_unlock(&can_rcvlists_lock);
 
 	return err;
@@ -518,6 +578,7 @@ void can_rx_unregister(struct net_device *dev, canid_t can_id, canid_t mask,
 	struct receiver *r = NULL;
 	struct hlist_head *rl;
 	struct dev_rcv_lists *d;
+	struct rcv_mask_group *g;
 
 	if (dev && dev->type != ARPHRD_CAN)
 		return;
@@ -532,7 +593,7 @@ void can_rx_unregister(struct net_device *dev, canid_t can_id, canid_t mask,
 		goto out;
 	}
 
-	rl = find_rcv_list(&can_id, &mask, d);
+	rl = find_rcv_list(&can_id, &mask, d, &g, false);
 
 	/*
 	 * Search the receiver list for the item to delete.  This should
@@ -540,10 +601,12 @@ void can_rx_unregister(struct net_device *dev, canid_t can_id, canid_t mask,
 	 * been registered before.
 	 */
 
-	hlist_for_each_entry_rcu(r, rl, list) {
-		if (r->can_id == can_id && r->mask == mask &&
-		    r->func == func && r->data == data)
-			break;
+	if (rl) {
+		hlist_for_each_entry_rcu(r, rl, list) {
+			if (r->can_id == can_id && r->mask == mask &&
+			    r->func == func && r->data == data)
+				break;
+		}
 	}
 
 	/*
@@ -560,6 +623,12 @@ void can_rx_unregister(struct net_device *dev, canid_t can_id, canid_t mask,
 	hlist_del_rcu(&r->list);
 	d->entries--;
 
+	/* drop the mask group with its last receiver */
+	if (g && !--g->entries) {
+		hlist_del_rcu(&g->list);
+		kfree_rcu(g, rcu);
+	}
+
 	if (can_pstats.rcv_entries > 0)
 		can_pstats.rcv_entries--;
 
@@ -587,9 +656,11 @@ static inline void deliver(struct sk_buff *skb, struct receiver *r)
 static int can_rcv_filter(struct dev_rcv_lists *d, struct sk_buff *skb)
 {
 	struct receiver *r;
+	struct rcv_mask_group *g;
 	int matches = 0;
 	struct can_frame *cf = (struct can_frame *)skb->data;
 	canid_t can_id = cf->can_id;
+	canid_t fil_id;
 
 	if (d->entries == 0)
 		return 0;
@@ -611,11 +682,14 @@ static int can_rcv_filter(struct dev_rcv_lists *d, struct sk_buff *skb)
 		matches++;
 	}
 
-	/* check for can_id/mask entries */
-	hlist_for_each_entry_rcu(r, &d->rx[RX_FIL], list) {
-		if ((can_id & r->mask) == r->can_id) {
-			deliver(skb, r);
-			matches++;
+	/* check for can_id/mask entries, one lookup per distinct mask */
+	hlist_for_each_entry_rcu(g, &d->rx_fil, list) {
+		fil_id = can_id & g->mask;
+		hlist_for_each_entry_rcu(r, &g->rx[filhash(fil_id)], list) {
+			if (r->can_id == fil_id) {
+				deliver(skb, r);
+				matches++;
+			}
 		}
 	}
 
@@ -632,7 +706,9 @@ static int can_rcv_filter(struct dev_rcv_lists *d, struct sk_buff *skb)
 		return matches;
 
 	if (can_id & CAN_EFF_FLAG) {
-		hlist_for_each_entry_rcu(r, &d->rx[RX_EFF], list) {
+		unsigned int h = effhash(can_id);
+
+		hlist_for_each_entry_rcu(r, &d->rx_eff[h], list) {
 			if (r->can_id == can_id) {
 				deliver(skb, r);
 				matches++;
@@ -655,8 +731,7 @@ static void can_receive(struct sk_buff *skb, struct net_device *dev)
 	int matches;
 
 	/* update statistics */
-	can_stats.rx_frames++;
-	can_stats.rx_frames_delta++;
+	this_cpu_inc(can_pcpu_stats.rx_frames);
 
 	rcu_read_lock();
 
@@ -673,10 +748,8 @@ static void can_receive(struct sk_buff *skb, struct net_device *dev)
 	/* consume the skbuff allocated by the netdevice driver */
 	consume_skb(skb);
 
-	if (matches > 0) {
-		can_stats.matches++;
-		can_stats.matches_delta++;
-	}
+	if (matches > 0)
+		this_cpu_inc(can_pcpu_stats.matches);
 }
 
 static int can_rcv(struct sk_buff *skb, struct net_device *dev,
@@ -885,9 +958,11 @@ static __init int can_init(void)
 		return -ENOMEM;
 
 	if (stats_timer) {
-		/* the statistics are updated every second (timer triggered) */
+		/*
+		 * the statistics are updated every second (timer triggered)
+		 * while /proc/net/can/stats is held open - see proc.c
+		 */
 		setup_timer(&can_stattimer, can_stat_update, 0);
-		mod_timer(&can_stattimer, round_jiffies(jiffies + HZ));
 	} else
 		can_stattimer.function = NULL;
 
@@ -43,6 +43,7 @@
 #include <linux/skbuff.h>
 #include <linux/netdevice.h>
 #include <linux/list.h>
+#include <linux/percpu.h>
 #include <linux/rcupdate.h>
 #include <linux/can.h>
 
@@ -59,18 +60,52 @@ struct receiver {
 	char *ident;
 };
 
-enum { RX_ERR, RX_ALL, RX_FIL, RX_INV, RX_EFF, RX_MAX };
+enum { RX_ERR, RX_ALL, RX_INV, RX_MAX };
+
+/* single 11 bit can_ids are directly indexed, 29 bit can_ids are hashed */
+#define CAN_SFF_RCV_ARRAY_SZ (1 << CAN_SFF_ID_BITS)
+#define CAN_EFF_RCV_HASH_BITS 10
+#define CAN_EFF_RCV_ARRAY_SZ (1 << CAN_EFF_RCV_HASH_BITS)
+
+/*
+ * can_id/mask receivers are grouped by their mask. Within a group the
+ * receivers are hashed by their (masked) can_id, so a received frame
+ * costs one hash lookup per distinct mask instead of one compare per
+ * receiver.
+ */
+#define CAN_FIL_RCV_HASH_BITS 6
+#define CAN_FIL_RCV_ARRAY_SZ (1 << CAN_FIL_RCV_HASH_BITS)
+
+struct rcv_mask_group {
+	struct hlist_node list;
+	struct rcu_head rcu;
+	canid_t mask;
+	int entries;
+	struct hlist_head rx[CAN_FIL_RCV_ARRAY_SZ];
+};
 
 /* per device receive filters linked at dev->ml_priv */
 struct dev_rcv_lists {
 	struct hlist_head rx[RX_MAX];
-	struct hlist_head rx_sff[0x800];
+	struct hlist_head rx_sff[CAN_SFF_RCV_ARRAY_SZ];
+	struct hlist_head rx_eff[CAN_EFF_RCV_ARRAY_SZ];
+	struct hlist_head rx_fil; /* list of struct rcv_mask_group */
 	int remove_on_zero_entries;
 	int entries;
 };
 
 /* statistic structures */
 
+/*
+ * per-CPU packet counters, only ever incremented in the hot paths and
+ * summed up by can_stats_refresh() when the statistics are read
+ */
+struct can_pcpu_stats {
+	unsigned long rx_frames;
+	unsigned long tx_frames;
+	unsigned long matches;
+};
+
 /* can be reset e.g. by can_init_stats() */
 struct s_stats {
 	unsigned long jiffies_init;
@@ -91,9 +126,11 @@ struct s_stats {
 	unsigned long max_tx_rate;
 	unsigned long max_rx_match_ratio;
 
-	unsigned long rx_frames_delta;
-	unsigned long tx_frames_delta;
-	unsigned long matches_delta;
+	/* snapshot of the last rate calculation for the 'current' values */
+	unsigned long jiffies_last;
+	unsigned long rx_frames_last;
+	unsigned long tx_frames_last;
+	unsigned long matches_last;
 };
 
 /* persistent statistics */
@@ -115,6 +152,7 @@ void can_stat_update(unsigned long data);
 /* structures and variables from af_can.c needed in proc.c for reading */
 extern struct timer_list can_stattimer;    /* timer for statistics update */
 extern struct s_stats    can_stats;        /* packet statistics */
+DECLARE_PER_CPU(struct can_pcpu_stats, can_pcpu_stats);
 extern struct s_pstats   can_pstats;       /* receive list statistics */
 extern struct hlist_head can_rx_dev_list;  /* rx dispatcher structures */
 
@@ -44,6 +44,8 @@
 #include <linux/interrupt.h>
 #include <linux/hrtimer.h>
 #include <linux/list.h>
+#include <linux/mutex.h>
+#include <linux/timerqueue.h>
 #include <linux/proc_fs.h>
 #include <linux/seq_file.h>
 #include <linux/uio.h>
@@ -78,6 +80,9 @@
 		     (CAN_SFF_MASK | CAN_EFF_FLAG | CAN_RTR_FLAG))
 
 #define CAN_BCM_VERSION CAN_VERSION
+
+#define BCM_MIN_NAMELEN CAN_REQUIRED_SIZE(struct sockaddr_can, can_ifindex)
+
 static __initconst const char banner[] = KERN_INFO
 	"can: broadcast manager protocol (rev " CAN_BCM_VERSION " t)\n";
 
@@ -86,12 +91,40 @@ MODULE_LICENSE("Dual BSD/GPL");
 MODULE_AUTHOR("Oliver Hartkopp <oliver.hartkopp@volkswagen.de>");
 MODULE_ALIAS("can-proto-2");
 
+#define BCM_DEFAULT_TX_SLACK_US 1000
+
+static unsigned int tx_slack_us __read_mostly = BCM_DEFAULT_TX_SLACK_US;
+module_param(tx_slack_us, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(tx_slack_us,
+		 "time in us a cyclic transmission may be moved to send it "
+		 "together with others "
+		 "(default: " __stringify(BCM_DEFAULT_TX_SLACK_US) " us)");
+
 /* easy access to can_frame payload */
 static inline u64 GET_U64(const struct can_frame *cp)
 {
 	return *(u64 *)cp->data;
 }
 
+/*
+ * All cyclic tx ops of a CAN interface share one timer: the ops are kept
+ * in a timerqueue sorted by their next transmission time, the timer is
+ * programmed to the first one with a slack of tx_slack_us and sends every
+ * op that is due within the slack as one batch.
+ */
+struct bcm_tx_wheel {
+	struct list_head list;
+	int ifindex;
+	unsigned int users;
+	spinlock_t lock;
+	struct timerqueue_head ops;
+	struct tasklet_hrtimer timer;
+};
+
+/* all tx wheels, protected by bcm_tx_wheel_mutex */
+static LIST_HEAD(bcm_tx_wheels);
+static DEFINE_MUTEX(bcm_tx_wheel_mutex);
+
 struct bcm_op {
 	struct list_head list;
 	int ifindex;
@@ -112,6 +145,9 @@ struct bcm_op {
 	struct can_frame last_sframe;
 	struct sock *sk;
 	struct net_device *rx_reg_dev;
+	struct bcm_tx_wheel *wheel;
+	struct timerqueue_node tx_node;
+	struct list_head tx_due;
 };
 
 static struct proc_dir_entry *proc_dir;
@@ -346,22 +382,73 @@ static void bcm_send_to_user(struct bcm_op *op, struct bcm_msg_head *head,
 	}
 }
 
-static void bcm_tx_start_timer(struct bcm_op *op)
+/* interval to the next transmission of a tx op, zero if there is none */
+static ktime_t bcm_tx_ival(const struct bcm_op *op)
 {
 	if (op->kt_ival1.tv64 && op->count)
-		hrtimer_start(&op->timer,
-			      ktime_add(ktime_get(), op->kt_ival1),
-			      HRTIMER_MODE_ABS);
-	else if (op->kt_ival2.tv64)
-		hrtimer_start(&op->timer,
-			      ktime_add(ktime_get(), op->kt_ival2),
-			      HRTIMER_MODE_ABS);
+		return op->kt_ival1;
+
+	return op->kt_ival2;
 }
 
-static void bcm_tx_timeout_tsklet(unsigned long data)
+/* (re)program the wheel timer to the first op, called with wheel->lock */
+static void bcm_tx_wheel_program(struct bcm_tx_wheel *wheel)
+{
+	struct hrtimer *timer = &wheel->timer.timer;
+	struct timerqueue_node *next = timerqueue_getnext(&wheel->ops);
+
+	/* an idle wheel may fire once more, it finds nothing to do then */
+	if (!next)
+		return;
+
+	if (hrtimer_is_queued(timer) &&
+	    ktime_to_ns(hrtimer_get_softexpires(timer)) <=
+	    ktime_to_ns(next->expires))
+		return;
+
+	hrtimer_start_range_ns(timer, next->expires,
+			       (unsigned long)tx_slack_us * NSEC_PER_USEC,
+			       HRTIMER_MODE_ABS);
+}
+
+/* queue @op for transmission at @expires, called with wheel->lock */
+static void bcm_tx_wheel_add(struct bcm_op *op, ktime_t expires)
+{
+	struct bcm_tx_wheel *wheel = op->wheel;
+
+	if (!RB_EMPTY_NODE(&op->tx_node.node))
+		timerqueue_del(&wheel->ops, &op->tx_node);
+
+	op->tx_node.expires = expires;
+	timerqueue_add(&wheel->ops, &op->tx_node);
+	bcm_tx_wheel_program(wheel);
+}
+
+static void bcm_tx_start_timer(struct bcm_op *op)
+{
+	ktime_t ival = bcm_tx_ival(op);
+
+	spin_lock_bh(&op->wheel->lock);
+	if (ival.tv64)
+		bcm_tx_wheel_add(op, ktime_add(ktime_get(), ival));
+	spin_unlock_bh(&op->wheel->lock);
+}
+
+static void bcm_tx_stop_timer(struct bcm_op *op)
+{
+	struct bcm_tx_wheel *wheel = op->wheel;
+
+	spin_lock_bh(&wheel->lock);
+	if (!RB_EMPTY_NODE(&op->tx_node.node))
+		timerqueue_del(&wheel->ops, &op->tx_node);
+	spin_unlock_bh(&wheel->lock);
+}
+
+/* send the next frame of a due tx op, called with wheel->lock */
+static void bcm_tx_timeout(struct bcm_op *op, ktime_t now)
 {
-	struct bcm_op *op = (struct bcm_op *)data;
 	struct bcm_msg_head msg_head;
+	ktime_t ival, expires;
 
 	if (op->kt_ival1.tv64 && (op->count > 0)) {
 
@@ -384,21 +471,105 @@ static void bcm_tx_timeout_tsklet(unsigned long data)
 	} else if (op->kt_ival2.tv64)
 		bcm_can_tx(op);
 
-	bcm_tx_start_timer(op);
+	ival = bcm_tx_ival(op);
+	if (!ival.tv64)
+		return;
+
+	/*
+	 * Keep the cycle of the op instead of accumulating the slack, unless
+	 * the transmission was late by more than a whole interval.
+	 */
+	expires = ktime_add(op->tx_node.expires, ival);
+	if (ktime_to_ns(expires) <= ktime_to_ns(now))
+		expires = ktime_add(now, ival);
+
+	op->tx_node.expires = expires;
+	timerqueue_add(&op->wheel->ops, &op->tx_node);
 }
 
 /*
- * bcm_tx_timeout_handler - performs cyclic CAN frame transmissions
+ * bcm_tx_wheel_handler - performs the due cyclic CAN frame transmissions
+ *                        of one CAN interface
  */
-static enum hrtimer_restart bcm_tx_timeout_handler(struct hrtimer *hrtimer)
+static enum hrtimer_restart bcm_tx_wheel_handler(struct hrtimer *hrtimer)
 {
-	struct bcm_op *op = container_of(hrtimer, struct bcm_op, timer);
+	struct bcm_tx_wheel *wheel = container_of(hrtimer, struct bcm_tx_wheel,
+						  timer.timer);
+	struct timerqueue_node *node;
+	ktime_t now, horizon;
+	LIST_HEAD(due);
+	struct bcm_op *op, *n;
+
+	spin_lock(&wheel->lock);
+
+	now = ktime_get();
+	horizon = ktime_add_us(now, tx_slack_us);
+
+	/* take all due ops out first, they are queued again with new times */
+	while ((node = timerqueue_getnext(&wheel->ops)) &&
+	       ktime_to_ns(node->expires) <= ktime_to_ns(horizon)) {
+		op = container_of(node, struct bcm_op, tx_node);
+		timerqueue_del(&wheel->ops, node);
+		list_add_tail(&op->tx_due, &due);
+	}
+
+	list_for_each_entry_safe(op, n, &due, tx_due) {
+		list_del(&op->tx_due);
+		bcm_tx_timeout(op, now);
+	}
 
-	tasklet_schedule(&op->tsklet);
+	bcm_tx_wheel_program(wheel);
+
+	spin_unlock(&wheel->lock);
 
 	return HRTIMER_NORESTART;
 }
 
+/* get the tx wheel of @ifindex, called from process context */
+static struct bcm_tx_wheel *bcm_tx_wheel_get(int ifindex)
+{
+	struct bcm_tx_wheel *wheel;
+
+	mutex_lock(&bcm_tx_wheel_mutex);
+
+	list_for_each_entry(wheel, &bcm_tx_wheels, list) {
+		if (wheel->ifindex == ifindex) {
+			wheel->users++;
+			goto out;
+		}
+	}
+
+	wheel = kzalloc(sizeof(*wheel), GFP_KERNEL);
+	if (!wheel)
+		goto out;
+
+	wheel->ifindex = ifindex;
+	wheel->users = 1;
+	spin_lock_init(&wheel->lock);
+	timerqueue_init_head(&wheel->ops);
+	tasklet_hrtimer_init(&wheel->timer, bcm_tx_wheel_handler,
+			     CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	list_add(&wheel->list, &bcm_tx_wheels);
+ out:
+	mutex_unlock(&bcm_tx_wheel_mutex);
+
+	return wheel;
+}
+
+static void bcm_tx_wheel_put(struct bcm_tx_wheel *wheel)
+{
+	mutex_lock(&bcm_tx_wheel_mutex);
+	if (--wheel->users) {
+		mutex_unlock(&bcm_tx_wheel_mutex);
+		return;
+	}
+	list_del(&wheel->list);
+	mutex_unlock(&bcm_tx_wheel_mutex);
+
+	tasklet_hrtimer_cancel(&wheel->timer);
+	kfree(wheel);
+}
+
 /*
  * bcm_rx_changed - create a RX_CHANGED notification due to changed content
  */
@@ -706,6 +877,11 @@ static struct bcm_op *bcm_find_op(struct list_head *ops, canid_t can_id,
 
 static void bcm_remove_op(struct bcm_op *op)
 {
+	if (op->wheel) {
+		bcm_tx_stop_timer(op);
+		bcm_tx_wheel_put(op->wheel);
+	}
+
 	hrtimer_cancel(&op->timer);
 	hrtimer_cancel(&op->thrtimer);
 
@@ -916,19 +1092,22 @@ static int bcm_tx_setup(struct bcm_msg_head *msg_head, struct msghdr *msg,
 		/* tx_ops never compare with previous received messages */
 		op->last_frames = NULL;
 
-		/* bcm_can_tx / bcm_tx_timeout_handler needs this */
+		/* bcm_can_tx / bcm_tx_wheel_handler needs this */
 		op->sk = sk;
 		op->ifindex = ifindex;
 
-		/* initialize uninitialized (kzalloc) structure */
-		hrtimer_init(&op->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
-		op->timer.function = bcm_tx_timeout_handler;
-
-		/* initialize tasklet for tx countevent notification */
-		tasklet_init(&op->tsklet, bcm_tx_timeout_tsklet,
-			     (unsigned long) op);
+		/* cyclic transmissions are done by the wheel of the device */
+		op->wheel = bcm_tx_wheel_get(ifindex);
+		if (!op->wheel) {
+			if (op->frames != &op->sframe)
+				kfree(op->frames);
+			kfree(op);
+			return -ENOMEM;
+		}
+		timerqueue_init(&op->tx_node);
 
 		/* currently unused in tx_ops */
+		hrtimer_init(&op->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
 		hrtimer_init(&op->thrtimer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
 
 		/* add this bcm_op to the list of the tx_ops */
@@ -961,11 +1140,11 @@ static int bcm_tx_setup(struct bcm_msg_head *msg_head, struct msghdr *msg,
 
 		/* disable an active timer due to zero values? */
 		if (!op->kt_ival1.tv64 && !op->kt_ival2.tv64)
-			hrtimer_cancel(&op->timer);
+			bcm_tx_stop_timer(op);
 	}
 
 	if (op->flags & STARTTIMER) {
-		hrtimer_cancel(&op->timer);
+		bcm_tx_stop_timer(op);
 		/* spec: send can_frame when starting timer */
 		op->flags |= TX_ANNOUNCE;
 	}
@@ -1084,7 +1263,7 @@ static int bcm_rx_setup(struct bcm_msg_head *msg_head, struct msghdr *msg,
 			}
 		}
 
-		/* bcm_can_tx / bcm_tx_timeout_handler needs this */
+		/* bcm_can_tx / bcm_tx_timeout() from the wheel needs this */
 		op->sk = sk;
 		op->ifindex = ifindex;
 
@@ -1258,7 +1437,7 @@ static int bcm_sendmsg(struct kiocb *iocb, struct socket *sock,
 		/* no bound device as default => check msg_name */
 		DECLARE_SOCKADDR(struct sockaddr_can *, addr, msg->msg_name);
 
-		if (msg->msg_namelen < sizeof(*addr))
+		if (msg->msg_namelen < BCM_MIN_NAMELEN)
 			return -EINVAL;
 
 		if (addr->can_family != AF_CAN)
@@ -1500,7 +1679,7 @@ static int bcm_connect(struct socket *sock, struct sockaddr *uaddr, int len,
 	struct sock *sk = sock->sk;
 	struct bcm_sock *bo = bcm_sk(sk);
 
-	if (len < sizeof(*addr))
+	if (len < BCM_MIN_NAMELEN)
 		return -EINVAL;
 
 	if (bo->bound)
@@ -1568,7 +1747,7 @@ static int bcm_recvmsg(struct kiocb *iocb, struct socket *sock,
 
 	if (msg->msg_name) {
 		__sockaddr_check_size(sizeof(struct sockaddr_can));
-		msg->msg_namelen = sizeof(struct sockaddr_can);
+		msg->msg_namelen = BCM_MIN_NAMELEN;
 		memcpy(msg->msg_name, skb->cb, msg->msg_namelen);
 	}
 
@@ -0,0 +1,818 @@
+/*
+ * gen.c - CAN traffic generator and latency benchmark
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the version 2 of the GNU General Public License
+ * as published by the Free Software Foundation
+ *
+ * A pktgen like load generator for CAN network devices. Devices are added
+ * with "add <ifname>" to /proc/net/can-gen/ctrl, each one gets a file
+ * /proc/net/can-gen/<ifname> that takes the commands below and shows the
+ * configuration, the transmit statistics and the latency histogram.
+ *
+ *   ids <first> <last>	CAN ID range (hex), EFF if beyond 0x7FF
+ *   idmode seq|random	walk the ID range or pick IDs at random
+ *   eff 0|1		send extended frame format IDs
+ *   fd 0|1		send CAN FD frames (the device has to support them)
+ *   dlc <min> <max>	DLC range, picked at random (0..8, FD: 0..15)
+ *   rate <fps>		frames per second, 0 = as fast as possible
+ *   burst <n>		frames sent back to back per rate interval
+ *   count <n>		stop after n frames, 0 = run until "stop"
+ *   rxdev <ifname>	measure the latency on this device (default: own)
+ *   start | stop | clear
+ *
+ * Frames with at least 8 bytes of payload carry a sequence number and the
+ * low 32 bit of the CLOCK_MONOTONIC send time (in ns). The receive side
+ * listens for the configured IDs on the rx device (the local loopback of
+ * the device itself or a second interface on the same bus) and accounts
+ * the latency in a log2 histogram with 1 us resolution. Other traffic
+ * with the same IDs on the bus falsifies the results.
+ */
+
+#include <linux/module.h>
+#include <linux/init.h>
+#include <linux/kthread.h>
+#include <linux/mutex.h>
+#include <linux/netdevice.h>
+#include <linux/if_arp.h>
+#include <linux/proc_fs.h>
+#include <linux/random.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+#include <linux/uaccess.h>
+#include <linux/can.h>
+#include <linux/can/core.h>
+#include <linux/can/skb.h>
+#include <net/net_namespace.h>
+#include <asm/unaligned.h>
+
+#define CAN_GEN_NAME "can-gen"
+
+MODULE_DESCRIPTION("PF_CAN traffic generator and latency benchmark");
+MODULE_LICENSE("GPL v2");
+
+static __initconst const char banner[] =
+	KERN_INFO "can: traffic generator\n";
+
+/* bucket n counts latencies of [2^(n-1), 2^n) us, bucket 0 is < 1 us */
+#define CGEN_HIST_BUCKETS 24
+
+/* payload layout of timed frames */
+#define CGEN_SEQ_OFF 0
+#define CGEN_STAMP_OFF 4
+#define CGEN_TIMED_LEN 8
+
+#define CGEN_CMD_MAX 64
+
+struct cgen_dev {
+	struct list_head list;
+	struct net_device *dev;
+	struct net_device *rx_dev;
+	struct proc_dir_entry *pde;
+	struct task_struct *thread;
+	bool removed;
+
+	/* configuration */
+	canid_t id_first, id_last;
+	bool id_random;
+	bool eff;
+	bool fd;
+	u8 dlc_min, dlc_max;
+	u32 rate;
+	u32 burst;
+	u64 count;
+
+	/* transmit side, only written by the thread */
+	canid_t id_next;
+	u32 seq;
+	u64 tx_frames;
+	u64 tx_errors;
+	u64 tx_busy;
+	ktime_t tx_start;
+	ktime_t tx_end;
+	bool running;
+
+	/* receive side */
+	bool rx_registered;
+	spinlock_t rx_lock;
+	u64 rx_frames;
+	u64 rx_timed;
+	u64 rx_lost;
+	u32 rx_seq;
+	u64 lat_min, lat_max, lat_sum;
+	u64 hist[CGEN_HIST_BUCKETS];
+};
+
+/* all generator devices, protected by cgen_mutex */
+static LIST_HEAD(cgen_list);
+static DEFINE_MUTEX(cgen_mutex);
+
+static struct proc_dir_entry *cgen_proc_dir;
+
+static const u8 cgen_dlc2len[] = {0, 1, 2, 3, 4, 5, 6, 7,
+				  8, 12, 16, 20, 24, 32, 48, 64};
+
+static u8 cgen_len(const struct cgen_dev *gd)
+{
+	u8 dlc = gd->dlc_min;
+
+	if (gd->dlc_max > gd->dlc_min)
+		dlc += prandom_u32() % (gd->dlc_max - gd->dlc_min + 1);
+
+	return gd->fd ? cgen_dlc2len[dlc] : dlc;
+}
+
+static canid_t cgen_id(struct cgen_dev *gd)
+{
+	canid_t id;
+
+	if (gd->id_random) {
+		id = gd->id_first +
+			prandom_u32() % (gd->id_last - gd->id_first + 1);
+	} else {
+		id = gd->id_next;
+		gd->id_next = (id >= gd->id_last) ? gd->id_first : id + 1;
+	}
+
+	return gd->eff ? id | CAN_EFF_FLAG : id;
+}
+
+static int cgen_xmit(struct cgen_dev *gd)
+{
+	unsigned int mtu = gd->fd ? CANFD_MTU : CAN_MTU;
+	struct canfd_frame *cfd;
+	struct sk_buff *skb;
+	int err;
+
+	skb = alloc_skb(mtu + sizeof(struct can_skb_priv), GFP_KERNEL);
+	if (!skb)
+		return -ENOMEM;
+
+	can_skb_reserve(skb);
+	can_skb_prv(skb)->ifindex = gd->dev->ifindex;
+
+	cfd = (struct canfd_frame *)skb_put(skb, mtu);
+	memset(cfd, 0, mtu);
+	cfd->can_id = cgen_id(gd);
+	cfd->len = cgen_len(gd);
+
+	if (cfd->len >= CGEN_TIMED_LEN) {
+		put_unaligned_le32(gd->seq++, cfd->data + CGEN_SEQ_OFF);
+		put_unaligned_le32((u32)ktime_to_ns(ktime_get()),
+				   cfd->data + CGEN_STAMP_OFF);
+	}
+
+	skb->dev = gd->dev;
+
+	/* bottom halves off: looped back frames are processed right away */
+	local_bh_disable();
+	err = can_send(skb, 1);
+	local_bh_enable();
+
+	return err;
+}
+
+static bool cgen_done(const struct cgen_dev *gd)
+{
+	return gd->count && gd->tx_frames + gd->tx_errors >= gd->count;
+}
+
+static int cgen_thread(void *data)
+{
+	struct cgen_dev *gd = data;
+	u64 ival_ns = 0;
+	ktime_t next;
+	u32 i;
+	int err;
+
+	if (gd->rate)
+		ival_ns = div_u64((u64)NSEC_PER_SEC * gd->burst, gd->rate);
+
+	gd->tx_start = ktime_get();
+	next = gd->tx_start;
+
+	while (!kthread_should_stop() && !cgen_done(gd)) {
+		for (i = 0; i < gd->burst && !cgen_done(gd); i++) {
+			err = cgen_xmit(gd);
+			if (!err) {
+				gd->tx_frames++;
+			} else if (err == -ENOBUFS) {
+				/* queue full: that's the line rate */
+				gd->tx_busy++;
+				usleep_range(50, 100);
+			} else {
+				gd->tx_errors++;
+			}
+		}
+
+		if (!ival_ns) {
+			cond_resched();
+			continue;
+		}
+
+		/* keep the rate, bursts delayed by a busy queue catch up */
+		next = ktime_add_ns(next, ival_ns);
+		set_current_state(TASK_INTERRUPTIBLE);
+		if (!kthread_should_stop())
+			schedule_hrtimeout(&next, HRTIMER_MODE_ABS);
+		__set_current_state(TASK_RUNNING);
+	}
+
+	gd->tx_end = ktime_get();
+	gd->running = false;
+
+	/* wait for cgen_stop() */
+	while (!kthread_should_stop()) {
+		set_current_state(TASK_INTERRUPTIBLE);
+		if (!kthread_should_stop())
+			schedule();
+		__set_current_state(TASK_RUNNING);
+	}
+
+	return 0;
+}
+
+static bool cgen_id_match(const struct cgen_dev *gd, canid_t can_id)
+{
+	canid_t id;
+
+	if (!!(can_id & CAN_EFF_FLAG) != gd->eff || (can_id & CAN_RTR_FLAG))
+		return false;
+
+	id = can_id & (gd->eff ? CAN_EFF_MASK : CAN_SFF_MASK);
+
+	return id >= gd->id_first && id <= gd->id_last;
+}
+
+static void cgen_rx(struct sk_buff *skb, void *data)
+{
+	const struct canfd_frame *cfd = (struct canfd_frame *)skb->data;
+	struct cgen_dev *gd = data;
+	u32 now = (u32)ktime_to_ns(ktime_get());
+	unsigned int bucket;
+	u32 seq;
+	u64 lat;
+
+	if (!cgen_id_match(gd, cfd->can_id))
+		return;
+
+	spin_lock(&gd->rx_lock);
+
+	gd->rx_frames++;
+	if (cfd->len < CGEN_TIMED_LEN)
+		goto out_unlock;
+
+	seq = get_unaligned_le32(cfd->data + CGEN_SEQ_OFF);
+	if (gd->rx_timed && (s32)(seq - gd->rx_seq) > 0)
+		gd->rx_lost += seq - gd->rx_seq;
+	gd->rx_seq = seq + 1;
+
+	/* the 32 bit stamp wraps after 4.29s, far beyond any sane latency */
+	lat = now - get_unaligned_le32(cfd->data + CGEN_STAMP_OFF);
+
+	if (!gd->rx_timed || lat < gd->lat_min)
+		gd->lat_min = lat;
+	if (lat > gd->lat_max)
+		gd->lat_max = lat;
+	gd->lat_sum += lat;
+	gd->rx_timed++;
+
+	bucket = fls64(div_u64(lat, NSEC_PER_USEC));
+	if (bucket >= CGEN_HIST_BUCKETS)
+		bucket = CGEN_HIST_BUCKETS - 1;
+	gd->hist[bucket]++;
+
+ out_unlock:
+	spin_unlock(&gd->rx_lock);
+}
+
+static void cgen_clear(struct cgen_dev *gd)
+{
+	gd->tx_frames = 0;
+	gd->tx_errors = 0;
+	gd->tx_busy = 0;
+	gd->tx_start = ktime_set(0, 0);
+	gd->tx_end = ktime_set(0, 0);
+	gd->seq = 0;
+	gd->id_next = gd->id_first;
+
+	spin_lock_bh(&gd->rx_lock);
+	gd->rx_frames = 0;
+	gd->rx_timed = 0;
+	gd->rx_lost = 0;
+	gd->rx_seq = 0;
+	gd->lat_min = 0;
+	gd->lat_max = 0;
+	gd->lat_sum = 0;
+	memset(gd->hist, 0, sizeof(gd->hist));
+	spin_unlock_bh(&gd->rx_lock);
+}
+
+/* called with cgen_mutex held */
+static void cgen_stop(struct cgen_dev *gd)
+{
+	if (gd->thread) {
+		kthread_stop(gd->thread);
+		gd->thread = NULL;
+	}
+
+	if (gd->rx_registered) {
+		can_rx_unregister(gd->rx_dev, 0, 0, cgen_rx, gd);
+		gd->rx_registered = false;
+	}
+}
+
+/* called with cgen_mutex held */
+static int cgen_start(struct cgen_dev *gd)
+{
+	struct task_struct *thread;
+	int err;
+
+	if (gd->thread)
+		return -EBUSY;
+
+	if (gd->fd && gd->dev->mtu != CANFD_MTU)
+		return -EINVAL;
+
+	if (!(gd->dev->flags & IFF_UP))
+		return -ENETDOWN;
+
+	cgen_clear(gd);
+
+	/* all frames: the ID range may not be expressible as one filter */
+	err = can_rx_register(gd->rx_dev, 0, 0, cgen_rx, gd, "cgen");
+	if (err)
+		return err;
+	gd->rx_registered = true;
+
+	gd->running = true;
+	thread = kthread_run(cgen_thread, gd, "kcangen_%s", gd->dev->name);
+	if (IS_ERR(thread)) {
+		gd->running = false;
+		cgen_stop(gd);
+		return PTR_ERR(thread);
+	}
+	gd->thread = thread;
+
+	return 0;
+}
+
+static int cgen_set_rx_dev(struct cgen_dev *gd, const char *ifname)
+{
+	struct net_device *dev;
+
+	if (gd->thread)
+		return -EBUSY;
+
+	dev = dev_get_by_name(&init_net, ifname);
+	if (!dev)
+		return -ENODEV;
+
+	if (dev->type != ARPHRD_CAN) {
+		dev_put(dev);
+		return -ENODEV;
+	}
+
+	dev_put(gd->rx_dev);
+	gd->rx_dev = dev;
+
+	return 0;
+}
+
+/* called with cgen_mutex held */
+static int cgen_command(struct cgen_dev *gd, const char *cmd)
+{
+	char ifname[IFNAMSIZ];
+	unsigned int a, b;
+	unsigned long long c;
+
+	if (!strcmp(cmd, "start"))
+		return cgen_start(gd);
+
+	if (!strcmp(cmd, "stop")) {
+		cgen_stop(gd);
+		return 0;
+	}
+
+	/* the remaining commands are configuration */
+	if (gd->thread && strcmp(cmd, "clear"))
+		return -EBUSY;
+
+	if (!strcmp(cmd, "clear")) {
+		cgen_clear(gd);
+		return 0;
+	}
+
+	if (sscanf(cmd, "ids %x %x", &a, &b) == 2) {
+		if (a > b || b > CAN_EFF_MASK)
+			return -EINVAL;
+		gd->id_first = a;
+		gd->id_last = b;
+		if (b > CAN_SFF_MASK)
+			gd->eff = true;
+		return 0;
+	}
+
+	if (!strcmp(cmd, "idmode seq")) {
+		gd->id_random = false;
+		return 0;
+	}
+
+	if (!strcmp(cmd, "idmode random")) {
+		gd->id_random = true;
+		return 0;
+	}
+
+	if (sscanf(cmd, "eff %u", &a) == 1) {
+		if (!a && gd->id_last > CAN_SFF_MASK)
+			return -EINVAL;
+		gd->eff = !!a;
+		return 0;
+	}
+
+	if (sscanf(cmd, "fd %u", &a) == 1) {
+		gd->fd = !!a;
+		if (!gd->fd && gd->dlc_max > CAN_MAX_DLC) {
+			gd->dlc_max = CAN_MAX_DLC;
+			gd->dlc_min = min_t(u8, gd->dlc_min, CAN_MAX_DLC);
+		}
+		return 0;
+	}
+
+	if (sscanf(cmd, "dlc %u %u", &a, &b) == 2) {
+		if (a > b || b > (gd->fd ? 15 : CAN_MAX_DLC))
+			return -EINVAL;
+		gd->dlc_min = a;
+		gd->dlc_max = b;
+		return 0;
+	}
+
+	if (sscanf(cmd, "rate %u", &a) == 1) {
+		gd->rate = a;
+		return 0;
+	}
+
+	if (sscanf(cmd, "burst %u", &a) == 1) {
+		if (!a)
+			return -EINVAL;
+		gd->burst = a;
+		return 0;
+	}
+
+	if (sscanf(cmd, "count %llu", &c) == 1) {
+		gd->count = c;
+		return 0;
+	}
+
+	if (sscanf(cmd, "rxdev %15s", ifname) == 1)
+		return cgen_set_rx_dev(gd, ifname);
+
+	return -EINVAL;
+}
+
+static int cgen_copy_cmd(char *cmd, const char __user *buf, size_t count)
+{
+	size_t len = min_t(size_t, count, CGEN_CMD_MAX - 1);
+
+	if (copy_from_user(cmd, buf, len))
+		return -EFAULT;
+
+	cmd[len] = '\0';
+	strim(cmd);
+
+	return 0;
+}
+
+static int cgen_dev_show(struct seq_file *m, void *v)
+{
+	struct cgen_dev *gd = m->private;
+	u64 elapsed_us = 0, tx_frames, rx_timed, lat_sum;
+	u64 hist[CGEN_HIST_BUCKETS];
+	u64 rx_frames, rx_lost, lat_min, lat_max;
+	ktime_t end;
+	int i;
+
+	mutex_lock(&cgen_mutex);
+
+	seq_printf(m, "dev: %s rxdev: %s\n", gd->dev->name, gd->rx_dev->name);
+	seq_printf(m, "ids: 0x%X-0x%X %s eff: %d fd: %d dlc: %u-%u\n",
+		   gd->id_first, gd->id_last,
+		   gd->id_random ? "random" : "seq", gd->eff, gd->fd,
+		   gd->dlc_min, gd->dlc_max);
+	seq_printf(m, "rate: %u burst: %u count: %llu\n",
+		   gd->rate, gd->burst, gd->count);
+	seq_printf(m, "state: %s\n", gd->running ? "running" : "stopped");
+
+	tx_frames = gd->tx_frames;
+	if (gd->tx_start.tv64) {
+		end = gd->running ? ktime_get() : gd->tx_end;
+		elapsed_us = ktime_to_us(ktime_sub(end, gd->tx_start));
+	}
+	seq_printf(m, "tx: frames %llu errors %llu busy %llu elapsed %llu us",
+		   tx_frames, gd->tx_errors, gd->tx_busy, elapsed_us);
+	if (elapsed_us)
+		seq_printf(m, " => %llu fps",
+			   div64_u64(tx_frames * USEC_PER_SEC, elapsed_us));
+	seq_putc(m, '\n');
+
+	mutex_unlock(&cgen_mutex);
+
+	spin_lock_bh(&gd->rx_lock);
+	rx_frames = gd->rx_frames;
+	rx_timed = gd->rx_timed;
+	rx_lost = gd->rx_lost;
+	lat_min = gd->lat_min;
+	lat_max = gd->lat_max;
+	lat_sum = gd->lat_sum;
+	memcpy(hist, gd->hist, sizeof(hist));
+	spin_unlock_bh(&gd->rx_lock);
+
+	seq_printf(m, "rx: frames %llu timed %llu lost %llu\n",
+		   rx_frames, rx_timed, rx_lost);
+	if (!rx_timed)
+		return 0;
+
+	seq_printf(m, "latency: min %llu avg %llu max %llu ns\n",
+		   lat_min, div64_u64(lat_sum, rx_timed), lat_max);
+	seq_puts(m, "histogram:\n");
+	for (i = 0; i < CGEN_HIST_BUCKETS; i++) {
+		if (!hist[i])
+			continue;
+		if (!i)
+			seq_printf(m, "  %8s us: %llu\n", "<1", hist[i]);
+		else if (i == CGEN_HIST_BUCKETS - 1)
+			seq_printf(m, "  >=%6lu us: %llu\n", 1UL << (i - 1),
+				   hist[i]);
+		else
+			seq_printf(m, "  %8lu us: %llu\n", 1UL << (i - 1),
+				   hist[i]);
+	}
+
+	return 0;
+}
+
+static int cgen_dev_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, cgen_dev_show, PDE_DATA(inode));
+}
+
+static ssize_t cgen_dev_write(struct file *file, const char __user *buf,
+			      size_t count, loff_t *ppos)
+{
+	struct cgen_dev *gd = PDE_DATA(file_inode(file));
+	char cmd[CGEN_CMD_MAX];
+	int err;
+
+	err = cgen_copy_cmd(cmd, buf, count);
+	if (err)
+		return err;
+
+	mutex_lock(&cgen_mutex);
+	err = gd->removed ? -ENODEV : cgen_command(gd, cmd);
+	mutex_unlock(&cgen_mutex);
+
+	return err ? err : count;
+}
+
+static const struct file_operations cgen_dev_fops = {
+	.owner		= THIS_MODULE,
+	.open		= cgen_dev_open,
+	.read		= seq_read,
+	.write		= cgen_dev_write,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static struct cgen_dev *cgen_find_locked(const char *ifname)
+{
+	struct cgen_dev *gd;
+
+	list_for_each_entry(gd, &cgen_list, list) {
+		if (!strcmp(gd->dev->name, ifname))
+			return gd;
+	}
+
+	return NULL;
+}
+
+static int cgen_add(const char *ifname)
+{
+	struct net_device *dev;
+	struct cgen_dev *gd;
+	int err;
+
+	dev = dev_get_by_name(&init_net, ifname);
+	if (!dev)
+		return -ENODEV;
+
+	if (dev->type != ARPHRD_CAN) {
+		err = -ENODEV;
+		goto out_put;
+	}
+
+	gd = kzalloc(sizeof(*gd), GFP_KERNEL);
+	if (!gd) {
+		err = -ENOMEM;
+		goto out_put;
+	}
+
+	gd->dev = dev;
+	dev_hold(dev);
+	gd->rx_dev = dev;
+	spin_lock_init(&gd->rx_lock);
+
+	gd->id_first = 0x100;
+	gd->id_last = 0x100;
+	gd->id_next = gd->id_first;
+	gd->dlc_min = CAN_MAX_DLC;
+	gd->dlc_max = CAN_MAX_DLC;
+	gd->burst = 1;
+
+	mutex_lock(&cgen_mutex);
+
+	if (cgen_find_locked(dev->name)) {
+		err = -EEXIST;
+		goto out_unlock;
+	}
+
+	gd->pde = proc_create_data(dev->name, 0644, cgen_proc_dir,
+				   &cgen_dev_fops, gd);
+	if (!gd->pde) {
+		err = -ENOMEM;
+		goto out_unlock;
+	}
+
+	list_add_tail(&gd->list, &cgen_list);
+	mutex_unlock(&cgen_mutex);
+
+	return 0;
+
+ out_unlock:
+	mutex_unlock(&cgen_mutex);
+	dev_put(gd->rx_dev);
+	kfree(gd);
+ out_put:
+	dev_put(dev);
+
+	return err;
+}
+
+/* called with cgen_mutex held, drops it */
+static void cgen_remove_unlock(struct cgen_dev *gd)
+{
+	cgen_stop(gd);
+	gd->removed = true;
+	list_del(&gd->list);
+	mutex_unlock(&cgen_mutex);
+
+	/* waits for readers and writers of the file */
+	proc_remove(gd->pde);
+
+	/* cgen_rx() may still run on other CPUs */
+	synchronize_rcu();
+
+	dev_put(gd->rx_dev);
+	dev_put(gd->dev);
+	kfree(gd);
+}
+
+static int cgen_remove(const char *ifname)
+{
+	struct cgen_dev *gd;
+
+	mutex_lock(&cgen_mutex);
+	gd = cgen_find_locked(ifname);
+	if (!gd) {
+		mutex_unlock(&cgen_mutex);
+		return -ENODEV;
+	}
+	cgen_remove_unlock(gd);
+
+	return 0;
+}
+
+static int cgen_ctrl_show(struct seq_file *m, void *v)
+{
+	struct cgen_dev *gd;
+
+	mutex_lock(&cgen_mutex);
+	list_for_each_entry(gd, &cgen_list, list)
+		seq_printf(m, "%s %s\n", gd->dev->name,
+			   gd->running ? "running" : "stopped");
+	mutex_unlock(&cgen_mutex);
+
+	return 0;
+}
+
+static int cgen_ctrl_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, cgen_ctrl_show, NULL);
+}
+
+static ssize_t cgen_ctrl_write(struct file *file, const char __user *buf,
+			       size_t count, loff_t *ppos)
+{
+	char cmd[CGEN_CMD_MAX];
+	char ifname[IFNAMSIZ];
+	int err;
+
+	err = cgen_copy_cmd(cmd, buf, count);
+	if (err)
+		return err;
+
+	if (sscanf(cmd, "add %15s", ifname) == 1)
+		err = cgen_add(ifname);
+	else if (sscanf(cmd, "rem %15s", ifname) == 1)
+		err = cgen_remove(ifname);
+	else
+		err = -EINVAL;
+
+	return err ? err : count;
+}
+
+static const struct file_operations cgen_ctrl_fops = {
+	.owner		= THIS_MODULE,
+	.open		= cgen_ctrl_open,
+	.read		= seq_read,
+	.write		= cgen_ctrl_write,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static int cgen_notifier(struct notifier_block *nb, unsigned long msg,
+			 void *ptr)
+{
+	struct net_device *dev = netdev_notifier_info_to_dev(ptr);
+	struct cgen_dev *gd;
+
+	if (!net_eq(dev_net(dev), &init_net))
+		return NOTIFY_DONE;
+
+	if (dev->type != ARPHRD_CAN)
+		return NOTIFY_DONE;
+
+	if (msg != NETDEV_UNREGISTER)
+		return NOTIFY_DONE;
+
+ restart:
+	mutex_lock(&cgen_mutex);
+	list_for_each_entry(gd, &cgen_list, list) {
+		if (gd->dev == dev || gd->rx_dev == dev) {
+			/* drops cgen_mutex, the list may change meanwhile */
+			cgen_remove_unlock(gd);
+			goto restart;
+		}
+	}
+	mutex_unlock(&cgen_mutex);
+
+	return NOTIFY_DONE;
+}
+
+static struct notifier_block cgen_notifier_block = {
+	.notifier_call = cgen_notifier,
+};
+
+static __init int cgen_module_init(void)
+{
+	int err;
+
+	printk(banner);
+
+	cgen_proc_dir = proc_mkdir(CAN_GEN_NAME, init_net.proc_net);
+	if (!cgen_proc_dir)
+		return -ENOMEM;
+
+	if (!proc_create("ctrl", 0644, cgen_proc_dir, &cgen_ctrl_fops)) {
+		err = -ENOMEM;
+		goto out_remove;
+	}
+
+	err = register_netdevice_notifier(&cgen_notifier_block);
+	if (err)
+		goto out_remove;
+
+	return 0;
+
+ out_remove:
+	remove_proc_subtree(CAN_GEN_NAME, init_net.proc_net);
+
+	return err;
+}
+
+static __exit void cgen_module_exit(void)
+{
+	unregister_netdevice_notifier(&cgen_notifier_block);
+
+	mutex_lock(&cgen_mutex);
+	while (!list_empty(&cgen_list)) {
+		cgen_remove_unlock(list_first_entry(&cgen_list,
+						    struct cgen_dev, list));
+		mutex_lock(&cgen_mutex);
+	}
+	mutex_unlock(&cgen_mutex);
+
+	remove_proc_subtree(CAN_GEN_NAME, init_net.proc_net);
+}
+
+module_init(cgen_module_init);
+module_exit(cgen_module_exit);
@@ -51,6 +51,10 @@
 #include <linux/netdevice.h>
 #include <linux/if_arp.h>
 #include <linux/skbuff.h>
+#include <linux/interrupt.h>
+#include <linux/percpu.h>
+#include <linux/slab.h>
+#include <linux/ktime.h>
 #include <linux/can.h>
 #include <linux/can/core.h>
 #include <linux/can/skb.h>
@@ -79,6 +83,17 @@ MODULE_PARM_DESC(max_hops,
 		 __stringify(CGW_MAX_HOPS) " hops, "
 		 "default: " __stringify(CGW_DEFAULT_HOPS) ")");
 
+#define CGW_DEFAULT_SKB_POOL 16
+#define CGW_MAX_SKB_POOL 256
+
+static unsigned int skb_pool __read_mostly = CGW_DEFAULT_SKB_POOL;
+module_param(skb_pool, uint, S_IRUGO);
+MODULE_PARM_DESC(skb_pool,
+		 "preallocated skbs per " CAN_GW_NAME " job with frame "
+		 "modifications (0 = disabled, max "
+		 __stringify(CGW_MAX_SKB_POOL) ", "
+		 "default: " __stringify(CGW_DEFAULT_SKB_POOL) ")");
+
 static HLIST_HEAD(cgw_list);
 static struct notifier_block notifier;
 
@@ -125,13 +140,35 @@ struct can_can_gw {
 	int dst_idx;
 };
 
+/*
+ * Preallocated skbs for jobs with frame modifications. The pool holds a
+ * reference on each skb: an skb whose only user is the pool and whose
+ * data is not shared with a clone (e.g. an echo skb) has left the stack
+ * and can be reused instead of doing a skb_copy() for every frame.
+ */
+struct cgw_skb_pool {
+	unsigned int size;
+	unsigned int next;
+	struct sk_buff *skb[0];
+};
+
 /* list entry for CAN gateways jobs */
 struct cgw_job {
 	struct hlist_node list;
 	struct rcu_head rcu;
+	atomic_t refcnt;
 	u32 handled_frames;
 	u32 dropped_frames;
 	u32 deleted_frames;
+
+	/* protects skb_pool and the latency statistics */
+	spinlock_t lock;
+	struct cgw_skb_pool *skb_pool;
+	u64 lat_frames;
+	u64 lat_min;
+	u64 lat_max;
+	u64 lat_sum;
+
 	struct cf_mod mod;
 	union {
 		/* CAN frame data source */
@@ -345,12 +382,218 @@ static void cgw_csum_crc8_neg(struct can_frame *cf, struct cgw_csum_crc8 *crc8)
 	cf->data[crc8->result_idx] = crc^crc8->final_xor_val;
 }
 
+static struct cgw_skb_pool *cgw_pool_alloc(unsigned int size)
+{
+	struct cgw_skb_pool *pool;
+	struct sk_buff *skb;
+
+	pool = kzalloc(sizeof(*pool) + size * sizeof(pool->skb[0]),
+		       GFP_KERNEL);
+	if (!pool)
+		return NULL;
+
+	for (pool->size = 0; pool->size < size; pool->size++) {
+		skb = alloc_skb(sizeof(struct can_skb_priv) + CANFD_MTU,
+				GFP_KERNEL);
+		if (!skb)
+			break;
+
+		pool->skb[pool->size] = skb;
+	}
+
+	if (!pool->size) {
+		kfree(pool);
+		return NULL;
+	}
+
+	return pool;
+}
+
+static void cgw_pool_free(struct cgw_skb_pool *pool)
+{
+	unsigned int i;
+
+	if (!pool)
+		return;
+
+	/* skbs still on their way through the stack are freed there */
+	for (i = 0; i < pool->size; i++)
+		kfree_skb(pool->skb[i]);
+
+	kfree(pool);
+}
+
+/* reset a pool skb to the state of a freshly allocated skb */
+static void cgw_skb_recycle(struct sk_buff *skb)
+{
+	struct skb_shared_info *shinfo = skb_shinfo(skb);
+
+	memset(shinfo, 0, offsetof(struct skb_shared_info, dataref));
+	atomic_set(&shinfo->dataref, 1);
+
+	memset(skb, 0, offsetof(struct sk_buff, tail));
+	skb->data = skb->head;
+	skb_reset_tail_pointer(skb);
+	skb->mac_header = (typeof(skb->mac_header))~0U;
+	skb->transport_header = (typeof(skb->transport_header))~0U;
+}
+
+/*
+ * Copy the received CAN frame into a free skb of the job's pool.
+ * Returns NULL when there is no pool or all its skbs are in flight.
+ */
+static struct sk_buff *cgw_pool_copy(struct cgw_job *gwj, struct sk_buff *skb)
+{
+	struct cgw_skb_pool *pool = gwj->skb_pool;
+	struct sk_buff *nskb = NULL;
+	unsigned int i;
+
+	if (!pool || skb->len > CANFD_MTU)
+		return NULL;
+
+	spin_lock(&gwj->lock);
+	for (i = 0; i < pool->size; i++) {
+		struct sk_buff *pskb = pool->skb[pool->next];
+
+		if (++pool->next == pool->size)
+			pool->next = 0;
+
+		if (atomic_read(&pskb->users) == 1 && !skb_cloned(pskb)) {
+			nskb = skb_get(pskb);
+			break;
+		}
+	}
+	spin_unlock(&gwj->lock);
+
+	if (!nskb)
+		return NULL;
+
+	/* pairs with the barrier in the final kfree_skb() of the stack */
+	smp_rmb();
+	cgw_skb_recycle(nskb);
+
+	can_skb_reserve(nskb);
+	memcpy(can_skb_prv(nskb), can_skb_prv(skb),
+	       sizeof(struct can_skb_priv));
+	memcpy(skb_put(nskb, skb->len), skb->data, skb->len);
+
+	nskb->protocol = skb->protocol;
+	nskb->ip_summed = skb->ip_summed;
+	nskb->tstamp = skb->tstamp;
+	skb_reset_mac_header(nskb);
+	skb_reset_network_header(nskb);
+	skb_reset_transport_header(nskb);
+
+	return nskb;
+}
+
+static void cgw_job_put(struct cgw_job *gwj)
+{
+	if (atomic_dec_and_test(&gwj->refcnt)) {
+		cgw_pool_free(gwj->skb_pool);
+		kmem_cache_free(cgw_cache, gwj);
+	}
+}
+
+static void cgw_job_free_rcu(struct rcu_head *rcu_head)
+{
+	struct cgw_job *gwj = container_of(rcu_head, struct cgw_job, rcu);
+
+	cgw_job_put(gwj);
+}
+
+static void cgw_update_latency(struct cgw_job *gwj, ktime_t start)
+{
+	u64 lat = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+	spin_lock(&gwj->lock);
+	if (!gwj->lat_frames || lat < gwj->lat_min)
+		gwj->lat_min = lat;
+	if (lat > gwj->lat_max)
+		gwj->lat_max = lat;
+	gwj->lat_sum += lat;
+	gwj->lat_frames++;
+	spin_unlock(&gwj->lock);
+}
+
+static void cgw_send(struct cgw_job *gwj, struct sk_buff *skb, ktime_t start)
+{
+	/* send to netdevice */
+	if (can_send(skb, gwj->flags & CGW_FLAGS_CAN_ECHO)) {
+		gwj->dropped_frames++;
+	} else {
+		gwj->handled_frames++;
+		cgw_update_latency(gwj, start);
+	}
+}
+
+/*
+ * Jobs with CGW_FLAGS_CAN_BATCH queue the routed frames per CPU. The
+ * queue is sent from a tasklet, i.e. after the NET_RX softirq has
+ * processed the whole NAPI poll of the source interface.
+ */
+struct cgw_batch {
+	struct sk_buff_head queue;
+	struct tasklet_struct tasklet;
+};
+
+struct cgw_skb_cb {
+	struct cgw_job *gwj;
+	ktime_t start;
+};
+
+static DEFINE_PER_CPU(struct cgw_batch, cgw_batch);
+
+static inline struct cgw_skb_cb *cgw_skb_cb(struct sk_buff *skb)
+{
+	BUILD_BUG_ON(sizeof(struct cgw_skb_cb) > sizeof(skb->cb));
+
+	return (struct cgw_skb_cb *)skb->cb;
+}
+
+static void cgw_batch_queue(struct cgw_job *gwj, struct sk_buff *skb,
+			    ktime_t start)
+{
+	struct cgw_batch *batch = this_cpu_ptr(&cgw_batch);
+
+	/* the job and the device may vanish before the tasklet runs */
+	atomic_inc(&gwj->refcnt);
+	dev_hold(skb->dev);
+
+	cgw_skb_cb(skb)->gwj = gwj;
+	cgw_skb_cb(skb)->start = start;
+	__skb_queue_tail(&batch->queue, skb);
+
+	tasklet_schedule(&batch->tasklet);
+}
+
+static void cgw_batch_flush(unsigned long data)
+{
+	struct cgw_batch *batch = (struct cgw_batch *)data;
+	struct net_device *dev;
+	struct cgw_job *gwj;
+	struct sk_buff *skb;
+	ktime_t start;
+
+	while ((skb = __skb_dequeue(&batch->queue))) {
+		gwj = cgw_skb_cb(skb)->gwj;
+		start = cgw_skb_cb(skb)->start;
+		dev = skb->dev;
+
+		cgw_send(gwj, skb, start);
+
+		dev_put(dev);
+		cgw_job_put(gwj);
+	}
+}
+
 /* the receive & process & send function */
 static void can_can_gw_rcv(struct sk_buff *skb, void *data)
 {
 	struct cgw_job *gwj = (struct cgw_job *)data;
 	struct can_frame *cf;
 	struct sk_buff *nskb;
+	ktime_t start = ktime_get();
 	int modidx = 0;
 
 	/*
@@ -389,12 +632,16 @@ static void can_can_gw_rcv(struct sk_buff *skb, void *data)
 	 * clone the given skb, which has not been done in can_rcv()
 	 *
 	 * When there is at least one modification function activated,
-	 * we need to copy the skb as we want to modify skb->data.
+	 * we need to copy the skb as we want to modify skb->data. The copy
+	 * goes into a preallocated skb of the job if one is available.
 	 */
-	if (gwj->mod.modfunc[0])
-		nskb = skb_copy(skb, GFP_ATOMIC);
-	else
+	if (gwj->mod.modfunc[0]) {
+		nskb = cgw_pool_copy(gwj, skb);
+		if (!nskb)
+			nskb = skb_copy(skb, GFP_ATOMIC);
+	} else {
 		nskb = skb_clone(skb, GFP_ATOMIC);
+	}
 
 	if (!nskb) {
 		gwj->dropped_frames++;
@@ -430,11 +677,10 @@ static void can_can_gw_rcv(struct sk_buff *skb, void *data)
 	if (!(gwj->flags & CGW_FLAGS_CAN_SRC_TSTAMP))
 		nskb->tstamp.tv64 = 0;
 
-	/* send to netdevice */
-	if (can_send(nskb, gwj->flags & CGW_FLAGS_CAN_ECHO))
-		gwj->dropped_frames++;
+	if (gwj->flags & CGW_FLAGS_CAN_BATCH)
+		cgw_batch_queue(gwj, nskb, start);
 	else
-		gwj->handled_frames++;
+		cgw_send(gwj, nskb, start);
 }
 
 static inline int cgw_register_filter(struct cgw_job *gwj)
@@ -470,9 +716,9 @@ static int cgw_notifier(struct notifier_block *nb,
 		hlist_for_each_entry_safe(gwj, nx, &cgw_list, list) {
 
 			if (gwj->src.dev == dev || gwj->dst.dev == dev) {
-				hlist_del(&gwj->list);
+				hlist_del_rcu(&gwj->list);
 				cgw_unregister_filter(gwj);
-				kmem_cache_free(cgw_cache, gwj);
+				call_rcu(&gwj->rcu, cgw_job_free_rcu);
 			}
 		}
 	}
@@ -513,6 +759,20 @@ static int cgw_put_job(struct sk_buff *skb, struct cgw_job *gwj, int type,
 			goto cancel;
 	}
 
+	if (gwj->lat_frames) {
+		struct cgw_latency lat;
+
+		spin_lock_bh(&gwj->lock);
+		lat.frames = gwj->lat_frames;
+		lat.min_ns = gwj->lat_min;
+		lat.max_ns = gwj->lat_max;
+		lat.sum_ns = gwj->lat_sum;
+		spin_unlock_bh(&gwj->lock);
+
+		if (nla_put(skb, CGW_LATENCY, sizeof(lat), &lat) < 0)
+			goto cancel;
+	}
+
 	/* check non default settings of attributes */
 
 	if (gwj->limit_hops) {
@@ -822,9 +1082,16 @@ static int cgw_create_job(struct sk_buff *skb,  struct nlmsghdr *nlh)
 	if (!gwj)
 		return -ENOMEM;
 
+	atomic_set(&gwj->refcnt, 1);
 	gwj->handled_frames = 0;
 	gwj->dropped_frames = 0;
 	gwj->deleted_frames = 0;
+	spin_lock_init(&gwj->lock);
+	gwj->skb_pool = NULL;
+	gwj->lat_frames = 0;
+	gwj->lat_min = 0;
+	gwj->lat_max = 0;
+	gwj->lat_sum = 0;
 	gwj->flags = r->flags;
 	gwj->gwtype = r->gwtype;
 
@@ -857,14 +1124,20 @@ static int cgw_create_job(struct sk_buff *skb,  struct nlmsghdr *nlh)
 
 	gwj->limit_hops = limhops;
 
+	/* a failing pool allocation only costs the skb_copy() fast path */
+	if (gwj->mod.modfunc[0] && skb_pool)
+		gwj->skb_pool = cgw_pool_alloc(skb_pool);
+
 	ASSERT_RTNL();
 
 	err = cgw_register_filter(gwj);
 	if (!err)
 		hlist_add_head_rcu(&gwj->list, &cgw_list);
 out:
-	if (err)
+	if (err) {
+		cgw_pool_free(gwj->skb_pool);
 		kmem_cache_free(cgw_cache, gwj);
+	}
 
 	return err;
 }
@@ -877,9 +1150,9 @@ static void cgw_remove_all_jobs(void)
 	ASSERT_RTNL();
 
 	hlist_for_each_entry_safe(gwj, nx, &cgw_list, list) {
-		hlist_del(&gwj->list);
+		hlist_del_rcu(&gwj->list);
 		cgw_unregister_filter(gwj);
-		kmem_cache_free(cgw_cache, gwj);
+		call_rcu(&gwj->rcu, cgw_job_free_rcu);
 	}
 }
 
@@ -937,9 +1210,9 @@ static int cgw_remove_job(struct sk_buff *skb, struct nlmsghdr *nlh)
 		if (memcmp(&gwj->ccgw, &ccgw, sizeof(ccgw)))
 			continue;
 
-		hlist_del(&gwj->list);
+		hlist_del_rcu(&gwj->list);
 		cgw_unregister_filter(gwj);
-		kmem_cache_free(cgw_cache, gwj);
+		call_rcu(&gwj->rcu, cgw_job_free_rcu);
 		err = 0;
 		break;
 	}
@@ -949,8 +1222,19 @@ static int cgw_remove_job(struct sk_buff *skb, struct nlmsghdr *nlh)
 
 static __init int cgw_module_init(void)
 {
+	int cpu;
+
 	/* sanitize given module parameter */
 	max_hops = clamp_t(unsigned int, max_hops, CGW_MIN_HOPS, CGW_MAX_HOPS);
+	skb_pool = min_t(unsigned int, skb_pool, CGW_MAX_SKB_POOL);
+
+	for_each_possible_cpu(cpu) {
+		struct cgw_batch *batch = &per_cpu(cgw_batch, cpu);
+
+		__skb_queue_head_init(&batch->queue);
+		tasklet_init(&batch->tasklet, cgw_batch_flush,
+			     (unsigned long)batch);
+	}
 
 	pr_info("can: netlink gateway (rev " CAN_GW_VERSION ") max_hops=%d\n",
 		max_hops);
@@ -980,6 +1264,8 @@ static __init int cgw_module_init(void)
 
 static __exit void cgw_module_exit(void)
 {
+	int cpu;
+
 	rtnl_unregister_all(PF_CAN);
 
 	unregister_netdevice_notifier(&notifier);
@@ -990,6 +1276,10 @@ static __exit void cgw_module_exit(void)
 
 	rcu_barrier(); /* Wait for completion of call_rcu()'s */
 
+	/* send out the batched frames, this drops the last job references */
+	for_each_possible_cpu(cpu)
+		tasklet_kill(&per_cpu(cgw_batch, cpu).tasklet);
+
 	kmem_cache_destroy(cgw_cache);
 }
 
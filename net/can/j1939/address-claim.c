@@ -0,0 +1,332 @@
+/*
+ * address-claim.c - SAE J1939 address claiming (J1939-81)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the version 2 of the GNU General Public License
+ * as published by the Free Software Foundation
+ *
+ * The kernel does not claim addresses itself. It follows the address
+ * claim messages on the bus (including the ones sent by local sockets)
+ * and keeps a NAME <-> address table, so that sockets can be bound to
+ * and send to a NAME instead of a static address.
+ *
+ * A claim is taken over immediately; if two ECUs claim the same address
+ * the one with the lower NAME keeps it.
+ */
+
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/skbuff.h>
+#include <asm/unaligned.h>
+
+#include "j1939-priv.h"
+
+static inline name_t j1939_skb_to_name(const struct sk_buff *skb)
+{
+	return get_unaligned_le64(skb->data);
+}
+
+static inline bool j1939_ac_msg_is_request(const struct sk_buff *skb)
+{
+	const struct j1939_sk_buff_cb *skcb = j1939_skb_to_cb(skb);
+	pgn_t req_pgn;
+
+	if (skb->len < 3 || skcb->addr.pgn != J1939_PGN_REQUEST)
+		return false;
+
+	req_pgn = skb->data[0] | (skb->data[1] << 8) | (skb->data[2] << 16);
+
+	return req_pgn == J1939_PGN_ADDRESS_CLAIMED;
+}
+
+static struct j1939_ecu *j1939_ecu_find_by_name_locked(struct j1939_priv *priv,
+							name_t name)
+{
+	struct j1939_ecu *ecu;
+
+	list_for_each_entry(ecu, &priv->ecus, list) {
+		if (ecu->name == name)
+			return ecu;
+	}
+
+	return NULL;
+}
+
+static struct j1939_ecu *j1939_ecu_create_locked(struct j1939_priv *priv,
+						  name_t name)
+{
+	struct j1939_ecu *ecu;
+
+	ecu = kzalloc(sizeof(*ecu), GFP_ATOMIC);
+	if (!ecu)
+		return NULL;
+
+	ecu->name = name;
+	ecu->addr = J1939_IDLE_ADDR;
+	list_add_tail(&ecu->list, &priv->ecus);
+
+	return ecu;
+}
+
+static void j1939_ecu_unmap_locked(struct j1939_priv *priv,
+				   struct j1939_ecu *ecu)
+{
+	if (j1939_address_is_unicast(ecu->addr) &&
+	    priv->ents[ecu->addr].ecu == ecu)
+		priv->ents[ecu->addr].ecu = NULL;
+
+	ecu->addr = J1939_IDLE_ADDR;
+}
+
+/* forget an ECU without address that is not used by local sockets */
+static void j1939_ecu_release_locked(struct j1939_priv *priv,
+				     struct j1939_ecu *ecu)
+{
+	if (ecu->nusers || j1939_address_is_unicast(ecu->addr))
+		return;
+
+	list_del(&ecu->list);
+	kfree(ecu);
+}
+
+bool j1939_address_is_local_locked(struct j1939_priv *priv, u8 addr)
+{
+	struct j1939_addr_ent *ent;
+
+	if (!j1939_address_is_unicast(addr))
+		return false;
+
+	ent = &priv->ents[addr];
+
+	return ent->nusers || (ent->ecu && ent->ecu->nusers);
+}
+
+void j1939_ac_fill_names_locked(struct j1939_priv *priv,
+				struct j1939_sk_buff_cb *skcb)
+{
+	struct j1939_ecu *ecu;
+
+	if (j1939_address_is_unicast(skcb->addr.sa)) {
+		ecu = priv->ents[skcb->addr.sa].ecu;
+		if (ecu)
+			skcb->addr.src_name = ecu->name;
+	}
+
+	if (j1939_address_is_unicast(skcb->addr.da)) {
+		ecu = priv->ents[skcb->addr.da].ecu;
+		if (ecu)
+			skcb->addr.dst_name = ecu->name;
+	}
+}
+
+static u8 j1939_name_to_addr(struct j1939_priv *priv, name_t name)
+{
+	struct j1939_ecu *ecu;
+	u8 addr = J1939_NO_ADDR;
+
+	read_lock_bh(&priv->lock);
+	ecu = j1939_ecu_find_by_name_locked(priv, name);
+	if (ecu && j1939_address_is_unicast(ecu->addr))
+		addr = ecu->addr;
+	read_unlock_bh(&priv->lock);
+
+	return addr;
+}
+
+/* process an address claim seen on the bus (or sent by us) */
+void j1939_ac_recv(struct j1939_priv *priv, struct sk_buff *skb)
+{
+	struct j1939_sk_buff_cb *skcb = j1939_skb_to_cb(skb);
+	struct j1939_ecu *ecu, *prev;
+	name_t name;
+	u8 sa;
+
+	if (skb->len != 8) {
+		netdev_notice(priv->ndev, "rx address claim with wrong dlc %i\n",
+			      skb->len);
+		return;
+	}
+
+	name = j1939_skb_to_name(skb);
+	sa = skcb->addr.sa;
+	skcb->addr.src_name = name;
+	if (!name)
+		return;
+
+	write_lock_bh(&priv->lock);
+
+	ecu = j1939_ecu_find_by_name_locked(priv, name);
+
+	if (!j1939_address_is_unicast(sa)) {
+		/* "cannot claim address" */
+		if (ecu) {
+			j1939_ecu_unmap_locked(priv, ecu);
+			j1939_ecu_release_locked(priv, ecu);
+		}
+		goto out_unlock;
+	}
+
+	if (!ecu) {
+		ecu = j1939_ecu_create_locked(priv, name);
+		if (!ecu)
+			goto out_unlock;
+	}
+
+	if (ecu->addr == sa)
+		goto out_unlock;
+
+	j1939_ecu_unmap_locked(priv, ecu);
+
+	prev = priv->ents[sa].ecu;
+	if (prev) {
+		if (prev->name < name) {
+			/* the lower NAME wins, the new claimer lost */
+			j1939_ecu_release_locked(priv, ecu);
+			goto out_unlock;
+		}
+
+		j1939_ecu_unmap_locked(priv, prev);
+		j1939_ecu_release_locked(priv, prev);
+	}
+
+	priv->ents[sa].ecu = ecu;
+	ecu->addr = sa;
+
+ out_unlock:
+	write_unlock_bh(&priv->lock);
+}
+
+static int j1939_ac_verify_outgoing(struct j1939_priv *priv,
+				    struct sk_buff *skb)
+{
+	struct j1939_sk_buff_cb *skcb = j1939_skb_to_cb(skb);
+
+	if (skb->len != 8) {
+		netdev_notice(priv->ndev, "tx address claim with dlc %i\n",
+			      skb->len);
+		return -EPROTO;
+	}
+
+	if (skcb->addr.src_name != j1939_skb_to_name(skb)) {
+		netdev_notice(priv->ndev, "tx address claim with different name\n");
+		return -EPROTO;
+	}
+
+	if (!j1939_address_is_valid(skcb->addr.sa)) {
+		netdev_notice(priv->ndev, "tx address claim with broadcast sa\n");
+		return -EPROTO;
+	}
+
+	/* ac must always be a broadcast */
+	if (j1939_address_is_valid(skcb->addr.da)) {
+		netdev_notice(priv->ndev, "tx address claim with dest, not broadcast\n");
+		return -EPROTO;
+	}
+
+	return 0;
+}
+
+/*
+ * Check an outgoing message and resolve the source and destination
+ * NAMEs into addresses. An outgoing address claim is sent from the
+ * address the socket is bound to; the claim takes effect when it
+ * comes back from the bus.
+ */
+int j1939_ac_fixup(struct j1939_priv *priv, struct sk_buff *skb)
+{
+	struct j1939_sk_buff_cb *skcb = j1939_skb_to_cb(skb);
+	int ret;
+	u8 addr;
+
+	if (skcb->addr.pgn == J1939_PGN_ADDRESS_CLAIMED) {
+		ret = j1939_ac_verify_outgoing(priv, skb);
+		if (ret < 0)
+			return ret;
+	} else if (skcb->addr.src_name) {
+		/* assign source address */
+		addr = j1939_name_to_addr(priv, skcb->addr.src_name);
+		if (!j1939_address_is_unicast(addr) &&
+		    !j1939_ac_msg_is_request(skb)) {
+			netdev_notice(priv->ndev, "tx drop: invalid sa for name 0x%016llx\n",
+				      skcb->addr.src_name);
+			return -EADDRNOTAVAIL;
+		}
+		/* a request for address claimed may be sent from the null address */
+		skcb->addr.sa = j1939_address_is_unicast(addr) ?
+			addr : J1939_IDLE_ADDR;
+	}
+
+	/* assign destination address */
+	if (skcb->addr.dst_name) {
+		addr = j1939_name_to_addr(priv, skcb->addr.dst_name);
+		if (!j1939_address_is_unicast(addr)) {
+			netdev_notice(priv->ndev, "tx drop: invalid da for name 0x%016llx\n",
+				      skcb->addr.dst_name);
+			return -EADDRNOTAVAIL;
+		}
+		skcb->addr.da = addr;
+	}
+
+	return 0;
+}
+
+/* account a local socket bound to @name and/or the static address @sa */
+int j1939_local_ecu_get(struct j1939_priv *priv, name_t name, u8 sa)
+{
+	struct j1939_ecu *ecu;
+	int ret = 0;
+
+	write_lock_bh(&priv->lock);
+
+	if (name) {
+		ecu = j1939_ecu_find_by_name_locked(priv, name);
+		if (!ecu)
+			ecu = j1939_ecu_create_locked(priv, name);
+		if (!ecu) {
+			ret = -ENOMEM;
+			goto out_unlock;
+		}
+		ecu->nusers++;
+	}
+
+	if (j1939_address_is_unicast(sa))
+		priv->ents[sa].nusers++;
+
+ out_unlock:
+	write_unlock_bh(&priv->lock);
+
+	return ret;
+}
+
+void j1939_local_ecu_put(struct j1939_priv *priv, name_t name, u8 sa)
+{
+	struct j1939_ecu *ecu;
+
+	write_lock_bh(&priv->lock);
+
+	if (j1939_address_is_unicast(sa) && priv->ents[sa].nusers)
+		priv->ents[sa].nusers--;
+
+	if (name) {
+		ecu = j1939_ecu_find_by_name_locked(priv, name);
+		if (ecu && ecu->nusers) {
+			ecu->nusers--;
+			j1939_ecu_release_locked(priv, ecu);
+		}
+	}
+
+	write_unlock_bh(&priv->lock);
+}
+
+void j1939_ecu_flush(struct j1939_priv *priv)
+{
+	struct j1939_ecu *ecu, *next;
+
+	write_lock_bh(&priv->lock);
+	list_for_each_entry_safe(ecu, next, &priv->ecus, list) {
+		j1939_ecu_unmap_locked(priv, ecu);
+		list_del(&ecu->list);
+		kfree(ecu);
+	}
+	write_unlock_bh(&priv->lock);
+}
@@ -0,0 +1,190 @@
+/*
+ * j1939-priv.h - SAE J1939 protocol internals
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the version 2 of the GNU General Public License
+ * as published by the Free Software Foundation
+ */
+
+#ifndef _J1939_PRIV_H_
+#define _J1939_PRIV_H_
+
+#include <linux/can/core.h>
+#include <linux/can/j1939.h>
+#include <linux/interrupt.h>
+#include <linux/kref.h>
+#include <linux/list.h>
+#include <linux/netdevice.h>
+#include <linux/skbuff.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
+#include <net/sock.h>
+
+/* one J1939 frame is an extended CAN frame without RTR */
+#define J1939_CAN_ID CAN_EFF_FLAG
+#define J1939_CAN_MASK (CAN_EFF_FLAG | CAN_RTR_FLAG)
+
+/* the CAN header in front of the payload of a struct can_frame */
+#define J1939_CAN_HDR (offsetof(struct can_frame, data))
+
+#define J1939_MAX_TP_PACKET_SIZE (7 * 0xff)
+#define J1939_MAX_ETP_PACKET_SIZE (7 * 0x00ffffff)
+
+/* default priority of messages sent by a socket */
+#define J1939_DEFAULT_PRIO 6
+
+/*
+ * struct j1939_ecu - an ECU known by its NAME
+ * @addr: claimed address, J1939_IDLE_ADDR while the ECU has no address
+ * @nusers: local sockets bound to this NAME
+ *
+ * ECUs are created when an address claim is seen on the bus or when a
+ * local socket binds to a NAME. They are protected by j1939_priv.lock.
+ */
+struct j1939_ecu {
+	struct list_head list;
+	name_t name;
+	u8 addr;
+	int nusers;
+};
+
+/*
+ * struct j1939_addr_ent - per address state
+ * @ecu: ECU that claimed this address
+ * @nusers: local sockets bound to this static address
+ */
+struct j1939_addr_ent {
+	struct j1939_ecu *ecu;
+	int nusers;
+};
+
+/*
+ * struct j1939_priv - J1939 state of one CAN network device
+ *
+ * Created on the first bind() to a device and shared by all J1939
+ * sockets bound to it.
+ */
+struct j1939_priv {
+	struct list_head list;
+	struct net_device *ndev;
+	struct kref kref;
+
+	/* address claim bookkeeping */
+	rwlock_t lock;
+	struct list_head ecus;
+	struct j1939_addr_ent ents[256];
+
+	/* bound sockets */
+	spinlock_t j1939_socks_lock;
+	struct list_head j1939_socks;
+
+	/* transport protocol sessions */
+	spinlock_t session_lock;
+	struct list_head sessions;
+	struct tasklet_hrtimer tp_timer;
+	wait_queue_head_t tp_wait;
+};
+
+/* J1939 addressing of a message */
+struct j1939_addr {
+	name_t src_name;
+	name_t dst_name;
+	pgn_t pgn;
+	u8 sa;
+	u8 da;
+};
+
+#define J1939_ECU_LOCAL_SRC BIT(0)
+#define J1939_ECU_LOCAL_DST BIT(1)
+
+/*
+ * struct j1939_sk_buff_cb - J1939 message information in skb->cb
+ * @src_sk: socket that sent the message, only compared against
+ * @flags: J1939_ECU_LOCAL_* flags
+ */
+struct j1939_sk_buff_cb {
+	struct j1939_addr addr;
+	priority_t priority;
+	u8 flags;
+	const struct sock *src_sk;
+};
+
+static inline struct j1939_sk_buff_cb *j1939_skb_to_cb(const struct sk_buff *skb)
+{
+	BUILD_BUG_ON(sizeof(struct j1939_sk_buff_cb) > sizeof(skb->cb));
+
+	return (struct j1939_sk_buff_cb *)skb->cb;
+}
+
+static inline bool j1939_address_is_unicast(u8 addr)
+{
+	return addr <= J1939_MAX_UNICAST_ADDR;
+}
+
+static inline bool j1939_address_is_idle(u8 addr)
+{
+	return addr == J1939_IDLE_ADDR;
+}
+
+static inline bool j1939_address_is_valid(u8 addr)
+{
+	return addr != J1939_NO_ADDR;
+}
+
+static inline bool j1939_pgn_is_pdu1(pgn_t pgn)
+{
+	/* ignore dp & res bits for this */
+	return (pgn & 0xff00) < 0xf000;
+}
+
+static inline bool j1939_pgn_is_valid(pgn_t pgn)
+{
+	return pgn <= J1939_PGN_MAX;
+}
+
+static inline bool j1939_pgn_is_clean_pdu(pgn_t pgn)
+{
+	if (j1939_pgn_is_pdu1(pgn))
+		return !(pgn & 0xff);
+
+	return true;
+}
+
+/* main.c */
+struct j1939_priv *j1939_netdev_start(struct net_device *ndev);
+void j1939_netdev_stop(struct j1939_priv *priv);
+
+/* additional reference, dropped with j1939_netdev_stop() */
+static inline void j1939_priv_get(struct j1939_priv *priv)
+{
+	kref_get(&priv->kref);
+}
+
+int j1939_send_frame(struct j1939_priv *priv, const struct j1939_addr *addr,
+		     priority_t prio, const void *data, unsigned int len,
+		     struct sock *sk);
+
+/* address-claim.c */
+bool j1939_address_is_local_locked(struct j1939_priv *priv, u8 addr);
+void j1939_ac_fill_names_locked(struct j1939_priv *priv,
+				struct j1939_sk_buff_cb *skcb);
+void j1939_ac_recv(struct j1939_priv *priv, struct sk_buff *skb);
+int j1939_ac_fixup(struct j1939_priv *priv, struct sk_buff *skb);
+int j1939_local_ecu_get(struct j1939_priv *priv, name_t name, u8 sa);
+void j1939_local_ecu_put(struct j1939_priv *priv, name_t name, u8 sa);
+void j1939_ecu_flush(struct j1939_priv *priv);
+
+/* transport.c */
+extern unsigned int j1939_max_packet_size;
+void j1939_tp_init(struct j1939_priv *priv);
+void j1939_tp_stop(struct j1939_priv *priv);
+bool j1939_tp_recv(struct j1939_priv *priv, struct sk_buff *skb);
+int j1939_tp_send(struct j1939_priv *priv, struct sk_buff *skb, bool nonblock);
+void j1939_tp_abort_sock(struct j1939_priv *priv, struct sock *sk);
+
+/* socket.c */
+extern const struct can_proto j1939_can_proto;
+void j1939_sk_recv(struct j1939_priv *priv, struct sk_buff *skb);
+void j1939_sk_netdev_event_unregister(struct j1939_priv *priv);
+
+#endif /* _J1939_PRIV_H_ */
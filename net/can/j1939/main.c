@@ -0,0 +1,280 @@
+/*
+ * main.c - SAE J1939 protocol core
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the version 2 of the GNU General Public License
+ * as published by the Free Software Foundation
+ *
+ * Every CAN device with bound J1939 sockets gets a struct j1939_priv
+ * that receives all extended frames of the device via can_rx_register(),
+ * decodes the J1939 addressing and dispatches the message to the address
+ * claim tracking, the transport protocol or directly to the sockets.
+ */
+
+#include <linux/module.h>
+#include <linux/init.h>
+#include <linux/mutex.h>
+#include <linux/slab.h>
+#include <linux/if_arp.h>
+#include <linux/can/skb.h>
+
+#include "j1939-priv.h"
+
+MODULE_DESCRIPTION("PF_CAN SAE J1939");
+MODULE_LICENSE("GPL v2");
+MODULE_ALIAS("can-proto-" __stringify(CAN_J1939));
+
+static __initconst const char banner[] =
+	KERN_INFO "can: SAE J1939\n";
+
+/* all j1939_priv of the system, protected by j1939_netdev_lock */
+static LIST_HEAD(j1939_priv_list);
+static DEFINE_MUTEX(j1939_netdev_lock);
+
+/* LOWLEVEL CAN interface */
+
+static void j1939_can_recv(struct sk_buff *iskb, void *data)
+{
+	struct j1939_priv *priv = data;
+	struct j1939_sk_buff_cb *skcb;
+	struct can_frame *cf;
+	struct sk_buff *skb;
+
+	/* J1939 is defined for classical CAN frames only */
+	if (iskb->len != CAN_MTU)
+		return;
+
+	cf = (struct can_frame *)iskb->data;
+	if (cf->can_dlc > CAN_MAX_DLEN)
+		return;
+
+	/* clone: the payload is shared, the control buffer becomes ours */
+	skb = skb_clone(iskb, GFP_ATOMIC);
+	if (!skb)
+		return;
+
+	skcb = j1939_skb_to_cb(skb);
+	memset(skcb, 0, sizeof(*skcb));
+
+	skcb->src_sk = iskb->sk;
+	skcb->priority = (cf->can_id >> 26) & 0x7;
+	skcb->addr.sa = cf->can_id;
+	skcb->addr.pgn = (cf->can_id >> 8) & J1939_PGN_MAX;
+	if (j1939_pgn_is_pdu1(skcb->addr.pgn)) {
+		/* Type 1: with destination address */
+		skcb->addr.da = skcb->addr.pgn;
+		/* normalize pgn: strip dst address */
+		skcb->addr.pgn &= J1939_PGN_PDU1_MAX;
+	} else {
+		/* set broadcast address */
+		skcb->addr.da = J1939_NO_ADDR;
+	}
+
+	read_lock_bh(&priv->lock);
+	j1939_ac_fill_names_locked(priv, skcb);
+	if (iskb->sk || j1939_address_is_local_locked(priv, skcb->addr.sa))
+		skcb->flags |= J1939_ECU_LOCAL_SRC;
+	if (j1939_address_is_local_locked(priv, skcb->addr.da))
+		skcb->flags |= J1939_ECU_LOCAL_DST;
+	read_unlock_bh(&priv->lock);
+
+	/* strip the CAN header, only the payload is left */
+	skb_pull(skb, J1939_CAN_HDR);
+	skb_trim(skb, cf->can_dlc);
+
+	if (skcb->addr.pgn == J1939_PGN_ADDRESS_CLAIMED)
+		j1939_ac_recv(priv, skb);
+
+	if (!j1939_tp_recv(priv, skb))
+		j1939_sk_recv(priv, skb);
+
+	kfree_skb(skb);
+}
+
+/*
+ * j1939_send_frame - send a single J1939 frame
+ * @addr: source/destination address and PGN of the frame
+ * @sk: originating socket, NULL for frames generated by the kernel
+ */
+int j1939_send_frame(struct j1939_priv *priv, const struct j1939_addr *addr,
+		     priority_t prio, const void *data, unsigned int len,
+		     struct sock *sk)
+{
+	struct can_frame *cf;
+	struct sk_buff *skb;
+
+	if (len > CAN_MAX_DLEN)
+		return -EMSGSIZE;
+
+	skb = alloc_skb(CAN_MTU + sizeof(struct can_skb_priv), GFP_ATOMIC);
+	if (!skb)
+		return -ENOMEM;
+
+	can_skb_reserve(skb);
+	can_skb_prv(skb)->ifindex = priv->ndev->ifindex;
+
+	cf = (struct can_frame *)skb_put(skb, CAN_MTU);
+	memset(cf, 0, CAN_MTU);
+
+	cf->can_id = CAN_EFF_FLAG | ((canid_t)(prio & 0x7) << 26) |
+		((canid_t)addr->pgn << 8) | addr->sa;
+	if (j1939_pgn_is_pdu1(addr->pgn))
+		cf->can_id |= (canid_t)addr->da << 8;
+
+	cf->can_dlc = len;
+	memcpy(cf->data, data, len);
+
+	skb->dev = priv->ndev;
+	if (sk)
+		can_skb_set_owner(skb, sk);
+
+	return can_send(skb, 1);
+}
+
+static struct j1939_priv *j1939_priv_get_by_ndev_locked(struct net_device *ndev)
+{
+	struct j1939_priv *priv;
+
+	list_for_each_entry(priv, &j1939_priv_list, list) {
+		if (priv->ndev == ndev)
+			return priv;
+	}
+
+	return NULL;
+}
+
+static void j1939_priv_kref_release(struct kref *kref)
+{
+	struct j1939_priv *priv = container_of(kref, struct j1939_priv, kref);
+
+	/* freed by j1939_netdev_stop() outside of j1939_netdev_lock */
+	list_del(&priv->list);
+}
+
+struct j1939_priv *j1939_netdev_start(struct net_device *ndev)
+{
+	struct j1939_priv *priv;
+	int ret;
+
+	mutex_lock(&j1939_netdev_lock);
+
+	priv = j1939_priv_get_by_ndev_locked(ndev);
+	if (priv) {
+		kref_get(&priv->kref);
+		goto out_unlock;
+	}
+
+	priv = kzalloc(sizeof(*priv), GFP_KERNEL);
+	if (!priv) {
+		priv = ERR_PTR(-ENOMEM);
+		goto out_unlock;
+	}
+
+	priv->ndev = ndev;
+	kref_init(&priv->kref);
+	rwlock_init(&priv->lock);
+	INIT_LIST_HEAD(&priv->ecus);
+	spin_lock_init(&priv->j1939_socks_lock);
+	INIT_LIST_HEAD(&priv->j1939_socks);
+	j1939_tp_init(priv);
+
+	ret = can_rx_register(ndev, J1939_CAN_ID, J1939_CAN_MASK,
+			      j1939_can_recv, priv, "j1939");
+	if (ret < 0) {
+		kfree(priv);
+		priv = ERR_PTR(ret);
+		goto out_unlock;
+	}
+
+	dev_hold(ndev);
+	list_add_tail(&priv->list, &j1939_priv_list);
+
+ out_unlock:
+	mutex_unlock(&j1939_netdev_lock);
+
+	return priv;
+}
+
+void j1939_netdev_stop(struct j1939_priv *priv)
+{
+	mutex_lock(&j1939_netdev_lock);
+	if (!kref_put(&priv->kref, j1939_priv_kref_release)) {
+		mutex_unlock(&j1939_netdev_lock);
+		return;
+	}
+	mutex_unlock(&j1939_netdev_lock);
+
+	can_rx_unregister(priv->ndev, J1939_CAN_ID, J1939_CAN_MASK,
+			  j1939_can_recv, priv);
+
+	/* wait for j1939_can_recv() on other CPUs to finish */
+	synchronize_rcu();
+
+	j1939_tp_stop(priv);
+	j1939_ecu_flush(priv);
+	dev_put(priv->ndev);
+	kfree(priv);
+}
+
+static int j1939_netdev_notify(struct notifier_block *nb,
+			       unsigned long msg, void *data)
+{
+	struct net_device *ndev = netdev_notifier_info_to_dev(data);
+	struct j1939_priv *priv;
+
+	if (!net_eq(dev_net(ndev), &init_net))
+		return NOTIFY_DONE;
+
+	if (ndev->type != ARPHRD_CAN)
+		return NOTIFY_DONE;
+
+	if (msg != NETDEV_UNREGISTER)
+		return NOTIFY_DONE;
+
+	mutex_lock(&j1939_netdev_lock);
+	priv = j1939_priv_get_by_ndev_locked(ndev);
+	if (priv)
+		kref_get(&priv->kref);
+	mutex_unlock(&j1939_netdev_lock);
+
+	if (!priv)
+		return NOTIFY_DONE;
+
+	/* unbind all sockets, this drops their references on priv */
+	j1939_sk_netdev_event_unregister(priv);
+	j1939_netdev_stop(priv);
+
+	return NOTIFY_DONE;
+}
+
+static struct notifier_block j1939_netdev_notifier = {
+	.notifier_call = j1939_netdev_notify,
+};
+
+static __init int j1939_module_init(void)
+{
+	int ret;
+
+	printk(banner);
+
+	ret = register_netdevice_notifier(&j1939_netdev_notifier);
+	if (ret)
+		return ret;
+
+	ret = can_proto_register(&j1939_can_proto);
+	if (ret < 0) {
+		printk(KERN_ERR "can: registration of j1939 protocol failed\n");
+		unregister_netdevice_notifier(&j1939_netdev_notifier);
+	}
+
+	return ret;
+}
+
+static __exit void j1939_module_exit(void)
+{
+	can_proto_unregister(&j1939_can_proto);
+	unregister_netdevice_notifier(&j1939_netdev_notifier);
+}
+
+module_init(j1939_module_init);
+module_exit(j1939_module_exit);
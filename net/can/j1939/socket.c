@@ -0,0 +1,829 @@
+/*
+ * socket.c - SAE J1939 sockets
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the version 2 of the GNU General Public License
+ * as published by the Free Software Foundation
+ *
+ * A J1939 socket is bound to a CAN interface and to a local static
+ * address and/or a NAME. recvmsg() returns complete messages (single
+ * frames or reassembled transport protocol sessions) together with the
+ * source address in msg_name and the destination and priority as
+ * SCM_J1939_* control messages. sendmsg() uses the transport protocol
+ * automatically for messages longer than 8 bytes; a blocking send of
+ * such a message returns when the transfer has completed.
+ */
+
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/uio.h>
+#include <linux/if_arp.h>
+#include <linux/can/skb.h>
+
+#include "j1939-priv.h"
+
+#define J1939_MIN_NAMELEN CAN_REQUIRED_SIZE(struct sockaddr_can, can_addr.j1939)
+
+/* jsk->state */
+#define J1939_SOCK_BOUND BIT(0)
+#define J1939_SOCK_CONNECTED BIT(1)
+#define J1939_SOCK_PROMISC BIT(2)
+
+struct j1939_sock {
+	struct sock sk; /* must be first to skip with memset */
+	struct list_head list;
+	struct j1939_priv *priv;
+	int ifindex;
+	u32 state;
+
+	/* src_name/sa: bind(), dst_name/da/pgn: connect() */
+	struct j1939_addr addr;
+	pgn_t pgn_rx_filter;
+	priority_t send_prio;
+
+	spinlock_t filters_lock;
+	struct j1939_filter *filters;
+	int nfilters;
+};
+
+static inline struct j1939_sock *j1939_sk(const struct sock *sk)
+{
+	return container_of(sk, struct j1939_sock, sk);
+}
+
+static void j1939_jsk_add(struct j1939_priv *priv, struct j1939_sock *jsk)
+{
+	jsk->state |= J1939_SOCK_BOUND;
+
+	spin_lock_bh(&priv->j1939_socks_lock);
+	list_add_tail(&jsk->list, &priv->j1939_socks);
+	spin_unlock_bh(&priv->j1939_socks_lock);
+}
+
+static void j1939_jsk_del(struct j1939_priv *priv, struct j1939_sock *jsk)
+{
+	spin_lock_bh(&priv->j1939_socks_lock);
+	list_del_init(&jsk->list);
+	spin_unlock_bh(&priv->j1939_socks_lock);
+
+	jsk->state &= ~J1939_SOCK_BOUND;
+}
+
+/* RX */
+
+static bool j1939_sk_match_dst(struct j1939_sock *jsk,
+			       const struct j1939_sk_buff_cb *skcb)
+{
+	if (jsk->state & J1939_SOCK_PROMISC)
+		return true;
+
+	/* Destination address filter */
+	if (jsk->addr.src_name && skcb->addr.dst_name) {
+		if (jsk->addr.src_name != skcb->addr.dst_name)
+			return false;
+	} else {
+		/* receive (all sockets) if
+		 * - all packages that match our bind() address
+		 * - all broadcast on a socket if SO_BROADCAST
+		 *   is set
+		 */
+		if (j1939_address_is_unicast(skcb->addr.da)) {
+			if (jsk->addr.sa != skcb->addr.da)
+				return false;
+		} else if (!sock_flag(&jsk->sk, SOCK_BROADCAST)) {
+			/* receiving broadcast without SO_BROADCAST
+			 * flag is not allowed
+			 */
+			return false;
+		}
+	}
+
+	/* Source address filter */
+	if (jsk->state & J1939_SOCK_CONNECTED) {
+		/* receive (all sockets) if
+		 * - all packages that match our connect() name or address
+		 */
+		if (jsk->addr.dst_name && skcb->addr.src_name) {
+			if (jsk->addr.dst_name != skcb->addr.src_name)
+				return false;
+		} else if (jsk->addr.da != skcb->addr.sa) {
+			return false;
+		}
+	}
+
+	/* PGN filter */
+	if (j1939_pgn_is_valid(jsk->pgn_rx_filter) &&
+	    jsk->pgn_rx_filter != skcb->addr.pgn)
+		return false;
+
+	return true;
+}
+
+/* returns true if the message passes the socket filters */
+static bool j1939_sk_match_filter(struct j1939_sock *jsk,
+				  const struct j1939_sk_buff_cb *skcb)
+{
+	const struct j1939_filter *f;
+	bool match = false;
+	int i;
+
+	spin_lock(&jsk->filters_lock);
+
+	if (!jsk->nfilters) {
+		match = true;
+		goto out_unlock;
+	}
+
+	for (i = 0, f = jsk->filters; i < jsk->nfilters; i++, f++) {
+		if ((skcb->addr.pgn & f->pgn_mask) != f->pgn)
+			continue;
+		if ((skcb->addr.sa & f->addr_mask) != f->addr)
+			continue;
+		if ((skcb->addr.src_name & f->name_mask) != f->name)
+			continue;
+
+		match = true;
+		break;
+	}
+
+ out_unlock:
+	spin_unlock(&jsk->filters_lock);
+
+	return match;
+}
+
+static bool j1939_sk_recv_match_one(struct j1939_sock *jsk,
+				    const struct j1939_sk_buff_cb *skcb)
+{
+	/* no loop back to the sending socket */
+	if (skcb->src_sk == &jsk->sk)
+		return false;
+
+	if (!j1939_sk_match_dst(jsk, skcb))
+		return false;
+
+	return j1939_sk_match_filter(jsk, skcb);
+}
+
+/* deliver a complete message to all matching sockets */
+void j1939_sk_recv(struct j1939_priv *priv, struct sk_buff *skb)
+{
+	const struct j1939_sk_buff_cb *skcb = j1939_skb_to_cb(skb);
+	struct j1939_sock *jsk;
+	struct sk_buff *nskb;
+
+	spin_lock_bh(&priv->j1939_socks_lock);
+	list_for_each_entry(jsk, &priv->j1939_socks, list) {
+		if (!j1939_sk_recv_match_one(jsk, skcb))
+			continue;
+
+		nskb = skb_clone(skb, GFP_ATOMIC);
+		if (!nskb)
+			continue;
+
+		if (sock_queue_rcv_skb(&jsk->sk, nskb) < 0)
+			kfree_skb(nskb);
+	}
+	spin_unlock_bh(&priv->j1939_socks_lock);
+}
+
+/* unbind all sockets of a vanishing CAN device */
+void j1939_sk_netdev_event_unregister(struct j1939_priv *priv)
+{
+	struct j1939_sock *jsk;
+	struct sock *sk;
+
+ rescan:
+	spin_lock_bh(&priv->j1939_socks_lock);
+	list_for_each_entry(jsk, &priv->j1939_socks, list) {
+		sk = &jsk->sk;
+		sock_hold(sk);
+		spin_unlock_bh(&priv->j1939_socks_lock);
+
+		lock_sock(sk);
+		if (jsk->state & J1939_SOCK_BOUND) {
+			j1939_jsk_del(priv, jsk);
+			j1939_tp_abort_sock(priv, sk);
+			j1939_local_ecu_put(priv, jsk->addr.src_name,
+					    jsk->addr.sa);
+			j1939_netdev_stop(priv);
+			jsk->priv = NULL;
+			jsk->ifindex = 0;
+			jsk->state &= ~J1939_SOCK_CONNECTED;
+
+			sk->sk_err = ENODEV;
+			if (!sock_flag(sk, SOCK_DEAD))
+				sk->sk_error_report(sk);
+		}
+		release_sock(sk);
+		sock_put(sk);
+
+		goto rescan;
+	}
+	spin_unlock_bh(&priv->j1939_socks_lock);
+}
+
+/* PF_CAN protocol handlers */
+
+static int j1939_sk_init(struct sock *sk)
+{
+	struct j1939_sock *jsk = j1939_sk(sk);
+
+	/* Ensure that "sk" is first member in "struct j1939_sock", so that we
+	 * can skip it during memset().
+	 */
+	BUILD_BUG_ON(offsetof(struct j1939_sock, sk) != 0);
+	memset((void *)jsk + sizeof(jsk->sk), 0x0,
+	       sizeof(*jsk) - sizeof(jsk->sk));
+
+	INIT_LIST_HEAD(&jsk->list);
+	spin_lock_init(&jsk->filters_lock);
+
+	jsk->addr.sa = J1939_NO_ADDR;
+	jsk->addr.da = J1939_NO_ADDR;
+	jsk->addr.pgn = J1939_NO_PGN;
+	jsk->pgn_rx_filter = J1939_NO_PGN;
+	jsk->send_prio = J1939_DEFAULT_PRIO;
+
+	return 0;
+}
+
+static int j1939_sk_sanity_check(struct sockaddr_can *addr, int len)
+{
+	if (!addr)
+		return -EDESTADDRREQ;
+	if (len < J1939_MIN_NAMELEN)
+		return -EINVAL;
+	if (addr->can_family != AF_CAN)
+		return -EINVAL;
+	if (!addr->can_ifindex)
+		return -ENODEV;
+	if (j1939_pgn_is_valid(addr->can_addr.j1939.pgn) &&
+	    !j1939_pgn_is_clean_pdu(addr->can_addr.j1939.pgn))
+		return -EINVAL;
+
+	return 0;
+}
+
+static int j1939_sk_bind(struct socket *sock, struct sockaddr *uaddr, int len)
+{
+	struct sockaddr_can *addr = (struct sockaddr_can *)uaddr;
+	struct sock *sk = sock->sk;
+	struct j1939_sock *jsk = j1939_sk(sk);
+	struct j1939_priv *priv;
+	struct net_device *ndev;
+	int ret;
+
+	ret = j1939_sk_sanity_check(addr, len);
+	if (ret)
+		return ret;
+
+	lock_sock(sk);
+
+	if (jsk->state & J1939_SOCK_BOUND) {
+		/* a re-bind() to a different interface is not supported */
+		if (jsk->ifindex != addr->can_ifindex) {
+			ret = -EINVAL;
+			goto out_release_sock;
+		}
+
+		priv = jsk->priv;
+		ret = j1939_local_ecu_get(priv, addr->can_addr.j1939.name,
+					  addr->can_addr.j1939.addr);
+		if (ret)
+			goto out_release_sock;
+
+		/* drop the references of the old address */
+		j1939_local_ecu_put(priv, jsk->addr.src_name, jsk->addr.sa);
+	} else {
+		ndev = dev_get_by_index(&init_net, addr->can_ifindex);
+		if (!ndev) {
+			ret = -ENODEV;
+			goto out_release_sock;
+		}
+
+		if (ndev->type != ARPHRD_CAN) {
+			dev_put(ndev);
+			ret = -ENODEV;
+			goto out_release_sock;
+		}
+
+		priv = j1939_netdev_start(ndev);
+		dev_put(ndev);
+		if (IS_ERR(priv)) {
+			ret = PTR_ERR(priv);
+			goto out_release_sock;
+		}
+
+		ret = j1939_local_ecu_get(priv, addr->can_addr.j1939.name,
+					  addr->can_addr.j1939.addr);
+		if (ret) {
+			j1939_netdev_stop(priv);
+			goto out_release_sock;
+		}
+
+		jsk->ifindex = addr->can_ifindex;
+		jsk->priv = priv;
+		j1939_jsk_add(priv, jsk);
+	}
+
+	jsk->addr.src_name = addr->can_addr.j1939.name;
+	jsk->addr.sa = addr->can_addr.j1939.addr;
+	jsk->pgn_rx_filter = addr->can_addr.j1939.pgn;
+
+ out_release_sock:
+	release_sock(sk);
+
+	return ret;
+}
+
+static int j1939_sk_connect(struct socket *sock, struct sockaddr *uaddr,
+			    int len, int flags)
+{
+	struct sockaddr_can *addr = (struct sockaddr_can *)uaddr;
+	struct sock *sk = sock->sk;
+	struct j1939_sock *jsk = j1939_sk(sk);
+	int ret;
+
+	ret = j1939_sk_sanity_check(addr, len);
+	if (ret)
+		return ret;
+
+	lock_sock(sk);
+
+	/* bind() before connect() is mandatory */
+	if (!(jsk->state & J1939_SOCK_BOUND)) {
+		ret = -EINVAL;
+		goto out_release_sock;
+	}
+
+	/* A connect() to a different interface is not supported. */
+	if (jsk->ifindex != addr->can_ifindex) {
+		ret = -EINVAL;
+		goto out_release_sock;
+	}
+
+	if (!addr->can_addr.j1939.name &&
+	    addr->can_addr.j1939.addr == J1939_NO_ADDR &&
+	    !sock_flag(sk, SOCK_BROADCAST)) {
+		/* broadcast, but SO_BROADCAST not set */
+		ret = -EACCES;
+		goto out_release_sock;
+	}
+
+	jsk->addr.dst_name = addr->can_addr.j1939.name;
+	jsk->addr.da = addr->can_addr.j1939.addr;
+	if (j1939_pgn_is_valid(addr->can_addr.j1939.pgn))
+		jsk->addr.pgn = addr->can_addr.j1939.pgn;
+
+	jsk->state |= J1939_SOCK_CONNECTED;
+
+ out_release_sock:
+	release_sock(sk);
+
+	return ret;
+}
+
+static void j1939_sk_sock2sockaddr_can(struct sockaddr_can *addr,
+				       const struct j1939_sock *jsk, int peer)
+{
+	memset(addr, 0, J1939_MIN_NAMELEN);
+	addr->can_family = AF_CAN;
+	addr->can_ifindex = jsk->ifindex;
+
+	if (peer) {
+		addr->can_addr.j1939.name = jsk->addr.dst_name;
+		addr->can_addr.j1939.addr = jsk->addr.da;
+		addr->can_addr.j1939.pgn = jsk->addr.pgn;
+	} else {
+		addr->can_addr.j1939.name = jsk->addr.src_name;
+		addr->can_addr.j1939.addr = jsk->addr.sa;
+		addr->can_addr.j1939.pgn = jsk->pgn_rx_filter;
+	}
+}
+
+static int j1939_sk_getname(struct socket *sock, struct sockaddr *uaddr,
+			    int *len, int peer)
+{
+	struct sockaddr_can *addr = (struct sockaddr_can *)uaddr;
+	struct sock *sk = sock->sk;
+	struct j1939_sock *jsk = j1939_sk(sk);
+	int ret = 0;
+
+	lock_sock(sk);
+
+	if (peer && !(jsk->state & J1939_SOCK_CONNECTED)) {
+		ret = -EADDRNOTAVAIL;
+		goto failure;
+	}
+
+	j1939_sk_sock2sockaddr_can(addr, jsk, peer);
+	*len = J1939_MIN_NAMELEN;
+
+ failure:
+	release_sock(sk);
+
+	return ret;
+}
+
+static int j1939_sk_release(struct socket *sock)
+{
+	struct sock *sk = sock->sk;
+	struct j1939_sock *jsk;
+	struct j1939_priv *priv;
+
+	if (!sk)
+		return 0;
+
+	jsk = j1939_sk(sk);
+
+	lock_sock(sk);
+
+	if (jsk->state & J1939_SOCK_BOUND) {
+		priv = jsk->priv;
+
+		j1939_jsk_del(priv, jsk);
+		j1939_tp_abort_sock(priv, sk);
+		j1939_local_ecu_put(priv, jsk->addr.src_name, jsk->addr.sa);
+		j1939_netdev_stop(priv);
+		jsk->priv = NULL;
+	}
+
+	kfree(jsk->filters);
+	jsk->filters = NULL;
+
+	sock_orphan(sk);
+	sock->sk = NULL;
+
+	release_sock(sk);
+	sock_put(sk);
+
+	return 0;
+}
+
+static int j1939_sk_setsockopt_flag(struct j1939_sock *jsk, char __user *optval,
+				    unsigned int optlen, int flag)
+{
+	int tmp;
+
+	if (optlen != sizeof(tmp))
+		return -EINVAL;
+	if (copy_from_user(&tmp, optval, optlen))
+		return -EFAULT;
+
+	lock_sock(&jsk->sk);
+	if (tmp)
+		jsk->state |= flag;
+	else
+		jsk->state &= ~flag;
+	release_sock(&jsk->sk);
+
+	return tmp;
+}
+
+static int j1939_sk_setsockopt(struct socket *sock, int level, int optname,
+			       char __user *optval, unsigned int optlen)
+{
+	struct sock *sk = sock->sk;
+	struct j1939_sock *jsk = j1939_sk(sk);
+	struct j1939_filter *filters = NULL, *ofilters, *f;
+	int tmp, count = 0, ret = 0, i;
+
+	if (level != SOL_CAN_J1939)
+		return -EINVAL;
+
+	switch (optname) {
+	case SO_J1939_FILTER:
+		if (optlen) {
+			if (optlen % sizeof(*filters) != 0)
+				return -EINVAL;
+
+			if (optlen > J1939_FILTER_MAX * sizeof(*filters))
+				return -EINVAL;
+
+			count = optlen / sizeof(*filters);
+			filters = memdup_user(optval, optlen);
+			if (IS_ERR(filters))
+				return PTR_ERR(filters);
+
+			for (i = 0, f = filters; i < count; i++, f++) {
+				f->name &= f->name_mask;
+				f->pgn &= f->pgn_mask;
+				f->addr &= f->addr_mask;
+			}
+		}
+
+		lock_sock(sk);
+		spin_lock_bh(&jsk->filters_lock);
+		ofilters = jsk->filters;
+		jsk->filters = filters;
+		jsk->nfilters = count;
+		spin_unlock_bh(&jsk->filters_lock);
+		release_sock(sk);
+		kfree(ofilters);
+		return 0;
+
+	case SO_J1939_PROMISC:
+		ret = j1939_sk_setsockopt_flag(jsk, optval, optlen,
+					       J1939_SOCK_PROMISC);
+		return ret < 0 ? ret : 0;
+
+	case SO_J1939_SEND_PRIO:
+		if (optlen != sizeof(tmp))
+			return -EINVAL;
+		if (copy_from_user(&tmp, optval, optlen))
+			return -EFAULT;
+		if (tmp < 0 || tmp > 7)
+			return -EDOM;
+		if (tmp < 2 && !capable(CAP_NET_ADMIN))
+			return -EPERM;
+
+		lock_sock(sk);
+		jsk->send_prio = tmp;
+		release_sock(sk);
+		return 0;
+
+	default:
+		return -ENOPROTOOPT;
+	}
+}
+
+static int j1939_sk_getsockopt(struct socket *sock, int level, int optname,
+			       char __user *optval, int __user *optlen)
+{
+	struct sock *sk = sock->sk;
+	struct j1939_sock *jsk = j1939_sk(sk);
+	int ret, ulen;
+	/* set defaults for using 'int' properties */
+	int tmp = 0;
+	int len = sizeof(tmp);
+	void *val = &tmp;
+
+	if (level != SOL_CAN_J1939)
+		return -EINVAL;
+	if (get_user(ulen, optlen))
+		return -EFAULT;
+	if (ulen < 0)
+		return -EINVAL;
+
+	lock_sock(sk);
+
+	switch (optname) {
+	case SO_J1939_PROMISC:
+		tmp = (jsk->state & J1939_SOCK_PROMISC) ? 1 : 0;
+		break;
+	case SO_J1939_SEND_PRIO:
+		tmp = jsk->send_prio;
+		break;
+	default:
+		ret = -ENOPROTOOPT;
+		goto no_copy;
+	}
+
+	/* copy to user, based on 'len' & 'val'
+	 * but most sockopt's are 'int' properties, and have 'len' & 'val'
+	 * left unchanged, but instead modified 'tmp'
+	 */
+	if (len > ulen)
+		ret = -EFAULT;
+	else if (put_user(len, optlen))
+		ret = -EFAULT;
+	else
+		ret = copy_to_user(optval, val, len) ? -EFAULT : 0;
+
+ no_copy:
+	release_sock(sk);
+
+	return ret;
+}
+
+static int j1939_sk_recvmsg(struct kiocb *iocb, struct socket *sock,
+			    struct msghdr *msg, size_t size, int flags)
+{
+	struct sock *sk = sock->sk;
+	struct j1939_sk_buff_cb *skcb;
+	struct sk_buff *skb;
+	int ret = 0;
+	int noblock;
+
+	noblock = flags & MSG_DONTWAIT;
+	flags &= ~MSG_DONTWAIT;
+
+	skb = skb_recv_datagram(sk, flags, noblock, &ret);
+	if (!skb)
+		return ret;
+
+	if (size < skb->len)
+		msg->msg_flags |= MSG_TRUNC;
+	else
+		size = skb->len;
+
+	ret = memcpy_toiovec(msg->msg_iov, skb->data, size);
+	if (ret < 0) {
+		skb_free_datagram(sk, skb);
+		return ret;
+	}
+
+	skcb = j1939_skb_to_cb(skb);
+	if (j1939_address_is_unicast(skcb->addr.da))
+		put_cmsg(msg, SOL_CAN_J1939, SCM_J1939_DEST_ADDR,
+			 sizeof(skcb->addr.da), &skcb->addr.da);
+
+	if (skcb->addr.dst_name)
+		put_cmsg(msg, SOL_CAN_J1939, SCM_J1939_DEST_NAME,
+			 sizeof(skcb->addr.dst_name), &skcb->addr.dst_name);
+
+	put_cmsg(msg, SOL_CAN_J1939, SCM_J1939_PRIO,
+		 sizeof(skcb->priority), &skcb->priority);
+
+	if (msg->msg_name) {
+		struct sockaddr_can *paddr = msg->msg_name;
+
+		__sockaddr_check_size(sizeof(struct sockaddr_can));
+		msg->msg_namelen = J1939_MIN_NAMELEN;
+		memset(msg->msg_name, 0, msg->msg_namelen);
+		paddr->can_family = AF_CAN;
+		paddr->can_ifindex = j1939_sk(sk)->ifindex;
+		paddr->can_addr.j1939.name = skcb->addr.src_name;
+		paddr->can_addr.j1939.addr = skcb->addr.sa;
+		paddr->can_addr.j1939.pgn = skcb->addr.pgn;
+	}
+
+	sock_recv_ts_and_drops(msg, sk, skb);
+	skb_free_datagram(sk, skb);
+
+	return size;
+}
+
+static int j1939_sk_sendmsg(struct kiocb *iocb, struct socket *sock,
+			    struct msghdr *msg, size_t size)
+{
+	struct sock *sk = sock->sk;
+	struct j1939_sock *jsk = j1939_sk(sk);
+	struct j1939_sk_buff_cb *skcb;
+	struct j1939_priv *priv;
+	struct sk_buff *skb;
+	int ret;
+
+	lock_sock(sk);
+
+	/* various socket state tests */
+	if (!(jsk->state & J1939_SOCK_BOUND)) {
+		ret = -EBADFD;
+		goto out_release_sock;
+	}
+
+	priv = jsk->priv;
+
+	if (!jsk->addr.src_name && jsk->addr.sa == J1939_NO_ADDR) {
+		/* no source address assigned yet */
+		ret = -EBADFD;
+		goto out_release_sock;
+	}
+
+	if (!size || size > j1939_max_packet_size) {
+		ret = -EMSGSIZE;
+		goto out_release_sock;
+	}
+
+	/* deal with provided destination address info */
+	if (msg->msg_name) {
+		struct sockaddr_can *addr = msg->msg_name;
+
+		if (msg->msg_namelen < J1939_MIN_NAMELEN) {
+			ret = -EINVAL;
+			goto out_release_sock;
+		}
+
+		if (addr->can_family != AF_CAN) {
+			ret = -EINVAL;
+			goto out_release_sock;
+		}
+
+		if (addr->can_ifindex && addr->can_ifindex != jsk->ifindex) {
+			ret = -EBADFD;
+			goto out_release_sock;
+		}
+
+		if (j1939_pgn_is_valid(addr->can_addr.j1939.pgn) &&
+		    !j1939_pgn_is_clean_pdu(addr->can_addr.j1939.pgn)) {
+			ret = -EINVAL;
+			goto out_release_sock;
+		}
+
+		if (!addr->can_addr.j1939.name &&
+		    addr->can_addr.j1939.addr == J1939_NO_ADDR &&
+		    !sock_flag(sk, SOCK_BROADCAST)) {
+			/* broadcast, but SO_BROADCAST not set */
+			ret = -EACCES;
+			goto out_release_sock;
+		}
+	} else if (!(jsk->state & J1939_SOCK_CONNECTED)) {
+		ret = -EDESTADDRREQ;
+		goto out_release_sock;
+	}
+
+	skb = sock_alloc_send_skb(sk, size, msg->msg_flags & MSG_DONTWAIT,
+				  &ret);
+	if (!skb)
+		goto out_release_sock;
+
+	ret = memcpy_fromiovec(skb_put(skb, size), msg->msg_iov, size);
+	if (ret < 0)
+		goto free_skb;
+
+	skcb = j1939_skb_to_cb(skb);
+	memset(skcb, 0, sizeof(*skcb));
+	skcb->addr = jsk->addr;
+	skcb->priority = jsk->send_prio;
+	skcb->src_sk = sk;
+	skcb->flags = J1939_ECU_LOCAL_SRC;
+
+	if (msg->msg_name) {
+		struct sockaddr_can *addr = msg->msg_name;
+
+		skcb->addr.dst_name = addr->can_addr.j1939.name;
+		skcb->addr.da = addr->can_addr.j1939.addr;
+		if (j1939_pgn_is_valid(addr->can_addr.j1939.pgn))
+			skcb->addr.pgn = addr->can_addr.j1939.pgn;
+	}
+
+	/* keep priv alive if the device goes away while we are sending */
+	j1939_priv_get(priv);
+	release_sock(sk);
+
+	if (!j1939_pgn_is_valid(skcb->addr.pgn)) {
+		ret = -EINVAL;
+		goto free_skb_unlocked;
+	}
+
+	if (!j1939_pgn_is_pdu1(skcb->addr.pgn) &&
+	    j1939_address_is_unicast(skcb->addr.da)) {
+		/* PDU2 messages are always broadcast */
+		ret = -EINVAL;
+		goto free_skb_unlocked;
+	}
+
+	ret = j1939_ac_fixup(priv, skb);
+	if (ret < 0)
+		goto free_skb_unlocked;
+
+	if (size <= CAN_MAX_DLEN) {
+		ret = j1939_send_frame(priv, &skcb->addr, skcb->priority,
+				       skb->data, skb->len, sk);
+		kfree_skb(skb);
+	} else {
+		ret = j1939_tp_send(priv, skb,
+				    msg->msg_flags & MSG_DONTWAIT);
+	}
+	j1939_netdev_stop(priv);
+
+	return ret < 0 ? ret : size;
+
+ free_skb:
+	kfree_skb(skb);
+ out_release_sock:
+	release_sock(sk);
+
+	return ret;
+
+ free_skb_unlocked:
+	kfree_skb(skb);
+	j1939_netdev_stop(priv);
+
+	return ret;
+}
+
+static const struct proto_ops j1939_ops = {
+	.family        = PF_CAN,
+	.release       = j1939_sk_release,
+	.bind          = j1939_sk_bind,
+	.connect       = j1939_sk_connect,
+	.socketpair    = sock_no_socketpair,
+	.accept        = sock_no_accept,
+	.getname       = j1939_sk_getname,
+	.poll          = datagram_poll,
+	.ioctl         = can_ioctl,	/* use can_ioctl() from af_can.c */
+	.listen        = sock_no_listen,
+	.shutdown      = sock_no_shutdown,
+	.setsockopt    = j1939_sk_setsockopt,
+	.getsockopt    = j1939_sk_getsockopt,
+	.sendmsg       = j1939_sk_sendmsg,
+	.recvmsg       = j1939_sk_recvmsg,
+	.mmap          = sock_no_mmap,
+	.sendpage      = sock_no_sendpage,
+};
+
+static struct proto j1939_proto __read_mostly = {
+	.name       = "CAN_J1939",
+	.owner      = THIS_MODULE,
+	.obj_size   = sizeof(struct j1939_sock),
+	.init       = j1939_sk_init,
+};
+
+const struct can_proto j1939_can_proto = {
+	.type       = SOCK_DGRAM,
+	.protocol   = CAN_J1939,
+	.ops        = &j1939_ops,
+	.prot       = &j1939_proto,
+};
@@ -0,0 +1,949 @@
+/*
+ * transport.c - SAE J1939 transport protocols (J1939-21)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the version 2 of the GNU General Public License
+ * as published by the Free Software Foundation
+ *
+ * Messages of 9 up to 1785 bytes are sent with the transport protocol
+ * (TP), larger ones with the extended transport protocol (ETP). Unicast
+ * messages use the RTS/CTS handshake, broadcast messages are announced
+ * with BAM and sent with 50ms between the data packets.
+ *
+ * All sessions of a device live on one list and share one hrtimer that
+ * is programmed to the earliest session deadline (protocol timeouts,
+ * BAM pacing and retries after a full CAN TX queue).
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/skbuff.h>
+#include <asm/unaligned.h>
+
+#include "j1939-priv.h"
+
+#define J1939_TP_PGN_DAT 0x0eb00
+#define J1939_TP_PGN_CTL 0x0ec00
+#define J1939_ETP_PGN_DAT 0x0c700
+#define J1939_ETP_PGN_CTL 0x0c800
+
+#define J1939_TP_CMD_RTS 0x10
+#define J1939_TP_CMD_CTS 0x11
+#define J1939_TP_CMD_EOMA 0x13
+#define J1939_TP_CMD_BAM 0x20
+#define J1939_TP_CMD_ABORT 0xff
+
+#define J1939_ETP_CMD_RTS 0x14
+#define J1939_ETP_CMD_CTS 0x15
+#define J1939_ETP_CMD_DPO 0x16
+#define J1939_ETP_CMD_EOMA 0x17
+#define J1939_ETP_CMD_ABORT 0xff
+
+/* connection abort reasons */
+#define J1939_XTP_ABORT_BUSY 1		/* already in a session */
+#define J1939_XTP_ABORT_RESOURCE 2	/* system resources needed */
+#define J1939_XTP_ABORT_TIMEOUT 3	/* timeout occurred */
+#define J1939_XTP_ABORT_GENERIC 4	/* CTS while data transfer in progress */
+#define J1939_XTP_ABORT_UNEXPECTED_DATA 6
+#define J1939_XTP_ABORT_BAD_SEQ 7	/* bad sequence number */
+#define J1939_XTP_ABORT_EDPO_UNEXPECTED 9
+#define J1939_XTP_ABORT_BAD_EDPO_OFFSET 12
+#define J1939_XTP_ABORT_OTHER 250
+
+/* timeouts in ms */
+#define J1939_TP_T1 750		/* between data packets */
+#define J1939_TP_T2 1250	/* after CTS until the first data packet */
+#define J1939_TP_T3 1250	/* after the last data packet of a block */
+#define J1939_TP_T4 1050	/* hold (CTS with 0 packets) */
+#define J1939_TP_BAM_GAP 50	/* between BAM data packets */
+#define J1939_TP_RETRY 1	/* CAN TX queue was full */
+
+/* priority of the transport protocol frames */
+#define J1939_TP_PRIO 7
+
+#define J1939_TP_PKT_LEN 7
+
+unsigned int j1939_max_packet_size = 65536;
+module_param_named(max_packet_size, j1939_max_packet_size, uint, S_IRUGO);
+MODULE_PARM_DESC(max_packet_size, "Maximum size of a (E)TP message "
+		 "(default: 65536)");
+
+enum j1939_session_state {
+	J1939_SESSION_WAIT_CTS,		/* tx: RTS or block sent */
+	J1939_SESSION_SENDING,		/* tx: sending a block of packets */
+	J1939_SESSION_WAIT_EOMA,	/* tx: all packets sent */
+	J1939_SESSION_RECEIVING,	/* rx: waiting for packets */
+};
+
+/* blocking sendmsg() waiting for the end of its session */
+struct j1939_tp_waiter {
+	int err;
+	bool done;
+};
+
+/*
+ * struct j1939_session - one (E)TP transfer
+ * @skb: message data, skb->cb holds the addressing of the message
+ *	(sa is always the sender, da the receiver)
+ * @local: rx: we are the receiver and answer with CTS/EOMA
+ * @pkt_next: next packet to send/receive (0 based)
+ * @pkt_block_end: end of the packets cleared by the last CTS
+ * @pkt_max_block: rx: max packets per CTS requested by the sender
+ * @dpo: ETP: data packet offset of the current block
+ */
+struct j1939_session {
+	struct list_head list;
+	struct j1939_priv *priv;
+	struct sock *sk;
+	struct j1939_tp_waiter *waiter;
+	struct sk_buff *skb;
+
+	enum j1939_session_state state;
+	bool tx;
+	bool extd;
+	bool bam;
+	bool local;
+	bool dpo_valid;
+
+	unsigned int pkt_total;
+	unsigned int pkt_next;
+	unsigned int pkt_block_end;
+	unsigned int pkt_max_block;
+	unsigned int dpo;
+
+	ktime_t deadline;
+};
+
+static inline struct j1939_sk_buff_cb *j1939_session_cb(struct j1939_session *session)
+{
+	return j1939_skb_to_cb(session->skb);
+}
+
+static inline pgn_t j1939_tp_ctl_pgn(const struct j1939_session *session)
+{
+	return session->extd ? J1939_ETP_PGN_CTL : J1939_TP_PGN_CTL;
+}
+
+static inline pgn_t j1939_tp_dat_pgn(const struct j1939_session *session)
+{
+	return session->extd ? J1939_ETP_PGN_DAT : J1939_TP_PGN_DAT;
+}
+
+static inline void j1939_tp_set_pgn(u8 *dat, pgn_t pgn)
+{
+	dat[5] = pgn;
+	dat[6] = pgn >> 8;
+	dat[7] = pgn >> 16;
+}
+
+static inline pgn_t j1939_tp_get_pgn(const u8 *dat)
+{
+	return (dat[5] | (dat[6] << 8) | (dat[7] << 16)) & J1939_PGN_MAX;
+}
+
+static void j1939_tp_set_deadline(struct j1939_session *session,
+				  unsigned int msec)
+{
+	session->deadline = ktime_add_ms(ktime_get(), msec);
+}
+
+/* program the timer to @deadline unless it already expires earlier */
+static void j1939_tp_schedule(struct j1939_priv *priv, ktime_t deadline)
+{
+	struct hrtimer *timer = &priv->tp_timer.timer;
+
+	if (hrtimer_is_queued(timer) &&
+	    ktime_to_ns(hrtimer_get_expires(timer)) <= ktime_to_ns(deadline))
+		return;
+
+	tasklet_hrtimer_start(&priv->tp_timer, deadline, HRTIMER_MODE_ABS);
+}
+
+static struct j1939_session *j1939_session_find(struct j1939_priv *priv,
+						u8 sa, u8 da, bool tx)
+{
+	struct j1939_session *session;
+	struct j1939_sk_buff_cb *skcb;
+
+	list_for_each_entry(session, &priv->sessions, list) {
+		skcb = j1939_session_cb(session);
+		if (session->tx == tx && skcb->addr.sa == sa &&
+		    skcb->addr.da == da)
+			return session;
+	}
+
+	return NULL;
+}
+
+static void j1939_session_free(struct j1939_session *session)
+{
+	kfree_skb(session->skb);
+	if (session->sk)
+		sock_put(session->sk);
+	kfree(session);
+}
+
+/* end a session, session_lock held */
+static void j1939_session_finish(struct j1939_session *session, int err)
+{
+	struct j1939_priv *priv = session->priv;
+	struct sock *sk = session->sk;
+
+	list_del(&session->list);
+
+	if (session->tx) {
+		if (!err) {
+			/* local loop back of the complete message */
+			j1939_sk_recv(priv, session->skb);
+		}
+
+		if (session->waiter) {
+			session->waiter->err = err;
+			session->waiter->done = true;
+		} else if (err && sk) {
+			sk->sk_err = -err;
+			if (!sock_flag(sk, SOCK_DEAD))
+				sk->sk_error_report(sk);
+		}
+	} else if (!err) {
+		j1939_sk_recv(priv, session->skb);
+	}
+
+	j1939_session_free(session);
+	wake_up_all(&priv->tp_wait);
+}
+
+/* TX of control and data frames */
+
+static int j1939_tp_send_ctl(struct j1939_session *session, const u8 *dat)
+{
+	struct j1939_sk_buff_cb *skcb = j1939_session_cb(session);
+	struct j1939_addr addr = {
+		.pgn = j1939_tp_ctl_pgn(session),
+	};
+
+	/* the receiver answers in the opposite direction */
+	if (session->tx) {
+		addr.sa = skcb->addr.sa;
+		addr.da = skcb->addr.da;
+	} else {
+		addr.sa = skcb->addr.da;
+		addr.da = skcb->addr.sa;
+	}
+
+	return j1939_send_frame(session->priv, &addr, J1939_TP_PRIO, dat, 8,
+				session->sk);
+}
+
+static int j1939_tp_send_abort(struct j1939_session *session, u8 reason)
+{
+	u8 dat[8];
+
+	if (session->bam || (!session->tx && !session->local))
+		return 0;
+
+	memset(dat, 0xff, sizeof(dat));
+	dat[0] = J1939_TP_CMD_ABORT;
+	dat[1] = reason;
+	j1939_tp_set_pgn(dat, j1939_session_cb(session)->addr.pgn);
+
+	return j1939_tp_send_ctl(session, dat);
+}
+
+static int j1939_tp_send_rts(struct j1939_session *session)
+{
+	struct j1939_sk_buff_cb *skcb = j1939_session_cb(session);
+	unsigned int size = session->skb->len;
+	u8 dat[8];
+
+	memset(dat, 0xff, sizeof(dat));
+	if (session->extd) {
+		dat[0] = J1939_ETP_CMD_RTS;
+		put_unaligned_le32(size, &dat[1]);
+	} else {
+		dat[0] = session->bam ? J1939_TP_CMD_BAM : J1939_TP_CMD_RTS;
+		put_unaligned_le16(size, &dat[1]);
+		dat[3] = session->pkt_total;
+		/* dat[4]: no limit of packets per CTS */
+	}
+	j1939_tp_set_pgn(dat, skcb->addr.pgn);
+
+	return j1939_tp_send_ctl(session, dat);
+}
+
+static int j1939_tp_send_cts(struct j1939_session *session)
+{
+	struct j1939_sk_buff_cb *skcb = j1939_session_cb(session);
+	unsigned int next = session->pkt_next + 1;
+	unsigned int n;
+	u8 dat[8];
+
+	n = min(session->pkt_total - session->pkt_next, session->pkt_max_block);
+
+	memset(dat, 0xff, sizeof(dat));
+	dat[1] = n;
+	if (session->extd) {
+		dat[0] = J1939_ETP_CMD_CTS;
+		dat[2] = next;
+		dat[3] = next >> 8;
+		dat[4] = next >> 16;
+	} else {
+		dat[0] = J1939_TP_CMD_CTS;
+		dat[2] = next;
+	}
+	j1939_tp_set_pgn(dat, skcb->addr.pgn);
+
+	session->pkt_block_end = session->pkt_next + n;
+	session->dpo_valid = false;
+
+	return j1939_tp_send_ctl(session, dat);
+}
+
+static int j1939_tp_send_eoma(struct j1939_session *session)
+{
+	struct j1939_sk_buff_cb *skcb = j1939_session_cb(session);
+	unsigned int size = session->skb->len;
+	u8 dat[8];
+
+	memset(dat, 0xff, sizeof(dat));
+	if (session->extd) {
+		dat[0] = J1939_ETP_CMD_EOMA;
+		put_unaligned_le32(size, &dat[1]);
+	} else {
+		dat[0] = J1939_TP_CMD_EOMA;
+		put_unaligned_le16(size, &dat[1]);
+		dat[3] = session->pkt_total;
+	}
+	j1939_tp_set_pgn(dat, skcb->addr.pgn);
+
+	return j1939_tp_send_ctl(session, dat);
+}
+
+static int j1939_tp_send_dpo(struct j1939_session *session)
+{
+	struct j1939_sk_buff_cb *skcb = j1939_session_cb(session);
+	unsigned int n = session->pkt_block_end - session->pkt_next;
+	u8 dat[8];
+
+	session->dpo = session->pkt_next;
+
+	dat[0] = J1939_ETP_CMD_DPO;
+	dat[1] = n;
+	dat[2] = session->dpo;
+	dat[3] = session->dpo >> 8;
+	dat[4] = session->dpo >> 16;
+	j1939_tp_set_pgn(dat, skcb->addr.pgn);
+
+	return j1939_tp_send_ctl(session, dat);
+}
+
+static int j1939_tp_send_dat(struct j1939_session *session)
+{
+	struct j1939_sk_buff_cb *skcb = j1939_session_cb(session);
+	unsigned int offset = session->pkt_next * J1939_TP_PKT_LEN;
+	unsigned int len = min_t(unsigned int, session->skb->len - offset,
+				 J1939_TP_PKT_LEN);
+	struct j1939_addr addr = {
+		.pgn = j1939_tp_dat_pgn(session),
+		.sa = skcb->addr.sa,
+		.da = skcb->addr.da,
+	};
+	u8 dat[8];
+
+	memset(dat, 0xff, sizeof(dat));
+	dat[0] = session->pkt_next - session->dpo + 1;
+	memcpy(&dat[1], session->skb->data + offset, len);
+
+	return j1939_send_frame(session->priv, &addr, J1939_TP_PRIO, dat, 8,
+				session->sk);
+}
+
+/* abort a session from our side */
+static void j1939_session_abort(struct j1939_session *session, u8 reason,
+				int err)
+{
+	j1939_tp_send_abort(session, reason);
+	j1939_session_finish(session, err);
+}
+
+/*
+ * Send the packets of the current block. Returns with the session
+ * waiting for the timer when the CAN TX queue is full or when BAM
+ * pacing applies.
+ */
+static void j1939_session_tx_block(struct j1939_session *session)
+{
+	struct j1939_priv *priv = session->priv;
+	int err;
+
+	while (session->pkt_next < session->pkt_block_end) {
+		err = j1939_tp_send_dat(session);
+		if (err == -ENOBUFS) {
+			j1939_tp_set_deadline(session, J1939_TP_RETRY);
+			j1939_tp_schedule(priv, session->deadline);
+			return;
+		}
+		if (err < 0) {
+			j1939_session_abort(session, J1939_XTP_ABORT_OTHER, err);
+			return;
+		}
+
+		session->pkt_next++;
+
+		if (session->bam && session->pkt_next < session->pkt_total) {
+			j1939_tp_set_deadline(session, J1939_TP_BAM_GAP);
+			j1939_tp_schedule(priv, session->deadline);
+			return;
+		}
+	}
+
+	if (session->bam) {
+		j1939_session_finish(session, 0);
+		return;
+	}
+
+	if (session->pkt_next == session->pkt_total)
+		session->state = J1939_SESSION_WAIT_EOMA;
+	else
+		session->state = J1939_SESSION_WAIT_CTS;
+
+	j1939_tp_set_deadline(session, J1939_TP_T3);
+	j1939_tp_schedule(priv, session->deadline);
+}
+
+static void j1939_session_expired(struct j1939_session *session)
+{
+	if (session->tx && session->state == J1939_SESSION_SENDING) {
+		/* BAM pacing or retry after a full TX queue */
+		j1939_session_tx_block(session);
+		return;
+	}
+
+	netdev_dbg(session->priv->ndev, "tp session timeout (state %d)\n",
+		   session->state);
+	j1939_session_abort(session, J1939_XTP_ABORT_TIMEOUT, -ETIMEDOUT);
+}
+
+static enum hrtimer_restart j1939_tp_timer_handler(struct hrtimer *hrtimer)
+{
+	struct j1939_priv *priv = container_of(hrtimer, struct j1939_priv,
+					       tp_timer.timer);
+	struct j1939_session *session, *next;
+	ktime_t now, first = ktime_set(0, 0);
+	bool pending = false;
+
+	spin_lock_bh(&priv->session_lock);
+
+	now = ktime_get();
+	list_for_each_entry_safe(session, next, &priv->sessions, list) {
+		if (ktime_to_ns(session->deadline) <= ktime_to_ns(now))
+			j1939_session_expired(session);
+	}
+
+	list_for_each_entry(session, &priv->sessions, list) {
+		if (!pending ||
+		    ktime_to_ns(session->deadline) < ktime_to_ns(first)) {
+			first = session->deadline;
+			pending = true;
+		}
+	}
+
+	if (pending)
+		j1939_tp_schedule(priv, first);
+
+	spin_unlock_bh(&priv->session_lock);
+
+	return HRTIMER_NORESTART;
+}
+
+/* RX of control and data frames */
+
+static void j1939_tp_rx_rts(struct j1939_priv *priv, struct sk_buff *skb,
+			    bool extd)
+{
+	struct j1939_sk_buff_cb *skcb = j1939_skb_to_cb(skb);
+	struct j1939_session *session;
+	struct j1939_sk_buff_cb *scb;
+	const u8 *dat = skb->data;
+	unsigned int size, pkt_total;
+	bool bam = !extd && dat[0] == J1939_TP_CMD_BAM;
+	bool local;
+
+	if (bam == j1939_address_is_unicast(skcb->addr.da))
+		return;
+
+	local = !bam && (skcb->flags & J1939_ECU_LOCAL_DST);
+	if (!bam && !local)
+		/* not for us */
+		return;
+
+	if (extd) {
+		size = get_unaligned_le32(&dat[1]);
+		pkt_total = DIV_ROUND_UP(size, J1939_TP_PKT_LEN);
+		if (size <= J1939_MAX_TP_PACKET_SIZE ||
+		    size > J1939_MAX_ETP_PACKET_SIZE)
+			return;
+	} else {
+		size = get_unaligned_le16(&dat[1]);
+		pkt_total = dat[3];
+		if (size <= CAN_MAX_DLEN || size > J1939_MAX_TP_PACKET_SIZE ||
+		    pkt_total != DIV_ROUND_UP(size, J1939_TP_PKT_LEN))
+			return;
+	}
+
+	/* a new RTS replaces a running session */
+	session = j1939_session_find(priv, skcb->addr.sa, skcb->addr.da, false);
+	if (session)
+		j1939_session_finish(session, -EALREADY);
+
+	session = kzalloc(sizeof(*session), GFP_ATOMIC);
+	if (session && size <= j1939_max_packet_size)
+		session->skb = alloc_skb(size, GFP_ATOMIC);
+	if (!session || !session->skb) {
+		kfree(session);
+		if (local) {
+			struct j1939_addr addr = {
+				.pgn = extd ? J1939_ETP_PGN_CTL : J1939_TP_PGN_CTL,
+				.sa = skcb->addr.da,
+				.da = skcb->addr.sa,
+			};
+			u8 abort[8];
+
+			memset(abort, 0xff, sizeof(abort));
+			abort[0] = J1939_TP_CMD_ABORT;
+			abort[1] = J1939_XTP_ABORT_RESOURCE;
+			j1939_tp_set_pgn(abort, j1939_tp_get_pgn(dat));
+			j1939_send_frame(priv, &addr, J1939_TP_PRIO, abort, 8,
+					 NULL);
+		}
+		return;
+	}
+
+	skb_put(session->skb, size);
+	scb = j1939_skb_to_cb(session->skb);
+	memcpy(scb, skcb, sizeof(*scb));
+	scb->addr.pgn = j1939_tp_get_pgn(dat);
+	if (j1939_pgn_is_pdu1(scb->addr.pgn))
+		scb->addr.pgn &= J1939_PGN_PDU1_MAX;
+
+	session->priv = priv;
+	session->extd = extd;
+	session->bam = bam;
+	session->local = local;
+	session->pkt_total = pkt_total;
+	session->state = J1939_SESSION_RECEIVING;
+	list_add_tail(&session->list, &priv->sessions);
+
+	if (bam) {
+		session->pkt_block_end = pkt_total;
+		j1939_tp_set_deadline(session, J1939_TP_T1);
+	} else {
+		/* dat[4]: max packets per CTS, 0xff: no limit */
+		session->pkt_max_block = extd ? 0xff : dat[4];
+		if (!session->pkt_max_block)
+			session->pkt_max_block = 0xff;
+		j1939_tp_send_cts(session);
+		j1939_tp_set_deadline(session, J1939_TP_T2);
+	}
+	j1939_tp_schedule(priv, session->deadline);
+}
+
+static void j1939_tp_rx_dpo(struct j1939_priv *priv, struct sk_buff *skb)
+{
+	struct j1939_sk_buff_cb *skcb = j1939_skb_to_cb(skb);
+	struct j1939_session *session;
+	const u8 *dat = skb->data;
+	unsigned int dpo;
+
+	session = j1939_session_find(priv, skcb->addr.sa, skcb->addr.da, false);
+	if (!session || !session->extd)
+		return;
+
+	dpo = dat[2] | (dat[3] << 8) | (dat[4] << 16);
+	if (dpo != session->pkt_next) {
+		j1939_session_abort(session, J1939_XTP_ABORT_BAD_EDPO_OFFSET,
+				    -EBADMSG);
+		return;
+	}
+
+	session->dpo = dpo;
+	session->dpo_valid = true;
+	j1939_tp_set_deadline(session, J1939_TP_T1);
+	j1939_tp_schedule(priv, session->deadline);
+}
+
+static void j1939_tp_rx_dat(struct j1939_priv *priv, struct sk_buff *skb,
+			    bool extd)
+{
+	struct j1939_sk_buff_cb *skcb = j1939_skb_to_cb(skb);
+	struct j1939_session *session;
+	const u8 *dat = skb->data;
+	unsigned int pkt, offset, len;
+
+	session = j1939_session_find(priv, skcb->addr.sa, skcb->addr.da, false);
+	if (!session || session->extd != extd)
+		return;
+
+	if (!dat[0]) {
+		j1939_session_abort(session, J1939_XTP_ABORT_BAD_SEQ, -EBADMSG);
+		return;
+	}
+
+	if (extd && !session->dpo_valid) {
+		j1939_session_abort(session, J1939_XTP_ABORT_EDPO_UNEXPECTED,
+				    -EBADMSG);
+		return;
+	}
+
+	pkt = session->dpo + dat[0] - 1;
+	if (pkt < session->pkt_next)
+		/* duplicate packet */
+		return;
+
+	if (pkt != session->pkt_next) {
+		j1939_session_abort(session, J1939_XTP_ABORT_BAD_SEQ, -EBADMSG);
+		return;
+	}
+
+	if (!session->bam && pkt >= session->pkt_block_end) {
+		j1939_session_abort(session, J1939_XTP_ABORT_UNEXPECTED_DATA,
+				    -EBADMSG);
+		return;
+	}
+
+	offset = pkt * J1939_TP_PKT_LEN;
+	len = min_t(unsigned int, session->skb->len - offset, J1939_TP_PKT_LEN);
+	if (skb->len < len + 1) {
+		j1939_session_abort(session, J1939_XTP_ABORT_OTHER, -EBADMSG);
+		return;
+	}
+
+	memcpy(session->skb->data + offset, &dat[1], len);
+	session->pkt_next++;
+
+	if (session->pkt_next == session->pkt_total) {
+		if (session->local)
+			j1939_tp_send_eoma(session);
+		j1939_session_finish(session, 0);
+		return;
+	}
+
+	if (!session->bam && session->pkt_next == session->pkt_block_end) {
+		j1939_tp_send_cts(session);
+		j1939_tp_set_deadline(session, J1939_TP_T2);
+	} else {
+		j1939_tp_set_deadline(session, J1939_TP_T1);
+	}
+	j1939_tp_schedule(priv, session->deadline);
+}
+
+/* CTS, EOMA and aborts from the receiver of one of our sessions */
+static void j1939_tp_rx_cts(struct j1939_priv *priv, struct sk_buff *skb)
+{
+	struct j1939_sk_buff_cb *skcb = j1939_skb_to_cb(skb);
+	struct j1939_session *session;
+	const u8 *dat = skb->data;
+	unsigned int n, next;
+
+	session = j1939_session_find(priv, skcb->addr.da, skcb->addr.sa, true);
+	if (!session || session->bam)
+		return;
+
+	if (session->state == J1939_SESSION_SENDING) {
+		j1939_session_abort(session, J1939_XTP_ABORT_GENERIC, -EBADMSG);
+		return;
+	}
+
+	n = dat[1];
+	if (session->extd)
+		next = dat[2] | (dat[3] << 8) | (dat[4] << 16);
+	else
+		next = dat[2];
+
+	if (!n) {
+		/* hold the connection open */
+		session->state = J1939_SESSION_WAIT_CTS;
+		j1939_tp_set_deadline(session, J1939_TP_T4);
+		j1939_tp_schedule(priv, session->deadline);
+		return;
+	}
+
+	if (!next || next - 1 + n > session->pkt_total) {
+		j1939_session_abort(session, J1939_XTP_ABORT_BAD_SEQ, -EBADMSG);
+		return;
+	}
+
+	session->pkt_next = next - 1;
+	session->pkt_block_end = session->pkt_next + n;
+	session->state = J1939_SESSION_SENDING;
+
+	if (session->extd) {
+		int err = j1939_tp_send_dpo(session);
+
+		if (err < 0) {
+			j1939_session_abort(session, J1939_XTP_ABORT_OTHER, err);
+			return;
+		}
+	}
+
+	j1939_session_tx_block(session);
+}
+
+static void j1939_tp_rx_eoma(struct j1939_priv *priv, struct sk_buff *skb)
+{
+	struct j1939_sk_buff_cb *skcb = j1939_skb_to_cb(skb);
+	struct j1939_session *session;
+
+	session = j1939_session_find(priv, skcb->addr.da, skcb->addr.sa, true);
+	if (!session || session->bam ||
+	    session->state != J1939_SESSION_WAIT_EOMA)
+		return;
+
+	j1939_session_finish(session, 0);
+}
+
+static void j1939_tp_rx_abort(struct j1939_priv *priv, struct sk_buff *skb)
+{
+	struct j1939_sk_buff_cb *skcb = j1939_skb_to_cb(skb);
+	struct j1939_session *session;
+
+	/* from the receiver of one of our sessions */
+	session = j1939_session_find(priv, skcb->addr.da, skcb->addr.sa, true);
+	if (session) {
+		netdev_dbg(priv->ndev, "tp session aborted by peer (%u)\n",
+			   skb->data[1]);
+		j1939_session_finish(session, -ECONNABORTED);
+	}
+
+	/* from the sender of a session we receive */
+	session = j1939_session_find(priv, skcb->addr.sa, skcb->addr.da, false);
+	if (session)
+		j1939_session_finish(session, -ECONNABORTED);
+}
+
+static void j1939_tp_cmd_recv(struct j1939_priv *priv, struct sk_buff *skb,
+			      bool extd)
+{
+	switch (skb->data[0]) {
+	case J1939_TP_CMD_RTS:
+	case J1939_TP_CMD_BAM:
+		if (!extd)
+			j1939_tp_rx_rts(priv, skb, false);
+		break;
+	case J1939_ETP_CMD_RTS:
+		if (extd)
+			j1939_tp_rx_rts(priv, skb, true);
+		break;
+	case J1939_TP_CMD_CTS:
+	case J1939_ETP_CMD_CTS:
+		j1939_tp_rx_cts(priv, skb);
+		break;
+	case J1939_ETP_CMD_DPO:
+		j1939_tp_rx_dpo(priv, skb);
+		break;
+	case J1939_TP_CMD_EOMA:
+	case J1939_ETP_CMD_EOMA:
+		j1939_tp_rx_eoma(priv, skb);
+		break;
+	case J1939_TP_CMD_ABORT:
+		j1939_tp_rx_abort(priv, skb);
+		break;
+	}
+}
+
+/*
+ * Returns true if @skb is a transport protocol frame and has been
+ * consumed. Our own transport frames come back from the bus as well,
+ * they are ignored here.
+ */
+bool j1939_tp_recv(struct j1939_priv *priv, struct sk_buff *skb)
+{
+	struct j1939_sk_buff_cb *skcb = j1939_skb_to_cb(skb);
+	bool extd;
+
+	switch (skcb->addr.pgn) {
+	case J1939_TP_PGN_CTL:
+	case J1939_ETP_PGN_CTL:
+		if (skcb->flags & J1939_ECU_LOCAL_SRC || skb->len < 8)
+			return true;
+
+		extd = skcb->addr.pgn == J1939_ETP_PGN_CTL;
+		spin_lock_bh(&priv->session_lock);
+		j1939_tp_cmd_recv(priv, skb, extd);
+		spin_unlock_bh(&priv->session_lock);
+		return true;
+
+	case J1939_TP_PGN_DAT:
+	case J1939_ETP_PGN_DAT:
+		if (skcb->flags & J1939_ECU_LOCAL_SRC || skb->len < 2)
+			return true;
+
+		extd = skcb->addr.pgn == J1939_ETP_PGN_DAT;
+		spin_lock_bh(&priv->session_lock);
+		j1939_tp_rx_dat(priv, skb, extd);
+		spin_unlock_bh(&priv->session_lock);
+		return true;
+
+	default:
+		return false;
+	}
+}
+
+static bool j1939_tp_busy(struct j1939_priv *priv, u8 sa, u8 da)
+{
+	bool busy;
+
+	spin_lock_bh(&priv->session_lock);
+	busy = j1939_session_find(priv, sa, da, true);
+	spin_unlock_bh(&priv->session_lock);
+
+	return busy;
+}
+
+/*
+ * Send a message of more than 8 bytes. Consumes @skb. Without @nonblock
+ * this waits until the transfer has completed, otherwise an error is
+ * reported via sk_err.
+ */
+int j1939_tp_send(struct j1939_priv *priv, struct sk_buff *skb, bool nonblock)
+{
+	struct j1939_sk_buff_cb *skcb = j1939_skb_to_cb(skb);
+	struct j1939_tp_waiter waiter = { };
+	struct j1939_session *session;
+	u8 sa = skcb->addr.sa, da = skcb->addr.da;
+	int err;
+
+	if (skb->len > j1939_max_packet_size) {
+		err = -EMSGSIZE;
+		goto free_skb;
+	}
+
+	if (!j1939_address_is_unicast(sa)) {
+		err = -EADDRNOTAVAIL;
+		goto free_skb;
+	}
+
+	session = kzalloc(sizeof(*session), GFP_KERNEL);
+	if (!session) {
+		err = -ENOMEM;
+		goto free_skb;
+	}
+
+	session->priv = priv;
+	session->skb = skb;
+	session->tx = true;
+	session->extd = skb->len > J1939_MAX_TP_PACKET_SIZE;
+	session->bam = !j1939_address_is_unicast(da);
+	session->pkt_total = DIV_ROUND_UP(skb->len, J1939_TP_PKT_LEN);
+	if (skb->sk) {
+		session->sk = skb->sk;
+		sock_hold(session->sk);
+	}
+
+	if (session->extd && session->bam) {
+		/* ETP is connection mode only */
+		err = -EINVAL;
+		goto free_session;
+	}
+
+	/* only one session per source/destination pair */
+	spin_lock_bh(&priv->session_lock);
+	while (j1939_session_find(priv, sa, da, true)) {
+		spin_unlock_bh(&priv->session_lock);
+
+		if (nonblock) {
+			err = -EAGAIN;
+			goto free_session;
+		}
+
+		err = wait_event_interruptible(priv->tp_wait,
+					       !j1939_tp_busy(priv, sa, da));
+		if (err)
+			goto free_session;
+
+		spin_lock_bh(&priv->session_lock);
+	}
+
+	err = j1939_tp_send_rts(session);
+	if (err < 0) {
+		spin_unlock_bh(&priv->session_lock);
+		goto free_session;
+	}
+
+	if (!nonblock)
+		session->waiter = &waiter;
+
+	if (session->bam) {
+		session->state = J1939_SESSION_SENDING;
+		session->pkt_block_end = session->pkt_total;
+		j1939_tp_set_deadline(session, J1939_TP_BAM_GAP);
+	} else {
+		session->state = J1939_SESSION_WAIT_CTS;
+		j1939_tp_set_deadline(session, J1939_TP_T3);
+	}
+	list_add_tail(&session->list, &priv->sessions);
+	j1939_tp_schedule(priv, session->deadline);
+
+	spin_unlock_bh(&priv->session_lock);
+
+	if (nonblock)
+		return 0;
+
+	err = wait_event_interruptible(priv->tp_wait, waiter.done);
+
+	spin_lock_bh(&priv->session_lock);
+	if (!waiter.done) {
+		/* interrupted: the transfer continues in the background */
+		session->waiter = NULL;
+		spin_unlock_bh(&priv->session_lock);
+		return err;
+	}
+	spin_unlock_bh(&priv->session_lock);
+
+	return waiter.err;
+
+ free_session:
+	/* the skb is freed with the session */
+	j1939_session_free(session);
+	return err;
+
+ free_skb:
+	kfree_skb(skb);
+	return err;
+}
+
+/* abort all transmissions of a closing socket */
+void j1939_tp_abort_sock(struct j1939_priv *priv, struct sock *sk)
+{
+	struct j1939_session *session, *next;
+
+	spin_lock_bh(&priv->session_lock);
+	list_for_each_entry_safe(session, next, &priv->sessions, list) {
+		if (session->sk == sk)
+			j1939_session_abort(session, J1939_XTP_ABORT_OTHER,
+					    -ESHUTDOWN);
+	}
+	spin_unlock_bh(&priv->session_lock);
+}
+
+void j1939_tp_init(struct j1939_priv *priv)
+{
+	spin_lock_init(&priv->session_lock);
+	INIT_LIST_HEAD(&priv->sessions);
+	init_waitqueue_head(&priv->tp_wait);
+	tasklet_hrtimer_init(&priv->tp_timer, j1939_tp_timer_handler,
+			     CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+}
+
+void j1939_tp_stop(struct j1939_priv *priv)
+{
+	struct j1939_session *session, *next;
+
+	tasklet_hrtimer_cancel(&priv->tp_timer);
+
+	spin_lock_bh(&priv->session_lock);
+	list_for_each_entry_safe(session, next, &priv->sessions, list)
+		j1939_session_finish(session, -ENETDOWN);
+	spin_unlock_bh(&priv->session_lock);
+}
@@ -78,24 +78,59 @@ static int user_reset;
 static const char rx_list_name[][8] = {
 	[RX_ERR] = "rx_err",
 	[RX_ALL] = "rx_all",
-	[RX_FIL] = "rx_fil",
 	[RX_INV] = "rx_inv",
-	[RX_EFF] = "rx_eff",
+};
+
+/* receive lists which are spread over index or hash tables */
+enum { RX_SFF_TAB, RX_EFF_TAB, RX_FIL_TAB };
+
+static const char rx_tab_name[][8] = {
+	[RX_SFF_TAB] = "rx_sff",
+	[RX_EFF_TAB] = "rx_eff",
+	[RX_FIL_TAB] = "rx_fil",
 };
 
 /*
  * af_can statistics stuff
  */
 
+/*
+ * The packet counters are kept per CPU (see can_pcpu_stats) and folded into
+ * can_stats under can_stats_lock when they are read. The rates are calculated
+ * by can_stat_update() which runs once a second, but only while somebody
+ * holds /proc/net/can/stats open. Each open of an idle stats file takes a
+ * fresh sample, so the 'current' values then cover the time since the last
+ * sample.
+ */
+static DEFINE_SPINLOCK(can_stats_lock);
+static DEFINE_MUTEX(can_stats_users_lock);
+static unsigned int can_stats_users;		/* openers of the stats file */
+static struct can_pcpu_stats can_stats_base;	/* counters at last reset */
+
+static void can_pcpu_stats_sum(struct can_pcpu_stats *sum)
+{
+	int cpu;
+
+	memset(sum, 0, sizeof(*sum));
+
+	for_each_possible_cpu(cpu) {
+		const struct can_pcpu_stats *s = &per_cpu(can_pcpu_stats, cpu);
+
+		sum->rx_frames += ACCESS_ONCE(s->rx_frames);
+		sum->tx_frames += ACCESS_ONCE(s->tx_frames);
+		sum->matches   += ACCESS_ONCE(s->matches);
+	}
+}
+
+/* called with can_stats_lock held */
 static void can_init_stats(void)
 {
-	/*
-	 * This memset function is called from a timer context (when
-	 * can_stattimer is active which is the default) OR in a process
-	 * context (reading the proc_fs when can_stattimer is disabled).
-	 */
 	memset(&can_stats, 0, sizeof(can_stats));
 	can_stats.jiffies_init = jiffies;
+	can_stats.jiffies_last = can_stats.jiffies_init;
+
+	/* the per-CPU counters are never cleared, remember where we start */
+	can_pcpu_stats_sum(&can_stats_base);
 
 	can_pstats.stats_reset++;
 
@@ -105,6 +140,18 @@ static void can_init_stats(void)
 	}
 }
 
+/* fold the per-CPU counters into can_stats, called with can_stats_lock held */
+static void can_stats_refresh(void)
+{
+	struct can_pcpu_stats sum;
+
+	can_pcpu_stats_sum(&sum);
+
+	can_stats.rx_frames = sum.rx_frames - can_stats_base.rx_frames;
+	can_stats.tx_frames = sum.tx_frames - can_stats_base.tx_frames;
+	can_stats.matches   = sum.matches   - can_stats_base.matches;
+}
+
 static unsigned long calc_rate(unsigned long oldjif, unsigned long newjif,
 			       unsigned long count)
 {
@@ -125,13 +172,13 @@ static unsigned long calc_rate(unsigned long oldjif, unsigned long newjif,
 	return rate;
 }
 
-void can_stat_update(unsigned long data)
+/* called with can_stats_lock held */
+static void __can_stat_update(void)
 {
 	unsigned long j = jiffies; /* snapshot */
+	unsigned long rx_delta, tx_delta, matches_delta;
 
-	/* restart counting in timer context on user request */
-	if (user_reset)
-		can_init_stats();
+	can_stats_refresh();
 
 	/* restart counting on jiffies overflow */
 	if (j < can_stats.jiffies_init)
@@ -159,14 +206,23 @@ void can_stat_update(unsigned long data)
 	can_stats.total_rx_rate = calc_rate(can_stats.jiffies_init, j,
 					    can_stats.rx_frames);
 
+	/* two samples within one jiffy - keep the previous current values */
+	if (j == can_stats.jiffies_last)
+		return;
+
 	/* calc current values */
-	if (can_stats.rx_frames_delta)
-		can_stats.current_rx_match_ratio =
-			(can_stats.matches_delta * 100) /
-			can_stats.rx_frames_delta;
+	rx_delta      = can_stats.rx_frames - can_stats.rx_frames_last;
+	tx_delta      = can_stats.tx_frames - can_stats.tx_frames_last;
+	matches_delta = can_stats.matches   - can_stats.matches_last;
 
-	can_stats.current_tx_rate = calc_rate(0, HZ, can_stats.tx_frames_delta);
-	can_stats.current_rx_rate = calc_rate(0, HZ, can_stats.rx_frames_delta);
+	if (rx_delta)
+		can_stats.current_rx_match_ratio = (matches_delta * 100) /
+			rx_delta;
+
+	can_stats.current_tx_rate = calc_rate(can_stats.jiffies_last, j,
+					      tx_delta);
+	can_stats.current_rx_rate = calc_rate(can_stats.jiffies_last, j,
+					      rx_delta);
 
 	/* check / update maximum values */
 	if (can_stats.max_tx_rate < can_stats.current_tx_rate)
@@ -178,10 +234,18 @@ void can_stat_update(unsigned long data)
 	if (can_stats.max_rx_match_ratio < can_stats.current_rx_match_ratio)
 		can_stats.max_rx_match_ratio = can_stats.current_rx_match_ratio;
 
-	/* clear values for 'current rate' calculation */
-	can_stats.tx_frames_delta = 0;
-	can_stats.rx_frames_delta = 0;
-	can_stats.matches_delta   = 0;
+	/* remember this sample for the next 'current rate' calculation */
+	can_stats.jiffies_last   = j;
+	can_stats.rx_frames_last = can_stats.rx_frames;
+	can_stats.tx_frames_last = can_stats.tx_frames;
+	can_stats.matches_last   = can_stats.matches;
+}
+
+void can_stat_update(unsigned long data)
+{
+	spin_lock(&can_stats_lock);
+	__can_stat_update();
+	spin_unlock(&can_stats_lock);
 
 	/* restart timer (one second) */
 	mod_timer(&can_stattimer, round_jiffies(jiffies + HZ));
@@ -218,6 +282,10 @@ static void can_print_recv_banner(struct seq_file *m)
 
 static int can_stats_proc_show(struct seq_file *m, void *v)
 {
+	spin_lock_bh(&can_stats_lock);
+	can_stats_refresh();
+	spin_unlock_bh(&can_stats_lock);
+
 	seq_putc(m, '\n');
 	seq_printf(m, " %8ld transmitted frames (TXF)\n", can_stats.tx_frames);
 	seq_printf(m, " %8ld received frames (RXF)\n", can_stats.rx_frames);
@@ -276,7 +344,37 @@ static int can_stats_proc_show(struct seq_file *m, void *v)
 
 static int can_stats_proc_open(struct inode *inode, struct file *file)
 {
-	return single_open(file, can_stats_proc_show, NULL);
+	int err;
+
+	err = single_open(file, can_stats_proc_show, NULL);
+	if (err || can_stattimer.function != can_stat_update)
+		return err;
+
+	/* the first opener takes a sample and starts the update timer */
+	mutex_lock(&can_stats_users_lock);
+	if (!can_stats_users++) {
+		spin_lock_bh(&can_stats_lock);
+		__can_stat_update();
+		spin_unlock_bh(&can_stats_lock);
+
+		mod_timer(&can_stattimer, round_jiffies(jiffies + HZ));
+	}
+	mutex_unlock(&can_stats_users_lock);
+
+	return 0;
+}
+
+static int can_stats_proc_release(struct inode *inode, struct file *file)
+{
+	if (can_stattimer.function == can_stat_update) {
+		/* the last one out stops the update timer */
+		mutex_lock(&can_stats_users_lock);
+		if (!--can_stats_users)
+			del_timer_sync(&can_stattimer);
+		mutex_unlock(&can_stats_users_lock);
+	}
+
+	return single_release(inode, file);
 }
 
 static const struct file_operations can_stats_proc_fops = {
@@ -284,24 +382,20 @@ static const struct file_operations can_stats_proc_fops = {
 	.open		= can_stats_proc_open,
 	.read		= seq_read,
 	.llseek		= seq_lseek,
-	.release	= single_release,
+	.release	= can_stats_proc_release,
 };
 
 static int can_reset_stats_proc_show(struct seq_file *m, void *v)
 {
 	user_reset = 1;
 
-	if (can_stattimer.function == can_stat_update) {
-		seq_printf(m, "Scheduled statistic reset #%ld.\n",
-				can_pstats.stats_reset + 1);
+	spin_lock_bh(&can_stats_lock);
+	can_init_stats();
+	spin_unlock_bh(&can_stats_lock);
 
-	} else {
-		if (can_stats.jiffies_init != jiffies)
-			can_init_stats();
+	seq_printf(m, "Performed statistic reset #%ld.\n",
+			can_pstats.stats_reset);
 
-		seq_printf(m, "Performed statistic reset #%ld.\n",
-				can_pstats.stats_reset);
-	}
 	return 0;
 }
 
@@ -389,48 +483,92 @@ static const struct file_operations can_rcvlist_proc_fops = {
 	.release	= single_release,
 };
 
-static inline void can_rcvlist_sff_proc_show_one(struct seq_file *m,
+static bool can_rcvlist_tab_empty(struct hlist_head *tab, int size)
+{
+	int i;
+
+	for (i = 0; i < size; i++)
+		if (!hlist_empty(&tab[i]))
+			return false;
+
+	return true;
+}
+
+static void can_print_rcvlist_tab(struct seq_file *m, struct hlist_head *tab,
+				  int size, struct net_device *dev)
+{
+	int i;
+
+	for (i = 0; i < size; i++)
+		if (!hlist_empty(&tab[i]))
+			can_print_rcvlist(m, &tab[i], dev);
+}
+
+static inline void can_rcvlist_tab_proc_show_one(struct seq_file *m, int idx,
 						 struct net_device *dev,
 						 struct dev_rcv_lists *d)
 {
-	int i;
-	int all_empty = 1;
+	struct rcv_mask_group *g;
+	bool all_empty;
 
 	/* check whether at least one list is non-empty */
-	for (i = 0; i < 0x800; i++)
-		if (!hlist_empty(&d->rx_sff[i])) {
-			all_empty = 0;
-			break;
-		}
+	switch (idx) {
+	case RX_SFF_TAB:
+		all_empty = can_rcvlist_tab_empty(d->rx_sff,
+						  CAN_SFF_RCV_ARRAY_SZ);
+		break;
+	case RX_EFF_TAB:
+		all_empty = can_rcvlist_tab_empty(d->rx_eff,
+						  CAN_EFF_RCV_ARRAY_SZ);
+		break;
+	default:
+		/* mask groups only exist while they have receivers */
+		all_empty = hlist_empty(&d->rx_fil);
+		break;
+	}
 
-	if (!all_empty) {
-		can_print_recv_banner(m);
-		for (i = 0; i < 0x800; i++) {
-			if (!hlist_empty(&d->rx_sff[i]))
-				can_print_rcvlist(m, &d->rx_sff[i], dev);
-		}
-	} else
+	if (all_empty) {
 		seq_printf(m, "  (%s: no entry)\n", DNAME(dev));
+		return;
+	}
+
+	can_print_recv_banner(m);
+
+	switch (idx) {
+	case RX_SFF_TAB:
+		can_print_rcvlist_tab(m, d->rx_sff, CAN_SFF_RCV_ARRAY_SZ, dev);
+		break;
+	case RX_EFF_TAB:
+		can_print_rcvlist_tab(m, d->rx_eff, CAN_EFF_RCV_ARRAY_SZ, dev);
+		break;
+	default:
+		hlist_for_each_entry_rcu(g, &d->rx_fil, list)
+			can_print_rcvlist_tab(m, g->rx, CAN_FIL_RCV_ARRAY_SZ,
+					      dev);
+		break;
+	}
 }
 
-static int can_rcvlist_sff_proc_show(struct seq_file *m, void *v)
+static int can_rcvlist_tab_proc_show(struct seq_file *m, void *v)
 {
+	/* double cast to prevent GCC warning */
+	int idx = (int)(long)m->private;
 	struct net_device *dev;
 	struct dev_rcv_lists *d;
 
-	/* RX_SFF */
-	seq_puts(m, "\nreceive list 'rx_sff':\n");
+	seq_printf(m, "\nreceive list '%s':\n", rx_tab_name[idx]);
 
 	rcu_read_lock();
 
-	/* sff receive list for 'all' CAN devices (dev == NULL) */
+	/* receive list for 'all' CAN devices (dev == NULL) */
 	d = &can_rx_alldev_list;
-	can_rcvlist_sff_proc_show_one(m, NULL, d);
+	can_rcvlist_tab_proc_show_one(m, idx, NULL, d);
 
-	/* sff receive list for registered CAN devices */
+	/* receive list for registered CAN devices */
 	for_each_netdev_rcu(&init_net, dev) {
 		if (dev->type == ARPHRD_CAN && dev->ml_priv)
-			can_rcvlist_sff_proc_show_one(m, dev, dev->ml_priv);
+			can_rcvlist_tab_proc_show_one(m, idx, dev,
+						      dev->ml_priv);
 	}
 
 	rcu_read_unlock();
@@ -439,14 +577,14 @@ static int can_rcvlist_sff_proc_show(struct seq_file *m, void *v)
 	return 0;
 }
 
-static int can_rcvlist_sff_proc_open(struct inode *inode, struct file *file)
+static int can_rcvlist_tab_proc_open(struct inode *inode, struct file *file)
 {
-	return single_open(file, can_rcvlist_sff_proc_show, NULL);
+	return single_open(file, can_rcvlist_tab_proc_show, PDE_DATA(inode));
 }
 
-static const struct file_operations can_rcvlist_sff_proc_fops = {
+static const struct file_operations can_rcvlist_tab_proc_fops = {
 	.owner		= THIS_MODULE,
-	.open		= can_rcvlist_sff_proc_open,
+	.open		= can_rcvlist_tab_proc_open,
 	.read		= seq_read,
 	.llseek		= seq_lseek,
 	.release	= single_release,
@@ -476,6 +614,10 @@ void can_init_proc(void)
 		return;
 	}
 
+	/* the rates are calculated from here on */
+	can_stats.jiffies_init = jiffies;
+	can_stats.jiffies_last = can_stats.jiffies_init;
+
 	/* own procfs entries from the AF_CAN core */
 	pde_version     = proc_create(CAN_PROC_VERSION, 0644, can_dir,
 				      &can_version_proc_fops);
@@ -488,13 +630,16 @@ void can_init_proc(void)
 	pde_rcvlist_all = proc_create_data(CAN_PROC_RCVLIST_ALL, 0644, can_dir,
 					   &can_rcvlist_proc_fops, (void *)RX_ALL);
 	pde_rcvlist_fil = proc_create_data(CAN_PROC_RCVLIST_FIL, 0644, can_dir,
-					   &can_rcvlist_proc_fops, (void *)RX_FIL);
+					   &can_rcvlist_tab_proc_fops,
+					   (void *)RX_FIL_TAB);
 	pde_rcvlist_inv = proc_create_data(CAN_PROC_RCVLIST_INV, 0644, can_dir,
 					   &can_rcvlist_proc_fops, (void *)RX_INV);
 	pde_rcvlist_eff = proc_create_data(CAN_PROC_RCVLIST_EFF, 0644, can_dir,
-					   &can_rcvlist_proc_fops, (void *)RX_EFF);
-	pde_rcvlist_sff = proc_create(CAN_PROC_RCVLIST_SFF, 0644, can_dir,
-				      &can_rcvlist_sff_proc_fops);
+					   &can_rcvlist_tab_proc_fops,
+					   (void *)RX_EFF_TAB);
+	pde_rcvlist_sff = proc_create_data(CAN_PROC_RCVLIST_SFF, 0644, can_dir,
+					   &can_rcvlist_tab_proc_fops,
+					   (void *)RX_SFF_TAB);
 }
 
 /*
@@ -44,16 +44,21 @@
 #include <linux/uio.h>
 #include <linux/net.h>
 #include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/mutex.h>
+#include <linux/poll.h>
 #include <linux/netdevice.h>
 #include <linux/socket.h>
 #include <linux/if_arp.h>
 #include <linux/skbuff.h>
+#include <linux/filter.h>
 #include <linux/can.h>
 #include <linux/can/core.h>
 #include <linux/can/skb.h>
 #include <linux/can/raw.h>
 #include <net/sock.h>
 #include <net/net_namespace.h>
+#include <asm/cacheflush.h>
 
 #define CAN_RAW_VERSION CAN_VERSION
 static __initconst const char banner[] =
@@ -66,6 +71,8 @@ MODULE_ALIAS("can-proto-1");
 
 #define MASK_ALL 0
 
+#define RAW_MIN_NAMELEN CAN_REQUIRED_SIZE(struct sockaddr_can, can_ifindex)
+
 /*
  * A raw socket has a list of can_filters attached to it, each receiving
  * the CAN frames matching that filter.  If the filter list is empty,
@@ -74,8 +81,24 @@ MODULE_ALIAS("can-proto-1");
  * The filter list is allocated dynamically with the exception of the
  * list containing only one item.  This common case is optimized by
  * storing the single filter in dfilter, to avoid using dynamic memory.
+ *
+ * Optionally the socket has a receive and/or a transmit ring of frame slots
+ * which is shared with user space by mmap(). The receive ring is filled
+ * directly from raw_rcv() without cloning the skb and is protected by the
+ * lock of sk_receive_queue, the transmit ring is drained in raw_sendmsg().
+ * Setting up and removing the rings is serialized by ring_mutex.
  */
 
+struct raw_ring {
+	char **pg_vec;		/* the blocks of the ring */
+	unsigned int pg_vec_order;
+	unsigned int pg_vec_len;
+	unsigned int frames_per_block;
+	unsigned int frame_size;
+	unsigned int frame_max;
+	unsigned int head;	/* next slot to fill (RX) or send (TX) */
+};
+
 struct raw_sock {
 	struct sock sk;
 	int bound;
@@ -88,6 +111,11 @@ struct raw_sock {
 	struct can_filter dfilter; /* default/single filter */
 	struct can_filter *filter; /* pointer to filter(s) */
 	can_err_mask_t err_mask;
+	struct raw_ring rx_ring;
+	struct raw_ring tx_ring;
+	struct mutex ring_mutex;
+	atomic_t mapped;           /* number of mmap()s of the rings */
+	int rx_losing;             /* RX ring overrun since last frame */
 };
 
 /*
@@ -109,13 +137,133 @@ static inline struct raw_sock *raw_sk(const struct sock *sk)
 	return (struct raw_sock *)sk;
 }
 
+/* CAN specific message flags for raw_recvmsg() and the RX ring */
+static inline unsigned int raw_msg_flags(const struct sock *sk,
+					 const struct sk_buff *oskb)
+{
+	unsigned int flags = 0;
+
+	if (oskb->sk)
+		flags |= MSG_DONTROUTE;
+	if (oskb->sk == sk)
+		flags |= MSG_CONFIRM;
+
+	return flags;
+}
+
+static inline struct can_raw_slot *raw_ring_slot(const struct raw_ring *rb,
+						 unsigned int idx)
+{
+	unsigned int blk = idx / rb->frames_per_block;
+	unsigned int off = idx % rb->frames_per_block;
+
+	return (struct can_raw_slot *)(rb->pg_vec[blk] + off * rb->frame_size);
+}
+
+static inline void raw_ring_advance(struct raw_ring *rb)
+{
+	rb->head = rb->head != rb->frame_max ? rb->head + 1 : 0;
+}
+
+/* write back the kernel view of a slot so that user space can see it */
+static inline void raw_ring_flush(void *start, unsigned int len)
+{
+#if ARCH_IMPLEMENTS_FLUSH_DCACHE_PAGE == 1
+	char *end = (char *)start + len;
+	char *p;
+
+	for (p = (char *)((unsigned long)start & PAGE_MASK); p < end;
+	     p += PAGE_SIZE)
+		flush_dcache_page(virt_to_page(p));
+#endif
+}
+
+static inline u32 raw_ring_get_status(struct can_raw_slot *slot)
+{
+	smp_rmb();
+	raw_ring_flush(&slot->status, sizeof(slot->status));
+
+	return ACCESS_ONCE(slot->status);
+}
+
+static inline void raw_ring_set_status(struct can_raw_slot *slot, u32 status)
+{
+	slot->status = status;
+	raw_ring_flush(&slot->status, sizeof(slot->status));
+	smp_wmb();
+}
+
+static void raw_rcv_ring(struct sock *sk, struct sk_buff *oskb)
+{
+	struct raw_sock *ro = raw_sk(sk);
+	struct raw_ring *rb = &ro->rx_ring;
+	struct sk_filter *filter;
+	struct can_raw_slot *slot;
+	struct timespec ts;
+	u32 status = CAN_RAW_SLOT_USER;
+
+	/* the RX ring bypasses sock_queue_rcv_skb(), run the filter here */
+	rcu_read_lock();
+	filter = rcu_dereference(sk->sk_filter);
+	if (filter && !SK_RUN_FILTER(filter, oskb)) {
+		rcu_read_unlock();
+		return;
+	}
+	rcu_read_unlock();
+
+	spin_lock(&sk->sk_receive_queue.lock);
+
+	if (!rb->pg_vec)
+		goto drop;
+
+	slot = raw_ring_slot(rb, rb->head);
+	if (oskb->len > rb->frame_size - CAN_RAW_SLOT_HDRLEN ||
+	    raw_ring_get_status(slot) != CAN_RAW_SLOT_KERNEL)
+		goto drop;
+
+	memcpy((char *)slot + CAN_RAW_SLOT_HDRLEN, oskb->data, oskb->len);
+	slot->len     = oskb->len;
+	slot->ifindex = oskb->dev->ifindex;
+	slot->flags   = raw_msg_flags(sk, oskb);
+
+	/* prefer the controller timestamp, it is taken at the frame on the bus */
+	if (skb_hwtstamps(oskb)->hwtstamp.tv64) {
+		ts = ktime_to_timespec(skb_hwtstamps(oskb)->hwtstamp);
+		status |= CAN_RAW_SLOT_TS_HW;
+	} else {
+		ts = ktime_to_timespec(oskb->tstamp.tv64 ? oskb->tstamp :
+				       ktime_get_real());
+	}
+	slot->sec  = ts.tv_sec;
+	slot->nsec = ts.tv_nsec;
+
+	raw_ring_flush(slot, CAN_RAW_SLOT_HDRLEN + oskb->len);
+	smp_wmb();
+
+	if (ro->rx_losing) {
+		status |= CAN_RAW_SLOT_LOSING;
+		ro->rx_losing = 0;
+	}
+	raw_ring_set_status(slot, status);
+	raw_ring_advance(rb);
+
+	spin_unlock(&sk->sk_receive_queue.lock);
+
+	sk->sk_data_ready(sk, 0);
+	return;
+
+drop:
+	ro->rx_losing = 1;
+	spin_unlock(&sk->sk_receive_queue.lock);
+	atomic_inc(&sk->sk_drops);
+}
+
 static void raw_rcv(struct sk_buff *oskb, void *data)
 {
 	struct sock *sk = (struct sock *)data;
 	struct raw_sock *ro = raw_sk(sk);
 	struct sockaddr_can *addr;
 	struct sk_buff *skb;
-	unsigned int *pflags;
 
 	/* check the received tx sock reference */
 	if (!ro->recv_own_msgs && oskb->sk == sk)
@@ -125,6 +273,12 @@ static void raw_rcv(struct sk_buff *oskb, void *data)
 	if (!ro->fd_frames && oskb->len != CAN_MTU)
 		return;
 
+	/* copy the frame into the mmap()ed ring instead of queueing a clone */
+	if (ACCESS_ONCE(ro->rx_ring.pg_vec)) {
+		raw_rcv_ring(sk, oskb);
+		return;
+	}
+
 	/* clone the given skb to be able to enqueue it into the rcv queue */
 	skb = skb_clone(oskb, GFP_ATOMIC);
 	if (!skb)
@@ -144,12 +298,7 @@ static void raw_rcv(struct sk_buff *oskb, void *data)
 	addr->can_ifindex = skb->dev->ifindex;
 
 	/* add CAN specific message flags for raw_recvmsg() */
-	pflags = raw_flags(skb);
-	*pflags = 0;
-	if (oskb->sk)
-		*pflags |= MSG_DONTROUTE;
-	if (oskb->sk == sk)
-		*pflags |= MSG_CONFIRM;
+	*raw_flags(skb) = raw_msg_flags(sk, oskb);
 
 	if (sock_queue_rcv_skb(sk, skb) < 0)
 		kfree_skb(skb);
@@ -281,6 +430,108 @@ static int raw_notifier(struct notifier_block *nb,
 	return NOTIFY_DONE;
 }
 
+static void raw_free_pg_vec(char **pg_vec, unsigned int order,
+			    unsigned int len)
+{
+	unsigned int i;
+
+	if (!pg_vec)
+		return;
+
+	for (i = 0; i < len; i++) {
+		if (pg_vec[i])
+			free_pages((unsigned long)pg_vec[i], order);
+	}
+	kfree(pg_vec);
+}
+
+static char **raw_alloc_pg_vec(unsigned int len, unsigned int order)
+{
+	gfp_t gfp = GFP_KERNEL | __GFP_COMP | __GFP_ZERO | __GFP_NOWARN |
+		    __GFP_NORETRY;
+	char **pg_vec;
+	unsigned int i;
+
+	pg_vec = kcalloc(len, sizeof(*pg_vec), GFP_KERNEL);
+	if (!pg_vec)
+		return NULL;
+
+	for (i = 0; i < len; i++) {
+		pg_vec[i] = (char *)__get_free_pages(gfp, order);
+		if (!pg_vec[i]) {
+			raw_free_pg_vec(pg_vec, order, len);
+			return NULL;
+		}
+	}
+
+	return pg_vec;
+}
+
+static int raw_set_ring(struct sock *sk, const struct can_raw_ring_req *req,
+			int tx)
+{
+	struct raw_sock *ro = raw_sk(sk);
+	struct raw_ring *rb = tx ? &ro->tx_ring : &ro->rx_ring;
+	spinlock_t *lock = tx ? &sk->sk_write_queue.lock :
+				&sk->sk_receive_queue.lock;
+	struct raw_ring new;
+	int err = 0;
+
+	memset(&new, 0, sizeof(new));
+
+	if (req->block_nr) {
+		if (!req->block_size || !PAGE_ALIGNED(req->block_size) ||
+		    req->block_size > PAGE_SIZE << (MAX_ORDER - 1))
+			return -EINVAL;
+
+		/* the ring is charged against the socket buffer it replaces */
+		if ((u64)req->block_nr * req->block_size >
+		    (tx ? sk->sk_sndbuf : sk->sk_rcvbuf))
+			return -ENOBUFS;
+
+		if (req->frame_size < CAN_RAW_SLOT_HDRLEN + CAN_MTU ||
+		    req->frame_size & (CAN_RAW_SLOT_ALIGNMENT - 1))
+			return -EINVAL;
+
+		new.frames_per_block = req->block_size / req->frame_size;
+		if (!new.frames_per_block ||
+		    req->block_nr > UINT_MAX / new.frames_per_block ||
+		    new.frames_per_block * req->block_nr != req->frame_nr)
+			return -EINVAL;
+
+		new.pg_vec_order = get_order(req->block_size);
+		new.pg_vec = raw_alloc_pg_vec(req->block_nr, new.pg_vec_order);
+		if (!new.pg_vec)
+			return -ENOMEM;
+
+		new.pg_vec_len = req->block_nr;
+		new.frame_size = req->frame_size;
+		new.frame_max  = req->frame_nr - 1;
+	}
+
+	mutex_lock(&ro->ring_mutex);
+
+	if (atomic_read(&ro->mapped)) {
+		err = -EBUSY;
+		goto out;
+	}
+
+	/* raw_rcv() and raw_poll() access the rings under these locks */
+	spin_lock_bh(lock);
+	swap(*rb, new);
+	if (!tx)
+		ro->rx_losing = 0;
+	spin_unlock_bh(lock);
+
+ out:
+	mutex_unlock(&ro->ring_mutex);
+
+	/* free the old ring - or the new one if it could not be installed */
+	raw_free_pg_vec(new.pg_vec, new.pg_vec_order, new.pg_vec_len);
+
+	return err;
+}
+
 static int raw_init(struct sock *sk)
 {
 	struct raw_sock *ro = raw_sk(sk);
@@ -299,6 +550,13 @@ static int raw_init(struct sock *sk)
 	ro->recv_own_msgs    = 0;
 	ro->fd_frames        = 0;
 
+	/* no mmap()ed rings */
+	memset(&ro->rx_ring, 0, sizeof(ro->rx_ring));
+	memset(&ro->tx_ring, 0, sizeof(ro->tx_ring));
+	mutex_init(&ro->ring_mutex);
+	atomic_set(&ro->mapped, 0);
+	ro->rx_losing        = 0;
+
 	/* set notifier */
 	ro->notifier.notifier_call = raw_notifier;
 
@@ -310,6 +568,7 @@ static int raw_init(struct sock *sk)
 static int raw_release(struct socket *sock)
 {
 	struct sock *sk = sock->sk;
+	struct can_raw_ring_req req;
 	struct raw_sock *ro;
 
 	if (!sk)
@@ -319,6 +578,11 @@ static int raw_release(struct socket *sock)
 
 	unregister_netdevice_notifier(&ro->notifier);
 
+	/* the rings can not be mapped anymore when the socket is released */
+	memset(&req, 0, sizeof(req));
+	raw_set_ring(sk, &req, 0);
+	raw_set_ring(sk, &req, 1);
+
 	lock_sock(sk);
 
 	/* remove current filters & unregister */
@@ -360,7 +624,7 @@ static int raw_bind(struct socket *sock, struct sockaddr *uaddr, int len)
 	int err = 0;
 	int notify_enetdown = 0;
 
-	if (len < sizeof(*addr))
+	if (len < RAW_MIN_NAMELEN)
 		return -EINVAL;
 
 	lock_sock(sk);
@@ -440,7 +704,7 @@ static int raw_getname(struct socket *sock, struct sockaddr *uaddr,
 	addr->can_family  = AF_CAN;
 	addr->can_ifindex = ro->ifindex;
 
-	*len = sizeof(*addr);
+	*len = RAW_MIN_NAMELEN;
 
 	return 0;
 }
@@ -452,6 +716,7 @@ static int raw_setsockopt(struct socket *sock, int level, int optname,
 	struct raw_sock *ro = raw_sk(sk);
 	struct can_filter *filter = NULL;  /* dyn. alloc'ed filters */
 	struct can_filter sfilter;         /* single filter */
+	struct can_raw_ring_req req;
 	struct net_device *dev = NULL;
 	can_err_mask_t err_mask = 0;
 	int count = 0;
@@ -585,6 +850,18 @@ static int raw_setsockopt(struct socket *sock, int level, int optname,
 
 		break;
 
+	case CAN_RAW_RX_RING:
+	case CAN_RAW_TX_RING:
+		if (optlen < sizeof(req))
+			return -EINVAL;
+
+		if (copy_from_user(&req, optval, sizeof(req)))
+			return -EFAULT;
+
+		err = raw_set_ring(sk, &req, optname == CAN_RAW_TX_RING);
+
+		break;
+
 	default:
 		return -ENOPROTOOPT;
 	}
@@ -660,6 +937,115 @@ static int raw_getsockopt(struct socket *sock, int level, int optname,
 	return 0;
 }
 
+/*
+ * Send all slots of the TX ring which are marked for sending, starting at
+ * the ring head. Slots which can never be sent are flagged and skipped,
+ * the others stay pending when the device is down or out of buffers.
+ * Returns the number of bytes sent, or the last error if nothing was sent.
+ */
+static int raw_send_ring(struct sock *sk, int ifindex, int noblock)
+{
+	struct raw_sock *ro = raw_sk(sk);
+	struct raw_ring *rb = &ro->tx_ring;
+	struct net_device *dev = NULL;
+	struct can_raw_slot *slot;
+	struct canfd_frame *cfd;
+	struct sk_buff *skb;
+	unsigned int len;
+	unsigned int n;
+	int sent = 0;
+	int err = 0;
+
+	mutex_lock(&ro->ring_mutex);
+
+	if (!rb->pg_vec) {
+		err = -EINVAL;
+		goto out;
+	}
+
+	for (n = 0; n <= rb->frame_max; n++) {
+		slot = raw_ring_slot(rb, rb->head);
+		if (raw_ring_get_status(slot) != CAN_RAW_SLOT_SEND_REQUEST)
+			break;
+
+		len = slot->len;
+		cfd = (struct canfd_frame *)((char *)slot + CAN_RAW_SLOT_HDRLEN);
+		if ((len != CAN_MTU && !(ro->fd_frames && len == CANFD_MTU)) ||
+		    len > rb->frame_size - CAN_RAW_SLOT_HDRLEN ||
+		    cfd->len > (len == CAN_MTU ? CAN_MAX_DLEN :
+						 CANFD_MAX_DLEN)) {
+			err = -EINVAL;
+			goto wrong_format;
+		}
+
+		if (!dev || dev->ifindex != (slot->ifindex ? : ifindex)) {
+			if (dev)
+				dev_put(dev);
+			dev = dev_get_by_index(&init_net,
+					       slot->ifindex ? : ifindex);
+			if (!dev) {
+				err = -ENXIO;
+				goto wrong_format;
+			}
+		}
+
+		if (dev->type != ARPHRD_CAN) {
+			err = -EPERM;
+			goto wrong_format;
+		}
+
+		skb = sock_alloc_send_skb(sk, len + sizeof(struct can_skb_priv),
+					  noblock, &err);
+		if (!skb)
+			break;
+
+		can_skb_reserve(skb);
+		can_skb_prv(skb)->ifindex = dev->ifindex;
+
+		memcpy(skb_put(skb, len), cfd, len);
+
+		sock_tx_timestamp(sk, &skb_shinfo(skb)->tx_flags);
+
+		skb->dev = dev;
+		skb->sk  = sk;
+		skb->priority = sk->sk_priority;
+
+		err = can_send(skb, ro->loopback);
+		switch (err) {
+		case 0:
+			break;
+		case -EINVAL:
+		case -EPERM:
+		case -EMSGSIZE:
+			/* the frame can never be sent as it is */
+			goto wrong_format;
+		default:
+			/*
+			 * The device is down or out of buffers, the slot
+			 * stays pending for the next send()
+			 */
+			goto out_put;
+		}
+
+		raw_ring_set_status(slot, CAN_RAW_SLOT_KERNEL);
+		raw_ring_advance(rb);
+		sent += len;
+		continue;
+
+ wrong_format:
+		raw_ring_set_status(slot, CAN_RAW_SLOT_WRONG_FORMAT);
+		raw_ring_advance(rb);
+	}
+
+ out_put:
+	if (dev)
+		dev_put(dev);
+ out:
+	mutex_unlock(&ro->ring_mutex);
+
+	return sent ? sent : err;
+}
+
 static int raw_sendmsg(struct kiocb *iocb, struct socket *sock,
 		       struct msghdr *msg, size_t size)
 {
@@ -673,7 +1059,7 @@ static int raw_sendmsg(struct kiocb *iocb, struct socket *sock,
 	if (msg->msg_name) {
 		DECLARE_SOCKADDR(struct sockaddr_can *, addr, msg->msg_name);
 
-		if (msg->msg_namelen < sizeof(*addr))
+		if (msg->msg_namelen < RAW_MIN_NAMELEN)
 			return -EINVAL;
 
 		if (addr->can_family != AF_CAN)
@@ -683,6 +1069,10 @@ static int raw_sendmsg(struct kiocb *iocb, struct socket *sock,
 	} else
 		ifindex = ro->ifindex;
 
+	/* a zero length send() kicks the transmission of the TX ring */
+	if (!size && ACCESS_ONCE(ro->tx_ring.pg_vec))
+		return raw_send_ring(sk, ifindex, msg->msg_flags & MSG_DONTWAIT);
+
 	if (ro->fd_frames) {
 		if (unlikely(size != CANFD_MTU && size != CAN_MTU))
 			return -EINVAL;
@@ -738,6 +1128,10 @@ static int raw_recvmsg(struct kiocb *iocb, struct socket *sock,
 	int err = 0;
 	int noblock;
 
+	if (flags & MSG_ERRQUEUE)
+		return sock_recv_errqueue(sk, msg, size,
+					  SOL_CAN_RAW, SCM_CAN_RAW_ERRQUEUE);
+
 	noblock =  flags & MSG_DONTWAIT;
 	flags   &= ~MSG_DONTWAIT;
 
@@ -760,7 +1154,7 @@ static int raw_recvmsg(struct kiocb *iocb, struct socket *sock,
 
 	if (msg->msg_name) {
 		__sockaddr_check_size(sizeof(struct sockaddr_can));
-		msg->msg_namelen = sizeof(struct sockaddr_can);
+		msg->msg_namelen = RAW_MIN_NAMELEN;
 		memcpy(msg->msg_name, skb->cb, msg->msg_namelen);
 	}
 
@@ -772,6 +1166,113 @@ static int raw_recvmsg(struct kiocb *iocb, struct socket *sock,
 	return size;
 }
 
+static unsigned int raw_poll(struct file *file, struct socket *sock,
+			     poll_table *wait)
+{
+	struct sock *sk = sock->sk;
+	struct raw_sock *ro = raw_sk(sk);
+	unsigned int mask = datagram_poll(file, sock, wait);
+	struct raw_ring *rb;
+
+	/* readable if the slot written last is still owned by user space */
+	spin_lock_bh(&sk->sk_receive_queue.lock);
+	rb = &ro->rx_ring;
+	if (rb->pg_vec &&
+	    raw_ring_get_status(raw_ring_slot(rb, rb->head ? rb->head - 1 :
+						  rb->frame_max)) !=
+	    CAN_RAW_SLOT_KERNEL)
+		mask |= POLLIN | POLLRDNORM;
+	spin_unlock_bh(&sk->sk_receive_queue.lock);
+
+	/* writable if the next slot to send is available */
+	spin_lock_bh(&sk->sk_write_queue.lock);
+	rb = &ro->tx_ring;
+	if (rb->pg_vec &&
+	    raw_ring_get_status(raw_ring_slot(rb, rb->head)) ==
+	    CAN_RAW_SLOT_KERNEL)
+		mask |= POLLOUT | POLLWRNORM;
+	spin_unlock_bh(&sk->sk_write_queue.lock);
+
+	return mask;
+}
+
+static void raw_mm_open(struct vm_area_struct *vma)
+{
+	struct socket *sock = vma->vm_file->private_data;
+	struct sock *sk = sock->sk;
+
+	if (sk)
+		atomic_inc(&raw_sk(sk)->mapped);
+}
+
+static void raw_mm_close(struct vm_area_struct *vma)
+{
+	struct socket *sock = vma->vm_file->private_data;
+	struct sock *sk = sock->sk;
+
+	if (sk)
+		atomic_dec(&raw_sk(sk)->mapped);
+}
+
+static const struct vm_operations_struct raw_mmap_ops = {
+	.open	= raw_mm_open,
+	.close	= raw_mm_close,
+};
+
+static int raw_mmap(struct file *file, struct socket *sock,
+		    struct vm_area_struct *vma)
+{
+	struct sock *sk = sock->sk;
+	struct raw_sock *ro = raw_sk(sk);
+	struct raw_ring *rings[] = { &ro->rx_ring, &ro->tx_ring };
+	unsigned long size = 0;
+	unsigned long start;
+	unsigned int r, i, pg;
+	int err = -EINVAL;
+
+	if (vma->vm_pgoff)
+		return -EINVAL;
+
+	mutex_lock(&ro->ring_mutex);
+
+	for (r = 0; r < ARRAY_SIZE(rings); r++) {
+		if (rings[r]->pg_vec)
+			size += rings[r]->pg_vec_len *
+				(PAGE_SIZE << rings[r]->pg_vec_order);
+	}
+
+	if (!size || vma->vm_end - vma->vm_start != size)
+		goto out;
+
+	start = vma->vm_start;
+	for (r = 0; r < ARRAY_SIZE(rings); r++) {
+		struct raw_ring *rb = rings[r];
+
+		if (!rb->pg_vec)
+			continue;
+
+		for (i = 0; i < rb->pg_vec_len; i++) {
+			struct page *page = virt_to_page(rb->pg_vec[i]);
+
+			for (pg = 0; pg < (1 << rb->pg_vec_order); pg++) {
+				err = vm_insert_page(vma, start, page++);
+				if (err)
+					goto out;
+				start += PAGE_SIZE;
+			}
+		}
+	}
+
+	atomic_inc(&ro->mapped);
+	vma->vm_ops = &raw_mmap_ops;
+	err = 0;
+
+ out:
+	mutex_unlock(&ro->ring_mutex);
+
+	return err;
+}
+
 static const struct proto_ops raw_ops = {
 	.family        = PF_CAN,
 	.release       = raw_release,
@@ -780,7 +1281,7 @@ static const struct proto_ops raw_ops = {
 	.socketpair    = sock_no_socketpair,
 	.accept        = sock_no_accept,
 	.getname       = raw_getname,
-	.poll          = datagram_poll,
+	.poll          = raw_poll,
 	.ioctl         = can_ioctl,	/* use can_ioctl() from af_can.c */
 	.listen        = sock_no_listen,
 	.shutdown      = sock_no_shutdown,
@@ -788,7 +1289,7 @@ static const struct proto_ops raw_ops = {
 	.getsockopt    = raw_getsockopt,
 	.sendmsg       = raw_sendmsg,
 	.recvmsg       = raw_recvmsg,
-	.mmap          = sock_no_mmap,
+	.mmap          = raw_mmap,
 	.sendpage      = sock_no_sendpage,
 };
 